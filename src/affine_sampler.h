@@ -31,6 +31,7 @@
 #include <iomanip>
 #include <fstream>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <vector>
 #include <time.h>
@@ -60,6 +61,10 @@
 #endif // GSL_RANGE_CHECK_OFF
 
 
+// Largest number of times a slice-sampling interval is stepped out
+#define SLICE_MAX_STEPS_OUT 8
+
+
 /*************************************************************************
  *   Function Prototypes
  *************************************************************************/
@@ -69,6 +74,9 @@ void seed_gsl_rng(gsl_rng **r);
 
 static void Gelman_Rubin_diagnostic(TStats **stats_arr, unsigned int N_chains, double *R);
 
+template<class TParams, class TLogger>
+class TParallelAffineSampler;
+
 
 /*************************************************************************
  *   Affine Sampler class protoype
@@ -84,6 +92,9 @@ class TAffineSampler {
 	double logL;		// Log of ensemble size
 	double sqrta;		// Square-root of dimensionless step scale a (a = 2 by default). Can be tuned to achieve desired acceptance rate.
 	double h, log_h, h_MH, log_h_MH;
+	double h_HMC;			// Hamiltonian Monte Carlo step size, in units of the ensemble standard deviation
+	unsigned int N_leapfrog;	// # of leapfrog steps per Hamiltonian trajectory
+	double w_slice;			// Initial width of slice-sampling intervals, in units of the ensemble standard deviation
 	double replacement_accept_bias;
 	double twopiN;
 	bool use_log;		// If true, <pdf> returns log(pi(X)). Else, <pdf> returns pi(X). Default value is <true>.
@@ -123,6 +134,29 @@ class TAffineSampler {
 	// Model for Gaussian mixture proposals
 	TGaussianMixture *gm_target;
 	
+	// Working space for batched evaluation of proposals
+	double* Y_batch;	// Proposals in struct-of-arrays layout: Y_batch[i*n + j] is coordinate i of proposal j
+	double* pi_batch;
+	double* log_Q_batch;	// Log of proposal density ratio, Q(Y->X) / Q(X->Y), for each walker
+	unsigned int* idx_batch;	// Walkers whose proposals are scored by eval_batch_subset
+	
+	// Working space for Hamiltonian Monte Carlo steps
+	double* p_HMC;		// Momentum
+	double* grad_HMC;	// Gradient of log(pi)
+	
+	// Scale of each coordinate over the half of the ensemble not being moved. Used as the square root of
+	// the diagonal inverse mass matrix by Hamiltonian Monte Carlo steps, and as the unit of slice widths.
+	double* scale_half;
+	
+	// Cache of the surrogate ln(pi) of each walker, for delayed acceptance
+	double* X_surr;		// State of walker j at which lnp_surr[j] was computed, at X_surr + j*N
+	double* lnp_surr;	// NaN if not yet computed
+	double* lnp_surr_Y;	// Surrogate ln(pi) of the proposal of each walker that passed the first stage
+	
+	// Outcome of the first stage of delayed acceptance, for each walker in a batched step
+	enum TSurrogateStage { SURROGATE_REJECTED, SURROGATE_PASSED, SURROGATE_SKIPPED };
+	TSurrogateStage* stage_batch;
+	
 	TParams& params;	// Constant model parameters
 	
 	// Information about chain
@@ -135,24 +169,41 @@ class TAffineSampler {
 	boost::uint64_t N_replacements_accepted, N_replacements_rejected;	// # of replacement steps which have been accepted and rejected. Used to track effectiveness of long-range steps.
 	boost::uint64_t N_MH_accepted, N_MH_rejected;	// # of Metroplis-Hastings steps accepted/rejected
 	boost::uint64_t N_custom_accepted, N_custom_rejected;	// # of custom reversible steps accepted/rejected
+	boost::uint64_t N_HMC_accepted, N_HMC_rejected;	// # of Hamiltonian Monte Carlo steps accepted/rejected
+	boost::uint64_t N_slice_steps, N_slice_evals;	// # of slice-sampling steps taken, and of pdf evaluations they made
+	boost::uint64_t N_surrogate_passed, N_surrogate_rejected;	// # of delayed-acceptance proposals passed on to <pdf>, and screened out by <pdf_surrogate>
 	
 	// Random number generator
 	gsl_rng* r;
 	
 	// Private member functions
-	void affine_proposal(unsigned int j, double& scale);		// Generate a proposal state for sampler j, with the given step scale, using the stretch algorithm (default)
+	void affine_proposal(unsigned int j, double& scale, bool eval_pdf=true);	// Generate a proposal state for sampler j, with the given step scale, using the stretch algorithm (default)
 	void replacement_proposal(unsigned int j, bool unbalanced);	// Generate a proposal state for sampler j using the replacement algorithm (long-range steps)
 	void replacement_proposal_diag(unsigned int j, bool unbalanced);	// Geenrate proposal state using replacement algorithm (with diagonal covariance)
 	void mixture_proposal(unsigned int j);				// Generate a proposal state for sampler j from a Gaussian mixture model designed to resemble the target distribution
-	void MH_proposal(unsigned int j);				// Generate a Metropolis-Hastings proposal for sampler j
+	void MH_proposal(unsigned int j, bool eval_pdf=true);		// Generate a Metropolis-Hastings proposal for sampler j
 	void update_ensemble_cov();					// Calculate the covariance of the ensemble, as well as its inverse, determinant and square-root (A A^T = Cov)
+	void half_ensemble_scale(unsigned int k_begin, unsigned int k_end, double *const scale);	// Standard deviation of walkers k_begin <= k < k_end in each coordinate
 	double log_gaussian_density(const TState *const x, const TState *const y);	// Log gaussian density at (x-y) given covariance matrix of ensemble
 	double log_gaussian_density_diag(const TState *const x, const TState *const y);	// Log gaussian density at (x-y) given diagonal approximation of covariance matrix of ensemble
+	void eval_batch(unsigned int j_begin, unsigned int j_end);	// Score the proposals Y[j_begin:j_end] with a single call to <pdf_batch>
+	bool accept_proposal(unsigned int j, double log_Q);		// Metropolis-Hastings acceptance test for proposal Y[j], given log Q(Y->X) / Q(X->Y)
+	bool delayed_accept(unsigned int j, double log_Q, bool local);	// Same, but screening Y[j] on <pdf_surrogate> before scoring it
+	TSurrogateStage surrogate_stage(unsigned int j, double log_Q);	// First stage of delayed_accept, on <pdf_surrogate> alone
+	bool surrogate_second_stage(unsigned int j);			// Second stage of delayed_accept, once Y[j] has been scored on <pdf>
+	void eval_batch_subset(const unsigned int *const idx, unsigned int n);	// Score the proposals Y[idx[0:n]] with a single call to <pdf_batch>
+	double walker_surrogate(unsigned int j);		// Surrogate ln(pi) of walker j, from the cache if the walker has not moved
+	double eval_slice_point(unsigned int j, unsigned int i, double x);	// pi of walker j with coordinate i set to x, for slice sampling
+	void update_walker(unsigned int j, bool record_step);		// Move walker j to Y[j] if accept[j] is set, otherwise add to its weight
 	
 public:
 	typedef double (*pdf_t)(const double *const _X, unsigned int _N, TParams& _params);
+	typedef void (*pdf_batch_t)(const double *const _X, unsigned int _N, unsigned int _L, double *const _pi, TParams& _params);	// _X[i*_L + j] is coordinate i of state j
 	typedef void (*rand_state_t)(double *const _X, unsigned int _N, gsl_rng* r, TParams& _params);
 	typedef double (*reversible_step_t)(double *const _X, double *const _Y, unsigned int _N, gsl_rng* r, TParams& _params);
+	typedef double (*pdf_local_t)(const double *const _X, const double *const _Y, unsigned int _N, unsigned int _j, TParams& _params);	// pi(Y), where Y is a local move of walker _j (counted from the walker offset) from X
+	typedef void (*local_update_t)(unsigned int _j, bool _accepted, TParams& _params);	// Walker _j has accepted or rejected its last local move
+	typedef double (*pdf_grad_t)(const double *const _X, unsigned int _N, double *const _grad, TParams& _params);	// log(pi(X)), also storing its gradient in _grad
 	
 	// Constructor & destructor
 	TAffineSampler(pdf_t _pdf, rand_state_t _rand_state, unsigned int _N, unsigned int _L, TParams& _params, TLogger& _logger, bool _use_log=true);
@@ -165,13 +216,26 @@ public:
 	void step_replacement(bool record_step=true, bool unbalanced=false, bool diag_approx=false);	// Replacement step using full covariance (affine invariant)
 	void step_MH(bool record_step=true);		// Advance each sampler using Metropolis-Hastings step
 	void step_custom_reversible(reversible_step_t f_reversible_step, bool record_step=true);
+	void step_HMC(bool record_step=true);		// Advance each sampler along a Hamiltonian trajectory (requires <pdf_grad>)
+	void step_slice(bool record_step=true);		// Advance each sampler by slice sampling along one coordinate
 	void set_scale(double a);			// Set dimensionless step scale
 	void set_replacement_bandwidth(double _h);	// Set smoothing scale to be used for replacement steps, in units of the covariance
 	void set_MH_bandwidth(double _h);
 	void set_replacement_accept_bias(double epsilon);
 	void set_sigma_min(double _sigma_min);
+	void set_batch_pdf(pdf_batch_t _pdf_batch);	// Score whole blocks of proposals at once in stretch, M-H and custom steps
+	void set_local_pdf(pdf_local_t _pdf_local, local_update_t _local_update);	// Score custom reversible steps incrementally
+	void set_walker_offset(unsigned int _walker_offset);	// Number the walkers passed to <pdf_local> and <local_update> from _walker_offset
+	void set_grad_pdf(pdf_grad_t _pdf_grad);	// Enable Hamiltonian Monte Carlo steps
+	void set_surrogate_pdf(pdf_t _pdf_surrogate);	// Screen stretch and custom steps on a cheap approximation of <pdf> (delayed acceptance). NULL to disable.
+	void set_HMC_bandwidth(double _h);		// Set the leapfrog step size, in units of the ensemble standard deviation
+	void set_HMC_leapfrog(unsigned int _N_leapfrog);	// Set the number of leapfrog steps per trajectory
+	void set_slice_width(double _w);		// Set the initial width of slice intervals, in units of the ensemble standard deviation
 	void flush(bool record_steps=true);		// Clear the weights in the ensemble and record the outstanding component states
 	void clear();					// Clear the stats, acceptance information and weights
+	void rescore();					// Re-evaluate the pdf of each walker, after the target distribution has changed
+	void set_walker(unsigned int j, const double *const x, double pi);	// Move walker j to x, with pdf pi (e.g., to resume an earlier run)
+	bool set_rng_state(const void *const state, size_t size);	// Restore the random number generator from a copy of get_rng_state(). False if the size does not match.
 	
 	void init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations=100);
 	
@@ -184,11 +248,17 @@ public:
 	double get_scale() { return sqrta*sqrta; }
 	double get_replacement_bandwidth() { return h; }
 	double get_MH_bandwidth() { return h_MH; }
+	double get_HMC_bandwidth() { return h_HMC; }
+	double get_slice_width() { return w_slice; }
+	void get_walker(unsigned int j, double *const x, double &pi) { assert(j < L); for(unsigned int i=0; i<N; i++) { x[i] = X[j].element[i]; } pi = X[j].pi; }
+	size_t get_rng_size() { return gsl_rng_size(r); }
+	const void* get_rng_state() { return gsl_rng_state(r); }
 	double get_acceptance_rate() { return (double)N_accepted/(double)(N_accepted+N_rejected); }
 	double get_stretch_acceptance_rate() { return (double)(N_stretch_accepted) / (double)(N_stretch_accepted + N_stretch_rejected); }
 	double get_replacement_acceptance_rate() { return (double)N_replacements_accepted / (double)(N_replacements_accepted + N_replacements_rejected); }
 	double get_MH_acceptance_rate() { return (double)N_MH_accepted / (double)(N_MH_accepted + N_MH_rejected); }
 	double get_custom_acceptance_rate() { return (double)(N_custom_accepted) / (double)(N_custom_accepted + N_custom_rejected); }
+	double get_HMC_acceptance_rate() { return (double)(N_HMC_accepted) / (double)(N_HMC_accepted + N_HMC_rejected); }
 	boost::uint64_t get_N_stretch_accepted() { return N_stretch_accepted; }
 	boost::uint64_t get_N_stretch_rejected() { return N_stretch_rejected; }
 	boost::uint64_t get_N_replacements_accepted() { return N_replacements_accepted; }
@@ -197,6 +267,12 @@ public:
 	boost::uint64_t get_N_MH_rejected() { return N_MH_rejected; }
 	boost::uint64_t get_N_custom_accepted() { return N_custom_accepted; }
 	boost::uint64_t get_N_custom_rejected() { return N_custom_rejected; }
+	boost::uint64_t get_N_HMC_accepted() { return N_HMC_accepted; }
+	boost::uint64_t get_N_HMC_rejected() { return N_HMC_rejected; }
+	boost::uint64_t get_N_slice_steps() { return N_slice_steps; }
+	boost::uint64_t get_N_slice_evals() { return N_slice_evals; }
+	boost::uint64_t get_N_surrogate_passed() { return N_surrogate_passed; }
+	boost::uint64_t get_N_surrogate_rejected() { return N_surrogate_rejected; }
 	double get_ln_Z_harmonic(bool use_peak=true, double nsigma_max=1., double nsigma_peak=0.1, double chain_frac=0.1) { return chain.get_ln_Z_harmonic(use_peak, nsigma_max, nsigma_peak, chain_frac); }
 	void print_state();
 	void print_stats();
@@ -205,6 +281,16 @@ public:
 private:
 	rand_state_t rand_state;	// Function which generates a random state
 	pdf_t pdf;			// pi(X), a function proportional to the target distribution
+	pdf_batch_t pdf_batch;		// Optional batched version of <pdf>. NULL if not provided.
+	pdf_local_t pdf_local;		// Optional version of <pdf> that reuses work from the walker's current state. NULL if not provided.
+	local_update_t local_update;	// Notified of the outcome of each proposal scored by <pdf_local>
+	unsigned int walker_offset;	// Added to the walker indices passed to <pdf_local> and <local_update>, so that they are unique across samplers
+	pdf_grad_t pdf_grad;		// Optional version of <pdf> that also returns the gradient. NULL if not provided.
+	pdf_t pdf_surrogate;		// Optional cheap approximation of <pdf>, used to screen proposals. NULL if not provided.
+	
+	static void print_step_counts(TAffineSampler<TParams, TLogger> *const *samplers, unsigned int N_samplers);	// Print the counts of each kind of step taken by each sampler
+	
+	friend class TParallelAffineSampler<TParams, TLogger>;
 };
 
 
@@ -237,13 +323,24 @@ public:
 	                            bool record_steps);	// Take given number of steps using custom user-provided reversible step
 	void tune_stretch(unsigned int N_rounds, double target_acceptance);	// Adjust stretch scale to achieve desired acceptance rate
 	void tune_MH(unsigned int N_rounds, double target_acceptance);		// Adjust step size to achieve desired acceptance rate
+	void step_HMC(unsigned int N_steps, bool record_steps);		// Take the given number of Hamiltonian Monte Carlo steps in each affine sampler
+	void step_slice(unsigned int N_steps, bool record_steps);	// Take the given number of slice-sampling steps in each affine sampler
+	void tune_HMC(unsigned int N_rounds, double target_acceptance);		// Adjust leapfrog step size to achieve desired acceptance rate
 	void set_scale(double a) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_scale(a); } };				// Set the dimensionless step size a
 	void set_replacement_bandwidth(double h) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_replacement_bandwidth(h); } };	// Set size of replacement steps (in units of covariance) 
 	void set_MH_bandwidth(double h) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_MH_bandwidth(h); } };	// Set size of M-H steps (in units of covariance) 
 	void set_replacement_accept_bias(double epsilon) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_replacement_accept_bias(epsilon); } };
 	void set_sigma_min(double _sigma_min) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_sigma_min(_sigma_min); } };
+	void set_batch_pdf(typename TAffineSampler<TParams, TLogger>::pdf_batch_t _pdf_batch) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_batch_pdf(_pdf_batch); } };
+	void set_local_pdf(typename TAffineSampler<TParams, TLogger>::pdf_local_t _pdf_local, typename TAffineSampler<TParams, TLogger>::local_update_t _local_update) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_local_pdf(_pdf_local, _local_update); } };
+	void set_grad_pdf(typename TAffineSampler<TParams, TLogger>::pdf_grad_t _pdf_grad) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_grad_pdf(_pdf_grad); } };
+	void set_surrogate_pdf(typename TAffineSampler<TParams, TLogger>::pdf_t _pdf_surrogate) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_surrogate_pdf(_pdf_surrogate); } };
+	void set_HMC_bandwidth(double h) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_HMC_bandwidth(h); } };
+	void set_HMC_leapfrog(unsigned int n) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_HMC_leapfrog(n); } };
+	void set_slice_width(double w) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->set_slice_width(w); } };
 	void init_gaussian_mixture_target(unsigned int nclusters, unsigned int iterations=100) { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->init_gaussian_mixture_target(nclusters, iterations); } };
 	void clear() { for(unsigned int i=0; i<N_samplers; i++) { sampler[i]->clear(); }; stats.clear(); };
+	void rescore();
 	
 	// Accessors
 	TLogger& get_logger() { return logger; }
@@ -264,8 +361,9 @@ public:
 	void print_clusters() { for(unsigned int i=0; i<N_samplers; i++) { std::cout << std::endl; sampler[i]->print_clusters(); } } 
 	TAffineSampler<TParams, TLogger>* const get_sampler(unsigned int index) { assert(index < N_samplers); return sampler[index]; }
 	
-	// Calculate the GR diagnostic on a transformed space
-	void calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf);
+	// Calculate the GR diagnostic on a transformed space. If transf_stats_acc is given, the transformed
+	// statistics of each sampler are added to transf_stats_acc[n], and the diagnostic is taken over the totals.
+	void calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf, TStats **transf_stats_acc=NULL);
 };
 
 
@@ -345,7 +443,9 @@ TAffineSampler<TParams, TLogger>::TAffineSampler(pdf_t _pdf, rand_state_t _rand_
 	: pdf(_pdf), rand_state(_rand_state), params(_params), logger(_logger), N(_N), L(_L), X(NULL), Y(NULL), accept(NULL),
 	  r(NULL), use_log(_use_log), chain(_N, 1000*_L), W(NULL), ensemble_mean(NULL), ensemble_cov(NULL), sqrt_ensemble_cov(NULL),
 	  inv_ensemble_cov(NULL), wv(NULL), ws(NULL), wm1(NULL), wm2(NULL), wp(NULL), gm_target(NULL),
-	  diag_cov(NULL), sqrt_diag_cov(NULL), inv_diag_cov(NULL)
+	  diag_cov(NULL), sqrt_diag_cov(NULL), inv_diag_cov(NULL), Y_batch(NULL), pi_batch(NULL), log_Q_batch(NULL), idx_batch(NULL),
+	  pdf_batch(NULL), pdf_local(NULL), local_update(NULL), walker_offset(0), pdf_grad(NULL), p_HMC(NULL), grad_HMC(NULL), scale_half(NULL),
+	  pdf_surrogate(NULL), X_surr(NULL), lnp_surr(NULL), lnp_surr_Y(NULL), stage_batch(NULL)
 {
 	// Seed the random number generator
 	seed_gsl_rng(&r);
@@ -408,6 +508,7 @@ TAffineSampler<TParams, TLogger>::TAffineSampler(pdf_t _pdf, rand_state_t _rand_
 	// Create working space for replacement move
 	W = new double[N];
 	ensemble_mean = new double[N];
+	scale_half = new double[N];
 	ensemble_cov = gsl_matrix_alloc(N, N);
 	sqrt_ensemble_cov = gsl_matrix_alloc(N, N);
 	inv_ensemble_cov = gsl_matrix_alloc(N, N);
@@ -428,6 +529,13 @@ TAffineSampler<TParams, TLogger>::TAffineSampler(pdf_t _pdf, rand_state_t _rand_
 	// Set Metropolis-Hastings step size, in units of ensemble covariance
 	set_MH_bandwidth(0.25);
 	
+	// Hamiltonian trajectories, in units of the ensemble standard deviation
+	set_HMC_bandwidth(0.1);
+	set_HMC_leapfrog(10);
+	
+	// Slice-sampling interval, in units of the ensemble standard deviation
+	set_slice_width(1.);
+	
 	// Set the initial step scale. 2 is good for most situations.
 	set_scale(2.);
 	
@@ -448,6 +556,12 @@ TAffineSampler<TParams, TLogger>::TAffineSampler(pdf_t _pdf, rand_state_t _rand_
 	N_MH_rejected = 0;
 	N_custom_accepted = 0;
 	N_custom_rejected = 0;
+	N_HMC_accepted = 0;
+	N_HMC_rejected = 0;
+	N_slice_steps = 0;
+	N_slice_evals = 0;
+	N_surrogate_passed = 0;
+	N_surrogate_rejected = 0;
 }
 
 // Destructor
@@ -471,6 +585,17 @@ TAffineSampler<TParams, TLogger>::~TAffineSampler() {
 	if(diag_cov != NULL) { delete[] diag_cov; diag_cov = NULL; }
 	if(sqrt_diag_cov != NULL) { delete[] sqrt_diag_cov; sqrt_diag_cov = NULL; }
 	if(inv_diag_cov != NULL) { delete[] inv_diag_cov; inv_diag_cov = NULL; }
+	if(Y_batch != NULL) { delete[] Y_batch; Y_batch = NULL; }
+	if(pi_batch != NULL) { delete[] pi_batch; pi_batch = NULL; }
+	if(log_Q_batch != NULL) { delete[] log_Q_batch; log_Q_batch = NULL; }
+	if(idx_batch != NULL) { delete[] idx_batch; idx_batch = NULL; }
+	if(p_HMC != NULL) { delete[] p_HMC; p_HMC = NULL; }
+	if(grad_HMC != NULL) { delete[] grad_HMC; grad_HMC = NULL; }
+	if(scale_half != NULL) { delete[] scale_half; scale_half = NULL; }
+	if(X_surr != NULL) { delete[] X_surr; X_surr = NULL; }
+	if(lnp_surr != NULL) { delete[] lnp_surr; lnp_surr = NULL; }
+	if(lnp_surr_Y != NULL) { delete[] lnp_surr_Y; lnp_surr_Y = NULL; }
+	if(stage_batch != NULL) { delete[] stage_batch; stage_batch = NULL; }
 }
 
 
@@ -480,7 +605,7 @@ TAffineSampler<TParams, TLogger>::~TAffineSampler() {
 
 // Generate a proposal state
 template<class TParams, class TLogger>
-inline void TAffineSampler<TParams, TLogger>::affine_proposal(unsigned int j, double& scale) {
+inline void TAffineSampler<TParams, TLogger>::affine_proposal(unsigned int j, double& scale, bool eval_pdf) {
 	// Determine stretch scale
 	scale = (sqrta - 1./sqrta) * gsl_rng_uniform(r) + 1./sqrta;
 	scale *= scale;
@@ -495,7 +620,7 @@ inline void TAffineSampler<TParams, TLogger>::affine_proposal(unsigned int j, do
 	}
 	
 	// Get pdf(Y) and initialize weight of proposal point to unity
-	Y[j].pi = pdf(Y[j].element, N, params);
+	if(eval_pdf) { Y[j].pi = pdf(Y[j].element, N, params); }
 	Y[j].weight = 1;
 	Y[j].replacement_factor = 1.;
 }
@@ -856,7 +981,7 @@ void TAffineSampler<TParams, TLogger>::replacement_proposal_diag(unsigned int j,
 }
 
 template<class TParams, class TLogger>
-void TAffineSampler<TParams, TLogger>::MH_proposal(unsigned int j) {
+void TAffineSampler<TParams, TLogger>::MH_proposal(unsigned int j, bool eval_pdf) {
 	// Determine step vector
 	draw_from_cov(W, sqrt_ensemble_cov, N, r);
 	
@@ -866,11 +991,168 @@ void TAffineSampler<TParams, TLogger>::MH_proposal(unsigned int j) {
 	}
 	
 	// Get pdf(Y) and initialize weight of proposal point to unity
-	Y[j].pi = pdf(Y[j].element, N, params);
+	if(eval_pdf) { Y[j].pi = pdf(Y[j].element, N, params); }
 	Y[j].weight = 1.;
 	Y[j].replacement_factor = 1.;
 }
 
+// Score proposals j_begin <= j < j_end in one call to the batched pdf
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::eval_batch(unsigned int j_begin, unsigned int j_end) {
+	unsigned int n = j_end - j_begin;
+	
+	// Transpose proposals into struct-of-arrays layout
+	for(unsigned int i=0; i<N; i++) {
+		for(unsigned int j=0; j<n; j++) {
+			Y_batch[i*n + j] = Y[j_begin+j].element[i];
+		}
+	}
+	
+	pdf_batch(Y_batch, N, n, pi_batch, params);
+	
+	for(unsigned int j=0; j<n; j++) {
+		Y[j_begin+j].pi = pi_batch[j];
+		Y[j_begin+j].weight = 1;
+		Y[j_begin+j].replacement_factor = 1.;
+	}
+}
+
+// Same as eval_batch, for the proposals of the walkers listed in idx
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::eval_batch_subset(const unsigned int *const idx, unsigned int n) {
+	if(n == 0) { return; }
+	
+	for(unsigned int i=0; i<N; i++) {
+		for(unsigned int m=0; m<n; m++) {
+			Y_batch[i*n + m] = Y[idx[m]].element[i];
+		}
+	}
+	
+	pdf_batch(Y_batch, N, n, pi_batch, params);
+	
+	for(unsigned int m=0; m<n; m++) {
+		Y[idx[m]].pi = pi_batch[m];
+		Y[idx[m]].weight = 1;
+		Y[idx[m]].replacement_factor = 1.;
+	}
+}
+
+template<class TParams, class TLogger>
+inline bool TAffineSampler<TParams, TLogger>::accept_proposal(unsigned int j, double log_Q) {
+	// Determine if the proposal is the maximum-likelihood point
+	if(Y[j].pi > X_ML.pi) { X_ML = Y[j]; }
+	
+	double alpha, p;
+	if(use_log) {	// If <pdf> returns log probability
+		// Accept the proposal if the current state has zero probability and the proposed state doesn't
+		if(is_neg_inf_replacement(X[j].pi) && !(is_neg_inf_replacement(Y[j].pi))) { return true; }
+		
+		alpha = Y[j].pi - X[j].pi + log_Q;
+		if(alpha > 0.) { return true; }
+		
+		p = gsl_rng_uniform(r);
+		if((p == 0.) && (Y[j] > neg_inf_replacement)) { return true; }	// Accept if zero is rolled but proposal has nonzero probability
+		return (log(p) < alpha);
+	} else {	// If <pdf> returns bare probability
+		if((X[j].pi == 0) && (Y[j].pi != 0)) { return true; }
+		
+		alpha = exp(log_Q) * Y[j].pi / X[j].pi;
+		if(alpha > 1.) { return true; }
+		
+		p = gsl_rng_uniform(r);
+		if((p == 0.) && (Y[j] != 0.)) { return true; }
+		return (p < alpha);
+	}
+}
+
+// Surrogate ln(pi) of walker j. The cached value is kept while the walker stays where it was computed,
+// and is recomputed once the walker has been moved by a step that does not use the surrogate.
+template<class TParams, class TLogger>
+inline double TAffineSampler<TParams, TLogger>::walker_surrogate(unsigned int j) {
+	double *const x = X_surr + j*N;
+	if(isnan(lnp_surr[j]) || (memcmp(x, X[j].element, N*sizeof(double)) != 0)) {
+		memcpy(x, X[j].element, N*sizeof(double));
+		lnp_surr[j] = pdf_surrogate(X[j].element, N, params);
+	}
+	return lnp_surr[j];
+}
+
+// Delayed-acceptance test of proposal Y[j], given log Q(Y->X) / Q(X->Y). The proposal is first tested
+// on <pdf_surrogate>, and only scored on <pdf> (or on <pdf_local>, if local is set) if it passes. The
+// second test divides out the ratio of the surrogate, so that the chain still targets <pdf>. The
+// surrogate of the current state is taken from the cache, which rescore() clears when the target
+// changes.
+template<class TParams, class TLogger>
+bool TAffineSampler<TParams, TLogger>::delayed_accept(unsigned int j, double log_Q, bool local) {
+	Y[j].weight = 1;
+	Y[j].replacement_factor = 1.;
+	
+	TSurrogateStage stage = surrogate_stage(j, log_Q);
+	if(stage == SURROGATE_REJECTED) { return false; }
+	
+	Y[j].pi = local ? pdf_local(X[j].element, Y[j].element, N, walker_offset + j, params) : pdf(Y[j].element, N, params);
+	if(stage == SURROGATE_SKIPPED) { return accept_proposal(j, log_Q); }
+	
+	return surrogate_second_stage(j);
+}
+
+// First stage of delayed acceptance. Walkers at zero probability skip the surrogate, and are moved by
+// the usual test. Otherwise, the surrogate ln(pi) of a proposal that passes is kept in lnp_surr_Y[j].
+template<class TParams, class TLogger>
+typename TAffineSampler<TParams, TLogger>::TSurrogateStage TAffineSampler<TParams, TLogger>::surrogate_stage(unsigned int j, double log_Q) {
+	double lnp_surr_X = walker_surrogate(j);
+	if(is_neg_inf_replacement(X[j].pi) || is_neg_inf_replacement(lnp_surr_X)) { return SURROGATE_SKIPPED; }
+	
+	lnp_surr_Y[j] = pdf_surrogate(Y[j].element, N, params);
+	double alpha = lnp_surr_Y[j] - lnp_surr_X + log_Q;
+	if(is_neg_inf_replacement(lnp_surr_Y[j]) || ((alpha < 0.) && (log(gsl_rng_uniform(r)) >= alpha))) {
+		Y[j].pi = neg_inf_replacement;
+		N_surrogate_rejected++;
+		return SURROGATE_REJECTED;
+	}
+	N_surrogate_passed++;
+	
+	return SURROGATE_PASSED;
+}
+
+// Second stage of delayed acceptance, on the full pdf, already stored in Y[j].pi
+template<class TParams, class TLogger>
+bool TAffineSampler<TParams, TLogger>::surrogate_second_stage(unsigned int j) {
+	if(Y[j].pi > X_ML.pi) { X_ML = Y[j]; }
+	if(is_neg_inf_replacement(Y[j].pi)) { return false; }
+	
+	double alpha = (Y[j].pi - X[j].pi) - (lnp_surr_Y[j] - lnp_surr[j]);
+	bool accepted = (alpha > 0.) || (log(gsl_rng_uniform(r)) < alpha);
+	
+	// The caller moves the walker to Y[j], whose surrogate is already known
+	if(accepted) {
+		memcpy(X_surr + j*N, Y[j].element, N*sizeof(double));
+		lnp_surr[j] = lnp_surr_Y[j];
+	}
+	
+	return accepted;
+}
+
+template<class TParams, class TLogger>
+inline void TAffineSampler<TParams, TLogger>::update_walker(unsigned int j, bool record_step) {
+	if(accept[j]) {
+		if(record_step) {
+			chain.add_point(X[j].element, X[j].pi, (double)(X[j].weight));
+			
+			#pragma omp critical (logger)
+			logger(X[j].element, X[j].weight);
+		}
+		
+		X[j] = Y[j];
+		
+		N_accepted++;
+	} else {
+		X[j].weight++;
+		
+		N_rejected++;
+	}
+}
+
 template<class TParams, class TLogger>
 void TAffineSampler<TParams, TLogger>::mixture_proposal(unsigned int j) {
 	// Draw from Gaussian mixture
@@ -915,6 +1197,81 @@ void TAffineSampler<TParams, TLogger>::step(bool record_step, double p_replaceme
 template<class TParams, class TLogger>
 void TAffineSampler<TParams, TLogger>::step_affine(bool record_step) {
 	double scale, alpha, p;
+	
+	if((pdf_surrogate != NULL) && (pdf_batch == NULL)) {
+		for(unsigned int j=0; j<L; j++) {
+			affine_proposal(j, scale, false);
+			accept[j] = delayed_accept(j, (double)(N - 1) * log(scale), false);
+			update_walker(j, record_step);
+			if(accept[j]) { N_stretch_accepted++; } else { N_stretch_rejected++; }
+		}
+		
+		return;
+	}
+	
+	if(pdf_batch != NULL) {
+		// Update each half of the ensemble in turn, stretching towards walkers in the other
+		// half. The proposals within a half are then independent, and can be scored together.
+		// With a surrogate, only the proposals that pass its screen are scored, in one batch.
+		unsigned int L_half = L / 2;
+		unsigned int j_begin, j_end, k_begin, k_end, k, n_pass;
+		
+		for(unsigned int half=0; half<2; half++) {
+			j_begin = (half == 0) ? 0 : L_half;
+			j_end = (half == 0) ? L_half : L;
+			k_begin = (half == 0) ? L_half : 0;
+			k_end = (half == 0) ? L : L_half;
+			
+			for(unsigned int j=j_begin; j<j_end; j++) {
+				scale = (sqrta - 1./sqrta) * gsl_rng_uniform(r) + 1./sqrta;
+				scale *= scale;
+				
+				k = k_begin + gsl_rng_uniform_int(r, (long unsigned int)(k_end - k_begin));
+				
+				for(unsigned int i=0; i<N; i++) {
+					Y[j].element[i] = (1. - scale) * X[k].element[i] + scale * X[j].element[i];
+				}
+				log_Q_batch[j] = (double)(N - 1) * log(scale);
+			}
+			
+			if(pdf_surrogate == NULL) {
+				eval_batch(j_begin, j_end);
+				
+				for(unsigned int j=j_begin; j<j_end; j++) {
+					accept[j] = accept_proposal(j, log_Q_batch[j]);
+					update_walker(j, record_step);
+					if(accept[j]) { N_stretch_accepted++; } else { N_stretch_rejected++; }
+				}
+				
+				continue;
+			}
+			
+			n_pass = 0;
+			for(unsigned int j=j_begin; j<j_end; j++) {
+				Y[j].weight = 1;
+				Y[j].replacement_factor = 1.;
+				stage_batch[j] = surrogate_stage(j, log_Q_batch[j]);
+				if(stage_batch[j] != SURROGATE_REJECTED) { idx_batch[n_pass++] = j; }
+			}
+			
+			eval_batch_subset(idx_batch, n_pass);
+			
+			for(unsigned int j=j_begin; j<j_end; j++) {
+				if(stage_batch[j] == SURROGATE_REJECTED) {
+					accept[j] = false;
+				} else if(stage_batch[j] == SURROGATE_SKIPPED) {
+					accept[j] = accept_proposal(j, log_Q_batch[j]);
+				} else {
+					accept[j] = surrogate_second_stage(j);
+				}
+				update_walker(j, record_step);
+				if(accept[j]) { N_stretch_accepted++; } else { N_stretch_rejected++; }
+			}
+		}
+		
+		return;
+	}
+	
 	for(unsigned int j=0; j<L; j++) {
 		// Draw a proposal
 		affine_proposal(j, scale);
@@ -1087,6 +1444,20 @@ void TAffineSampler<TParams, TLogger>::step_MH(bool record_step) {
 	// Update statistics on ensemble
 	update_ensemble_cov();
 	
+	if(pdf_batch != NULL) {
+		// Each proposal depends only on its own walker, so the whole ensemble can be scored at once
+		for(unsigned int j=0; j<L; j++) { MH_proposal(j, false); }
+		eval_batch(0, L);
+		
+		for(unsigned int j=0; j<L; j++) {
+			accept[j] = accept_proposal(j, 0.);
+			update_walker(j, record_step);
+			if(accept[j]) { N_MH_accepted++; } else { N_MH_rejected++; }
+		}
+		
+		return;
+	}
+	
 	for(unsigned int j=0; j<L; j++) {
 		// Generate proposal
 		MH_proposal(j);
@@ -1160,12 +1531,43 @@ template<class TParams, class TLogger>
 void TAffineSampler<TParams, TLogger>::step_custom_reversible(reversible_step_t f_reversible_step, bool record_step) {
 	double alpha, p, Q_factor;
 	
+	if(pdf_surrogate != NULL) {
+		for(unsigned int j=0; j<L; j++) {
+			Q_factor = f_reversible_step(X[j].element, Y[j].element, N, r, params);
+			accept[j] = delayed_accept(j, Q_factor, pdf_local != NULL);
+			update_walker(j, record_step);
+			if(accept[j]) { N_custom_accepted++; } else { N_custom_rejected++; }
+			if(local_update != NULL) { local_update(walker_offset + j, accept[j], params); }
+		}
+		
+		return;
+	}
+	
+	if((pdf_batch != NULL) && use_log && (pdf_local == NULL)) {
+		for(unsigned int j=0; j<L; j++) {
+			log_Q_batch[j] = f_reversible_step(X[j].element, Y[j].element, N, r, params);
+		}
+		eval_batch(0, L);
+		
+		for(unsigned int j=0; j<L; j++) {
+			accept[j] = accept_proposal(j, log_Q_batch[j]);
+			update_walker(j, record_step);
+			if(accept[j]) { N_custom_accepted++; } else { N_custom_rejected++; }
+		}
+		
+		return;
+	}
+	
 	for(unsigned int j=0; j<L; j++) {
 		// Generate proposal from custom user function. Assume step probability is symmetric in X and Y.
 		Q_factor = f_reversible_step(X[j].element, Y[j].element, N, r, params);
 		
 		// Get pdf(Y) and initialize weight of proposal point to unity
-		Y[j].pi = pdf(Y[j].element, N, params);
+		if(pdf_local != NULL) {
+			Y[j].pi = pdf_local(X[j].element, Y[j].element, N, walker_offset + j, params);
+		} else {
+			Y[j].pi = pdf(Y[j].element, N, params);
+		}
 		Y[j].weight = 1;
 		Y[j].replacement_factor = 1.;
 		
@@ -1231,6 +1633,194 @@ void TAffineSampler<TParams, TLogger>::step_custom_reversible(reversible_step_t
 			N_rejected++;
 			N_custom_rejected++;
 		}
+		
+		if(local_update != NULL) { local_update(walker_offset + j, accept[j], params); }
+	}
+}
+
+// Hamiltonian Monte Carlo step. The mass matrix is diagonal, with each coordinate scaled by the
+// standard deviation of the ensemble. As in the batched stretch step, each half of the ensemble is
+// moved in turn, with the scale taken from the other half, so that the trajectory of a walker does
+// not depend on its own state. The step size is jittered by +-20% for each trajectory, so that
+// trajectories do not resonate with the period of the target distribution.
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::step_HMC(bool record_step) {
+	assert(pdf_grad != NULL);
+	
+	double eps, K_X, K_Y;
+	unsigned int L_half = L / 2;
+	unsigned int j_begin, j_end, k_begin, k_end;
+	
+	for(unsigned int half=0; half<2; half++) {
+		j_begin = (half == 0) ? 0 : L_half;
+		j_end = (half == 0) ? L_half : L;
+		k_begin = (half == 0) ? L_half : 0;
+		k_end = (half == 0) ? L : L_half;
+		
+		half_ensemble_scale(k_begin, k_end, scale_half);
+		
+		for(unsigned int j=j_begin; j<j_end; j++) {
+			eps = h_HMC * (0.8 + 0.4 * gsl_rng_uniform(r));
+			
+			// Draw momentum
+			K_X = 0.;
+			for(unsigned int i=0; i<N; i++) {
+				p_HMC[i] = gsl_ran_gaussian_ziggurat(r, 1.);
+				K_X += 0.5 * p_HMC[i] * p_HMC[i];
+				Y[j].element[i] = X[j].element[i];
+			}
+			
+			// Leapfrog integration
+			Y[j].pi = pdf_grad(Y[j].element, N, grad_HMC, params);
+			for(unsigned int i=0; i<N; i++) { p_HMC[i] += 0.5 * eps * scale_half[i] * grad_HMC[i]; }
+			
+			for(unsigned int n=1; n<=N_leapfrog; n++) {
+				for(unsigned int i=0; i<N; i++) { Y[j].element[i] += eps * scale_half[i] * p_HMC[i]; }
+				
+				Y[j].pi = pdf_grad(Y[j].element, N, grad_HMC, params);
+				if(is_neg_inf_replacement(Y[j].pi)) { break; }	// Trajectory has left the support
+				
+				for(unsigned int i=0; i<N; i++) { p_HMC[i] += (n == N_leapfrog ? 0.5 : 1.) * eps * scale_half[i] * grad_HMC[i]; }
+			}
+			
+			K_Y = 0.;
+			for(unsigned int i=0; i<N; i++) { K_Y += 0.5 * p_HMC[i] * p_HMC[i]; }
+			
+			Y[j].weight = 1;
+			Y[j].replacement_factor = 1.;
+			
+			// Kinetic energy enters the acceptance test in place of the proposal density ratio
+			accept[j] = accept_proposal(j, K_X - K_Y);
+			update_walker(j, record_step);
+			if(accept[j]) { N_HMC_accepted++; } else { N_HMC_rejected++; }
+		}
+	}
+}
+
+// Standard deviation of walkers k_begin <= k < k_end in each coordinate, weighted by probability as
+// in update_ensemble_cov, and floored at <sigma_min>.
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::half_ensemble_scale(unsigned int k_begin, unsigned int k_end, double *const scale) {
+	double pi_0 = neg_inf_replacement;
+	for(unsigned int k=k_begin; k<k_end; k++) {
+		if(X[k].pi > pi_0) { pi_0 = X[k].pi; }
+	}
+	
+	// Mean, accumulated in W
+	double weight;
+	double sum_weight = 0.;
+	for(unsigned int i=0; i<N; i++) {
+		W[i] = 0.;
+		scale[i] = 0.;
+	}
+	for(unsigned int k=k_begin; k<k_end; k++) {
+		weight = use_log ? exp(X[k].pi - pi_0) : X[k].pi / pi_0;
+		sum_weight += weight;
+		for(unsigned int i=0; i<N; i++) { W[i] += weight * X[k].element[i]; }
+	}
+	for(unsigned int i=0; i<N; i++) { W[i] /= sum_weight; }
+	
+	// Variance
+	double tmp;
+	for(unsigned int k=k_begin; k<k_end; k++) {
+		weight = use_log ? exp(X[k].pi - pi_0) : X[k].pi / pi_0;
+		for(unsigned int i=0; i<N; i++) {
+			tmp = X[k].element[i] - W[i];
+			scale[i] += weight * tmp * tmp;
+		}
+	}
+	for(unsigned int i=0; i<N; i++) {
+		scale[i] = sqrt(scale[i] / sum_weight);
+		if(!(scale[i] >= sigma_min)) { scale[i] = sigma_min; }	// Also if no walker has weight
+	}
+}
+
+// Score the point that differs from walker j only in coordinate i, where it takes the value x. The
+// point is left in Y[j].
+template<class TParams, class TLogger>
+inline double TAffineSampler<TParams, TLogger>::eval_slice_point(unsigned int j, unsigned int i, double x) {
+	Y[j].element[i] = x;
+	N_slice_evals++;
+	if(pdf_local != NULL) { return pdf_local(X[j].element, Y[j].element, N, walker_offset + j, params); }
+	return pdf(Y[j].element, N, params);
+}
+
+// Coordinate-wise slice-sampling step (Neal 2003), with stepping out. Each walker updates one randomly
+// chosen coordinate, starting from an interval <w_slice> times the standard deviation of the ensemble
+// in that coordinate, stepped out at most SLICE_MAX_STEPS_OUT times. Slice steps are never rejected.
+// As in step_HMC, the width for each half of the ensemble is taken from the other half, so that it
+// does not depend on the state of the walker being moved.
+// If <pdf_local> is set, points are scored incrementally, as they differ from the walker in one
+// coordinate. The last point scored is always the one moved to, as <local_update> requires.
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::step_slice(bool record_step) {
+	assert(use_log);
+	
+	double width, ln_y, x_0, x_1, lower, upper, lnp_1;
+	unsigned int i, n_left, n_right, n_shrink;
+	bool moved;
+	unsigned int L_half = L / 2;
+	unsigned int j_begin, j_end, k_begin, k_end;
+	
+	for(unsigned int half=0; half<2; half++) {
+		j_begin = (half == 0) ? 0 : L_half;
+		j_end = (half == 0) ? L_half : L;
+		k_begin = (half == 0) ? L_half : 0;
+		k_end = (half == 0) ? L : L_half;
+		
+		half_ensemble_scale(k_begin, k_end, scale_half);
+		
+		for(unsigned int j=j_begin; j<j_end; j++) {
+			// The slice is not defined for walkers at zero probability
+			if(is_neg_inf_replacement(X[j].pi)) {
+				accept[j] = false;
+				update_walker(j, record_step);
+				continue;
+			}
+			
+			i = gsl_rng_uniform_int(r, (long unsigned int)N);
+			width = w_slice * scale_half[i];
+			if(!(width > 0.)) {
+				accept[j] = false;
+				update_walker(j, record_step);
+				continue;
+			}
+			
+			for(unsigned int k=0; k<N; k++) { Y[j].element[k] = X[j].element[k]; }
+			x_0 = X[j].element[i];
+			ln_y = X[j].pi + log(gsl_rng_uniform_pos(r));	// Height of the slice
+			
+			// Step out, splitting the steps randomly between the two ends
+			lower = x_0 - width * gsl_rng_uniform(r);
+			upper = lower + width;
+			n_left = gsl_rng_uniform_int(r, SLICE_MAX_STEPS_OUT);
+			n_right = SLICE_MAX_STEPS_OUT - 1 - n_left;
+			for(; (n_left > 0) && (eval_slice_point(j, i, lower) > ln_y); n_left--) { lower -= width; }
+			for(; (n_right > 0) && (eval_slice_point(j, i, upper) > ln_y); n_right--) { upper += width; }
+			
+			// Shrink the interval towards x_0 until a point inside the slice is drawn
+			moved = false;
+			for(n_shrink=0; n_shrink<100; n_shrink++) {
+				x_1 = lower + (upper - lower) * gsl_rng_uniform(r);
+				lnp_1 = eval_slice_point(j, i, x_1);
+				if(lnp_1 > ln_y) {
+					moved = true;
+					break;
+				}
+				if(x_1 < x_0) { lower = x_1; } else { upper = x_1; }
+			}
+			
+			Y[j].pi = lnp_1;
+			Y[j].weight = 1;
+			Y[j].replacement_factor = 1.;
+			if(moved && (Y[j].pi > X_ML.pi)) { X_ML = Y[j]; }
+			
+			accept[j] = moved;
+			update_walker(j, record_step);
+			N_slice_steps++;
+			
+			if(local_update != NULL) { local_update(walker_offset + j, moved, params); }
+		}
 	}
 }
 
@@ -1261,6 +1851,71 @@ void TAffineSampler<TParams, TLogger>::set_sigma_min(double _sigma_min) {
 	sigma_min = _sigma_min;
 }
 
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_batch_pdf(pdf_batch_t _pdf_batch) {
+	assert(L >= 2);
+	pdf_batch = _pdf_batch;
+	if((pdf_batch != NULL) && (Y_batch == NULL)) {
+		Y_batch = new double[N*L];
+		pi_batch = new double[L];
+		log_Q_batch = new double[L];
+		idx_batch = new unsigned int[L];
+	}
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_local_pdf(pdf_local_t _pdf_local, local_update_t _local_update) {
+	pdf_local = _pdf_local;
+	local_update = _local_update;
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_walker_offset(unsigned int _walker_offset) {
+	walker_offset = _walker_offset;
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_grad_pdf(pdf_grad_t _pdf_grad) {
+	assert(use_log);
+	pdf_grad = _pdf_grad;
+	if((pdf_grad != NULL) && (p_HMC == NULL)) {
+		p_HMC = new double[N];
+		grad_HMC = new double[N];
+	}
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_surrogate_pdf(pdf_t _pdf_surrogate) {
+	assert(use_log || (_pdf_surrogate == NULL));
+	pdf_surrogate = _pdf_surrogate;
+	
+	if(X_surr == NULL) {
+		X_surr = new double[N*L];
+		lnp_surr = new double[L];
+		lnp_surr_Y = new double[L];
+		stage_batch = new TSurrogateStage[L];
+	}
+	for(unsigned int j=0; j<L; j++) { lnp_surr[j] = std::numeric_limits<double>::quiet_NaN(); }
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_HMC_bandwidth(double _h) {
+	assert(_h > 0.);
+	h_HMC = _h;
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_HMC_leapfrog(unsigned int _N_leapfrog) {
+	assert(_N_leapfrog > 0);
+	N_leapfrog = _N_leapfrog;
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_slice_width(double _w) {
+	assert(_w > 0.);
+	w_slice = _w;
+}
+
 template<class TParams, class TLogger>
 void TAffineSampler<TParams, TLogger>::set_replacement_accept_bias(double epsilon) {
 	assert(epsilon >= 0.);
@@ -1298,6 +1953,58 @@ void TAffineSampler<TParams, TLogger>::clear() {
 	N_MH_rejected = 0;
 	N_custom_accepted = 0;
 	N_custom_rejected = 0;
+	N_HMC_accepted = 0;
+	N_HMC_rejected = 0;
+	N_slice_steps = 0;
+	N_slice_evals = 0;
+	N_surrogate_passed = 0;
+	N_surrogate_rejected = 0;
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::rescore() {
+	if(pdf_batch != NULL) {
+		for(unsigned int j=0; j<L; j++) {
+			Y[j] = X[j];
+		}
+		eval_batch(0, L);
+		for(unsigned int j=0; j<L; j++) {
+			X[j].pi = Y[j].pi;
+		}
+	} else {
+		for(unsigned int j=0; j<L; j++) {
+			X[j].pi = pdf(X[j].element, N, params);
+		}
+	}
+	
+	// So were the cached surrogates
+	if(lnp_surr != NULL) {
+		for(unsigned int j=0; j<L; j++) { lnp_surr[j] = std::numeric_limits<double>::quiet_NaN(); }
+	}
+	
+	// The old maximum-likelihood point was scored under the old target
+	unsigned int index_of_best = 0;
+	for(unsigned int j=1; j<L; j++) {
+		if(X[j] > X[index_of_best]) { index_of_best = j; }
+	}
+	X_ML = X[index_of_best];
+}
+
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::set_walker(unsigned int j, const double *const x, double pi) {
+	assert(j < L);
+	for(unsigned int i=0; i<N; i++) { X[j].element[i] = x[i]; }
+	X[j].pi = pi;
+	X[j].weight = 0;
+	if(X[j] > X_ML) { X_ML = X[j]; }
+	if(lnp_surr != NULL) { lnp_surr[j] = std::numeric_limits<double>::quiet_NaN(); }
+}
+
+template<class TParams, class TLogger>
+bool TAffineSampler<TParams, TLogger>::set_rng_state(const void *const state, size_t size) {
+	if(size != gsl_rng_size(r)) { return false; }
+	memcpy(gsl_rng_state(r), state, size);
+	return true;
 }
 
 
@@ -1316,6 +2023,70 @@ void TAffineSampler<TParams, TLogger>::print_state() {
 	}
 }
 
+// Print one line for each kind of step taken by any of the samplers, with the number of steps of that
+// kind accepted and rejected by each sampler. Slice steps are given with the mean number of evaluations
+// per step instead.
+template<class TParams, class TLogger>
+void TAffineSampler<TParams, TLogger>::print_step_counts(TAffineSampler<TParams, TLogger> *const *samplers, unsigned int N_samplers) {
+	typedef boost::uint64_t (TAffineSampler<TParams, TLogger>::*counter_t)();
+	
+	const unsigned int N_kinds = 7;
+	const char *label[N_kinds] = {
+		"Stretch steps accepted:rejected: ",
+		"Replacements accepted:rejected: ",
+		"M-H steps accepted:rejected: ",
+		"Custom reversible steps accepted:rejected: ",
+		"HMC steps accepted:rejected: ",
+		"Slice steps (evaluations per step): ",
+		"Delayed-acceptance proposals passed:screened out: "
+	};
+	const counter_t get_acc[N_kinds] = {
+		&TAffineSampler<TParams, TLogger>::get_N_stretch_accepted,
+		&TAffineSampler<TParams, TLogger>::get_N_replacements_accepted,
+		&TAffineSampler<TParams, TLogger>::get_N_MH_accepted,
+		&TAffineSampler<TParams, TLogger>::get_N_custom_accepted,
+		&TAffineSampler<TParams, TLogger>::get_N_HMC_accepted,
+		&TAffineSampler<TParams, TLogger>::get_N_slice_steps,
+		&TAffineSampler<TParams, TLogger>::get_N_surrogate_passed
+	};
+	const counter_t get_rej[N_kinds] = {
+		&TAffineSampler<TParams, TLogger>::get_N_stretch_rejected,
+		&TAffineSampler<TParams, TLogger>::get_N_replacements_rejected,
+		&TAffineSampler<TParams, TLogger>::get_N_MH_rejected,
+		&TAffineSampler<TParams, TLogger>::get_N_custom_rejected,
+		&TAffineSampler<TParams, TLogger>::get_N_HMC_rejected,
+		&TAffineSampler<TParams, TLogger>::get_N_slice_evals,
+		&TAffineSampler<TParams, TLogger>::get_N_surrogate_rejected
+	};
+	const unsigned int slice_kind = 5;
+	
+	uint64_t acc_tmp, rej_tmp, N_steps_tmp;
+	
+	for(unsigned int n=0; n<N_kinds; n++) {
+		N_steps_tmp = 0;
+		for(unsigned int i=0; i<N_samplers; i++) {
+			N_steps_tmp += (samplers[i]->*get_acc[n])();
+			if(n != slice_kind) { N_steps_tmp += (samplers[i]->*get_rej[n])(); }
+		}
+		if(N_steps_tmp == 0) { continue; }
+		
+		std::cout << label[n];
+		for(unsigned int i=0; i<N_samplers; i++) {
+			acc_tmp = (samplers[i]->*get_acc[n])();
+			rej_tmp = (samplers[i]->*get_rej[n])();
+			if(n == slice_kind) {
+				std::cout << std::fixed << acc_tmp
+				          << " (" << std::setprecision(1) << (double)rej_tmp / (double)acc_tmp << ")";
+			} else {
+				std::cout << std::fixed << acc_tmp << ":" << rej_tmp
+				          << " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)";
+			}
+			std::cout << (i != N_samplers - 1 ? " " : "");
+		}
+		std::cout << std::endl;
+	}
+}
+
 template<class TParams, class TLogger>
 void TAffineSampler<TParams, TLogger>::print_stats() {
 	TStats &stats = get_stats();
@@ -1325,57 +2096,8 @@ void TAffineSampler<TParams, TLogger>::print_stats() {
 	std::cout << "Acceptance rate: ";
 	std::cout << std::setprecision(3) << 100.*get_acceptance_rate() << "%" << std::endl;
 	
-	uint64_t acc_tmp, rej_tmp;
-	
-	unsigned int N_steps_tmp = 0;
-	
-	N_steps_tmp = get_N_stretch_accepted();
-	N_steps_tmp += get_N_stretch_rejected();
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Stretch steps accepted:rejected: ";
-		acc_tmp = get_N_stretch_accepted();
-		rej_tmp = get_N_stretch_rejected();
-		std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-		          << " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)";
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = get_N_replacements_accepted();
-	N_steps_tmp += get_N_replacements_rejected();
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Replacements accepted:rejected: ";
-		acc_tmp = get_N_replacements_accepted();
-		rej_tmp = get_N_replacements_rejected();
-		std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-		          << " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)";
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = get_N_MH_accepted();
-	N_steps_tmp += get_N_MH_rejected();
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "M-H steps accepted:rejected: ";
-		acc_tmp = get_N_MH_accepted();
-		rej_tmp = get_N_MH_rejected();
-		std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-		          << " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)";
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = get_N_custom_accepted();
-	N_steps_tmp += get_N_custom_rejected();
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Custom reversible steps accepted:rejected: ";
-		acc_tmp = get_N_custom_accepted();
-		rej_tmp = get_N_custom_rejected();
-		std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-		          << " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)";
-		std::cout << std::endl;
-	}
+	TAffineSampler<TParams, TLogger> *self = this;
+	print_step_counts(&self, 1);
 	
 	std::cout << std::setprecision(6);
 }
@@ -1401,6 +2123,7 @@ TParallelAffineSampler<TParams, TLogger>::TParallelAffineSampler(typename TAffin
 	#pragma omp parallel for
 	for(unsigned int i=0; i<N_samplers; i++) {
 		sampler[i] = new TAffineSampler<TParams, TLogger>(_pdf, _rand_state, N, _L, _params, _logger, _use_log);
+		sampler[i]->set_walker_offset(i * _L);
 		component_stats[i] = &(sampler[i]->get_stats());
 	}
 	
@@ -1427,10 +2150,17 @@ void TParallelAffineSampler<TParams, TLogger>::step(unsigned int N_steps, bool r
 		}
 		sampler[sampler_num]->flush(record_steps);
 	}
-	#pragma omp barrier
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
+template<class TParams, class TLogger>
+void TParallelAffineSampler<TParams, TLogger>::rescore() {
+	#pragma omp parallel for
+	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+		sampler[sampler_num]->rescore();
+	}
+}
+
 template<class TParams, class TLogger>
 void TParallelAffineSampler<TParams, TLogger>::step_MH(unsigned int N_steps, bool record_steps) {
 	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps)
@@ -1440,7 +2170,6 @@ void TParallelAffineSampler<TParams, TLogger>::step_MH(unsigned int N_steps, boo
 		}
 		sampler[sampler_num]->flush(record_steps);
 	}
-	#pragma omp barrier
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
@@ -1455,7 +2184,6 @@ void TParallelAffineSampler<TParams, TLogger>::step_custom_reversible(unsigned i
 		}
 		sampler[sampler_num]->flush(record_steps);
 	}
-	#pragma omp barrier
 	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
 }
 
@@ -1496,6 +2224,57 @@ void TParallelAffineSampler<TParams, TLogger>::tune_MH(unsigned int N_rounds, do
 	}
 }
 
+template<class TParams, class TLogger>
+void TParallelAffineSampler<TParams, TLogger>::step_HMC(unsigned int N_steps, bool record_steps) {
+	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps)
+	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+		for(unsigned int i=0; i<N_steps; i++) {
+			sampler[sampler_num]->step_HMC(record_steps);
+		}
+		sampler[sampler_num]->flush(record_steps);
+	}
+	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
+}
+
+template<class TParams, class TLogger>
+void TParallelAffineSampler<TParams, TLogger>::step_slice(unsigned int N_steps, bool record_steps) {
+	#pragma omp parallel for schedule(dynamic) firstprivate(record_steps, N_steps)
+	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+		for(unsigned int i=0; i<N_steps; i++) {
+			sampler[sampler_num]->step_slice(record_steps);
+		}
+		sampler[sampler_num]->flush(record_steps);
+	}
+	Gelman_Rubin_diagnostic(component_stats, N_samplers, R, N);
+}
+
+template<class TParams, class TLogger>
+void TParallelAffineSampler<TParams, TLogger>::tune_HMC(unsigned int N_rounds, double target_acceptance) {
+	#pragma omp parallel for
+	for(int sampler_num = 0; sampler_num < N_samplers; sampler_num++) {
+		unsigned int N_steps = 100. / ((double)(sampler[sampler_num]->get_N_walkers()) * target_acceptance);
+		if(N_steps < 3) { N_steps = 3; }
+		
+		double acceptance_tmp, bandwidth_tmp;
+		
+		for(int k=0; k<N_rounds; k++) {
+			sampler[sampler_num]->clear();
+			for(unsigned int i=0; i<N_steps; i++) {
+				sampler[sampler_num]->step_HMC(false);
+			}
+			sampler[sampler_num]->flush(false);
+			
+			acceptance_tmp = sampler[sampler_num]->get_HMC_acceptance_rate();
+			bandwidth_tmp = sampler[sampler_num]->get_HMC_bandwidth();
+			if(acceptance_tmp < 0.9 * target_acceptance) {
+				sampler[sampler_num]->set_HMC_bandwidth(0.8 * bandwidth_tmp);
+			} else if(acceptance_tmp > 1.1 * target_acceptance) {
+				sampler[sampler_num]->set_HMC_bandwidth(1.2 * bandwidth_tmp);
+			}
+		}
+	}
+}
+
 template<class TParams, class TLogger>
 void TParallelAffineSampler<TParams, TLogger>::tune_stretch(unsigned int N_rounds, double target_acceptance) {
 	#pragma omp parallel for
@@ -1555,83 +2334,7 @@ void TParallelAffineSampler<TParams, TLogger>::print_stats() {
 	for(unsigned int i=0; i<N_samplers; i++) { std::cout << std::setprecision(3) << 100.*get_sampler(i)->get_acceptance_rate() << "%" << (i != N_samplers - 1 ? " " : ""); }
 	std::cout << std::endl;
 	
-	uint64_t acc_tmp, rej_tmp;
-	
-	unsigned int N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_stretch_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_stretch_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Stretch steps accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_stretch_accepted();
-			rej_tmp = get_sampler(i)->get_N_stretch_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_replacements_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_replacements_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Replacements accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_replacements_accepted();
-			rej_tmp = get_sampler(i)->get_N_replacements_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_MH_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_MH_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "M-H steps accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_MH_accepted();
-			rej_tmp = get_sampler(i)->get_N_MH_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_custom_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_custom_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Custom reversible steps accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_custom_accepted();
-			rej_tmp = get_sampler(i)->get_N_custom_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
+	TAffineSampler<TParams, TLogger>::print_step_counts(sampler, N_samplers);
 	
 	std::cout << std::setprecision(6);
 }
@@ -1645,83 +2348,7 @@ void TParallelAffineSampler<TParams, TLogger>::print_diagnostics() {
 	for(unsigned int i=0; i<N_samplers; i++) { std::cout << std::setprecision(3) << 100.*get_sampler(i)->get_acceptance_rate() << "%" << (i != N_samplers - 1 ? " " : ""); }
 	std::cout << std::endl;
 	
-	uint64_t acc_tmp, rej_tmp;
-	
-	unsigned int N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_stretch_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_stretch_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Stretch steps accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_stretch_accepted();
-			rej_tmp = get_sampler(i)->get_N_stretch_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_replacements_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_replacements_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Replacements accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_replacements_accepted();
-			rej_tmp = get_sampler(i)->get_N_replacements_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_MH_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_MH_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "M-H steps accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_MH_accepted();
-			rej_tmp = get_sampler(i)->get_N_MH_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
-	
-	N_steps_tmp = 0;
-	for(int i=0; i<N_samplers; i++) {
-		N_steps_tmp += get_sampler(i)->get_N_custom_accepted();
-		N_steps_tmp += get_sampler(i)->get_N_custom_rejected();
-		
-	}
-	
-	if(N_steps_tmp != 0) {
-		std::cout << "Custom reversible steps accepted:rejected: ";
-		for(unsigned int i=0; i<N_samplers; i++) {
-			acc_tmp = get_sampler(i)->get_N_custom_accepted();
-			rej_tmp = get_sampler(i)->get_N_custom_rejected();
-			std::cout << std::fixed << acc_tmp << ":" << rej_tmp
-				<< " (" << std::setprecision(1) << 100. * (double)acc_tmp / (double)(acc_tmp + rej_tmp) << "%)"
-				<< (i != N_samplers - 1 ? " " : "");
-		}
-		std::cout << std::endl;
-	}
+	TAffineSampler<TParams, TLogger>::print_step_counts(sampler, N_samplers);
 	
 	std::cout << std::setprecision(6);
 }
@@ -1740,7 +2367,7 @@ TChain TParallelAffineSampler<TParams, TLogger>::get_chain() {
 }
 
 template<class TParams, class TLogger>
-void TParallelAffineSampler<TParams, TLogger>::calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf) {
+void TParallelAffineSampler<TParams, TLogger>::calc_GR_transformed(std::vector<double>& GR, TTransformParamSpace* transf, TStats **transf_stats_acc) {
 	TStats **transf_stats = new TStats*[N_samplers];
 	for(size_t n=0; n<N_samplers; n++) {
 		transf_stats[n] = new TStats(N);
@@ -1761,10 +2388,18 @@ void TParallelAffineSampler<TParams, TLogger>::calc_GR_transformed(std::vector<d
 		
 		delete[] y;
 	}
-	#pragma omp barrier
 	
 	GR.resize(N);
-	Gelman_Rubin_diagnostic(transf_stats, N_samplers, GR.data(), N);
+	
+	// Statistics of earlier samples from the same chains (e.g., a run that is being extended)
+	if(transf_stats_acc != NULL) {
+		for(size_t n=0; n<N_samplers; n++) {
+			*(transf_stats_acc[n]) += *(transf_stats[n]);
+		}
+		Gelman_Rubin_diagnostic(transf_stats_acc, N_samplers, GR.data(), N);
+	} else {
+		Gelman_Rubin_diagnostic(transf_stats, N_samplers, GR.data(), N);
+	}
 	
 	for(size_t n=0; n<N_samplers; n++) {
 		delete transf_stats[n];
@@ -1219,6 +1219,7 @@ void TGaussianMixture::expectation_maximization(const double *x, const double *w
 	delete[] index;
 	
 	// Assign points to nearest cluster center
+	for(unsigned int k=0; k<nclusters; k++) { w[k] = 0.; }
 	double sum, tmp, min_dist;
 	unsigned int nearest_cluster;
 	for(unsigned int n=0; n<N; n++) {
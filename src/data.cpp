@@ -722,6 +722,84 @@ void get_input_pixels(std::string fname, std::vector<std::string> &pix_name) {
 	delete file;
 }
 
+// Parse a pixel name of the form "pixel nside-index"
+bool parse_pixel_name(const std::string &name, uint32_t &nside, uint64_t &healpix_index) {
+	std::istringstream ss(name);
+	std::string prefix;
+	char dash;
+	
+	if(!(ss >> prefix >> nside >> dash >> healpix_index)) { return false; }
+	
+	return (prefix == "pixel") && (dash == '-');
+}
+
+struct TPixelSortKey {
+	uint32_t nside;
+	uint64_t healpix_index;
+	bool parsed;
+	size_t order;
+	
+	bool operator<(const TPixelSortKey &other) const {
+		if(parsed != other.parsed) { return parsed; }
+		if(!parsed) { return order < other.order; }
+		if(nside != other.nside) { return nside < other.nside; }
+		return healpix_index < other.healpix_index;
+	}
+};
+
+// Sort pixel names by nside, and then by HEALPix index. Nested indices follow a Morton (Z-order)
+// curve, so most pixels then come shortly after one of their neighbours. Names that cannot be
+// parsed are left at the end, in their original order.
+void sort_pixels_nested(std::vector<std::string> &pix_name) {
+	std::vector<TPixelSortKey> key(pix_name.size());
+	for(size_t i=0; i<pix_name.size(); i++) {
+		key[i].parsed = parse_pixel_name(pix_name[i], key[i].nside, key[i].healpix_index);
+		key[i].order = i;
+	}
+	
+	std::sort(key.begin(), key.end());
+	
+	std::vector<std::string> tmp(pix_name);
+	for(size_t i=0; i<key.size(); i++) { pix_name[i] = tmp[key[i].order]; }
+}
+
+// Bits 0, 2, 4, ... of a nested index within a base face give x, and bits 1, 3, 5, ... give y
+static uint64_t nest_compress_bits(uint64_t v) {
+	uint64_t ret = 0;
+	for(int b=0; b<32; b++) { ret |= ((v >> (2*b)) & 1) << b; }
+	return ret;
+}
+
+static uint64_t nest_spread_bits(uint64_t v) {
+	uint64_t ret = 0;
+	for(int b=0; b<32; b++) { ret |= ((v >> b) & 1) << (2*b); }
+	return ret;
+}
+
+// HEALPix indices of the pixels that touch a nested pixel within its base face, those sharing
+// an edge first. Neighbours across the edges of the base faces are not found.
+void healpix_nest_neighbours(uint32_t nside, uint64_t healpix_index, std::vector<uint64_t> &neighbours) {
+	neighbours.clear();
+	
+	const uint64_t N_face = (uint64_t)nside * (uint64_t)nside;
+	const uint64_t face = healpix_index / N_face;
+	const uint64_t idx_in_face = healpix_index % N_face;
+	const int64_t x = nest_compress_bits(idx_in_face);
+	const int64_t y = nest_compress_bits(idx_in_face >> 1);
+	
+	const int dx[8] = {1, -1, 0, 0, 1, 1, -1, -1};
+	const int dy[8] = {0, 0, 1, -1, 1, -1, 1, -1};
+	int64_t x_nb, y_nb;
+	
+	for(int i=0; i<8; i++) {
+		x_nb = x + dx[i];
+		y_nb = y + dy[i];
+		if((x_nb < 0) || (y_nb < 0) || (x_nb >= (int64_t)nside) || (y_nb >= (int64_t)nside)) { continue; }
+		
+		neighbours.push_back(face * N_face + nest_spread_bits(x_nb) + (nest_spread_bits(y_nb) << 1));
+	}
+}
+
 
 /*************************************************************************
  * 
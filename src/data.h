@@ -153,5 +153,10 @@ void draw_from_emp_model(size_t nstars, double RV, TGalacticLOSModel& gal_model,
 // Return healpix indices of pixels in input file
 void get_input_pixels(std::string fname, std::vector<std::string> &pix_name);
 
+// Pixel names of the form "pixel nside-index", and their neighbours
+bool parse_pixel_name(const std::string &name, uint32_t &nside, uint64_t &healpix_index);
+void sort_pixels_nested(std::vector<std::string> &pix_name);
+void healpix_nest_neighbours(uint32_t nside, uint64_t healpix_index, std::vector<uint64_t> &neighbours);
+
 
 #endif // _STELLAR_DATA_H__
\ No newline at end of file
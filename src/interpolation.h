@@ -147,49 +147,9 @@ unsigned int TBilinearInterp<T>::get_index(double x, double y) const {
 template<class T>
 T TBilinearInterp<T>::operator()(double x, double y) const {
 	double idx = floor((x-x_min)*inv_dx);
-	
-	// DEBUG:
-	if((idx < 0) || (idx >= Nx)) {
-		#pragma omp critical
-		{
-			std::cerr << "Interpolation error: (" << x << ", " << y << ")" << std::endl;
-			std::cerr << x_min << " < " << x << " < " << x_max << std::endl;
-			std::cerr << "Nx = " << Nx << std::endl;
-			std::cerr << "inv_dx = " << inv_dx << std::endl;
-			std::cerr << y_min << " < " << y << " < " << y_max << std::endl;
-                        std::cerr << "Ny = " << Ny << std::endl;
-                        std::cerr << "inv_dy = " << inv_dy << std::endl;
-		}
-	}
-	
-	//#pragma omp critical
-	//{
-	//	std::cout << "0 <= " << idx << " < " << Nx << std::endl;
-	//}
-	
 	assert((idx >= 0) && (idx < Nx));
 	
 	double idy = floor((y-y_min)*inv_dy);
-	
-	// DEBUG:
-	if((idy < 0) || (idy >= Ny)) {
-		#pragma omp critical
-		{
-			std::cerr << "Interpolation error: (" << x << ", " << y << ")" << std::endl;
-			std::cerr << x_min << " < " << x << " < " << x_max << std::endl;
-                       	std::cerr << "Nx = " << Nx << std::endl;
-                        std::cerr << "inv_dx = " << inv_dx << std::endl;
-			std::cerr << y_min << " < " << y << " < " << y_max << std::endl;
-			std::cerr << "Ny = " << Ny << std::endl;
-			std::cerr << "inv_dy = " << inv_dy << std::endl;
-		}
-	}
-	
-	//#pragma	omp critical
-        //{
-        //        std::cout << "0 <= " << idy << " < " << Nx << std::endl;
-        //}
-	
 	assert((idy >= 0) && (idy < Ny));
 	
 	double Delta_x = x - x_min - dx*idx;
@@ -254,7 +214,6 @@ class TMultiLinearInterp {
 	std::vector<bool> filled;
 	T empty;
 	
-	double *lower;
 	unsigned int *Delta_idx;
 	unsigned int N_Delta;
 	
@@ -280,7 +239,10 @@ public:
 private:
 	int get_index(const double *x) const;
 	int get_lower(const double *x) const;
-	int set_index_arr(const double *x);
+	int set_index_arr(const double *x, double *const lower) const;
+	
+	// Upper limit on ndim, so that interpolation weights can live on the stack
+	static const unsigned int max_ndim = 8;
 };
 
 
@@ -288,6 +250,8 @@ template<class T>
 TMultiLinearInterp<T>::TMultiLinearInterp(const double *_min, const double *_max, const unsigned int *_N, unsigned int _ndim, T &_empty)
 	: ndim(_ndim), empty(_empty)
 {
+	assert(ndim <= max_ndim);
+	
 	length = 1;
 	coeff = new unsigned int[ndim];
 	min = new double[ndim];
@@ -307,8 +271,6 @@ TMultiLinearInterp<T>::TMultiLinearInterp(const double *_min, const double *_max
 	filled.resize(length);
 	std::fill(filled.begin(), filled.end(), false);
 	
-	lower = new double[ndim];
-	
 	// Compute Deltas (difference in index from lower corner) to corners of box
 	N_Delta = (1 << ndim);
 	Delta_idx = new unsigned int[N_Delta];
@@ -327,7 +289,6 @@ TMultiLinearInterp<T>::~TMultiLinearInterp() {
 	delete[] max;
 	delete[] inv_dx;
 	delete[] coeff;
-	delete[] lower;
 	delete[] Delta_idx;
 	delete[] N;
 }
@@ -360,7 +321,7 @@ int TMultiLinearInterp<T>::get_lower(const double* x) const {
 }
 
 template<class T>
-int TMultiLinearInterp<T>::set_index_arr(const double* x) {
+int TMultiLinearInterp<T>::set_index_arr(const double* x, double *const lower) const {
 	int index = 0;
 	int k;
 	for(int i=0; i<ndim; i++) {
@@ -387,7 +348,8 @@ void TMultiLinearInterp<T>::set(const double* x, T& fx) {
 
 template<class T>
 T TMultiLinearInterp<T>::operator()(const double* x) {
-	int idx = set_index_arr(x);
+	double lower[max_ndim];
+	int idx = set_index_arr(x, &(lower[0]));
 	if(idx < 0) { return empty; }
 	
 	T sum;
@@ -414,7 +376,8 @@ T TMultiLinearInterp<T>::operator()(const double* x) {
 
 template<class T>
 bool TMultiLinearInterp<T>::operator()(const double* x, T& res) {
-	int idx = set_index_arr(x);
+	double lower[max_ndim];
+	int idx = set_index_arr(x, &(lower[0]));
 	if(idx < 0) {
 		//res = empty;
 		return false;
@@ -99,6 +99,512 @@ void test_extinction_profiles(TLOSMCMCParams &params) {
 	}
 }
 
+// Dense copies of the surfaces of the first N stars of img_stack, in a stack of their own, for the
+// checks below to store and integrate without touching the stack being fit
+static TImgStack* copy_dense_stack(const TImgStack &img_stack, size_t N) {
+	const int N_y = img_stack.rect->N_bins[0];
+	const int N_x = img_stack.rect->N_bins[1];
+	
+	TImgStack *copy = new TImgStack(N, *(img_stack.rect));
+	cv::Mat buf;
+	const cv::Mat *src;
+	for(size_t k=0; k<N; k++) {
+		copy->img[k] = new cv::Mat;
+		src = img_stack.get_dense(k, buf);
+		if(src == NULL) {
+			*(copy->img[k]) = cv::Mat::zeros(N_y, N_x, CV_32F);
+		} else {
+			src->copyTo(*(copy->img[k]));
+		}
+	}
+	
+	return copy;
+}
+
+// K random profiles of N_regions regions, in the layout of los_integral_batch, that stay inside the
+// surfaces, as the dense los_integral does not check its bounds
+static void rand_test_profiles(const TImgStack &img_stack, unsigned int N_regions, unsigned int K, gsl_rng *r,
+                               float *const Delta_EBV) {
+	const double EBV_range = img_stack.rect->max[0] - img_stack.rect->min[0];
+	for(size_t i=0; i<K*(N_regions+1); i++) {
+		Delta_EBV[i] = gsl_rng_uniform(r) * 0.5 * EBV_range / (double)(N_regions+1);
+	}
+}
+
+// Store the surfaces of up to N_stars stars in each arena storage type, and check that every pixel,
+// and the line integrals through random profiles, round-trip to within the precision of the type.
+// Pixels are read back through TImgStack::pixel, as the 16-bit types release the dense images.
+// Returns true if all checks pass.
+bool test_arena_round_trip(TImgStack &img_stack, unsigned int N_regions, unsigned int N_stars) {
+	assert(img_stack.rect != NULL);
+	
+	const size_t N_y = img_stack.rect->N_bins[0];
+	const size_t N_x = img_stack.rect->N_bins[1];
+	if((N_regions == 0) || (N_x % N_regions != 0)) { N_regions = 1; }
+	
+	size_t N = (img_stack.N_images < N_stars) ? img_stack.N_images : N_stars;
+	TImgStack *ref_stack = copy_dense_stack(img_stack, N);
+	
+	const unsigned int N_profiles = 10;
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	float *Delta_EBV = new float[N_profiles*(N_regions+1)];
+	rand_test_profiles(img_stack, N_regions, N_profiles, r, Delta_EBV);
+	gsl_rng_free(r);
+	
+	std::vector<double> subpixel(N, 1.);
+	std::vector<double> line_int_dense(N_profiles*N);
+	std::vector<double> line_int_arena(N);
+	for(unsigned int n=0; n<N_profiles; n++) {
+		los_integral(*ref_stack, subpixel.data(), &(line_int_dense[n*N]), Delta_EBV + n*(N_regions+1), N_regions);
+	}
+	
+	const int types[4] = {IMG_ARENA_F32, IMG_ARENA_F16, IMG_ARENA_BF16, IMG_ARENA_U16};
+	const char *type_names[4] = {"f32", "f16", "bf16", "u16"};
+	bool passed = true;
+	
+	for(int t=0; t<4; t++) {
+		TImgStack *test_stack = copy_dense_stack(*ref_stack, N);
+		test_stack->build_arena(types[t]);
+		if(test_stack->arena == NULL) {
+			delete test_stack;
+			passed = false;
+			continue;
+		}
+		
+		// Largest error allowed by the storage type, for a pixel of value v
+		size_t N_pix_fail = 0;
+		double max_pix_err = 0.;
+		double v, err, tol;
+		const float *row;
+		for(size_t k=0; k<N; k++) {
+			for(size_t y=0; y<N_y; y++) {
+				row = ref_stack->img[k]->ptr<float>(y);
+				for(size_t x=0; x<N_x; x++) {
+					v = row[x];
+					err = fabs(test_stack->pixel(k, y, x) - v);
+					if(types[t] == IMG_ARENA_F32) {
+						tol = 0.;
+					} else if(types[t] == IMG_ARENA_F16) {
+						tol = fabs(v) / 2048. + 1. / 16777216.;
+					} else if(types[t] == IMG_ARENA_BF16) {
+						tol = fabs(v) / 256.;
+					} else {
+						tol = 0.5 * test_stack->arena_scale[k] + 1.e-6 * fabs(v);
+					}
+					if(err > max_pix_err) { max_pix_err = err; }
+					if(!(err <= tol)) { N_pix_fail++; }
+				}
+			}
+		}
+		
+		// The integrals sum N_x pixels, each weighted by at most one
+		size_t N_int_fail = 0;
+		double max_int_err = 0.;
+		for(unsigned int n=0; n<N_profiles; n++) {
+			los_integral(*test_stack, subpixel.data(), line_int_arena.data(), Delta_EBV + n*(N_regions+1), N_regions);
+			for(size_t k=0; k<N; k++) {
+				v = line_int_dense[n*N + k];
+				err = fabs(line_int_arena[k] - v);
+				if(types[t] == IMG_ARENA_F32) {
+					tol = 1.e-5 * fabs(v);
+				} else if(types[t] == IMG_ARENA_F16) {
+					tol = fabs(v) / 1024. + (double)N_x / 16777216.;
+				} else if(types[t] == IMG_ARENA_BF16) {
+					tol = fabs(v) / 128.;
+				} else {
+					tol = 0.5 * N_x * test_stack->arena_scale[k] + 1.e-5 * fabs(v);
+				}
+				if(err > max_int_err) { max_int_err = err; }
+				if(!(err <= tol)) { N_int_fail++; }
+			}
+		}
+		
+		std::cout << "# Arena " << type_names[t] << ": max. pixel error = " << max_pix_err
+		          << ", max. integral error = " << max_int_err;
+		if((N_pix_fail == 0) && (N_int_fail == 0)) {
+			std::cout << " (passed)" << std::endl;
+		} else {
+			std::cout << " (FAILED: " << N_pix_fail << " pixels, " << N_int_fail << " integrals)" << std::endl;
+			passed = false;
+		}
+		
+		delete test_stack;
+	}
+	
+	delete ref_stack;
+	delete[] Delta_EBV;
+	
+	return passed;
+}
+
+// Walk a chain of random local and global proposals, and check the ln(p) of each, scored incrementally
+// by lnp_los_extinction_local, against a full evaluation by lnp_los_extinction. Proposals are accepted
+// at random, so that the cached line integrals are swapped by los_local_update as in the sampler.
+// Returns true if all checks pass.
+bool test_los_local_lnp(TLOSMCMCParams &params, unsigned int N_proposals) {
+	const unsigned int N = params.N_regions + 1;
+	const size_t N_images = params.img_stack->N_images;
+	params.set_local_size(1, 1);
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	double *X = new double[N];
+	double *Y = new double[N];
+	
+	// Fill the cache of walker 0 with its starting state
+	gen_rand_los_extinction(X, N, r, params);
+	lnp_los_extinction_local(X, X, N, 0, params);
+	los_local_update(0, true, params);
+	
+	unsigned int N_fail = 0;
+	double max_err = 0.;
+	double lnp_local, lnp_full, err, u;
+	
+	for(unsigned int n=0; n<N_proposals; n++) {
+		u = gsl_rng_uniform(r);
+		if(u < 0.25) {
+			switch_adjacent_log_Delta_EBVs(X, Y, N, r, params);
+		} else if(u < 0.5) {
+			mix_log_Delta_EBVs(X, Y, N, r, params);
+		} else if(u < 0.85) {
+			step_one_Delta_EBV(X, Y, N, r, params);
+		} else {
+			gen_rand_los_extinction(Y, N, r, params);
+		}
+		
+		lnp_local = lnp_los_extinction_local(X, Y, N, 0, params);
+		lnp_full = lnp_los_extinction(Y, N, params);
+		
+		// The local version sums the line integrals region by region, so agrees only to float precision
+		if(is_neg_inf_replacement(lnp_local) || is_neg_inf_replacement(lnp_full)) {
+			if(is_neg_inf_replacement(lnp_local) != is_neg_inf_replacement(lnp_full)) { N_fail++; }
+		} else {
+			err = fabs(lnp_local - lnp_full);
+			if(err > max_err) { max_err = err; }
+			if(!(err <= 1.e-5 * (fabs(lnp_full) + (double)N_images))) { N_fail++; }
+		}
+		
+		if(!is_neg_inf_replacement(lnp_local) && (gsl_rng_uniform(r) < 0.5)) {
+			los_local_update(0, true, params);
+			for(unsigned int i=0; i<N; i++) { X[i] = Y[i]; }
+		} else {
+			los_local_update(0, false, params);
+		}
+	}
+	
+	std::cout << "# Local ln(p): max. error = " << max_err << " over " << N_proposals << " proposals";
+	if(N_fail == 0) {
+		std::cout << " (passed)" << std::endl;
+	} else {
+		std::cout << " (FAILED: " << N_fail << " proposals)" << std::endl;
+	}
+	
+	delete[] X;
+	delete[] Y;
+	gsl_rng_free(r);
+	
+	return (N_fail == 0);
+}
+
+// Score L random profiles with lnp_los_extinction_batch, and check them against lnp_los_extinction.
+// Returns true if all checks pass.
+bool test_los_batch_lnp(TLOSMCMCParams &params, unsigned int L) {
+	const unsigned int N = params.N_regions + 1;
+	const size_t N_images = params.img_stack->N_images;
+	params.set_batch_size(L);
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	double *x = new double[N];
+	double *logEBV = new double[N*L];
+	double *lnp_batch = new double[L];
+	for(unsigned int j=0; j<L; j++) {
+		gen_rand_los_extinction(x, N, r, params);
+		for(unsigned int i=0; i<N; i++) { logEBV[i*L + j] = x[i]; }
+	}
+	gsl_rng_free(r);
+	
+	lnp_los_extinction_batch(logEBV, N, L, lnp_batch, params);
+	
+	// The batch sums the line integrals in a different order, so agrees only to float precision
+	unsigned int N_fail = 0;
+	double max_err = 0.;
+	double lnp, err;
+	for(unsigned int j=0; j<L; j++) {
+		for(unsigned int i=0; i<N; i++) { x[i] = logEBV[i*L + j]; }
+		lnp = lnp_los_extinction(x, N, params);
+		if(is_neg_inf_replacement(lnp) || is_neg_inf_replacement(lnp_batch[j])) {
+			if(is_neg_inf_replacement(lnp) != is_neg_inf_replacement(lnp_batch[j])) { N_fail++; }
+		} else {
+			err = fabs(lnp_batch[j] - lnp);
+			if(err > max_err) { max_err = err; }
+			if(!(err <= 1.e-5 * (fabs(lnp) + (double)N_images))) { N_fail++; }
+		}
+	}
+	
+	std::cout << "# Batched ln(p): max. error = " << max_err << " over " << L << " profiles";
+	if(N_fail == 0) {
+		std::cout << " (passed)" << std::endl;
+	} else {
+		std::cout << " (FAILED: " << N_fail << " profiles)" << std::endl;
+	}
+	
+	delete[] x;
+	delete[] logEBV;
+	delete[] lnp_batch;
+	
+	return (N_fail == 0);
+}
+
+// Check lnp_los_extinction_grad against central differences of lnp_los_extinction, with step h in
+// log(Delta E(B-V)), at N_profiles random profiles. The line integrals are only piecewise linear in the
+// height of the path, and are summed in float, so each component may be off by 5% of its value plus the
+// float rounding of ln(p) divided by h. Returns true if all checks pass.
+bool test_los_grad(TLOSMCMCParams &params, unsigned int N_profiles, double h) {
+	const unsigned int N = params.N_regions + 1;
+	const size_t N_images = params.img_stack->N_images;
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	double *x = new double[N];
+	double *x_step = new double[N];
+	double *grad = new double[N];
+	
+	unsigned int N_fail = 0;
+	unsigned int N_checked = 0;
+	double max_rel_err = 0.;
+	double lnp, lnp_plus, lnp_minus, g_fd, err, tol;
+	for(unsigned int n=0; n<N_profiles; n++) {
+		gen_rand_los_extinction(x, N, r, params);
+		lnp = lnp_los_extinction_grad(x, N, grad, params);
+		if(is_neg_inf_replacement(lnp)) { continue; }
+		
+		for(unsigned int i=0; i<N; i++) {
+			for(unsigned int m=0; m<N; m++) { x_step[m] = x[m]; }
+			x_step[i] = x[i] + h;
+			lnp_plus = lnp_los_extinction(x_step, N, params);
+			x_step[i] = x[i] - h;
+			lnp_minus = lnp_los_extinction(x_step, N, params);
+			if(is_neg_inf_replacement(lnp_plus) || is_neg_inf_replacement(lnp_minus)) { continue; }
+			
+			g_fd = (lnp_plus - lnp_minus) / (2. * h);
+			err = fabs(grad[i] - g_fd);
+			tol = 0.05 * fabs(g_fd) + 1.e-6 * (fabs(lnp) + (double)N_images) / h;
+			if(err / (fabs(g_fd) + 1.e-10) > max_rel_err) { max_rel_err = err / (fabs(g_fd) + 1.e-10); }
+			if(!(err <= tol)) { N_fail++; }
+			N_checked++;
+		}
+	}
+	
+	std::cout << "# Gradient of ln(p): max. relative error = " << max_rel_err << " over " << N_checked << " components";
+	if(N_fail == 0) {
+		std::cout << " (passed)" << std::endl;
+	} else {
+		std::cout << " (FAILED: " << N_fail << " components)" << std::endl;
+	}
+	
+	delete[] x;
+	delete[] x_step;
+	delete[] grad;
+	gsl_rng_free(r);
+	
+	return (N_fail == 0);
+}
+
+// Integrate K random profiles through the surfaces of up to N_stars stars with los_integral_batch, held
+// densely, interleaved, banded and in a float32 arena, and check each against the dense los_integral,
+// to a relative tolerance of 1e-5. Returns true if all checks pass.
+bool test_los_integral_batch(TImgStack &img_stack, unsigned int N_regions, unsigned int K, unsigned int N_stars) {
+	assert(img_stack.rect != NULL);
+	
+	const size_t N_x = img_stack.rect->N_bins[1];
+	if((N_regions == 0) || (N_x % N_regions != 0)) { N_regions = 1; }
+	
+	size_t N = (img_stack.N_images < N_stars) ? img_stack.N_images : N_stars;
+	TImgStack *ref_stack = copy_dense_stack(img_stack, N);
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	float *Delta_EBV = new float[K*(N_regions+1)];
+	rand_test_profiles(img_stack, N_regions, K, r, Delta_EBV);
+	gsl_rng_free(r);
+	
+	std::vector<double> subpixel(N, 1.);
+	std::vector<double> line_int_ref(K*N);
+	std::vector<double> line_int_batch(K*N);
+	for(unsigned int m=0; m<K; m++) {
+		los_integral(*ref_stack, subpixel.data(), &(line_int_ref[m*N]), Delta_EBV + m*(N_regions+1), N_regions);
+	}
+	
+	const char *storage_names[4] = {"dense", "interleaved", "banded", "f32 arena"};
+	bool passed = true;
+	
+	for(int t=0; t<4; t++) {
+		TImgStack *test_stack = copy_dense_stack(*ref_stack, N);
+		if(t == 1) {
+			test_stack->build_interleaved();
+		} else if(t == 2) {
+			test_stack->build_banded();
+		} else if(t == 3) {
+			test_stack->build_arena(IMG_ARENA_F32);
+		}
+		
+		los_integral_batch(*test_stack, subpixel.data(), line_int_batch.data(), Delta_EBV, N_regions, K);
+		
+		size_t N_fail = 0;
+		double max_err = 0.;
+		double v, err;
+		for(size_t n=0; n<K*N; n++) {
+			v = line_int_ref[n];
+			err = fabs(line_int_batch[n] - v);
+			if(err > max_err) { max_err = err; }
+			if(!(err <= 1.e-5 * fabs(v))) { N_fail++; }
+		}
+		
+		std::cout << "# Batched integrals, " << storage_names[t] << ": max. error = " << max_err;
+		if(N_fail == 0) {
+			std::cout << " (passed)" << std::endl;
+		} else {
+			std::cout << " (FAILED: " << N_fail << " integrals)" << std::endl;
+			passed = false;
+		}
+		
+		delete test_stack;
+	}
+	
+	delete ref_stack;
+	delete[] Delta_EBV;
+	
+	return passed;
+}
+
+// Fit Gaussian mixtures to the surfaces of up to N_stars stars, and check the line integrals of the
+// stars with good fits against the dense los_integral through random profiles. The L1 residual of a good
+// fit is less than max_residual times the sum of its image, which bounds the error of the integral, as
+// each pixel is weighted by at most one. The mixture is integrated across each pixel column rather than
+// sampled at its center, which is allowed a further 1% of the integral. Returns true if all checks pass.
+bool test_los_integral_gmm(TImgStack &img_stack, unsigned int N_regions, double max_residual, unsigned int N_stars) {
+	assert(img_stack.rect != NULL);
+	
+	const size_t N_x = img_stack.rect->N_bins[1];
+	if((N_regions == 0) || (N_x % N_regions != 0)) { N_regions = 1; }
+	
+	size_t N = (img_stack.N_images < N_stars) ? img_stack.N_images : N_stars;
+	TImgStack *ref_stack = copy_dense_stack(img_stack, N);
+	TImgStack *test_stack = copy_dense_stack(img_stack, N);
+	unsigned int N_good = test_stack->build_gmm(max_residual);
+	
+	const unsigned int N_profiles = 10;
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	float *Delta_EBV = new float[N_profiles*(N_regions+1)];
+	rand_test_profiles(img_stack, N_regions, N_profiles, r, Delta_EBV);
+	gsl_rng_free(r);
+	
+	std::vector<double> img_sum(N);
+	for(size_t k=0; k<N; k++) { img_sum[k] = cv::sum(*(ref_stack->img[k]))[0]; }
+	
+	std::vector<double> subpixel(N, 1.);
+	std::vector<double> line_int_dense(N);
+	std::vector<double> line_int_gmm(N);
+	
+	size_t N_fail = 0;
+	double max_err = 0.;
+	double v, err, tol;
+	for(unsigned int n=0; n<N_profiles; n++) {
+		los_integral(*ref_stack, subpixel.data(), line_int_dense.data(), Delta_EBV + n*(N_regions+1), N_regions);
+		los_integral(*test_stack, subpixel.data(), line_int_gmm.data(), Delta_EBV + n*(N_regions+1), N_regions);
+		for(size_t k=0; k<N; k++) {
+			if(!test_stack->gmm[k].good) { continue; }
+			v = line_int_dense[k];
+			err = fabs(line_int_gmm[k] - v);
+			tol = max_residual * img_sum[k] + 0.01 * fabs(v);
+			if(err > max_err) { max_err = err; }
+			if(!(err <= tol)) { N_fail++; }
+		}
+	}
+	
+	std::cout << "# Gaussian-mixture integrals (" << N_good << " of " << N << " stars fit): max. error = " << max_err;
+	if(N_fail == 0) {
+		std::cout << " (passed)" << std::endl;
+	} else {
+		std::cout << " (FAILED: " << N_fail << " integrals)" << std::endl;
+	}
+	
+	delete ref_stack;
+	delete test_stack;
+	delete[] Delta_EBV;
+	
+	return (N_fail == 0);
+}
+
+// Store the surfaces of up to N_stars stars in bands, and check that every pixel reads back exactly, and
+// that the line integrals through random profiles agree with the dense los_integral to a relative tolerance
+// of 1e-5. Only the zero pixels outside the bands are skipped, so the two differ only by rounding.
+// Returns true if all checks pass.
+bool test_los_integral_banded(TImgStack &img_stack, unsigned int N_regions, unsigned int N_stars) {
+	assert(img_stack.rect != NULL);
+	
+	const size_t N_y = img_stack.rect->N_bins[0];
+	const size_t N_x = img_stack.rect->N_bins[1];
+	if((N_regions == 0) || (N_x % N_regions != 0)) { N_regions = 1; }
+	
+	size_t N = (img_stack.N_images < N_stars) ? img_stack.N_images : N_stars;
+	TImgStack *ref_stack = copy_dense_stack(img_stack, N);
+	TImgStack *test_stack = copy_dense_stack(img_stack, N);
+	test_stack->build_banded();
+	
+	size_t N_pix_fail = 0;
+	const float *row;
+	for(size_t k=0; k<N; k++) {
+		for(size_t y=0; y<N_y; y++) {
+			row = ref_stack->img[k]->ptr<float>(y);
+			for(size_t x=0; x<N_x; x++) {
+				if(test_stack->pixel(k, y, x) != row[x]) { N_pix_fail++; }
+			}
+		}
+	}
+	
+	const unsigned int N_profiles = 10;
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	float *Delta_EBV = new float[N_profiles*(N_regions+1)];
+	rand_test_profiles(img_stack, N_regions, N_profiles, r, Delta_EBV);
+	gsl_rng_free(r);
+	
+	std::vector<double> subpixel(N, 1.);
+	std::vector<double> line_int_dense(N);
+	std::vector<double> line_int_banded(N);
+	
+	size_t N_int_fail = 0;
+	double max_err = 0.;
+	double v, err;
+	for(unsigned int n=0; n<N_profiles; n++) {
+		los_integral(*ref_stack, subpixel.data(), line_int_dense.data(), Delta_EBV + n*(N_regions+1), N_regions);
+		los_integral(*test_stack, subpixel.data(), line_int_banded.data(), Delta_EBV + n*(N_regions+1), N_regions);
+		for(size_t k=0; k<N; k++) {
+			v = line_int_dense[k];
+			err = fabs(line_int_banded[k] - v);
+			if(err > max_err) { max_err = err; }
+			if(!(err <= 1.e-5 * fabs(v))) { N_int_fail++; }
+		}
+	}
+	
+	std::cout << "# Banded integrals: max. error = " << max_err;
+	if((N_pix_fail == 0) && (N_int_fail == 0)) {
+		std::cout << " (passed)" << std::endl;
+	} else {
+		std::cout << " (FAILED: " << N_pix_fail << " pixels, " << N_int_fail << " integrals)" << std::endl;
+	}
+	
+	delete ref_stack;
+	delete test_stack;
+	delete[] Delta_EBV;
+	
+	return (N_pix_fail == 0) && (N_int_fail == 0);
+}
+
 
 
 /*
@@ -127,6 +633,10 @@ void sample_los_extinction_clouds(const std::string& out_fname, const std::strin
 		std::cout << std::endl;
 	}
 	
+	// Cumulative sums along DM make each star's line integral O(N_clouds), if the surfaces are dense
+	bool own_row_cumsum = (params.img_stack->row_cumsum == NULL);
+	if(own_row_cumsum) { params.img_stack->build_row_cumsum(); }
+	
 	TNullLogger logger;
 	
 	unsigned int max_attempts = 2;
@@ -238,8 +748,11 @@ void sample_los_extinction_clouds(const std::string& out_fname, const std::strin
 	
 	TChainWriteBuffer writeBuffer(ndim, 100, 1);
 	writeBuffer.add(chain, converged, std::numeric_limits<double>::quiet_NaN(), GR_transf.data());
+	#pragma omp critical (los_output)
 	writeBuffer.write(out_fname, group_name_full.str(), "clouds");
 	
+	if(own_row_cumsum) { params.img_stack->free_row_cumsum(); }
+	
 	clock_gettime(CLOCK_MONOTONIC, &t_end);
 	
 	if(verbosity >= 2) { sampler.print_stats(); }
@@ -289,6 +802,28 @@ void los_integral_clouds(TImgStack &img_stack, const double *const subpixel, dou
 		}
 		
 		int x_start = x;
+		
+		// The E(B-V) row is constant between clouds, so each segment is a
+		// difference of cumulative sums along DM
+		if(img_stack.row_cumsum != NULL) {
+			if(x_next > x_start) {
+				const size_t row_len = img_stack.rect->N_bins[1] + 1;
+				const float *sum_floor, *sum_ceil;
+				for(int k=0; k<img_stack.N_images; k++) {
+					y_scaled = y_0 + y*subpixel[k];
+					y_floor = floor(y_scaled);
+					y_floor_int = (int)y_floor;
+					
+					sum_floor = img_stack.row_cumsum + ((size_t)y_max*k + y_floor_int)*row_len;
+					sum_ceil = sum_floor + row_len;
+					ret[k] += (y_floor + 1. - y_scaled) * (sum_floor[x_next] - sum_floor[x_start])
+					          + (y_scaled - y_floor) * (sum_ceil[x_next] - sum_ceil[x_start]);
+				}
+				x = x_next;
+			}
+			continue;
+		}
+		
 		for(int k=0; k<img_stack.N_images; k++) {
 			y_scaled = y_0 + y*subpixel[k];
 			y_floor = floor(y_scaled);
@@ -299,6 +834,15 @@ void los_integral_clouds(TImgStack &img_stack, const double *const subpixel, dou
 			//if(y_ceil_int >= y_max) { std::cout << "!! y_ceil_int >= y_max !!" << std::endl; break; }
 			//if(y_floor_int < 0) { std::cout << "!! y_floor_int < 0 !!" << std::endl; break; }
 			
+			// Released images are read through pixel()
+			if((img_stack.img[k] == NULL) || (img_stack.img[k]->rows == 0)) {
+				for(x = x_start; x<x_next; x++) {
+					ret[k] += (y_ceil - y_scaled) * img_stack.pixel(k, y_floor_int, x)
+					          + (y_scaled - y_floor) * img_stack.pixel(k, y_ceil_int, x);
+				}
+				continue;
+			}
+			
 			for(x = x_start; x<x_next; x++) {
 				ret[k] += (y_ceil - y_scaled) * img_stack.img[k]->at<float>(y_floor_int, x)
 				          + (y_scaled - y_floor) * img_stack.img[k]->at<float>(y_ceil_int, x);
@@ -376,6 +920,7 @@ double lnp_los_extinction_clouds(const double* x, unsigned int N, TLOSMCMCParams
 		} else {
 			lnp_indiv = params.ln_p0_over_Z[i] + log(1. + line_int[i] * params.inv_p0_over_Z[i]);
 		}
+		if(!params.star_weight.empty()) { lnp_indiv *= params.star_weight[i]; }
 		
 		lnp += lnp_indiv;
 	}
@@ -430,81 +975,27 @@ void gen_rand_los_extinction_clouds(double *const x, unsigned int N, gsl_rng *r,
  *  Piecewise-linear line-of-sight model
  */
 
-void sample_los_extinction(const std::string& out_fname, const std::string& group_name,
-                           TMCMCOptions &options, TLOSMCMCParams &params,
-                           int verbosity) {
-	timespec t_start, t_write, t_end;
-	clock_gettime(CLOCK_MONOTONIC, &t_start);
-	
-	if(verbosity >= 1) {
-		//std::cout << std::endl;
-		std::cout << "Piecewise-linear l.o.s. model" << std::endl;
-		std::cout << "====================================" << std::endl;
-	}
-	
-	if(verbosity >= 2) {
-		std::cout << "guess of EBV max = " << params.EBV_guess_max << std::endl;
-	}
-	
-	if(verbosity >= 1) {
-		std::cout << "# Generating Guess ..." << std::endl;
-	}
-	
-	//std::vector<double> guess_time;
-	
-	/*for(int i=0; i<50; i++) {
-		timespec t_0, t_1;
-		double t_tmp;
-		
-		clock_gettime(CLOCK_MONOTONIC, &t_0);
-		
-		guess_EBV_profile(options, params);
-		
-		clock_gettime(CLOCK_MONOTONIC, &t_1);
-		
-		t_tmp = (t_1.tv_sec - t_0.tv_sec) + 1.e-9 * (t_1.tv_nsec - t_0.tv_nsec);
-		//guess_time.push_back(t_tmp);
-		
-		std::cerr << "Guess " << i << ": " << t_tmp << " s" << std::endl;
-	}*/
-	
-	guess_EBV_profile(options, params, verbosity);
-	
-	
-	//monotonic_guess(img_stack, N_regions, params.EBV_prof_guess, options);
-	if(verbosity >= 2) {
-		for(size_t i=0; i<params.EBV_prof_guess.size(); i++) {
-			std::cout << "\t" << params.EBV_prof_guess[i] << std::endl;
-		}
-		std::cout << std::endl;
-	}
-	
-	TNullLogger logger;
-	
-	unsigned int max_attempts = 2;
+// Burn-in of the piecewise-linear fit, in four rounds, the first three on downsampled surfaces if the pyramid
+// is built. Leaves the tuned step sizes in the sampler, and returns the number of Hamiltonian steps to take
+// per round of the main run.
+static unsigned int burn_in_los_extinction(TParallelAffineSampler<TLOSMCMCParams, TNullLogger> &sampler,
+                                           TMCMCOptions &options, TLOSMCMCParams &params, bool from_prof,
+                                           bool own_pyramid, unsigned int pyramid_level,
+                                           unsigned int N_slice_steps, int verbosity) {
 	unsigned int N_steps = options.steps;
-	unsigned int N_samplers = options.samplers;
-	unsigned int N_runs = options.N_runs;
-	unsigned int ndim = params.N_regions + 1;
-	
-	double max_conv_mu = 15.;
-	double DM_max = params.img_stack->rect->max[1];
-	double DM_min = params.img_stack->rect->min[1];
-	double Delta_DM = (DM_max - DM_min) / (double)(params.N_regions);
-	unsigned int max_conv_idx = ceil((max_conv_mu - DM_min) / Delta_DM);
-	//std::cout << "max_conv_idx = " << max_conv_idx << std::endl;
-	
-	std::vector<double> GR_transf;
-	TLOSTransform transf(ndim);
-	double GR_threshold = 1.25;
+	unsigned int N_HMC_steps = 0;
+	unsigned int tmp_level;
 	
-	TAffineSampler<TLOSMCMCParams, TNullLogger>::pdf_t f_pdf = &lnp_los_extinction;
-	TAffineSampler<TLOSMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_los_extinction_from_guess;
 	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t switch_step = &switch_adjacent_log_Delta_EBVs;
 	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t mix_step = &mix_log_Delta_EBVs;
 	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t move_one_step = &step_one_Delta_EBV;
 	
-	TParallelAffineSampler<TLOSMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
+	// During burn-in, stretch and custom proposals are screened on a subset of the stars, and
+	// only those that pass are scored on all of them
+	if(options.surrogate_frac > 0.) {
+		params.set_surrogate_stars(options.surrogate_frac);
+		sampler.set_surrogate_pdf(&lnp_los_extinction_surrogate);
+	}
 	
 	// Burn-in
 	if(verbosity >= 1) { std::cout << "# Burn-in ..." << std::endl; }
@@ -516,35 +1007,40 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	sampler.set_scale(1.1);
 	sampler.set_replacement_bandwidth(0.25);
 	sampler.set_MH_bandwidth(0.15);
+	if(params.init_scale > 0.) { sampler.set_scale(params.init_scale); }
+	if(params.init_MH_bandwidth > 0.) { sampler.set_MH_bandwidth(params.init_MH_bandwidth); }
 	
-	sampler.tune_MH(8, 0.25);
-	sampler.step_MH(base_N_steps, false);
-	
-	sampler.tune_MH(8, 0.25);
-	sampler.step_MH(base_N_steps, false);
-	
-	if(verbosity >= 2) {
-		std::cout << "scale: (";
-		for(int k=0; k<sampler.get_N_samplers(); k++) {
-			std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+	// Walkers drawn from a coarser fit or a neighbouring pixel start near equilibrium, and skip this round
+	if(!from_prof) {
+		sampler.tune_MH(8, 0.25);
+		sampler.step_MH(base_N_steps, false);
+		
+		sampler.tune_MH(8, 0.25);
+		sampler.step_MH(base_N_steps, false);
+		
+		if(verbosity >= 2) {
+			std::cout << "scale: (";
+			for(int k=0; k<sampler.get_N_samplers(); k++) {
+				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+			}
 		}
-	}
-	sampler.tune_stretch(5, 0.30);
-	if(verbosity >= 2) {
-		std::cout << ") -> (";
-		for(int k=0; k<sampler.get_N_samplers(); k++) {
-			std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+		sampler.tune_stretch(5, 0.30);
+		if(verbosity >= 2) {
+			std::cout << ") -> (";
+			for(int k=0; k<sampler.get_N_samplers(); k++) {
+				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+			}
+			std::cout << ")" << std::endl;
+		}
+		
+		sampler.step(2*base_N_steps, false, 0., options.p_replacement);
+		sampler.step(base_N_steps, false, 0., 1., true, true);
+		
+		if(verbosity >= 2) {
+			std::cout << "Round 1 diagnostics:" << std::endl;
+			sampler.print_diagnostics();
+			std::cout << std::endl;
 		}
-		std::cout << ")" << std::endl;
-	}
-	
-	sampler.step(2*base_N_steps, false, 0., options.p_replacement);
-	sampler.step(base_N_steps, false, 0., 1., true, true);
-	
-	if(verbosity >= 2) {
-		std::cout << "Round 1 diagnostics:" << std::endl;
-		sampler.print_diagnostics();
-		std::cout << std::endl;
 	}
 	
 	// Round 2 (5/20)
@@ -571,6 +1067,7 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	sampler.step_custom_reversible(base_N_steps, switch_step, false);
 	sampler.step_custom_reversible(base_N_steps, mix_step, false);
 	sampler.step_custom_reversible(base_N_steps, move_one_step, false);
+	if(options.slice) { sampler.step_slice(N_slice_steps, false); }
 	
 	//sampler.step(2*base_N_steps, false, 0., options.p_replacement);
 	sampler.step(base_N_steps, false, 0., 1., true, true);
@@ -582,6 +1079,11 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	}
 	
 	// Round 3 (5/20)
+	tmp_level = params.set_pyramid_level(1);
+	if(tmp_level != pyramid_level) {
+		pyramid_level = tmp_level;
+		sampler.rescore();
+	}
 	
 	if(verbosity >= 2) {
 		std::cout << "scale: (";
@@ -604,6 +1106,7 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	sampler.step_custom_reversible(base_N_steps, switch_step, false);
 	sampler.step_custom_reversible(base_N_steps, mix_step, false);
 	sampler.step_custom_reversible(base_N_steps, move_one_step, false);
+	if(options.slice) { sampler.step_slice(N_slice_steps, false); }
 	
 	if(verbosity >= 2) {
 		std::cout << "Round 3 diagnostics:" << std::endl;
@@ -611,7 +1114,14 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 		std::cout << std::endl;
 	}
 	
-	// Round 4 (5/20)
+	// Round 4 (5/20), at full resolution
+	tmp_level = params.set_pyramid_level(0);
+	if(tmp_level != pyramid_level) {
+		pyramid_level = tmp_level;
+		sampler.rescore();
+	}
+	if(own_pyramid) { params.img_stack_full->free_pyramid(); }
+	
 	sampler.set_replacement_accept_bias(0.);
 	
 	//sampler.tune_MH(8, 0.25);
@@ -636,6 +1146,14 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	sampler.step_custom_reversible(base_N_steps, switch_step, false);
 	sampler.step_custom_reversible(base_N_steps, mix_step, false);
 	sampler.step_custom_reversible(base_N_steps, move_one_step, false);
+	if(options.slice) { sampler.step_slice(N_slice_steps, false); }
+	
+	// Each Hamiltonian trajectory costs several evaluations, so fewer are taken
+	if(options.HMC) {
+		N_HMC_steps = ceil((double)base_N_steps / 5.);
+		sampler.tune_HMC(5, 0.65);
+		sampler.step_HMC(N_HMC_steps, false);
+	}
 	
 	if(verbosity >= 2) {
 		std::cout << "Round 4 diagnostics:" << std::endl;
@@ -643,11 +1161,256 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 		std::cout << std::endl;
 	}
 	
-	sampler.clear();
+	sampler.set_surrogate_pdf(NULL);
 	
-	// Main sampling phase (15/15)
-	if(verbosity >= 1) { std::cout << "# Main run ..." << std::endl; }
-	bool converged = false;
+	return N_HMC_steps;
+}
+
+// Put the walkers, tuned step sizes and random number generator states of a stored run back into the
+// samplers, and rescore the walkers on the current target.
+static void restore_los_ensemble(TParallelAffineSampler<TLOSMCMCParams, TNullLogger> &sampler,
+                                 const TLOSEnsembleState &state) {
+	assert(state.N_runs == sampler.get_N_samplers());
+	
+	TAffineSampler<TLOSMCMCParams, TNullLogger> *s;
+	const double *w;
+	
+	for(unsigned int k=0; k<state.N_runs; k++) {
+		s = sampler.get_sampler(k);
+		assert(state.L == s->get_N_walkers());
+		
+		for(unsigned int j=0; j<state.L; j++) {
+			w = &(state.walker[(k*state.L + j) * (state.ndim+1)]);
+			s->set_walker(j, w+1, w[0]);
+		}
+		
+		s->set_scale(state.scale[k]);
+		s->set_MH_bandwidth(state.MH_bandwidth[k]);
+		s->set_HMC_bandwidth(state.HMC_bandwidth[k]);
+		s->set_slice_width(state.slice_width[k]);
+		
+		// Otherwise, the run continues with a freshly seeded generator
+		s->set_rng_state(&(state.rng_state[k * state.rng_size]), state.rng_size);
+	}
+	
+	// The stars may not be the same as before (e.g., if a coreset was drawn)
+	sampler.rescore();
+}
+
+// Store the walkers, tuned step sizes and random number generator states of each run, along with the
+// transformed statistics of its chain, in <group_name>/los_ensemble, replacing any stored earlier.
+static void write_los_ensemble(const std::string &fname, const std::string &group_name,
+                               TParallelAffineSampler<TLOSMCMCParams, TNullLogger> &sampler,
+                               TStats **transf_stats, uint64_t N_steps) {
+	const unsigned int N_runs = sampler.get_N_samplers();
+	const unsigned int L = sampler.get_sampler(0)->get_N_walkers();
+	const unsigned int ndim = transf_stats[0]->get_dim();
+	const size_t rng_size = sampler.get_sampler(0)->get_rng_size();
+	
+	H5::H5File *file = H5Utils::openFile(fname);
+	H5::Group *pix_group = H5Utils::openGroup(file, group_name);
+	if(H5Utils::group_exists("los_ensemble", pix_group)) { pix_group->unlink("los_ensemble"); }
+	H5::Group *group = H5Utils::openGroup(file, group_name + "/los_ensemble");
+	
+	// Walkers: {ln(p), x...}
+	double *walker = new double[N_runs * L * (ndim+1)];
+	double *w;
+	for(unsigned int k=0; k<N_runs; k++) {
+		for(unsigned int j=0; j<L; j++) {
+			w = walker + (k*L + j) * (ndim+1);
+			sampler.get_sampler(k)->get_walker(j, w+1, w[0]);
+		}
+	}
+	
+	hsize_t dim[3] = {N_runs, L, ndim+1};
+	H5::DataSpace walker_dspace(3, &(dim[0]));
+	H5::DataSet walker_dset = group->createDataSet("walkers", H5::PredType::NATIVE_DOUBLE, walker_dspace);
+	walker_dset.write(walker, H5::PredType::NATIVE_DOUBLE);
+	delete[] walker;
+	
+	// Tuned step sizes of each run
+	double *tuned = new double[N_runs];
+	const char *tuned_name[4] = {"stretch_scale", "MH_bandwidth", "HMC_bandwidth", "slice_width"};
+	hsize_t att_dim = N_runs;
+	H5::DataSpace att_dspace(1, &att_dim);
+	for(int i=0; i<4; i++) {
+		for(unsigned int k=0; k<N_runs; k++) {
+			if(i == 0) {
+				tuned[k] = sampler.get_sampler(k)->get_scale();
+			} else if(i == 1) {
+				tuned[k] = sampler.get_sampler(k)->get_MH_bandwidth();
+			} else if(i == 2) {
+				tuned[k] = sampler.get_sampler(k)->get_HMC_bandwidth();
+			} else {
+				tuned[k] = sampler.get_sampler(k)->get_slice_width();
+			}
+		}
+		H5::Attribute att = walker_dset.createAttribute(tuned_name[i], H5::PredType::NATIVE_DOUBLE, att_dspace);
+		att.write(H5::PredType::NATIVE_DOUBLE, tuned);
+	}
+	delete[] tuned;
+	
+	H5::DataSpace scalar_dspace;
+	H5::Attribute steps_att = walker_dset.createAttribute("N_steps", H5::PredType::NATIVE_UINT64, scalar_dspace);
+	steps_att.write(H5::PredType::NATIVE_UINT64, &N_steps);
+	
+	// Random number generator states
+	unsigned char *rng_state = new unsigned char[N_runs * rng_size];
+	for(unsigned int k=0; k<N_runs; k++) {
+		memcpy(rng_state + k*rng_size, sampler.get_sampler(k)->get_rng_state(), rng_size);
+	}
+	
+	hsize_t rng_dim[2] = {N_runs, rng_size};
+	H5::DataSpace rng_dspace(2, &(rng_dim[0]));
+	H5::DataSet rng_dset = group->createDataSet("rng_state", H5::PredType::NATIVE_UCHAR, rng_dspace);
+	rng_dset.write(rng_state, H5::PredType::NATIVE_UCHAR);
+	delete[] rng_state;
+	
+	// Transformed statistics of each chain, for the G-R diagnostic: {N_items, sums of y_i, sums of y_i y_j}
+	const size_t N_stats = 1 + ndim + ndim*ndim;
+	double *stats = new double[N_runs * N_stats];
+	for(unsigned int k=0; k<N_runs; k++) {
+		stats[k*N_stats] = (double)(transf_stats[k]->get_N_items());
+		transf_stats[k]->get_sums(stats + k*N_stats + 1, stats + k*N_stats + 1 + ndim);
+	}
+	
+	hsize_t stats_dim[2] = {N_runs, N_stats};
+	H5::DataSpace stats_dspace(2, &(stats_dim[0]));
+	H5::DataSet stats_dset = group->createDataSet("transf_stats", H5::PredType::NATIVE_DOUBLE, stats_dspace);
+	stats_dset.write(stats, H5::PredType::NATIVE_DOUBLE);
+	delete[] stats;
+	
+	delete group;
+	delete pix_group;
+	delete file;
+}
+
+void sample_los_extinction(const std::string& out_fname, const std::string& group_name,
+                           TMCMCOptions &options, TLOSMCMCParams &params,
+                           int verbosity, const TLOSEnsembleState *resume) {
+	timespec t_start, t_write, t_end;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	
+	if(verbosity >= 1) {
+		//std::cout << std::endl;
+		std::cout << "Piecewise-linear l.o.s. model" << std::endl;
+		std::cout << "====================================" << std::endl;
+	}
+	
+	if(verbosity >= 2) {
+		std::cout << "guess of EBV max = " << params.EBV_guess_max << std::endl;
+	}
+	
+	if(verbosity >= 1) {
+		std::cout << "# Generating Guess ..." << std::endl;
+	}
+	
+	//std::vector<double> guess_time;
+	
+	/*for(int i=0; i<50; i++) {
+		timespec t_0, t_1;
+		double t_tmp;
+		
+		clock_gettime(CLOCK_MONOTONIC, &t_0);
+		
+		guess_EBV_profile(options, params);
+		
+		clock_gettime(CLOCK_MONOTONIC, &t_1);
+		
+		t_tmp = (t_1.tv_sec - t_0.tv_sec) + 1.e-9 * (t_1.tv_nsec - t_0.tv_nsec);
+		//guess_time.push_back(t_tmp);
+		
+		std::cerr << "Guess " << i << ": " << t_tmp << " s" << std::endl;
+	}*/
+	
+	// A warm start from a neighbouring pixel already provides the guess. When extending stored
+	// chains, the walkers are put back where they were, and burn-in is skipped.
+	bool extend = (resume != NULL);
+	bool warm_start = (params.init_prof.size() != 0);
+	if(extend) {
+		if(verbosity >= 1) { std::cout << "# Extending stored chains (" << resume->N_steps << " steps so far)" << std::endl; }
+	} else if(warm_start) {
+		if(verbosity >= 1) { std::cout << "# Starting from neighbouring pixel" << std::endl; }
+	} else {
+		guess_EBV_profile(options, params, verbosity);
+		
+		// Burn in on coarser profiles first, if requested
+		refine_los_extinction(options, params, verbosity);
+	}
+	bool from_prof = (params.init_prof.size() != 0);
+	
+	//monotonic_guess(img_stack, N_regions, params.EBV_prof_guess, options);
+	if(verbosity >= 2) {
+		for(size_t i=0; i<params.EBV_prof_guess.size(); i++) {
+			std::cout << "\t" << params.EBV_prof_guess[i] << std::endl;
+		}
+		std::cout << std::endl;
+	}
+	
+	TNullLogger logger;
+	
+	unsigned int max_attempts = 2;
+	unsigned int N_steps = options.steps;
+	unsigned int N_samplers = options.samplers;
+	unsigned int N_runs = options.N_runs;
+	unsigned int ndim = params.N_regions + 1;
+	
+	double max_conv_mu = 15.;
+	double DM_max = params.img_stack->rect->max[1];
+	double DM_min = params.img_stack->rect->min[1];
+	double Delta_DM = (DM_max - DM_min) / (double)(params.N_regions);
+	unsigned int max_conv_idx = ceil((max_conv_mu - DM_min) / Delta_DM);
+	//std::cout << "max_conv_idx = " << max_conv_idx << std::endl;
+	
+	std::vector<double> GR_transf;
+	TLOSTransform transf(ndim);
+	double GR_threshold = 1.25;
+	
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::pdf_t f_pdf = &lnp_los_extinction;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_los_extinction_from_guess;
+	if(from_prof) { f_rand_state = &gen_rand_los_extinction_from_prof; }
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t switch_step = &switch_adjacent_log_Delta_EBVs;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t mix_step = &mix_log_Delta_EBVs;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t move_one_step = &step_one_Delta_EBV;
+	
+	// The first rounds of burn-in are run on downsampled surfaces, as the walkers are still far from the mode
+	bool own_pyramid = !extend && (params.img_stack_full->pyramid.size() == 0);
+	if(own_pyramid) { params.img_stack_full->build_pyramid(2); }
+	unsigned int pyramid_level = params.set_pyramid_level(extend ? 0 : 2);
+	
+	TParallelAffineSampler<TLOSMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
+	
+	// Score all the proposals of an ensemble in one pass through the image stack
+	params.set_batch_size(N_samplers*ndim);
+	sampler.set_batch_pdf(&lnp_los_extinction_batch);
+	
+	// Custom reversible steps only change one or two Deltas, so are scored incrementally
+	params.set_local_size(N_samplers*ndim, N_runs);
+	sampler.set_local_pdf(&lnp_los_extinction_local, &los_local_update);
+	
+	if(options.HMC) { sampler.set_grad_pdf(&lnp_los_extinction_grad); }
+	
+	// Each slice step makes several evaluations, so fewer are taken than of the custom steps
+	unsigned int N_slice_steps = ceil((double)N_steps * 1./20. / 3.);
+	
+	unsigned int N_HMC_steps = 0;
+	if(extend) {
+		restore_los_ensemble(sampler, *resume);
+		if(options.HMC) { N_HMC_steps = ceil(ceil((double)N_steps * 1./20.) / 5.); }
+	} else {
+		N_HMC_steps = burn_in_los_extinction(sampler, options, params, from_prof, own_pyramid, pyramid_level,
+		                                     N_slice_steps, verbosity);
+	}
+	
+	sampler.clear();
+	
+	// Transformed statistics of each chain, including those of the stored samples when extending
+	TStats **transf_stats = new TStats*[N_runs];
+	for(unsigned int k=0; k<N_runs; k++) { transf_stats[k] = new TStats(ndim); }
+	
+	// Main sampling phase (15/15)
+	if(verbosity >= 1) { std::cout << "# Main run ..." << std::endl; }
+	bool converged = false;
 	size_t attempt;
 	for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
 		/*if(verbosity >= 2) {
@@ -682,13 +1445,15 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 			std::cout << ")" << std::endl;
 		}
 		
-		base_N_steps = ceil((double)((1<<attempt)*N_steps)*1./15.);
+		unsigned int base_N_steps = ceil((double)((1<<attempt)*N_steps)*1./15.);
 		
 		// Round 1 (5/15)
 		sampler.step(2*base_N_steps, true, 0., options.p_replacement);
 		sampler.step_custom_reversible(base_N_steps, switch_step, true);
 		sampler.step_custom_reversible(base_N_steps, mix_step, true);
 		sampler.step_custom_reversible(base_N_steps, move_one_step, true);
+		if(options.slice) { sampler.step_slice((1<<attempt)*N_slice_steps, true); }
+		if(options.HMC) { sampler.step_HMC(N_HMC_steps, true); }
 		//sampler.step_MH((1<<attempt)*N_steps*1./12., true);
 		
 		// Round 2 (5/15)
@@ -696,6 +1461,8 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 		sampler.step_custom_reversible(base_N_steps, switch_step, true);
 		sampler.step_custom_reversible(base_N_steps, mix_step, true);
 		sampler.step_custom_reversible(base_N_steps, move_one_step, true);
+		if(options.slice) { sampler.step_slice((1<<attempt)*N_slice_steps, true); }
+		if(options.HMC) { sampler.step_HMC(N_HMC_steps, true); }
 		//sampler.step_MH((1<<attempt)*N_steps*1./12., true);
 		
 		// Round 3 (5/15)
@@ -703,9 +1470,18 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 		sampler.step_custom_reversible(base_N_steps, switch_step, true);
 		sampler.step_custom_reversible(base_N_steps, mix_step, true);
 		sampler.step_custom_reversible(base_N_steps, move_one_step, true);
+		if(options.slice) { sampler.step_slice((1<<attempt)*N_slice_steps, true); }
+		if(options.HMC) { sampler.step_HMC(N_HMC_steps, true); }
 		//sampler.step_MH((1<<attempt)*N_steps*1./12., true);
 		
-		sampler.calc_GR_transformed(GR_transf, &transf);
+		for(unsigned int k=0; k<N_runs; k++) {
+			if(extend) {
+				resume->get_transf_stats(k, *(transf_stats[k]));
+			} else {
+				transf_stats[k]->clear();
+			}
+		}
+		sampler.calc_GR_transformed(GR_transf, &transf, transf_stats);
 		
 		if(verbosity >= 2) {
 			std::cout << std::endl << "Transformed G-R Diagnostic:";
@@ -745,14 +1521,73 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	group_name_full << "/" << group_name;
 	TChain chain = sampler.get_chain();
 	
+	// The stored samples stand in for the earlier part of the chains, with its total weight shared
+	// equally among them. The stored best point is kept as a candidate for the best point.
+	uint64_t N_steps_tot = (1<<(attempt-1))*N_steps;
+	if(extend) {
+		N_steps_tot += resume->N_steps;
+		
+		size_t N_samples = resume->sample.size() / (ndim+1) - 1;
+		double w_sample = resume->get_total_weight() / (double)N_samples;
+		std::vector<double> x(ndim);
+		const double *s;
+		for(size_t n=0; n<N_samples+1; n++) {
+			s = &(resume->sample[n*(ndim+1)]);
+			for(unsigned int i=0; i<ndim; i++) { x[i] = s[i+1]; }
+			chain.add_point(x.data(), s[0], (n == 0) ? 0. : w_sample);
+		}
+	}
+	
+	params.init_prof.clear();
+	params.init_cum_weight.clear();
+	params.init_scale = -1.;
+	params.init_MH_bandwidth = -1.;
+	
+	// Tuned step sizes, for warm starts of neighbouring pixels
+	double scale_mean = 0.;
+	double MH_bandwidth_mean = 0.;
+	for(int k=0; k<sampler.get_N_samplers(); k++) {
+		scale_mean += sampler.get_sampler(k)->get_scale() / (double)sampler.get_N_samplers();
+		MH_bandwidth_mean += sampler.get_sampler(k)->get_MH_bandwidth() / (double)sampler.get_N_samplers();
+	}
+	
 	TChainWriteBuffer writeBuffer(ndim, 500, 1);
 	writeBuffer.add(chain, converged, std::numeric_limits<double>::quiet_NaN(), GR_transf.data());
-	writeBuffer.write(out_fname, group_name_full.str(), "los");
 	
-	std::stringstream los_group_name;
-	los_group_name << group_name_full.str() << "/los";
-	H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "DM_min", params.img_stack->rect->min[1]);
-	H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "DM_max", params.img_stack->rect->max[1]);
+	// The cloud fit may be writing to the same file concurrently
+	#pragma omp critical (los_output)
+	{
+		// The extended chains replace the stored ones
+		if(extend) {
+			H5::H5File *file = H5Utils::openFile(out_fname);
+			H5::Group *pix_group = H5Utils::openGroup(file, group_name_full.str());
+			if(H5Utils::dataset_exists("los", pix_group)) { pix_group->unlink("los"); }
+			delete pix_group;
+			delete file;
+		}
+		
+		writeBuffer.write(out_fname, group_name_full.str(), "los");
+		
+		std::stringstream los_group_name;
+		los_group_name << group_name_full.str() << "/los";
+		H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "DM_min", params.img_stack->rect->min[1]);
+		H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "DM_max", params.img_stack->rect->max[1]);
+		H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "stretch_scale", scale_mean);
+		H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "MH_bandwidth", MH_bandwidth_mean);
+		
+		// Size of the coreset the fit ran on, and its estimated error in ln(p)
+		if(params.coreset_N_full != 0) {
+			H5Utils::add_watermark<uint32_t>(out_fname, los_group_name.str(), "coreset_N_stars", params.img_stack_full->N_images);
+			H5Utils::add_watermark<uint32_t>(out_fname, los_group_name.str(), "coreset_N_stars_full", params.coreset_N_full);
+			H5Utils::add_watermark<double>(out_fname, los_group_name.str(), "coreset_lnL_err", params.coreset_lnL_err);
+		}
+		
+		// Final state of the samplers, from which the chains can be extended
+		write_los_ensemble(out_fname, group_name_full.str(), sampler, transf_stats, N_steps_tot);
+	}
+	
+	for(unsigned int k=0; k<N_runs; k++) { delete transf_stats[k]; }
+	delete[] transf_stats;
 	
 	clock_gettime(CLOCK_MONOTONIC, &t_end);
 	
@@ -815,8 +1650,70 @@ void sample_los_extinction(const std::string& out_fname, const std::string& grou
 	}
 }
 
+// The kernels below walk the same path through each surface as los_integral, with the height held in
+// unsigned Q14.18 fixed point, in E(B-V) pixels. TLOSPath holds the factors shared by every walk.
+#define LOS_PATH_PREC_BITS 18
+
+struct TLOSPath {
+	int N_pix_per_bin;
+	double dx;
+	float prec_factor, y_0, dy_mult_factor, ret_mult_factor;
+	
+	TLOSPath(const TRect &rect, unsigned int N_regions) {
+		N_pix_per_bin = rect.N_bins[1] / N_regions;
+		dx = rect.dx[0];
+		prec_factor = (float)(1 << LOS_PATH_PREC_BITS);
+		y_0 = -rect.min[0] / dx;
+		dy_mult_factor = 1. / (float)N_pix_per_bin / dx;
+		ret_mult_factor = 1. / prec_factor;
+	}
+	
+	// Height at the first DM pixel of the path of a star with subpixel value s
+	uint32_t y_begin(float s, const float *const Delta_EBV) const {
+		const float Delta_y_0 = Delta_EBV[0] / dx;
+		return (uint32_t)(prec_factor * (y_0 + s * Delta_y_0));
+	}
+	
+	// Rise per DM pixel through a region of the given Delta E(B-V)
+	uint32_t dy(float s, float Delta_EBV) const {
+		return (uint32_t)(prec_factor * (s * Delta_EBV * dy_mult_factor));
+	}
+};
+
+// Row just below the fixed-point height y_int. Sets diff to the weight of the row above, out of 2^18.
+static inline uint32_t los_path_row(uint32_t y_int, uint32_t &diff) {
+	const uint32_t y_floor = (y_int >> LOS_PATH_PREC_BITS);
+	diff = y_int - (y_floor << LOS_PATH_PREC_BITS);
+	return y_floor;
+}
+
+// Pixel at the fixed-point height y_int, interpolated between the rows of a column whose rows are stride
+// elements apart, times 2^18
+static inline float los_path_pixel(const float *const column, size_t stride, uint32_t y_int) {
+	uint32_t diff;
+	const uint32_t y_floor = los_path_row(y_int, diff);
+	return ((1 << LOS_PATH_PREC_BITS) - diff) * column[y_floor*stride] + diff * column[(y_floor+1)*stride];
+}
+
 void los_integral(TImgStack &img_stack, const double *const subpixel, double *const ret,
                                         const float *const Delta_EBV, unsigned int N_regions) {
+	if(img_stack.gmm != NULL) {
+		los_integral_gmm(img_stack, subpixel, ret, Delta_EBV, N_regions);
+		return;
+	}
+	if(img_stack.arena != NULL) {
+		los_integral_arena(img_stack, subpixel, ret, Delta_EBV, N_regions);
+		return;
+	}
+	if(img_stack.band_data != NULL) {
+		los_integral_banded(img_stack, subpixel, ret, Delta_EBV, N_regions);
+		return;
+	}
+	if(img_stack.interleaved != NULL) {
+		los_integral_interleaved(img_stack, subpixel, ret, Delta_EBV, N_regions);
+		return;
+	}
+	
 	assert(img_stack.rect->N_bins[1] % N_regions == 0);
 	
 	const int subsampling = 1;
@@ -899,18 +1796,193 @@ void los_integral(TImgStack &img_stack, const double *const subpixel, double *co
 	}
 }
 
-double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCParams& params) {
+// Same as los_integral, but using the interleaved copy of the image stack. If all the stars share the
+// same subpixel value, they follow the same path through their images, so the path is walked only once,
+// and at each step, the pixels of all the stars are read from contiguous memory. Otherwise, blocks of
+// IMG_STACK_INTERLEAVE stars are walked together, gathering each star's pixels from its own path.
+void los_integral_interleaved(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                              const float *const Delta_EBV, unsigned int N_regions) {
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	assert(img_stack.interleaved != NULL);
+	
+	const size_t N_y = img_stack.rect->N_bins[0];
+	const size_t stride = img_stack.interleaved_stride;
+	const size_t N_images = img_stack.N_images;
+	const float *const img = img_stack.interleaved;
+	
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	
+	bool uniform = true;
+	for(size_t k=1; k<N_images; k++) {
+		if(subpixel[k] != subpixel[0]) {
+			uniform = false;
+			break;
+		}
+	}
+	
+	for(size_t k=0; k<N_images; k++) { ret[k] = 0.; }
+	
+	size_t x = 0;
+	uint32_t y_int, dy_int, y_floor, diff;
+	const float *p;
+	float w_0, w_1;
+	
+	if(uniform) {
+		const float tmp_subpixel = (N_images > 0) ? subpixel[0] : 1.;
+		y_int = path.y_begin(tmp_subpixel, Delta_EBV);
+		
+		for(int i=1; i<N_regions+1; i++) {
+			dy_int = path.dy(tmp_subpixel, Delta_EBV[i]);
+			
+			for(int j=0; j<path.N_pix_per_bin; j++, x++, y_int+=dy_int) {
+				y_floor = los_path_row(y_int, diff);
+				w_0 = (float)((1 << LOS_PATH_PREC_BITS) - diff);
+				w_1 = (float)diff;
+				
+				// Pixels (y_floor, x) and (y_floor+1, x) of every star are adjacent in memory
+				p = img + (N_y*x + y_floor)*stride;
+				for(size_t k=0; k<N_images; k++) {
+					ret[k] += w_0 * p[k] + w_1 * p[k+stride];
+				}
+			}
+		}
+	} else {
+		uint32_t y_int_k[IMG_STACK_INTERLEAVE];
+		uint32_t dy_int_k[IMG_STACK_INTERLEAVE];
+		float tmp_ret[IMG_STACK_INTERLEAVE];
+		size_t n;
+		
+		for(size_t k0=0; k0<N_images; k0+=IMG_STACK_INTERLEAVE) {
+			n = (N_images - k0 < IMG_STACK_INTERLEAVE) ? (N_images - k0) : IMG_STACK_INTERLEAVE;
+			
+			for(size_t k=0; k<n; k++) {
+				y_int_k[k] = path.y_begin(subpixel[k0+k], Delta_EBV);
+				tmp_ret[k] = 0.;
+			}
+			
+			x = 0;
+			for(int i=1; i<N_regions+1; i++) {
+				for(size_t k=0; k<n; k++) {
+					dy_int_k[k] = path.dy(subpixel[k0+k], Delta_EBV[i]);
+				}
+				
+				for(int j=0; j<path.N_pix_per_bin; j++, x++) {
+					p = img + N_y*x*stride + k0;
+					
+					// Each star reads from its own row
+					for(size_t k=0; k<n; k++) {
+						tmp_ret[k] += los_path_pixel(p + k, stride, y_int_k[k]);
+						y_int_k[k] += dy_int_k[k];
+					}
+				}
+			}
+			
+			for(size_t k=0; k<n; k++) { ret[k0+k] = tmp_ret[k]; }
+		}
+	}
+	
+	for(size_t k=0; k<N_images; k++) { ret[k] *= (double)path.ret_mult_factor; }
+}
+
+// Line integrals of K profiles through the image stack, in one pass. Delta_EBV[p*(N_regions+1) + i] is
+// element i of profile p, and the integral of star k along profile p is written to ret[p*N_images + k].
+// The stack is traversed in blocks of LOS_INTEGRAL_STAR_BLOCK stars, and each block is integrated along
+// all K profiles before moving on. The profiles of an ensemble lie close to one another, so they touch
+// nearly the same pixels, which are then still in cache, and the stack is streamed from memory only once.
+void los_integral_batch(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                        const float *const Delta_EBV, unsigned int N_regions, unsigned int K) {
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	
+	// Gaussian-mixture and quantized surfaces are read by their own kernels, one profile at a time
+	if((img_stack.gmm != NULL) || ((img_stack.arena != NULL) && (img_stack.arena_type != IMG_ARENA_F32))) {
+		for(unsigned int m=0; m<K; m++) {
+			los_integral(img_stack, subpixel, ret + m*img_stack.N_images, Delta_EBV + m*(N_regions+1), N_regions);
+		}
+		return;
+	}
+	
+	// So are banded surfaces, as in los_integral, whose dense images have been released
+	if((img_stack.band_data != NULL) && (img_stack.arena == NULL)) {
+		for(unsigned int m=0; m<K; m++) {
+			los_integral_banded(img_stack, subpixel, ret + m*img_stack.N_images, Delta_EBV + m*(N_regions+1), N_regions);
+		}
+		return;
+	}
+	
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	const size_t N_x = img_stack.rect->N_bins[1];
+	const size_t N_y = img_stack.rect->N_bins[0];
+	const size_t N_images = img_stack.N_images;
+	
+	uint32_t y_int[LOS_INTEGRAL_STAR_BLOCK];
+	uint32_t dy_int[LOS_INTEGRAL_STAR_BLOCK];
+	float tmp_ret[LOS_INTEGRAL_STAR_BLOCK];
+	const float *img_ptr[LOS_INTEGRAL_STAR_BLOCK];
+	
+	const float *D;
+	const float *p;
+	size_t n, x;
+	
+	const bool interleaved = (img_stack.interleaved != NULL);
+	const size_t stride = img_stack.interleaved_stride;
+	
+	for(size_t k0=0; k0<N_images; k0+=LOS_INTEGRAL_STAR_BLOCK) {
+		n = (N_images - k0 < LOS_INTEGRAL_STAR_BLOCK) ? (N_images - k0) : LOS_INTEGRAL_STAR_BLOCK;
+		
+		if(!interleaved && (img_stack.arena != NULL)) {
+			// Float32 arena, with the same layout as the images, which may have been released
+			for(size_t k=0; k<n; k++) { img_ptr[k] = (const float*)img_stack.arena + (k0+k)*img_stack.arena_slot; }
+		} else if(!interleaved) {
+			for(size_t k=0; k<n; k++) {
+				assert(img_stack.img[k0+k]->isContinuous());
+				img_ptr[k] = img_stack.img[k0+k]->ptr<float>(0);
+			}
+		}
+		
+		for(unsigned int m=0; m<K; m++) {
+			D = Delta_EBV + m*(N_regions+1);
+			
+			for(size_t k=0; k<n; k++) {
+				y_int[k] = path.y_begin(subpixel[k0+k], D);
+				tmp_ret[k] = 0.;
+			}
+			
+			x = 0;
+			for(int i=1; i<N_regions+1; i++) {
+				for(size_t k=0; k<n; k++) { dy_int[k] = path.dy(subpixel[k0+k], D[i]); }
+				
+				for(int j=0; j<path.N_pix_per_bin; j++, x++) {
+					if(interleaved) {
+						p = img_stack.interleaved + N_y*x*stride + k0;
+						for(size_t k=0; k<n; k++) {
+							tmp_ret[k] += los_path_pixel(p + k, stride, y_int[k]);
+							y_int[k] += dy_int[k];
+						}
+					} else {
+						// Images are stored EBV-major, with rows of N_bins[1] (DM) pixels
+						for(size_t k=0; k<n; k++) {
+							tmp_ret[k] += los_path_pixel(img_ptr[k] + x, N_x, y_int[k]);
+							y_int[k] += dy_int[k];
+						}
+					}
+				}
+			}
+			
+			for(size_t k=0; k<n; k++) { ret[m*N_images + k0+k] = tmp_ret[k] * path.ret_mult_factor; }
+		}
+	}
+}
+
+// Prior on the piecewise-linear profile, given log(Delta E(B-V)). Fills Delta_EBV, and returns
+// neg_inf_replacement if the profile runs off the top of the image stack.
+double lnp_los_extinction_prior(const double *const logEBV, unsigned int N, float *const Delta_EBV,
+                                TLOSMCMCParams& params) {
 	double lnp = 0.;
 	
 	double EBV_tot = 0.;
-	double EBV_tmp;
 	double diff_scaled;
 	
-	int thread_num = omp_get_thread_num();
-	
 	// Calculate Delta E(B-V) from log(Delta E(B-V))
-	float *Delta_EBV = params.get_Delta_EBV(thread_num);
-	
 	for(int i=0; i<N; i++) {
 		Delta_EBV[i] = exp(logEBV[i]);
 	}
@@ -948,21 +2020,27 @@ double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCPa
 		lnp -= (EBV_tot - params.EBV_max) * (EBV_tot - params.EBV_max) / (2. * 0.20 * 0.20 * params.EBV_max * params.EBV_max);
 	}
 	
-	// Compute line integrals through probability surfaces
-	double *line_int = params.get_line_int(thread_num);
-	los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
-	
-	// Soften and multiply line integrals
+	return lnp;
+}
+
+// Soften and multiply line integrals
+// Softened ln(p) of star k, given its line integral, before any coreset weight
+static inline double lnp_los_star(double line_int, size_t k, const TLOSMCMCParams &params) {
+	if(line_int > params.p0_over_Z[k]) {
+		return log(line_int) + log(1. + params.p0_over_Z[k] / line_int);
+	}
+	return params.ln_p0_over_Z[k] + log(1. + line_int * params.inv_p0_over_Z[k]);
+}
+
+double lnp_los_line_int(const double *const line_int, TLOSMCMCParams& params) {
+	double lnp = 0.;
 	double lnp_indiv;
 	for(size_t i=0; i<params.img_stack->N_images; i++) {
 		//if(line_int[i] < 1.e5*params.p0) {
 		//	line_int[i] += params.p0 * exp(-line_int[i]/params.p0);
 		//}
-		if(line_int[i] > params.p0_over_Z[i]) {
-			lnp_indiv = log(line_int[i]) + log(1. + params.p0_over_Z[i] / line_int[i]);
-		} else {
-			lnp_indiv = params.ln_p0_over_Z[i] + log(1. + line_int[i] * params.inv_p0_over_Z[i]);
-		}
+		lnp_indiv = lnp_los_star(line_int[i], i, params);
+		if(!params.star_weight.empty()) { lnp_indiv *= params.star_weight[i]; }
 		
 		lnp += lnp_indiv;
 		
@@ -975,23 +2053,728 @@ double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCPa
 	return lnp;
 }
 
-void gen_rand_los_extinction(double *const logEBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params) {
-	double EBV_ceil = params.img_stack->rect->max[0] / params.subpixel_max;
-	double mu = 1.5 * params.EBV_guess_max / params.subpixel_max / (double)N;
-	double EBV_sum = 0.;
+static void lnp_los_stars_parallel(TLOSMCMCParams &params, const float *const Delta_EBV, unsigned int N_regions,
+                                   unsigned int K, double *const line_int, double *const lnp_stars,
+                                   int N_star_threads);
+
+double lnp_los_extinction(const double *const logEBV, unsigned int N, TLOSMCMCParams& params) {
+	int thread_num = omp_get_thread_num();
 	
-	if((params.log_Delta_EBV_prior != NULL) && (gsl_rng_uniform(r) < 0.8)) {
-		for(size_t i=0; i<N; i++) {
-			logEBV[i] = params.log_Delta_EBV_prior[i] + gsl_ran_gaussian_ziggurat(r, params.sigma_log_Delta_EBV[i]);
-			EBV_sum += exp(logEBV[i]);
-		}
-	} else {
-		double log_scaling = gsl_ran_gaussian_ziggurat(r, 0.25);
-		for(size_t i=0; i<N; i++) {
-			logEBV[i] = log(mu * gsl_rng_uniform(r)) + log_scaling; //mu + gsl_ran_gaussian_ziggurat(r, 2.5);
-			EBV_sum += exp(logEBV[i]);
-		}
-		/*#pragma omp critical (cout)
+	float *Delta_EBV = params.get_Delta_EBV(thread_num);
+	double lnp = lnp_los_extinction_prior(logEBV, N, Delta_EBV, params);
+	if(is_neg_inf_replacement(lnp)) { return neg_inf_replacement; }
+	
+	// Compute line integrals through probability surfaces
+	double *line_int = params.get_line_int(thread_num);
+	
+	// Split large pixels across the threads left idle by the ensembles
+	int N_star_threads = params.get_N_star_threads();
+	if(N_star_threads > 1) {
+		double lnp_stars;
+		lnp_los_stars_parallel(params, Delta_EBV, N-1, 1, line_int, &lnp_stars, N_star_threads);
+		return lnp + lnp_stars;
+	}
+	
+	los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
+	
+	return lnp + lnp_los_line_int(line_int, params);
+}
+
+// Version of lnp_los_extinction that also stores the gradient with respect to log(Delta E(B-V)) in grad.
+//
+// Within each DM pixel, the surfaces are interpolated linearly in E(B-V), so the derivative of a line
+// integral with respect to the height of the path at pixel x is the difference of the two pixels that
+// bracket the path. Raising Delta E(B-V) in one region lifts the path by subpixel/dx[0] in every region
+// behind it, and in proportion to the distance travelled within the region itself.
+double lnp_los_extinction_grad(const double *const logEBV, unsigned int N, double *const grad, TLOSMCMCParams& params) {
+	int thread_num = omp_get_thread_num();
+	
+	for(unsigned int i=0; i<N; i++) { grad[i] = 0.; }
+	
+	float *Delta_EBV = params.get_Delta_EBV(thread_num);
+	double lnp = lnp_los_extinction_prior(logEBV, N, Delta_EBV, params);
+	if(is_neg_inf_replacement(lnp)) { return neg_inf_replacement; }
+	
+	// Gradient of the priors
+	double EBV_tot = 0.;
+	double diff_scaled, z;
+	for(unsigned int i=0; i<N; i++) {
+		EBV_tot += Delta_EBV[i];
+		
+		if(params.log_Delta_EBV_prior != NULL) {
+			diff_scaled = (logEBV[i] - params.log_Delta_EBV_prior[i]) / params.sigma_log_Delta_EBV[i];
+			z = params.alpha_skew * diff_scaled * INV_SQRT2;
+			grad[i] = -diff_scaled;
+			if(z > -25.) {
+				grad[i] += params.alpha_skew * SQRT2 / SQRTPI * exp(-z*z) / erfc(-z);
+			} else {
+				grad[i] -= params.alpha_skew * SQRT2 * z;	// Asymptotic form, where erfc underflows
+			}
+			grad[i] /= params.sigma_log_Delta_EBV[i];
+		} else {
+			grad[i] = -(logEBV[i] + 4.) / (2. * 2.);
+		}
+	}
+	
+	if((params.EBV_max > 0.) && (EBV_tot > params.EBV_max)) {
+		for(unsigned int i=0; i<N; i++) {
+			grad[i] -= (EBV_tot - params.EBV_max) / (0.20 * 0.20 * params.EBV_max * params.EBV_max) * Delta_EBV[i];
+		}
+	}
+	
+	// Line integrals
+	TImgStack &img_stack = *(params.img_stack);
+	const unsigned int N_regions = N - 1;
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	const int N_pix_per_bin = path.N_pix_per_bin;
+	
+	double *line_int = params.get_line_int(thread_num);
+	std::vector<double> G(N, 0.);	// Sum of slopes in each region
+	std::vector<double> H(N, 0.);	// Sum of slopes in each region, weighted by distance into region
+	std::vector<double> grad_line(N, 0.);
+	
+	uint32_t y_int, dy_int, y_floor, diff;
+	float tmp_ret, s, lower, upper;
+	double slope, G_behind, w;
+	int x;
+	const cv::Mat *img;
+	bool dense;
+	
+	for(size_t k=0; k<img_stack.N_images; k++) {
+		s = params.subpixel[k];
+		x = 0;
+		img = img_stack.img[k];
+		dense = (img != NULL) && (img->rows != 0);	// Otherwise released, and read through pixel()
+		y_int = path.y_begin(s, Delta_EBV);
+		tmp_ret = 0.;
+		
+		for(int i=1; i<N_regions+1; i++) {
+			dy_int = path.dy(s, Delta_EBV[i]);
+			G[i] = 0.;
+			H[i] = 0.;
+			
+			for(int j=0; j<N_pix_per_bin; j++, x++, y_int+=dy_int) {
+				y_floor = los_path_row(y_int, diff);
+				if(dense) {
+					lower = img->at<float>(y_floor, x);
+					upper = img->at<float>(y_floor+1, x);
+				} else {
+					lower = img_stack.pixel(k, y_floor, x);
+					upper = img_stack.pixel(k, y_floor+1, x);
+				}
+				
+				tmp_ret += ((1 << LOS_PATH_PREC_BITS) - diff) * lower + diff * upper;
+				
+				slope = upper - lower;
+				G[i] += slope;
+				H[i] += slope * (double)j;
+			}
+		}
+		
+		line_int[k] = tmp_ret * path.ret_mult_factor;
+		
+		// d ln(softened line integral) / d line integral
+		w = s / img_stack.rect->dx[0] / (line_int[k] + params.p0_over_Z[k]);
+		if(!params.star_weight.empty()) { w *= params.star_weight[k]; }
+		
+		G_behind = 0.;
+		for(int i=N_regions; i>=1; i--) {
+			grad_line[i] += w * (G_behind + H[i] / (double)N_pix_per_bin);
+			G_behind += G[i];
+		}
+		grad_line[0] += w * G_behind;
+	}
+	
+	for(unsigned int i=0; i<N; i++) { grad[i] += grad_line[i] * Delta_EBV[i]; }
+	
+	// With Gaussian-mixture or quantized surfaces, the gradient above is taken from the images, and only
+	// guides the trajectories of step_HMC. The value must still match lnp_los_extinction.
+	if((img_stack.gmm != NULL) || ((img_stack.arena != NULL) && (img_stack.arena_type != IMG_ARENA_F32))) {
+		return lnp_los_extinction(logEBV, N, params);
+	}
+	
+	return lnp + lnp_los_line_int(line_int, params);
+}
+
+// Batched version of lnp_los_extinction, for TAffineSampler::set_batch_pdf. The L profiles are in
+// struct-of-arrays layout, with logEBV[i*L + j] the ith coordinate of profile j. Their line integrals
+// are computed in a single pass through the image stack, by los_integral_batch.
+void lnp_los_extinction_batch(const double *const logEBV, unsigned int N, unsigned int L, double *const lnp,
+                              TLOSMCMCParams& params) {
+	int thread_num = omp_get_thread_num();
+	
+	assert(L <= params.batch_size);
+	
+	float *Delta_EBV = params.get_Delta_EBV_batch(thread_num);
+	double *line_int = params.get_line_int_batch(thread_num);
+	double *x = params.get_x_batch(thread_num);
+	unsigned int *idx = params.get_idx_batch(thread_num);
+	
+	// Evaluate the priors, and pack the profiles that stay inside the image stack
+	unsigned int K = 0;
+	for(unsigned int j=0; j<L; j++) {
+		for(unsigned int i=0; i<N; i++) { x[i] = logEBV[i*L + j]; }
+		lnp[j] = lnp_los_extinction_prior(x, N, Delta_EBV + K*N, params);
+		if(!is_neg_inf_replacement(lnp[j])) {
+			idx[K] = j;
+			K++;
+		}
+	}
+	
+	int N_star_threads = params.get_N_star_threads(K);
+	if((N_star_threads > 1) && (K > 0)) {
+		std::vector<double> lnp_stars(K);
+		lnp_los_stars_parallel(params, Delta_EBV, N-1, K, line_int, lnp_stars.data(), N_star_threads);
+		for(unsigned int k=0; k<K; k++) { lnp[idx[k]] += lnp_stars[k]; }
+		return;
+	}
+	
+	los_integral_batch(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1, K);
+	
+	const size_t N_images = params.img_stack->N_images;
+	for(unsigned int k=0; k<K; k++) {
+		lnp[idx[k]] += lnp_los_line_int(line_int + k*N_images, params);
+	}
+}
+
+// Conversions between float and IEEE half precision. Halves are decoded through a table,
+// filled by init_half_to_float_table.
+static float half_to_float_table[65536];
+
+static float half_to_float(uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t bits;
+	
+	if(exponent == 0) {
+		if(mantissa == 0) {
+			bits = sign;
+		} else {	// Subnormal half becomes a normal float
+			exponent = 127 - 15 + 1;
+			while(!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	} else if(exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	} else {
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+	
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static uint16_t float_to_half(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	
+	uint16_t sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	
+	if(exponent >= 0x1f) { return sign | 0x7c00; }	// Overflow to infinity
+	if(exponent <= 0) {
+		if(exponent < -10) { return sign; }	// Underflow to zero
+		mantissa = (mantissa | 0x800000) >> (1 - exponent);
+		return sign | (uint16_t)((mantissa + 0x1000) >> 13);
+	}
+	
+	// Round to nearest. A carry out of the mantissa correctly increments the exponent.
+	return sign | (uint16_t)(((exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
+}
+
+static bool fill_half_to_float_table() {
+	for(uint32_t h=0; h<65536; h++) { half_to_float_table[h] = half_to_float((uint16_t)h); }
+	return true;
+}
+
+// Fill the table once. Function-local statics are initialized exactly once, even if stacks are
+// built from several threads at the same time.
+static void init_half_to_float_table() {
+	static const bool ready = fill_half_to_float_table();
+	(void)ready;
+}
+
+// bfloat16 is the upper half of a float, rounded to nearest even
+static inline float bfloat16_to_float(uint16_t b) {
+	uint32_t bits = (uint32_t)b << 16;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static inline uint16_t float_to_bfloat16(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	bits += 0x7fff + ((bits >> 16) & 1);
+	return (uint16_t)(bits >> 16);
+}
+
+// Decode pixel idx of star k from the image arena, including the per-star scale
+static float arena_pixel(const TImgStack &img_stack, size_t k, size_t idx) {
+	const uint16_t *slot16 = (const uint16_t*)img_stack.arena + k*img_stack.arena_slot;
+	
+	switch(img_stack.arena_type) {
+		case IMG_ARENA_F16:
+			return half_to_float_table[slot16[idx]];
+		case IMG_ARENA_BF16:
+			return bfloat16_to_float(slot16[idx]);
+		case IMG_ARENA_U16:
+			return (float)slot16[idx] * img_stack.arena_scale[k];
+		default:
+			return ((const float*)img_stack.arena)[k*img_stack.arena_slot + idx];
+	}
+}
+
+// Decoders for the storage types of the image arena. Pixels stored as uint16 are decoded without
+// their per-star scale, which is applied to the whole line integral.
+struct TArenaF32 {
+	typedef float elem_t;
+	static inline float decode(float v) { return v; }
+};
+
+struct TArenaF16 {
+	typedef uint16_t elem_t;
+	static inline float decode(uint16_t v) { return half_to_float_table[v]; }
+};
+
+struct TArenaBF16 {
+	typedef uint16_t elem_t;
+	static inline float decode(uint16_t v) { return bfloat16_to_float(v); }
+};
+
+struct TArenaU16 {
+	typedef uint16_t elem_t;
+	static inline float decode(uint16_t v) { return (float)v; }
+};
+
+// Integral of star k through one distance region of the arena, as in los_integral_region, before the
+// per-star scale is applied.
+template<class TStorage>
+static inline float los_integral_region_arena(const TImgStack &img_stack, size_t k, uint32_t &y_int, uint32_t dy_int,
+                                              int x_begin, int N_pix) {
+	const size_t N_x = img_stack.rect->N_bins[1];
+	const typename TStorage::elem_t *slot = (const typename TStorage::elem_t*)img_stack.arena + k*img_stack.arena_slot;
+	const typename TStorage::elem_t *p;
+	uint32_t y_floor, diff;
+	float ret = 0.;
+	
+	for(int x=x_begin; x<x_begin+N_pix; x++, y_int+=dy_int) {
+		y_floor = los_path_row(y_int, diff);
+		p = slot + N_x*y_floor + x;
+		ret += ((1 << LOS_PATH_PREC_BITS) - diff) * TStorage::decode(p[0]) + diff * TStorage::decode(p[N_x]);
+	}
+	
+	return ret;
+}
+
+template<class TStorage>
+static void los_integral_arena_impl(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                                    const float *const Delta_EBV, unsigned int N_regions) {
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	const int N_pix_per_bin = path.N_pix_per_bin;
+	
+	uint32_t y_int;
+	float s, tmp_ret;
+	
+	for(size_t k=0; k<img_stack.N_images; k++) {
+		s = subpixel[k];
+		y_int = path.y_begin(s, Delta_EBV);
+		tmp_ret = 0.;
+		
+		for(int i=1; i<N_regions+1; i++) {
+			tmp_ret += los_integral_region_arena<TStorage>(img_stack, k, y_int, path.dy(s, Delta_EBV[i]), (i-1)*N_pix_per_bin, N_pix_per_bin);
+		}
+		
+		ret[k] = tmp_ret * path.ret_mult_factor * img_stack.arena_scale[k];
+	}
+}
+
+// Same as los_integral, but reading the image arena, with a kernel specialized for its storage type
+void los_integral_arena(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                        const float *const Delta_EBV, unsigned int N_regions) {
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	
+	switch(img_stack.arena_type) {
+		case IMG_ARENA_F16:
+			los_integral_arena_impl<TArenaF16>(img_stack, subpixel, ret, Delta_EBV, N_regions);
+			break;
+		case IMG_ARENA_BF16:
+			los_integral_arena_impl<TArenaBF16>(img_stack, subpixel, ret, Delta_EBV, N_regions);
+			break;
+		case IMG_ARENA_U16:
+			los_integral_arena_impl<TArenaU16>(img_stack, subpixel, ret, Delta_EBV, N_regions);
+			break;
+		default:
+			los_integral_arena_impl<TArenaF32>(img_stack, subpixel, ret, Delta_EBV, N_regions);
+			break;
+	}
+}
+
+// Integral of a Gaussian-mixture surface along the straight path y = y_begin + dy*(x - x_begin), in pixel
+// units, across the N_pix DM pixels starting at x_begin. This approximates the sum over the pixels taken by
+// los_integral, so each pixel column contributes the interval x +- 1/2. Writing each component as a Gaussian
+// in x times a Gaussian in y given x, the deviation of the path from the conditional mean of y is linear in x,
+// and the product is a Gaussian in x, which is integrated with erf.
+static inline float los_integral_region_gmm(const TImgGaussMix &gmm, float y_begin, float dy, int x_begin, int N_pix) {
+	const double x_0 = (double)x_begin - 0.5;
+	const double x_1 = x_0 + (double)N_pix;
+	
+	double beta, alpha, d_mu, var_tot, m, s_m, ret;
+	ret = 0.;
+	
+	for(int c=0; c<IMG_GMM_COMPONENTS; c++) {
+		if(gmm.w[c] <= 0.) { continue; }
+		
+		// Deviation of path from conditional mean of y: beta*x + alpha
+		beta = dy - gmm.slope[c];
+		alpha = y_begin - dy * (double)x_begin - gmm.mu_y[c] + gmm.slope[c] * gmm.mu_x[c];
+		
+		d_mu = beta * gmm.mu_x[c] + alpha;
+		var_tot = gmm.sigma_y[c] * gmm.sigma_y[c] + beta * beta * gmm.sigma_x[c] * gmm.sigma_x[c];
+		
+		m = gmm.mu_x[c] - beta * gmm.sigma_x[c] * gmm.sigma_x[c] * d_mu / var_tot;
+		s_m = SQRT2 * gmm.sigma_x[c] * gmm.sigma_y[c] / sqrt(var_tot);
+		
+		ret += gmm.w[c] * exp(-0.5 * d_mu * d_mu / var_tot) / (SQRT2PI * sqrt(var_tot))
+		       * 0.5 * (erf((x_1 - m) / s_m) - erf((x_0 - m) / s_m));
+	}
+	
+	return ret;
+}
+
+// Integral of star k through one distance region, starting at fixed-point height y_int (see TLOSPath),
+// and climbing by dy_int per DM pixel. On return, y_int holds the height at the start of the next region.
+static inline float los_integral_region(const TImgStack &img_stack, size_t k, uint32_t &y_int, uint32_t dy_int,
+                                        int x_begin, int N_pix) {
+	const float prec_factor = (float)(1 << LOS_PATH_PREC_BITS);
+	uint32_t y_floor, diff;
+	float ret = 0.;
+	
+	if((img_stack.gmm != NULL) && img_stack.gmm[k].good) {
+		ret = prec_factor * los_integral_region_gmm(img_stack.gmm[k], (float)y_int / prec_factor,
+		                                            (float)dy_int / prec_factor, x_begin, N_pix);
+		y_int += N_pix * dy_int;
+	} else if(img_stack.arena != NULL) {
+		switch(img_stack.arena_type) {
+			case IMG_ARENA_F16:
+				ret = los_integral_region_arena<TArenaF16>(img_stack, k, y_int, dy_int, x_begin, N_pix);
+				break;
+			case IMG_ARENA_BF16:
+				ret = los_integral_region_arena<TArenaBF16>(img_stack, k, y_int, dy_int, x_begin, N_pix);
+				break;
+			case IMG_ARENA_U16:
+				ret = los_integral_region_arena<TArenaU16>(img_stack, k, y_int, dy_int, x_begin, N_pix);
+				break;
+			default:
+				ret = los_integral_region_arena<TArenaF32>(img_stack, k, y_int, dy_int, x_begin, N_pix);
+				break;
+		}
+		ret *= img_stack.arena_scale[k];
+	} else if(img_stack.band_data != NULL) {
+		const size_t N_x = img_stack.rect->N_bins[1];
+		size_t idx;
+		for(int x=x_begin; x<x_begin+N_pix; x++, y_int+=dy_int) {
+			y_floor = los_path_row(y_int, diff);
+			idx = k*N_x + x;
+			
+			// Both pixels outside the band
+			if((y_floor + 1 < img_stack.band_lo[idx]) || (y_floor >= img_stack.band_hi[idx])) { continue; }
+			
+			const float *p = img_stack.band_data + img_stack.band_offset[idx] + y_floor + 1 - img_stack.band_lo[idx];
+			ret += ((1 << LOS_PATH_PREC_BITS) - diff) * p[0] + diff * p[1];
+		}
+	} else if(img_stack.interleaved != NULL) {
+		const size_t N_y = img_stack.rect->N_bins[0];
+		const size_t stride = img_stack.interleaved_stride;
+		for(int x=x_begin; x<x_begin+N_pix; x++, y_int+=dy_int) {
+			ret += los_path_pixel(img_stack.interleaved + N_y*x*stride + k, stride, y_int);
+		}
+	} else {
+		const cv::Mat *img = img_stack.img[k];
+		const float *img_ptr = img->ptr<float>(0);
+		const size_t stride = img->step1();
+		for(int x=x_begin; x<x_begin+N_pix; x++, y_int+=dy_int) {
+			ret += los_path_pixel(img_ptr + x, stride, y_int);
+		}
+	}
+	
+	return ret;
+}
+
+// Integral of star k, with subpixel value s, along the whole profile, times 2^18 (see TLOSPath)
+static inline float los_integral_star(const TImgStack &img_stack, size_t k, float s, const float *const Delta_EBV,
+                                      unsigned int N_regions, const TLOSPath &path) {
+	uint32_t y_int = path.y_begin(s, Delta_EBV);
+	float ret = 0.;
+	
+	for(int i=1; i<N_regions+1; i++) {
+		ret += los_integral_region(img_stack, k, y_int, path.dy(s, Delta_EBV[i]), (i-1)*path.N_pix_per_bin, path.N_pix_per_bin);
+	}
+	
+	return ret;
+}
+
+// Same as los_integral, but using the banded copy of the image stack. Columns in which the path passes
+// above or below the band of nonzero pixels are skipped without reading any pixels.
+void los_integral_banded(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                         const float *const Delta_EBV, unsigned int N_regions) {
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	
+	for(size_t k=0; k<img_stack.N_images; k++) {
+		ret[k] = los_integral_star(img_stack, k, subpixel[k], Delta_EBV, N_regions, path) * path.ret_mult_factor;
+	}
+}
+
+// Same as los_integral, but stars whose surfaces are well fit by Gaussian mixtures (see TImgStack::build_gmm)
+// are integrated in closed form. The path is walked one region at a time, so that the result agrees with
+// lnp_los_extinction_local.
+void los_integral_gmm(TImgStack &img_stack, const double *const subpixel, double *const ret,
+                      const float *const Delta_EBV, unsigned int N_regions) {
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	
+	for(size_t k=0; k<img_stack.N_images; k++) {
+		ret[k] = los_integral_star(img_stack, k, subpixel[k], Delta_EBV, N_regions, path) * path.ret_mult_factor;
+	}
+}
+
+// Line integrals and summed ln(p) of the stars for K profiles at once, with the stars split in blocks of
+// LOS_INTEGRAL_STAR_BLOCK across N_star_threads threads. Each thread adds the ln(p) of its own stars to
+// partial sums, which are reduced at the end. The paths are walked by los_integral_star, so this works
+// with every storage of the image stack. Sets line_int[m*N_images + k] and lnp_stars[m].
+static void lnp_los_stars_parallel(TLOSMCMCParams &params, const float *const Delta_EBV, unsigned int N_regions,
+                                   unsigned int K, double *const line_int, double *const lnp_stars,
+                                   int N_star_threads) {
+	const TImgStack &img_stack = *(params.img_stack);
+	assert(img_stack.rect->N_bins[1] % N_regions == 0);
+	
+	const size_t N_images = img_stack.N_images;
+	const long N_blocks = (N_images + LOS_INTEGRAL_STAR_BLOCK - 1) / LOS_INTEGRAL_STAR_BLOCK;
+	
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	
+	// Partial sums of each thread, padded to separate cache lines
+	const size_t stride = K + 8;
+	std::vector<double> partial(N_star_threads * stride, 0.);
+	
+	#pragma omp parallel num_threads(N_star_threads)
+	{
+		double *my_partial = &(partial[omp_get_thread_num() * stride]);
+		double lnp_indiv;
+		size_t k_end;
+		
+		#pragma omp for schedule(static)
+		for(long b=0; b<N_blocks; b++) {
+			k_end = (b+1) * LOS_INTEGRAL_STAR_BLOCK;
+			if(k_end > N_images) { k_end = N_images; }
+			
+			for(size_t k=b*LOS_INTEGRAL_STAR_BLOCK; k<k_end; k++) {
+				for(unsigned int m=0; m<K; m++) {
+					line_int[m*N_images + k] = los_integral_star(img_stack, k, params.subpixel[k], Delta_EBV + m*(N_regions+1),
+					                                             N_regions, path) * path.ret_mult_factor;
+					
+					lnp_indiv = lnp_los_star(line_int[m*N_images + k], k, params);
+					if(!params.star_weight.empty()) { lnp_indiv *= params.star_weight[k]; }
+					my_partial[m] += lnp_indiv;
+				}
+			}
+		}
+	}
+	
+	for(unsigned int m=0; m<K; m++) {
+		lnp_stars[m] = 0.;
+		for(int t=0; t<N_star_threads; t++) { lnp_stars[m] += partial[t*stride + m]; }
+	}
+}
+
+// Version of lnp_los_extinction for local moves, such as those made by switch_adjacent_log_Delta_EBVs,
+// mix_log_Delta_EBVs and step_one_Delta_EBV. Y is a proposal for walker j, which is currently at X. Walkers
+// are numbered across the ensembles of a TParallelAffineSampler, so that walker j belongs to ensemble
+// j / local_size (see TLOSMCMCParams::set_local_size).
+//
+// The line integrals of the walker's current state are cached by distance region. Regions before the first
+// changed Delta E(B-V) are reused as they are. Regions after the last changed Delta E(B-V) are reused for each
+// star whose path re-joins the old one there, which is always the case when Deltas are swapped. The line
+// integrals of Y are stored in a pending slot, which replaces the walker's slot if los_local_update reports
+// that Y was accepted.
+double lnp_los_extinction_local(const double *const X, const double *const Y, unsigned int N, unsigned int j,
+                                TLOSMCMCParams& params) {
+	int thread_num = omp_get_thread_num();
+	if(j >= params.local_size * params.local_ensembles) { return lnp_los_extinction(Y, N, params); }
+	
+	const unsigned int ensemble = j / params.local_size;
+	j -= ensemble * params.local_size;
+	
+	unsigned int *slot = params.get_local_slot(ensemble);
+	double *key_Y = params.get_region_key(ensemble, slot[params.local_size]);
+	
+	float *Delta_EBV = params.get_Delta_EBV(thread_num);
+	double lnp = lnp_los_extinction_prior(Y, N, Delta_EBV, params);
+	if(is_neg_inf_replacement(lnp)) {
+		key_Y[0] = std::numeric_limits<double>::quiet_NaN();	// Nothing cached for this state
+		return neg_inf_replacement;
+	}
+	
+	const double *key_X = params.get_region_key(ensemble, slot[j]);
+	const float *part_X = params.get_region_int(ensemble, slot[j]);
+	float *part_Y = params.get_region_int(ensemble, slot[params.local_size]);
+	
+	const unsigned int N_regions = N - 1;
+	const size_t N_images = params.img_stack->N_images;
+	assert(N_regions == params.N_regions);
+	assert(params.img_stack->rect->N_bins[1] % N_regions == 0);
+	const int N_pix_per_bin = params.img_stack->rect->N_bins[1] / N_regions;
+	
+	// Range of Deltas that differ from the cached state. Index 0 shifts every region.
+	unsigned int i_begin = 0;
+	unsigned int i_end = 0;
+	bool cached = true;
+	for(unsigned int i=0; i<N; i++) {
+		if(!(key_X[i] == X[i])) {	// Also fails if the cache is empty (NaN)
+			cached = false;
+			break;
+		}
+	}
+	if(cached) {
+		i_begin = N;
+		for(unsigned int i=0; i<N; i++) {
+			if(Y[i] != X[i]) {
+				if(i_begin == N) { i_begin = i; }
+				i_end = i + 1;
+			}
+		}
+		if(i_begin == N) { i_begin = i_end = N; }
+	}
+	if(!cached || (i_begin == 0)) {
+		i_begin = 1;
+		i_end = N;
+	}
+	
+	const TLOSPath path(*(params.img_stack->rect), N_regions);
+	
+	std::vector<float> Delta_EBV_X(N, 0.);
+	for(unsigned int i=i_begin; i<i_end; i++) { Delta_EBV_X[i] = exp(X[i]); }
+	
+	double *line_int = params.get_line_int(thread_num);
+	uint32_t y_int, dy_int, rise_X, rise_Y;
+	float s, tmp_ret;
+	unsigned int i;
+	
+	for(size_t k=0; k<N_images; k++) {
+		s = params.subpixel[k];
+		y_int = path.y_begin(s, Delta_EBV);
+		tmp_ret = 0.;
+		
+		// Unchanged regions in front
+		for(i=1; i<i_begin; i++) {
+			y_int += N_pix_per_bin * path.dy(s, Delta_EBV[i]);
+			part_Y[(i-1)*N_images + k] = part_X[(i-1)*N_images + k];
+			tmp_ret += part_Y[(i-1)*N_images + k];
+		}
+		
+		// Changed regions
+		rise_X = 0;
+		rise_Y = 0;
+		for(; i<i_end; i++) {
+			dy_int = path.dy(s, Delta_EBV[i]);
+			rise_Y += N_pix_per_bin * dy_int;
+			if(cached) { rise_X += N_pix_per_bin * path.dy(s, Delta_EBV_X[i]); }
+			part_Y[(i-1)*N_images + k] = los_integral_region(*(params.img_stack), k, y_int, dy_int, (i-1)*N_pix_per_bin, N_pix_per_bin);
+			tmp_ret += part_Y[(i-1)*N_images + k];
+		}
+		
+		// Regions behind are unchanged if the path re-joins the cached one
+		if(cached && (rise_X == rise_Y)) {
+			for(; i<N; i++) {
+				part_Y[(i-1)*N_images + k] = part_X[(i-1)*N_images + k];
+				tmp_ret += part_Y[(i-1)*N_images + k];
+			}
+		} else {
+			for(; i<N; i++) {
+				dy_int = path.dy(s, Delta_EBV[i]);
+				part_Y[(i-1)*N_images + k] = los_integral_region(*(params.img_stack), k, y_int, dy_int, (i-1)*N_pix_per_bin, N_pix_per_bin);
+				tmp_ret += part_Y[(i-1)*N_images + k];
+			}
+		}
+		
+		line_int[k] = tmp_ret * path.ret_mult_factor;
+	}
+	
+	for(unsigned int i=0; i<N; i++) { key_Y[i] = Y[i]; }
+	
+	return lnp + lnp_los_line_int(line_int, params);
+}
+
+// If walker j accepted the proposal last scored by lnp_los_extinction_local, its cached line integrals
+// are swapped with the pending ones.
+void los_local_update(unsigned int j, bool accepted, TLOSMCMCParams& params) {
+	if(!accepted || (j >= params.local_size * params.local_ensembles)) { return; }
+	
+	const unsigned int ensemble = j / params.local_size;
+	j -= ensemble * params.local_size;
+	
+	unsigned int *slot = params.get_local_slot(ensemble);
+	unsigned int tmp = slot[j];
+	slot[j] = slot[params.local_size];
+	slot[params.local_size] = tmp;
+}
+
+// Cheap approximation of lnp_los_extinction, used to screen proposals by delayed acceptance. Only the
+// stars in params.surrogate_idx are integrated, and their ln(p) is scaled up by params.surrogate_scale.
+double lnp_los_extinction_surrogate(const double *const logEBV, unsigned int N, TLOSMCMCParams& params) {
+	int thread_num = omp_get_thread_num();
+	
+	float *Delta_EBV = params.get_Delta_EBV(thread_num);
+	double lnp = lnp_los_extinction_prior(logEBV, N, Delta_EBV, params);
+	if(is_neg_inf_replacement(lnp)) { return neg_inf_replacement; }
+	
+	const TImgStack &img_stack = *(params.img_stack);
+	const unsigned int N_regions = N - 1;
+	const TLOSPath path(*(img_stack.rect), N_regions);
+	
+	double lnp_indiv;
+	double lnp_stars = 0.;
+	size_t k;
+	
+	for(size_t n=0; n<params.surrogate_idx.size(); n++) {
+		k = params.surrogate_idx[n];
+		lnp_indiv = lnp_los_star(los_integral_star(img_stack, k, params.subpixel[k], Delta_EBV, N_regions, path) * path.ret_mult_factor,
+		                         k, params);
+		if(!params.star_weight.empty()) { lnp_indiv *= params.star_weight[k]; }
+		lnp_stars += lnp_indiv;
+	}
+	
+	return lnp + params.surrogate_scale * lnp_stars;
+}
+
+void gen_rand_los_extinction(double *const logEBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params) {
+	double EBV_ceil = params.img_stack->rect->max[0] / params.subpixel_max;
+	double mu = 1.5 * params.EBV_guess_max / params.subpixel_max / (double)N;
+	double EBV_sum = 0.;
+	
+	if((params.log_Delta_EBV_prior != NULL) && (gsl_rng_uniform(r) < 0.8)) {
+		for(size_t i=0; i<N; i++) {
+			logEBV[i] = params.log_Delta_EBV_prior[i] + gsl_ran_gaussian_ziggurat(r, params.sigma_log_Delta_EBV[i]);
+			EBV_sum += exp(logEBV[i]);
+		}
+	} else {
+		double log_scaling = gsl_ran_gaussian_ziggurat(r, 0.25);
+		for(size_t i=0; i<N; i++) {
+			logEBV[i] = log(mu * gsl_rng_uniform(r)) + log_scaling; //mu + gsl_ran_gaussian_ziggurat(r, 2.5);
+			EBV_sum += exp(logEBV[i]);
+		}
+		/*#pragma omp critical (cout)
 		{
 		std::cerr << EBV_sum << ": ";
 		for(size_t i=0; i<N; i++) {
@@ -1051,7 +2834,8 @@ double guess_EBV_max(TImgStack &img_stack) {
 	return max * img_stack.rect->dx[0] + img_stack.rect->min[0];
 }
 
-void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity) {
+// Short MCMC run, for the initial guess of the piecewise-linear profile
+void guess_EBV_profile_MCMC(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity) {
 	TNullLogger logger;
 	
 	unsigned int N_steps = options.steps / 8;
@@ -1075,6 +2859,10 @@ void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbos
 	sampler.set_sigma_min(0.001);
 	sampler.set_scale(1.05);
 	sampler.set_replacement_bandwidth(0.25);
+	params.set_batch_size(N_samplers*ndim);
+	sampler.set_batch_pdf(&lnp_los_extinction_batch);
+	params.set_local_size(N_samplers*ndim, N_runs);
+	sampler.set_local_pdf(&lnp_los_extinction_local, &los_local_update);
 	
 	sampler.step_MH(2*base_N_steps, true);
 	//sampler.step(int(N_steps*10./100.), true, 0., 0.);
@@ -1097,37 +2885,255 @@ void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbos
 	for(int k=0; k<sampler.get_N_samplers(); k++) {
 		std::cout << sampler.get_MH_bandwidth(k) << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
 	}
-	std::cout << ")" << std::endl;*/
-	sampler.step_MH(base_N_steps, true);
-	sampler.step_custom_reversible(base_N_steps, switch_step, true);
-	sampler.step_custom_reversible(base_N_steps, move_one_step, true);
-	sampler.step(base_N_steps, false, 0., 1., true, true);
+	std::cout << ")" << std::endl;*/
+	sampler.step_MH(base_N_steps, true);
+	sampler.step_custom_reversible(base_N_steps, switch_step, true);
+	sampler.step_custom_reversible(base_N_steps, move_one_step, true);
+	sampler.step(base_N_steps, false, 0., 1., true, true);
+	
+	/*std::cout << "scale: (";
+	for(int k=0; k<sampler.get_N_samplers(); k++) {
+		std::cout << sampler.get_MH_bandwidth(k) << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+	}*/
+	//sampler.tune_MH(8, 0.30);
+	/*std::cout << ") -> (";
+	for(int k=0; k<sampler.get_N_samplers(); k++) {
+		std::cout << sampler.get_MH_bandwidth(k) << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+	}
+	std::cout << ")" << std::endl;*/
+	sampler.step_MH(base_N_steps, true);
+	
+	if(verbosity >= 2) {
+		sampler.print_diagnostics();
+		std::cout << std::endl;
+	}
+	
+	//std::cout << std::endl;
+	
+	//if(verbosity >= 2) {
+	//	sampler.print_stats();
+	//	std::cout << std::endl << std::endl;
+	//}
+	
+	sampler.get_chain().get_best(params.EBV_prof_guess);
+}
+
+// Deterministic guess of the piecewise-linear profile, in log(Delta E(B-V)). The stacked surfaces are
+// searched for the non-decreasing path of greatest summed log density, by dynamic programming over the
+// E(B-V) pixel reached at each region boundary. Between boundaries, the path is linear, as in los_integral.
+// Returns false if no path fits on the image stack.
+bool guess_EBV_profile_DP(TLOSMCMCParams &params, double *const logEBV) {
+	TImgStack &img_stack = *(params.img_stack);
+	if(img_stack.N_images == 0) { return false; }
+	
+	const unsigned int N_regions = params.N_regions;
+	const int N_x = img_stack.rect->N_bins[1];
+	const int N_y = img_stack.rect->N_bins[0];
+	const int N_pix_per_bin = N_x / N_regions;
+	const double dx = img_stack.rect->dx[0];
+	const double y_0 = -img_stack.rect->min[0] / dx;
+	
+	// Rows that the path may occupy at the region boundaries. The top row keeps the
+	// total reddening within the limit imposed by lnp_los_extinction_prior.
+	int y_lo = (int)ceil(y_0);
+	if(y_lo < 0) { y_lo = 0; }
+	int y_hi = (int)floor(y_0 + ((double)N_y - 2. - y_0) / params.subpixel_max) - 1;
+	if(y_hi > N_y - 2) { y_hi = N_y - 2; }
+	if(y_hi < y_lo) { return false; }
+	const int N_rows = y_hi - y_lo + 1;
+	
+	// Log of the stacked surfaces, with a floor to keep empty pixels finite
+	cv::Mat stack;
+	img_stack.stack(stack);
+	double stack_max;
+	cv::minMaxLoc(stack, NULL, &stack_max);
+	if(!(stack_max > 0.)) { return false; }
+	const double floor_val = 1.e-5 * stack_max;
+	
+	std::vector<double> score((size_t)N_y * N_x);
+	for(int y=0; y<N_y; y++) {
+		for(int x=0; x<N_x; x++) {
+			score[(size_t)y*N_x + x] = log(stack.at<float>(y, x) + floor_val);
+		}
+	}
+	
+	// best[r]: score of the best path ending on row y_lo+r at the current boundary
+	std::vector<double> best(N_rows, 0.);
+	std::vector<double> best_next(N_rows);
+	std::vector<int> back((size_t)(N_regions+1) * N_rows, 0);
+	
+	double seg, y, diff, tmp;
+	int x_0, y_floor;
+	
+	for(unsigned int i=1; i<N_regions+1; i++) {
+		x_0 = (i-1) * N_pix_per_bin;
+		
+		for(int rb=0; rb<N_rows; rb++) {
+			best_next[rb] = neg_inf_replacement;
+			
+			for(int ra=0; ra<=rb; ra++) {
+				seg = 0.;
+				for(int j=0; j<N_pix_per_bin; j++) {
+					y = (double)(y_lo + ra) + (double)(rb - ra) * (double)j / (double)N_pix_per_bin;
+					y_floor = (int)y;
+					diff = y - (double)y_floor;
+					seg += (1. - diff) * score[(size_t)y_floor*N_x + x_0 + j]
+					       + diff * score[(size_t)(y_floor+1)*N_x + x_0 + j];
+				}
+				
+				tmp = best[ra] + seg;
+				if(tmp > best_next[rb]) {
+					best_next[rb] = tmp;
+					back[(size_t)i*N_rows + rb] = ra;
+				}
+			}
+		}
+		
+		best.swap(best_next);
+	}
+	
+	// Trace the best path back from the far end
+	std::vector<int> row(N_regions+1);
+	row[N_regions] = std::max_element(best.begin(), best.end()) - best.begin();
+	for(unsigned int i=N_regions; i>=1; i--) {
+		row[i-1] = back[(size_t)i*N_rows + row[i]];
+	}
+	
+	// Regions in which the path stays on one row get a small increase, since Delta E(B-V) is
+	// sampled in log space. The scale is set by the prior on each region, where there is one.
+	double Delta_EBV, Delta_EBV_floor;
+	for(unsigned int i=0; i<N_regions+1; i++) {
+		if(i == 0) {
+			Delta_EBV = ((double)(y_lo + row[0]) - y_0) * dx;
+		} else {
+			Delta_EBV = (double)(row[i] - row[i-1]) * dx;
+		}
+		
+		if(params.log_Delta_EBV_prior != NULL) {
+			Delta_EBV_floor = exp(params.log_Delta_EBV_prior[i]);
+		} else {
+			Delta_EBV_floor = exp(-4.);
+		}
+		if(Delta_EBV_floor > 0.5 * dx) { Delta_EBV_floor = 0.5 * dx; }
+		if(Delta_EBV < Delta_EBV_floor) { Delta_EBV = Delta_EBV_floor; }
+		
+		logEBV[i] = log(Delta_EBV);
+	}
+	
+	return true;
+}
+
+// Maximize lnp_los_extinction by BFGS, starting from logEBV, which is overwritten by the result.
+// The line search backtracks until the step gives a sufficient increase, so steps that run off the
+// image stack are simply shortened. Returns the final value of lnp_los_extinction.
+double polish_EBV_profile(TLOSMCMCParams &params, double *const logEBV, unsigned int max_iter) {
+	const unsigned int N = params.N_regions + 1;
+	
+	std::vector<double> g(N), x_new(N), g_new(N), p(N), s(N), y(N), Hy(N);
+	std::vector<double> H(N*N, 0.);	// Approximate inverse Hessian of -lnp
+	for(unsigned int i=0; i<N; i++) { H[N*i + i] = 1.; }
+	
+	double f = lnp_los_extinction_grad(logEBV, N, g.data(), params);
+	if(is_neg_inf_replacement(f)) { return f; }
+	
+	double f_new, slope, alpha, p_max, sy, yHy, rho;
+	bool found;
+	
+	for(unsigned int iter=0; iter<max_iter; iter++) {
+		// Ascent direction
+		slope = 0.;
+		p_max = 0.;
+		for(unsigned int i=0; i<N; i++) {
+			p[i] = 0.;
+			for(unsigned int j=0; j<N; j++) { p[i] += H[N*i + j] * g[j]; }
+			slope += p[i] * g[i];
+			if(fabs(p[i]) > p_max) { p_max = fabs(p[i]); }
+		}
+		
+		if(slope < 1.e-10) { break; }
+		
+		// Backtracking line search, with steps of at most one e-fold in any Delta E(B-V)
+		alpha = (p_max > 1.) ? 1. / p_max : 1.;
+		found = false;
+		for(int n=0; n<40; n++, alpha*=0.5) {
+			for(unsigned int i=0; i<N; i++) { x_new[i] = logEBV[i] + alpha * p[i]; }
+			f_new = lnp_los_extinction_grad(x_new.data(), N, g_new.data(), params);
+			if(!is_neg_inf_replacement(f_new) && (f_new >= f + 1.e-4 * alpha * slope)) {
+				found = true;
+				break;
+			}
+		}
+		if(!found) { break; }
+		
+		// BFGS update of the inverse Hessian
+		sy = 0.;
+		for(unsigned int i=0; i<N; i++) {
+			s[i] = x_new[i] - logEBV[i];
+			y[i] = g[i] - g_new[i];
+			sy += s[i] * y[i];
+		}
+		
+		if(sy > 1.e-12) {
+			if(iter == 0) {
+				// Rescale the initial guess of the inverse Hessian to the observed curvature
+				double yy = 0.;
+				for(unsigned int i=0; i<N; i++) { yy += y[i] * y[i]; }
+				for(unsigned int i=0; i<N; i++) { H[N*i + i] = sy / yy; }
+			}
+			
+			rho = 1. / sy;
+			yHy = 0.;
+			for(unsigned int i=0; i<N; i++) {
+				Hy[i] = 0.;
+				for(unsigned int j=0; j<N; j++) { Hy[i] += H[N*i + j] * y[j]; }
+				yHy += y[i] * Hy[i];
+			}
+			for(unsigned int i=0; i<N; i++) {
+				for(unsigned int j=0; j<N; j++) {
+					H[N*i + j] += rho * ((1. + rho * yHy) * s[i] * s[j] - Hy[i] * s[j] - s[i] * Hy[j]);
+				}
+			}
+		}
+		
+		for(unsigned int i=0; i<N; i++) {
+			logEBV[i] = x_new[i];
+			g[i] = g_new[i];
+		}
+		
+		if(f_new - f < 1.e-6) {
+			f = f_new;
+			break;
+		}
+		f = f_new;
+	}
 	
-	/*std::cout << "scale: (";
-	for(int k=0; k<sampler.get_N_samplers(); k++) {
-		std::cout << sampler.get_MH_bandwidth(k) << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-	}*/
-	//sampler.tune_MH(8, 0.30);
-	/*std::cout << ") -> (";
-	for(int k=0; k<sampler.get_N_samplers(); k++) {
-		std::cout << sampler.get_MH_bandwidth(k) << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-	}
-	std::cout << ")" << std::endl;*/
-	sampler.step_MH(base_N_steps, true);
+	return f;
+}
+
+// Initial guess of the piecewise-linear profile, stored in params.EBV_prof_guess. The dynamic-programming
+// guess, polished by BFGS, is deterministic and cheap. A short MCMC run is used only if it fails.
+void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity) {
+	std::vector<double> logEBV(params.N_regions+1);
 	
-	if(verbosity >= 2) {
-		sampler.print_diagnostics();
-		std::cout << std::endl;
+	if(guess_EBV_profile_DP(params, logEBV.data())) {
+		double lnp = polish_EBV_profile(params, logEBV.data(), 200);
+		
+		if(!is_neg_inf_replacement(lnp)) {
+			params.EBV_prof_guess = logEBV;
+			
+			if(verbosity >= 2) {
+				std::cout << "ln(p) of guess = " << lnp << std::endl;
+			}
+			
+			return;
+		}
 	}
 	
-	//std::cout << std::endl;
-	
-	//if(verbosity >= 2) {
-	//	sampler.print_stats();
-	//	std::cout << std::endl << std::endl;
-	//}
+	if(verbosity >= 1) {
+		std::cerr << "Deterministic guess failed. Falling back on MCMC." << std::endl;
+	}
 	
-	sampler.get_chain().get_best(params.EBV_prof_guess);
+	guess_EBV_profile_MCMC(options, params, verbosity);
 }
 
 
@@ -1313,58 +3319,694 @@ void gen_rand_los_extinction_from_guess(double *const logEBV, unsigned int N, gs
 	//}
 	//}
 	
-	const double sigma = 0.05;
+	const double sigma = 0.05;
+	
+	if(params.guess_cov == NULL) {
+		for(size_t i=0; i<N; i++) {
+			logEBV[i] = params.EBV_prof_guess[i] + gsl_ran_gaussian_ziggurat(r, sigma);
+			EBV_sum += exp(logEBV[i]);
+		}
+	} else {
+		// Redistribute reddening among distance bins
+		draw_from_cov(logEBV, params.guess_sqrt_cov, N, r);
+		
+		/*#pragma omp critical (cout)
+		{
+		for(int i=0; i<N; i++) {
+			std::cout << std::setw(6) << std::setprecision(2) << logEBV[i] << " ";
+		}
+		std::cout << std::endl;
+		}*/
+		
+		for(size_t i=0; i<N; i++) {
+			logEBV[i] *= sigma;
+			logEBV[i] += params.EBV_prof_guess[i];
+			EBV_sum += exp(logEBV[i]);
+			guess_sum += exp(params.EBV_prof_guess[i]);
+		}
+		
+		// Change in reddening at infinity
+		//double norm = exp(gsl_ran_gaussian_ziggurat(r, 0.05));
+		//factor = log(norm * guess_sum / EBV_sum);
+		//for(size_t i=0; i<N; i++) { logEBV[i] += factor; }
+	}
+	
+	// Switch adjacent reddenings
+	/*int n_switches = sl_rng_uniform_int(r, 2);
+	size_t k;
+	double tmp_log_EBV;
+	//int max_dist = std::min((int)(N-1)/2, 5);
+	for(int i=0; i<n_switches; i++) {
+		int dist = 1; //gsl_rng_uniform_int(r, max_dist+1);
+		k = gsl_rng_uniform_int(r, N-dist);
+		tmp_log_EBV = logEBV[k];
+		logEBV[k] = logEBV[k+dist];
+		logEBV[k+dist] = tmp_log_EBV;
+	}*/
+	
+	// Ensure that reddening is not more than allowed
+	if(EBV_sum >= 0.95 * EBV_ceil) {
+		factor = log(0.95 * EBV_ceil / EBV_sum);
+		for(size_t i=0; i<N; i++) {
+			logEBV[i] += factor;
+		}
+	}
+}
+
+// Draw a starting state from params.init_prof, left by a fit with fewer regions (see refine_los_extinction)
+// or by a neighbouring pixel (see load_los_warm_start), scattered by the guess covariance, as in
+// gen_rand_los_extinction_from_guess.
+void gen_rand_los_extinction_from_prof(double *const logEBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params) {
+	size_t N_prof = params.init_cum_weight.size();
+	if(N_prof == 0) {
+		gen_rand_los_extinction_from_guess(logEBV, N, r, params);
+		return;
+	}
+	assert(params.init_prof.size() == N_prof * N);
+	
+	// Choose a profile, with probability proportional to its weight in the coarse chain
+	double u = gsl_rng_uniform(r) * params.init_cum_weight[N_prof-1];
+	size_t k = std::upper_bound(params.init_cum_weight.begin(), params.init_cum_weight.end(), u)
+	           - params.init_cum_weight.begin();
+	if(k >= N_prof) { k = N_prof - 1; }
+	const double *const prof = &(params.init_prof[k*N]);
+	
+	const double sigma = 0.05;
+	double EBV_ceil = params.img_stack->rect->max[0];
+	double EBV_sum = 0.;
+	
+	if(params.guess_sqrt_cov != NULL) {
+		draw_from_cov(logEBV, params.guess_sqrt_cov, N, r);
+	} else {
+		for(size_t i=0; i<N; i++) { logEBV[i] = gsl_ran_gaussian_ziggurat(r, 1.); }
+	}
+	
+	for(size_t i=0; i<N; i++) {
+		logEBV[i] = prof[i] + sigma * logEBV[i];
+		EBV_sum += exp(logEBV[i]);
+	}
+	
+	// Ensure that reddening is not more than allowed
+	if(EBV_sum >= 0.95 * EBV_ceil) {
+		double factor = log(0.95 * EBV_ceil / EBV_sum);
+		for(size_t i=0; i<N; i++) {
+			logEBV[i] += factor;
+		}
+	}
+}
+
+// Split each point of a chain with N_coarse regions into a profile with N_fine regions, by dividing
+// the reddening of each region evenly among the regions it is split into. The profiles are appended
+// to prof, and their cumulative weights to cum_weight.
+static void split_los_chain(const TChain &chain, unsigned int N_coarse, unsigned int N_fine,
+                            std::vector<double> &prof, std::vector<double> &cum_weight) {
+	assert(N_fine % N_coarse == 0);
+	const unsigned int m = N_fine / N_coarse;
+	const double log_m = log((double)m);
+	
+	prof.clear();
+	cum_weight.clear();
+	prof.reserve((size_t)chain.get_length() * (N_fine+1));
+	cum_weight.reserve(chain.get_length());
+	
+	double w_sum = 0.;
+	const double *x;
+	
+	for(unsigned int n=0; n<chain.get_length(); n++) {
+		x = chain.get_element(n);
+		
+		prof.push_back(x[0]);
+		for(unsigned int i=1; i<N_fine+1; i++) {
+			prof.push_back(x[(i-1)/m + 1] - log_m);
+		}
+		
+		w_sum += chain.get_w(n);
+		cum_weight.push_back(w_sum);
+	}
+}
+
+// Start the piecewise-linear fit from the l.o.s. samples stored in group_name of fname, normally
+// those of a neighbouring pixel. The samples are left in params.init_prof, the best one becomes
+// the guess, and the guess covariance is set to the correlations between the samples. The tuned
+// step sizes are also copied, if stored. Returns false if there is no fit with the same number of
+// regions and the same distance range.
+bool load_los_warm_start(const std::string &fname, const std::string &group_name, TLOSMCMCParams &params) {
+	H5::H5File *file = H5Utils::openFile(fname, H5Utils::READ);
+	if(file == NULL) { return false; }
+	
+	std::stringstream dset_name;
+	dset_name << "/" << group_name << "/los";
+	
+	H5::DataSet *dataset = NULL;
+	try {
+		dataset = H5Utils::openDataSet(file, dset_name.str());
+	} catch(H5::Exception &err) {
+		dataset = NULL;
+	}
+	if(dataset == NULL) {
+		delete file;
+		return false;
+	}
+	
+	const unsigned int N = params.N_regions + 1;
+	bool usable = true;
+	
+	// Layout written by TChainWriteBuffer: {G-R, best, samples...} x {ln(p), x...}
+	H5::DataSpace dspace = dataset->getSpace();
+	hsize_t dim[3];
+	if((dspace.getSimpleExtentNdims() != 3) || (dspace.getSimpleExtentDims(&(dim[0])) != 3)) {
+		usable = false;
+	} else if((dim[0] < 1) || (dim[1] < 3) || (dim[2] != N+1)) {
+		usable = false;
+	}
+	
+	// Distance range must match
+	double DM_range[2];
+	const char *DM_att_name[2] = {"DM_min", "DM_max"};
+	for(int i=0; (i<2) && usable; i++) {
+		try {
+			H5::Attribute att = dataset->openAttribute(DM_att_name[i]);
+			att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(&(DM_range[i])));
+		} catch(H5::AttributeIException &err) {
+			usable = false;
+		}
+	}
+	if(usable) {
+		if((fabs(DM_range[0] - params.img_stack->rect->min[1]) > 1.e-5)
+		   || (fabs(DM_range[1] - params.img_stack->rect->max[1]) > 1.e-5)) {
+			usable = false;
+		}
+	}
+	
+	float *buf = NULL;
+	if(usable) {
+		buf = new float[dim[0] * dim[1] * dim[2]];
+		dataset->read(buf, H5::PredType::NATIVE_FLOAT);
+	}
+	
+	// Tuned step sizes are optional
+	double scale = -1.;
+	double MH_bandwidth = -1.;
+	if(usable) {
+		try {
+			H5::Attribute att = dataset->openAttribute("stretch_scale");
+			att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(&scale));
+			att = dataset->openAttribute("MH_bandwidth");
+			att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(&MH_bandwidth));
+		} catch(H5::AttributeIException &err) {
+			scale = -1.;
+			MH_bandwidth = -1.;
+		}
+	}
+	
+	delete dataset;
+	delete file;
+	
+	if(!usable) { return false; }
+	
+	// Copy the samples of the first chain, with equal weights
+	const size_t N_samples = dim[1] - 2;
+	params.init_prof.resize(N_samples * N);
+	params.init_cum_weight.resize(N_samples);
+	
+	for(size_t n=0; n<N_samples; n++) {
+		for(unsigned int i=0; i<N; i++) {
+			params.init_prof[n*N + i] = buf[(n+2)*dim[2] + i + 1];
+		}
+		params.init_cum_weight[n] = (double)(n+1);
+	}
+	
+	params.EBV_prof_guess.resize(N);
+	for(unsigned int i=0; i<N; i++) { params.EBV_prof_guess[i] = buf[dim[2] + i + 1]; }
+	
+	delete[] buf;
+	
+	// Correlations between the samples
+	std::vector<double> mean(N, 0.);
+	for(size_t n=0; n<N_samples; n++) {
+		for(unsigned int i=0; i<N; i++) { mean[i] += params.init_prof[n*N + i]; }
+	}
+	for(unsigned int i=0; i<N; i++) { mean[i] /= (double)N_samples; }
+	
+	std::vector<double> cov(N*N, 0.);
+	for(size_t n=0; n<N_samples; n++) {
+		const double *const x = &(params.init_prof[n*N]);
+		for(unsigned int i=0; i<N; i++) {
+			for(unsigned int j=0; j<N; j++) {
+				cov[N*i + j] += (x[i] - mean[i]) * (x[j] - mean[j]);
+			}
+		}
+	}
+	
+	if(params.guess_cov == NULL) { params.guess_cov = gsl_matrix_alloc(N, N); }
+	if(params.guess_sqrt_cov == NULL) { params.guess_sqrt_cov = gsl_matrix_alloc(N, N); }
+	
+	double norm;
+	for(unsigned int i=0; i<N; i++) {
+		for(unsigned int j=0; j<N; j++) {
+			norm = sqrt(cov[N*i + i] * cov[N*j + j]);
+			if(i == j) {
+				gsl_matrix_set(params.guess_cov, i, j, 1.);
+			} else if(norm > 0.) {
+				gsl_matrix_set(params.guess_cov, i, j, 0.95 * cov[N*i + j] / norm);	// Shrunk, to stay positive definite
+			} else {
+				gsl_matrix_set(params.guess_cov, i, j, 0.);
+			}
+		}
+	}
+	
+	sqrt_matrix(params.guess_cov, params.guess_sqrt_cov);
+	
+	params.init_scale = scale;
+	params.init_MH_bandwidth = MH_bandwidth;
+	
+	return true;
+}
+
+// Read the final state of the samplers of the piecewise-linear fit stored in group_name of fname, along with
+// its samples, so that its chains can be extended. The samples are also left in params.init_prof, from which
+// the walkers are drawn before being put back in place. Returns false if no state is stored, or if it has a
+// different number of runs, walkers or regions, or a different distance range, from the current fit.
+bool load_los_ensemble(const std::string &fname, const std::string &group_name, const TMCMCOptions &options,
+                       TLOSMCMCParams &params, TLOSEnsembleState &state) {
+	H5::H5File *file = H5Utils::openFile(fname, H5Utils::READ);
+	if(file == NULL) { return false; }
+	
+	const unsigned int ndim = params.N_regions + 1;
+	const unsigned int N_runs = options.N_runs;
+	const unsigned int L = options.samplers * ndim;
+	
+	std::stringstream los_name, ens_name;
+	los_name << "/" << group_name << "/los";
+	ens_name << "/" << group_name << "/los_ensemble";
+	
+	H5::DataSet *los_dset = NULL;
+	H5::DataSet *walker_dset = NULL;
+	H5::DataSet *rng_dset = NULL;
+	H5::DataSet *stats_dset = NULL;
+	try {
+		los_dset = H5Utils::openDataSet(file, los_name.str());
+		walker_dset = H5Utils::openDataSet(file, ens_name.str() + "/walkers");
+		rng_dset = H5Utils::openDataSet(file, ens_name.str() + "/rng_state");
+		stats_dset = H5Utils::openDataSet(file, ens_name.str() + "/transf_stats");
+	} catch(H5::Exception &err) { }
+	
+	bool usable = (los_dset != NULL) && (walker_dset != NULL) && (rng_dset != NULL) && (stats_dset != NULL);
+	
+	// Shapes must match the current fit
+	hsize_t los_dim[3], walker_dim[3], rng_dim[2], stats_dim[2];
+	if(usable) {
+		H5::DataSpace los_dspace = los_dset->getSpace();
+		H5::DataSpace walker_dspace = walker_dset->getSpace();
+		H5::DataSpace rng_dspace = rng_dset->getSpace();
+		H5::DataSpace stats_dspace = stats_dset->getSpace();
+		usable = (los_dspace.getSimpleExtentNdims() == 3) && (walker_dspace.getSimpleExtentNdims() == 3)
+		         && (rng_dspace.getSimpleExtentNdims() == 2) && (stats_dspace.getSimpleExtentNdims() == 2);
+		if(usable) {
+			los_dspace.getSimpleExtentDims(&(los_dim[0]));
+			walker_dspace.getSimpleExtentDims(&(walker_dim[0]));
+			rng_dspace.getSimpleExtentDims(&(rng_dim[0]));
+			stats_dspace.getSimpleExtentDims(&(stats_dim[0]));
+			usable = (los_dim[0] >= 1) && (los_dim[1] >= 3) && (los_dim[2] == ndim+1)
+			         && (walker_dim[0] == N_runs) && (walker_dim[1] == L) && (walker_dim[2] == ndim+1)
+			         && (rng_dim[0] == N_runs) && (stats_dim[0] == N_runs) && (stats_dim[1] == 1 + ndim + ndim*ndim);
+		}
+	}
+	
+	// Distance range must match
+	double DM_range[2];
+	const char *DM_att_name[2] = {"DM_min", "DM_max"};
+	for(int i=0; (i<2) && usable; i++) {
+		try {
+			H5::Attribute att = los_dset->openAttribute(DM_att_name[i]);
+			att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(&(DM_range[i])));
+		} catch(H5::AttributeIException &err) {
+			usable = false;
+		}
+	}
+	if(usable) {
+		if((fabs(DM_range[0] - params.img_stack->rect->min[1]) > 1.e-5)
+		   || (fabs(DM_range[1] - params.img_stack->rect->max[1]) > 1.e-5)) {
+			usable = false;
+		}
+	}
+	
+	// Walkers, with their tuned step sizes
+	std::vector<double> *tuned[4] = {&(state.scale), &(state.MH_bandwidth), &(state.HMC_bandwidth), &(state.slice_width)};
+	const char *tuned_name[4] = {"stretch_scale", "MH_bandwidth", "HMC_bandwidth", "slice_width"};
+	if(usable) {
+		state.N_runs = N_runs;
+		state.L = L;
+		state.ndim = ndim;
+		
+		state.walker.resize(N_runs * L * (ndim+1));
+		walker_dset->read(state.walker.data(), H5::PredType::NATIVE_DOUBLE);
+		
+		try {
+			for(int i=0; i<4; i++) {
+				tuned[i]->resize(N_runs);
+				H5::Attribute att = walker_dset->openAttribute(tuned_name[i]);
+				att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(tuned[i]->data()));
+			}
+			H5::Attribute att = walker_dset->openAttribute("N_steps");
+			att.read(H5::PredType::NATIVE_UINT64, reinterpret_cast<void*>(&(state.N_steps)));
+		} catch(H5::AttributeIException &err) {
+			usable = false;
+		}
+	}
+	
+	// Random number generator states, and statistics of the chains
+	if(usable) {
+		state.rng_size = rng_dim[1];
+		state.rng_state.resize(N_runs * state.rng_size);
+		rng_dset->read(state.rng_state.data(), H5::PredType::NATIVE_UCHAR);
+		
+		state.transf_stats.resize(N_runs * stats_dim[1]);
+		stats_dset->read(state.transf_stats.data(), H5::PredType::NATIVE_DOUBLE);
+	}
+	
+	// Best point and samples of the first chain, skipping the G-R diagnostic
+	if(usable) {
+		float *buf = new float[los_dim[0] * los_dim[1] * los_dim[2]];
+		los_dset->read(buf, H5::PredType::NATIVE_FLOAT);
+		
+		state.sample.resize((los_dim[1]-1) * (ndim+1));
+		for(size_t n=0; n<state.sample.size(); n++) { state.sample[n] = buf[los_dim[2] + n]; }
+		
+		delete[] buf;
+	}
+	
+	if(los_dset != NULL) { delete los_dset; }
+	if(walker_dset != NULL) { delete walker_dset; }
+	if(rng_dset != NULL) { delete rng_dset; }
+	if(stats_dset != NULL) { delete stats_dset; }
+	delete file;
+	
+	if(!usable) { return false; }
+	
+	// Samples to draw the walkers from, with equal weights, and the best point as the guess
+	const size_t N_samples = los_dim[1] - 2;
+	params.init_prof.resize(N_samples * ndim);
+	params.init_cum_weight.resize(N_samples);
+	
+	for(size_t n=0; n<N_samples; n++) {
+		for(unsigned int i=0; i<ndim; i++) {
+			params.init_prof[n*ndim + i] = state.sample[(n+1)*(ndim+1) + i + 1];
+		}
+		params.init_cum_weight[n] = (double)(n+1);
+	}
+	
+	params.EBV_prof_guess.resize(ndim);
+	for(unsigned int i=0; i<ndim; i++) { params.EBV_prof_guess[i] = state.sample[i + 1]; }
+	
+	return true;
+}
+
+// Statistics of the stored chain of run k, in the space of TLOSTransform
+void TLOSEnsembleState::get_transf_stats(unsigned int k, TStats &stats) const {
+	assert((k < N_runs) && (stats.get_dim() == ndim));
+	const double *s = &(transf_stats[k * (1 + ndim + ndim*ndim)]);
+	stats.set_sums(s + 1, s + 1 + ndim, (uint64_t)(s[0]));
+}
+
+double TLOSEnsembleState::get_total_weight() const {
+	double w = 0.;
+	for(unsigned int k=0; k<N_runs; k++) { w += transf_stats[k * (1 + ndim + ndim*ndim)]; }
+	return w;
+}
+
+// Burn in on profiles with options.N_regions_coarse regions, then on successively finer ones,
+// each started from the chain of the last. The final chain is split to params.N_regions regions,
+// and left in params.init_prof, for gen_rand_los_extinction_from_prof. The priors of each
+// stage are found by merging those of params.
+void refine_los_extinction(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity) {
+	const unsigned int N_fine = params.N_regions;
+	const unsigned int N_coarse = options.N_regions_coarse;
+	
+	params.init_prof.clear();
+	params.init_cum_weight.clear();
+	
+	if((N_coarse == 0) || (N_coarse >= N_fine) || (N_fine % N_coarse != 0)) {
+		if((N_coarse != 0) && (verbosity >= 1)) {
+			std::cerr << "# of coarse regions (" << N_coarse << ") must divide # of regions ("
+			          << N_fine << "). Skipping coarse burn-in." << std::endl;
+		}
+		return;
+	}
+	
+	// Stage parameters share the stellar evidences of params
+	std::vector<double> lnZ(params.ln_p0_over_Z.size());
+	for(size_t k=0; k<lnZ.size(); k++) { lnZ[k] = params.lnp0 - params.ln_p0_over_Z[k]; }
+	
+	TNullLogger logger;
+	
+	unsigned int N_samplers = options.samplers;
+	unsigned int base_N_steps = ceil((double)options.steps * 1./20.);
+	
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::pdf_t f_pdf = &lnp_los_extinction;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_los_extinction_from_prof;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t switch_step = &switch_adjacent_log_Delta_EBVs;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t mix_step = &mix_log_Delta_EBVs;
+	TAffineSampler<TLOSMCMCParams, TNullLogger>::reversible_step_t move_one_step = &step_one_Delta_EBV;
+	
+	std::vector<double> prof, cum_weight;
+	unsigned int N_next, m, group;
+	double Delta_EBV_sum, sigma_sum;
+	
+	for(unsigned int N=N_coarse; N<N_fine; N=N_next) {
+		// Split by the smallest factor that leads towards N_fine
+		for(m=2; (N_fine / N) % m != 0; m++) {}
+		N_next = N * m;
+		group = N_fine / N;
+		
+		if(verbosity >= 1) {
+			std::cout << "# Coarse burn-in (" << N << " regions) ..." << std::endl;
+		}
+		
+		TLOSMCMCParams stage(params.img_stack, lnZ, params.p0, params.N_runs, params.N_threads, N, params.EBV_max);
+		stage.set_subpixel_mask(params.subpixel);
+		stage.star_weight = params.star_weight;
+		stage.N_star_threads = params.N_star_threads;
+		stage.gen_guess_covariance(1.);
+		
+		// Merge the guess and the priors of groups of regions
+		stage.EBV_prof_guess.resize(N+1);
+		stage.EBV_prof_guess[0] = params.EBV_prof_guess[0];
+		for(unsigned int i=1; i<N+1; i++) {
+			Delta_EBV_sum = 0.;
+			for(unsigned int j=0; j<group; j++) {
+				Delta_EBV_sum += exp(params.EBV_prof_guess[(i-1)*group + j + 1]);
+			}
+			stage.EBV_prof_guess[i] = log(Delta_EBV_sum);
+		}
+		
+		if(params.log_Delta_EBV_prior != NULL) {
+			stage.Delta_EBV_prior = new double[N+1];
+			stage.log_Delta_EBV_prior = new double[N+1];
+			stage.sigma_log_Delta_EBV = new double[N+1];
+			stage.alpha_skew = params.alpha_skew;
+			
+			stage.log_Delta_EBV_prior[0] = params.log_Delta_EBV_prior[0];
+			stage.sigma_log_Delta_EBV[0] = params.sigma_log_Delta_EBV[0];
+			for(unsigned int i=1; i<N+1; i++) {
+				Delta_EBV_sum = 0.;
+				sigma_sum = 0.;
+				for(unsigned int j=0; j<group; j++) {
+					Delta_EBV_sum += exp(params.log_Delta_EBV_prior[(i-1)*group + j + 1]);
+					sigma_sum += params.sigma_log_Delta_EBV[(i-1)*group + j + 1];
+				}
+				stage.log_Delta_EBV_prior[i] = log(Delta_EBV_sum);
+				stage.sigma_log_Delta_EBV[i] = sigma_sum / (double)group;
+			}
+			for(unsigned int i=0; i<N+1; i++) {
+				stage.Delta_EBV_prior[i] = exp(stage.log_Delta_EBV_prior[i]);
+			}
+		}
+		
+		// Start from the last stage, if there was one
+		stage.init_prof.swap(prof);
+		stage.init_cum_weight.swap(cum_weight);
+		
+		unsigned int ndim = N + 1;
+		TParallelAffineSampler<TLOSMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, stage, logger, params.N_runs);
+		stage.set_batch_size(N_samplers*ndim);
+		sampler.set_batch_pdf(&lnp_los_extinction_batch);
+		stage.set_local_size(N_samplers*ndim, params.N_runs);
+		sampler.set_local_pdf(&lnp_los_extinction_local, &los_local_update);
+		
+		sampler.set_sigma_min(1.e-5);
+		sampler.set_scale(1.1);
+		sampler.set_replacement_bandwidth(0.25);
+		sampler.set_MH_bandwidth(0.15);
+		
+		sampler.tune_MH(8, 0.25);
+		sampler.step_MH(base_N_steps, false);
+		sampler.tune_stretch(5, 0.30);
+		sampler.step(2*base_N_steps, false, 0., options.p_replacement);
+		sampler.step_custom_reversible(base_N_steps, switch_step, false);
+		sampler.step_custom_reversible(base_N_steps, mix_step, false);
+		sampler.step_custom_reversible(base_N_steps, move_one_step, false);
+		
+		// Record the end of the stage, to start the next one from
+		sampler.clear();
+		sampler.step(base_N_steps, true, 0., options.p_replacement);
+		sampler.step_custom_reversible(base_N_steps, move_one_step, true);
+		
+		if(verbosity >= 2) {
+			sampler.print_diagnostics();
+			std::cout << std::endl;
+		}
+		
+		split_los_chain(sampler.get_chain(), N, N_next, prof, cum_weight);
+	}
+	
+	params.init_prof.swap(prof);
+	params.init_cum_weight.swap(cum_weight);
+}
+
+// Replace the stars of params by a weighted coreset, chosen by sensitivity sampling. Profiles are drawn
+// around the guess, and the sensitivity of each star is the largest share it takes of the change in
+// ln(p) from the guess, over the probe profiles. N_core stars are drawn with replacement in proportion
+// to their sensitivity (plus a uniform floor), and given weights that keep the sum over the coreset an
+// unbiased estimate of the full ln(p). The error is checked on a second, independent set of probes,
+// and the coreset is doubled in size until it is within max_lnL_err. Returns the number of stars kept.
+unsigned int select_los_coreset(TMCMCOptions &options, TLOSMCMCParams &params, unsigned int N_core,
+                                double max_lnL_err, int verbosity) {
+	assert(params.img_stack == params.img_stack_full);
+	
+	const size_t N_stars = params.img_stack->N_images;
+	const unsigned int N = params.N_regions + 1;
+	if((N_core == 0) || (N_stars <= N_core)) { return N_stars; }
+	
+	if(verbosity >= 1) {
+		std::cout << "# Selecting coreset of " << N_stars << " stars ..." << std::endl;
+	}
+	
+	guess_EBV_profile(options, params, 0);
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	
+	// Change in ln(p) of each star from the guess, for sensitivity probes (j < LOS_CORESET_PROBES)
+	// and validation probes (j >= LOS_CORESET_PROBES)
+	const unsigned int N_probes = 2 * LOS_CORESET_PROBES;
+	std::vector<double> dlnp(N_probes * N_stars);
+	std::vector<double> lnp_guess(N_stars);
+	std::vector<double> logEBV(N);
+	float *Delta_EBV = params.get_Delta_EBV(0);
+	double *line_int = params.get_line_int(0);
+	double *d;
+	bool valid;
+	
+	for(unsigned int j=0; j<=N_probes; j++) {
+		valid = false;
+		for(unsigned int attempt=0; attempt<100; attempt++) {
+			for(unsigned int i=0; i<N; i++) {
+				logEBV[i] = params.EBV_prof_guess[i];
+				if(j != 0) { logEBV[i] += gsl_ran_gaussian_ziggurat(r, LOS_CORESET_PROBE_SIGMA); }
+			}
+			if(!is_neg_inf_replacement(lnp_los_extinction_prior(logEBV.data(), N, Delta_EBV, params))) {
+				valid = true;
+				break;
+			}
+		}
+		
+		// Profiles outside the prior may run past the top of the surfaces, and are not integrated. A probe
+		// with no valid profile is left out (its row of dlnp stays zero). Without a valid guess, all stars are kept.
+		if(!valid) {
+			if(j == 0) {
+				if(verbosity >= 1) {
+					std::cout << "# Guess is outside the prior. Keeping all stars." << std::endl;
+				}
+				gsl_rng_free(r);
+				return N_stars;
+			}
+			continue;
+		}
+		
+		los_integral(*(params.img_stack), params.subpixel.data(), line_int, Delta_EBV, N-1);
+		
+		if(j == 0) {
+			for(size_t k=0; k<N_stars; k++) { lnp_guess[k] = lnp_los_star(line_int[k], k, params); }
+		} else {
+			d = &(dlnp[(j-1)*N_stars]);
+			for(size_t k=0; k<N_stars; k++) { d[k] = lnp_los_star(line_int[k], k, params) - lnp_guess[k]; }
+		}
+	}
+	
+	// Sensitivities, normalized to a probability of selection
+	std::vector<double> p(N_stars, 1. / (double)N_stars);
+	double norm;
+	for(unsigned int j=0; j<LOS_CORESET_PROBES; j++) {
+		d = &(dlnp[j*N_stars]);
+		norm = 0.;
+		for(size_t k=0; k<N_stars; k++) { norm += fabs(d[k]); }
+		if(norm <= 0.) { continue; }
+		for(size_t k=0; k<N_stars; k++) {
+			if(fabs(d[k]) / norm > p[k] - 1. / (double)N_stars) { p[k] = 1. / (double)N_stars + fabs(d[k]) / norm; }
+		}
+	}
 	
-	if(params.guess_cov == NULL) {
-		for(size_t i=0; i<N; i++) {
-			logEBV[i] = params.EBV_prof_guess[i] + gsl_ran_gaussian_ziggurat(r, sigma);
-			EBV_sum += exp(logEBV[i]);
+	std::vector<double> cum_p(N_stars);
+	norm = 0.;
+	for(size_t k=0; k<N_stars; k++) {
+		norm += p[k];
+		cum_p[k] = norm;
+	}
+	for(size_t k=0; k<N_stars; k++) {
+		p[k] /= norm;
+		cum_p[k] /= norm;
+	}
+	
+	// Draw coresets of increasing size, until one is accurate enough
+	std::vector<double> weight(N_stars);
+	double err = 0.;
+	double err_j;
+	size_t idx;
+	unsigned int M;
+	
+	for(M=N_core; M<N_stars; M*=2) {
+		std::fill(weight.begin(), weight.end(), 0.);
+		for(unsigned int m=0; m<M; m++) {
+			idx = std::lower_bound(cum_p.begin(), cum_p.end(), gsl_rng_uniform(r)) - cum_p.begin();
+			if(idx >= N_stars) { idx = N_stars - 1; }
+			weight[idx] += 1. / ((double)M * p[idx]);
 		}
-	} else {
-		// Redistribute reddening among distance bins
-		draw_from_cov(logEBV, params.guess_sqrt_cov, N, r);
 		
-		/*#pragma omp critical (cout)
-		{
-		for(int i=0; i<N; i++) {
-			std::cout << std::setw(6) << std::setprecision(2) << logEBV[i] << " ";
+		err = 0.;
+		for(unsigned int j=LOS_CORESET_PROBES; j<N_probes; j++) {
+			d = &(dlnp[j*N_stars]);
+			err_j = 0.;
+			for(size_t k=0; k<N_stars; k++) { err_j += (weight[k] - 1.) * d[k]; }
+			if(fabs(err_j) > err) { err = fabs(err_j); }
 		}
-		std::cout << std::endl;
-		}*/
 		
-		for(size_t i=0; i<N; i++) {
-			logEBV[i] *= sigma;
-			logEBV[i] += params.EBV_prof_guess[i];
-			EBV_sum += exp(logEBV[i]);
-			guess_sum += exp(params.EBV_prof_guess[i]);
+		if(verbosity >= 2) {
+			std::cout << "# Coreset of " << M << " draws: max. ln(p) error = " << err << std::endl;
 		}
 		
-		// Change in reddening at infinity
-		//double norm = exp(gsl_ran_gaussian_ziggurat(r, 0.05));
-		//factor = log(norm * guess_sum / EBV_sum);
-		//for(size_t i=0; i<N; i++) { logEBV[i] += factor; }
+		if(err <= max_lnL_err) { break; }
 	}
 	
-	// Switch adjacent reddenings
-	/*int n_switches = sl_rng_uniform_int(r, 2);
-	size_t k;
-	double tmp_log_EBV;
-	//int max_dist = std::min((int)(N-1)/2, 5);
-	for(int i=0; i<n_switches; i++) {
-		int dist = 1; //gsl_rng_uniform_int(r, max_dist+1);
-		k = gsl_rng_uniform_int(r, N-dist);
-		tmp_log_EBV = logEBV[k];
-		logEBV[k] = logEBV[k+dist];
-		logEBV[k+dist] = tmp_log_EBV;
-	}*/
+	gsl_rng_free(r);
 	
-	// Ensure that reddening is not more than allowed
-	if(EBV_sum >= 0.95 * EBV_ceil) {
-		factor = log(0.95 * EBV_ceil / EBV_sum);
-		for(size_t i=0; i<N; i++) {
-			logEBV[i] += factor;
+	if(M >= N_stars) {
+		if(verbosity >= 1) {
+			std::cout << "# No coreset within tolerance. Keeping all stars." << std::endl;
 		}
+		return N_stars;
 	}
+	
+	std::vector<bool> keep(N_stars);
+	for(size_t k=0; k<N_stars; k++) { keep[k] = (weight[k] > 0.); }
+	params.set_coreset(keep, weight, err);
+	
+	if(verbosity >= 1) {
+		std::cout << "# Coreset holds " << params.img_stack->N_images << " of " << N_stars << " stars "
+		          << "(max. ln(p) error = " << err << ")." << std::endl;
+	}
+	
+	return params.img_stack->N_images;
 }
 
 
@@ -1449,11 +4091,15 @@ double step_one_Delta_EBV(double *const _X, double *const _Y, unsigned int _N, g
 TLOSMCMCParams::TLOSMCMCParams(TImgStack* _img_stack, const std::vector<double>& _lnZ, double _p0,
                                unsigned int _N_runs, unsigned int _N_threads, unsigned int _N_regions,
                                double _EBV_max)
-	: img_stack(_img_stack), subpixel(_img_stack->N_images, 1.),
-	  N_runs(_N_runs), N_threads(_N_threads), N_regions(_N_regions),
+	: img_stack(_img_stack), img_stack_full(_img_stack), subpixel(_img_stack->N_images, 1.),
+	  N_runs(_N_runs), N_threads(_N_threads), N_regions(_N_regions), N_star_threads(0),
 	  line_int(NULL), Delta_EBV_prior(NULL),
+	  batch_size(0), line_int_batch(NULL), Delta_EBV_batch(NULL), x_batch(NULL), idx_batch(NULL),
+	  local_size(0), local_ensembles(0), region_int(NULL), region_key(NULL), local_slot(NULL),
 	  log_Delta_EBV_prior(NULL), sigma_log_Delta_EBV(NULL),
-	  guess_cov(NULL), guess_sqrt_cov(NULL)
+	  guess_cov(NULL), guess_sqrt_cov(NULL),
+	  init_scale(-1.), init_MH_bandwidth(-1.),
+	  coreset_N_full(0), coreset_lnL_err(0.), surrogate_scale(1.)
 {
 	line_int = new double[_img_stack->N_images * N_threads];
 	Delta_EBV = new float[(N_regions+1) * N_threads];
@@ -1482,6 +4128,13 @@ TLOSMCMCParams::TLOSMCMCParams(TImgStack* _img_stack, const std::vector<double>&
 TLOSMCMCParams::~TLOSMCMCParams() {
 	if(line_int != NULL) { delete[] line_int; }
 	if(Delta_EBV != NULL) { delete[] Delta_EBV; }
+	if(line_int_batch != NULL) { delete[] line_int_batch; }
+	if(Delta_EBV_batch != NULL) { delete[] Delta_EBV_batch; }
+	if(x_batch != NULL) { delete[] x_batch; }
+	if(idx_batch != NULL) { delete[] idx_batch; }
+	if(region_int != NULL) { delete[] region_int; }
+	if(region_key != NULL) { delete[] region_key; }
+	if(local_slot != NULL) { delete[] local_slot; }
 	if(Delta_EBV_prior != NULL) { delete[] Delta_EBV_prior; }
 	if(log_Delta_EBV_prior != NULL) { delete[] log_Delta_EBV_prior; }
 	if(sigma_log_Delta_EBV != NULL) { delete[] sigma_log_Delta_EBV; }
@@ -1520,6 +4173,66 @@ void TLOSMCMCParams::set_subpixel_mask(std::vector<double>& new_mask) {
 	}
 }
 
+// Keep only the stars flagged in keep, with the given weights in the likelihood, culling the image
+// stack. lnL_err is the estimated error in ln(p) of the coreset, recorded with the output.
+void TLOSMCMCParams::set_coreset(const std::vector<bool> &keep, const std::vector<double> &weight, double lnL_err) {
+	assert(img_stack == img_stack_full);
+	assert((keep.size() == img_stack->N_images) && (weight.size() == keep.size()));
+	
+	std::vector<double> star_weight_new, subpixel_new;
+	size_t n = 0;
+	for(size_t k=0; k<keep.size(); k++) {
+		if(!keep[k]) { continue; }
+		
+		p0_over_Z[n] = p0_over_Z[k];
+		ln_p0_over_Z[n] = ln_p0_over_Z[k];
+		inv_p0_over_Z[n] = inv_p0_over_Z[k];
+		subpixel_new.push_back(subpixel[k]);
+		star_weight_new.push_back(star_weight.empty() ? weight[k] : weight[k] * star_weight[k]);
+		n++;
+	}
+	
+	p0_over_Z.resize(n);
+	ln_p0_over_Z.resize(n);
+	inv_p0_over_Z.resize(n);
+	star_weight = star_weight_new;
+	set_subpixel_mask(subpixel_new);
+	
+	if(coreset_N_full == 0) { coreset_N_full = keep.size(); }
+	coreset_lnL_err = lnL_err;
+	
+	img_stack->cull(keep);
+	EBV_guess_max = guess_EBV_max(*img_stack);
+}
+
+// Choose a random subset of a fraction frac of the stars for lnp_los_extinction_surrogate, and the factor
+// that scales the ln(p) of the subset up to that of all the stars. If frac <= 0, the subset is cleared.
+void TLOSMCMCParams::set_surrogate_stars(double frac) {
+	surrogate_idx.clear();
+	surrogate_scale = 1.;
+	
+	const size_t N_stars = img_stack_full->N_images;
+	if((frac <= 0.) || (N_stars == 0)) { return; }
+	
+	size_t N_sub = (size_t)ceil(frac * (double)N_stars);
+	if(N_sub > N_stars) { N_sub = N_stars; }
+	
+	std::vector<size_t> all_idx(N_stars);
+	for(size_t k=0; k<N_stars; k++) { all_idx[k] = k; }
+	surrogate_idx.resize(N_sub);
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	gsl_ran_choose(r, surrogate_idx.data(), N_sub, all_idx.data(), N_stars, sizeof(size_t));
+	gsl_rng_free(r);
+	
+	double w_all = 0.;
+	double w_sub = 0.;
+	for(size_t k=0; k<N_stars; k++) { w_all += star_weight.empty() ? 1. : star_weight[k]; }
+	for(size_t n=0; n<N_sub; n++) { w_sub += star_weight.empty() ? 1. : star_weight[surrogate_idx[n]]; }
+	if(w_sub > 0.) { surrogate_scale = w_all / w_sub; }
+}
+
 // Calculate the mean and std. dev. of log(delta_EBV)
 void TLOSMCMCParams::calc_Delta_EBV_prior(TGalacticLOSModel& gal_los_model, double EBV_tot, int verbosity) {
 	double mu_0 = img_stack->rect->min[1];
@@ -1695,6 +4408,132 @@ float* TLOSMCMCParams::get_Delta_EBV(unsigned int thread_num) {
 	return Delta_EBV + (N_regions+1) * thread_num;
 }
 
+// Allocate working space for lnp_los_extinction_batch to score up to L profiles per call
+void TLOSMCMCParams::set_batch_size(unsigned int L) {
+	if(L <= batch_size) { return; }
+	
+	if(line_int_batch != NULL) { delete[] line_int_batch; }
+	if(Delta_EBV_batch != NULL) { delete[] Delta_EBV_batch; }
+	if(x_batch != NULL) { delete[] x_batch; }
+	if(idx_batch != NULL) { delete[] idx_batch; }
+	
+	batch_size = L;
+	line_int_batch = new double[img_stack->N_images * batch_size * N_threads];
+	Delta_EBV_batch = new float[(N_regions+1) * batch_size * N_threads];
+	x_batch = new double[(N_regions+1) * N_threads];
+	idx_batch = new unsigned int[batch_size * N_threads];
+}
+
+double* TLOSMCMCParams::get_line_int_batch(unsigned int thread_num) {
+	assert(thread_num < N_threads);
+	return line_int_batch + img_stack->N_images * batch_size * thread_num;
+}
+
+float* TLOSMCMCParams::get_Delta_EBV_batch(unsigned int thread_num) {
+	assert(thread_num < N_threads);
+	return Delta_EBV_batch + (N_regions+1) * batch_size * thread_num;
+}
+
+double* TLOSMCMCParams::get_x_batch(unsigned int thread_num) {
+	assert(thread_num < N_threads);
+	return x_batch + (N_regions+1) * thread_num;
+}
+
+unsigned int* TLOSMCMCParams::get_idx_batch(unsigned int thread_num) {
+	assert(thread_num < N_threads);
+	return idx_batch + batch_size * thread_num;
+}
+
+// Allocate the cache used by lnp_los_extinction_local for N_ensembles ensembles of L walkers, numbered
+// as by TParallelAffineSampler. Each ensemble has one slot per walker, plus one for the pending proposal,
+// and is only ever stepped by one thread at a time. If the cache would take more than
+// LOS_LOCAL_CACHE_MAX_BYTES, none is kept, and every walker is scored by lnp_los_extinction.
+void TLOSMCMCParams::set_local_size(unsigned int L, unsigned int N_ensembles) {
+	if((L == local_size) && (N_ensembles == local_ensembles)) { return; }
+	
+	if(region_int != NULL) { delete[] region_int; }
+	if(region_key != NULL) { delete[] region_key; }
+	if(local_slot != NULL) { delete[] local_slot; }
+	region_int = NULL;
+	region_key = NULL;
+	local_slot = NULL;
+	local_size = 0;
+	local_ensembles = 0;
+	
+	size_t N_slots = (size_t)(L+1) * N_ensembles;
+	size_t N_bytes = N_slots * (N_regions * img_stack->N_images * sizeof(float) + (N_regions+1) * sizeof(double));
+	if(N_bytes > LOS_LOCAL_CACHE_MAX_BYTES) { return; }
+	
+	local_size = L;
+	local_ensembles = N_ensembles;
+	region_int = new float[N_regions * img_stack->N_images * N_slots];
+	region_key = new double[(N_regions+1) * N_slots];
+	local_slot = new unsigned int[N_slots];
+	
+	std::fill(region_key, region_key + (N_regions+1) * N_slots, std::numeric_limits<double>::quiet_NaN());
+	for(unsigned int e=0; e<local_ensembles; e++) {
+		for(unsigned int j=0; j<local_size+1; j++) { local_slot[(local_size+1)*e + j] = j; }
+	}
+}
+
+float* TLOSMCMCParams::get_region_int(unsigned int ensemble, unsigned int slot) {
+	assert((ensemble < local_ensembles) && (slot <= local_size));
+	return region_int + N_regions * img_stack->N_images * ((local_size+1) * ensemble + slot);
+}
+
+double* TLOSMCMCParams::get_region_key(unsigned int ensemble, unsigned int slot) {
+	assert((ensemble < local_ensembles) && (slot <= local_size));
+	return region_key + (N_regions+1) * ((local_size+1) * ensemble + slot);
+}
+
+unsigned int* TLOSMCMCParams::get_local_slot(unsigned int ensemble) {
+	assert(ensemble < local_ensembles);
+	return local_slot + (local_size+1) * ensemble;
+}
+
+// Evaluate the l.o.s. fit on the given level of the full stack's pyramid (0 being the full stack).
+// Levels whose DM axis cannot be split evenly into the distance regions are passed over for finer
+// ones. Returns the level actually used.
+unsigned int TLOSMCMCParams::set_pyramid_level(unsigned int level) {
+	if(level > img_stack_full->pyramid.size()) { level = img_stack_full->pyramid.size(); }
+	while((level > 0) && (img_stack_full->pyramid[level-1]->rect->N_bins[1] % N_regions != 0)) { level--; }
+	
+	TImgStack *img_stack_new = (level == 0) ? img_stack_full : img_stack_full->pyramid[level-1];
+	if(img_stack_new != img_stack) {
+		img_stack = img_stack_new;
+		
+		// Cached region integrals belong to the old level
+		if(region_key != NULL) {
+			std::fill(region_key, region_key + (N_regions+1) * (local_size+1) * local_ensembles,
+			          std::numeric_limits<double>::quiet_NaN());
+		}
+	}
+	
+	return level;
+}
+
+// Number of threads to split the stars of one evaluation of ln(p), along K profiles, across: N_star_threads
+// if it is set, and otherwise those of the current thread budget (omp_get_max_threads) left idle by the
+// enclosing parallel region, which runs one ensemble per thread. Each thread is left with at least
+// LOS_PARALLEL_STARS_PER_THREAD line integrals, so smaller evaluations, and those made with nested
+// parallelism disabled, return 1.
+int TLOSMCMCParams::get_N_star_threads(unsigned int K) const {
+	int N_max = (int)((img_stack->N_images * K) / LOS_PARALLEL_STARS_PER_THREAD);
+	if(N_max < 2) { return 1; }
+	if(omp_in_parallel() && (omp_get_active_level() >= omp_get_max_active_levels())) { return 1; }
+	
+	int N_split = N_star_threads;
+	if(N_split <= 0) {
+		int N_busy = omp_get_num_threads();
+		if(N_busy > (int)N_runs) { N_busy = N_runs; }
+		if(N_busy < 1) { N_busy = 1; }
+		N_split = omp_get_max_threads() / N_busy;
+	}
+	
+	if(N_split > N_max) { N_split = N_max; }
+	return (N_split > 1) ? N_split : 1;
+}
+
 
 
 /****************************************************************************************************************************
@@ -1703,6 +4542,18 @@ float* TLOSMCMCParams::get_Delta_EBV(unsigned int thread_num) {
  * 
  ****************************************************************************************************************************/
 
+// Density of the Gaussian mixture g at pixel (x, y), in the units of the image it was fit to
+static double img_gmm_density(const TImgGaussMix &g, double x, double y) {
+	double ret = 0.;
+	double z_x, z_y;
+	for(int c=0; c<IMG_GMM_COMPONENTS; c++) {
+		z_x = (x - g.mu_x[c]) / g.sigma_x[c];
+		z_y = (y - g.mu_y[c] - g.slope[c] * (x - g.mu_x[c])) / g.sigma_y[c];
+		ret += g.w[c] * exp(-0.5 * (z_x*z_x + z_y*z_y)) / (2. * PI * g.sigma_x[c] * g.sigma_y[c]);
+	}
+	return ret;
+}
+
 TImgStack::TImgStack(size_t _N_images) {
 	N_images = _N_images;
 	img = new cv::Mat*[N_images];
@@ -1710,6 +4561,18 @@ TImgStack::TImgStack(size_t _N_images) {
 		img[i] = new cv::Mat;
 	}
 	rect = NULL;
+	interleaved = NULL;
+	interleaved_stride = 0;
+	row_cumsum = NULL;
+	gmm = NULL;
+	band_data = NULL;
+	band_offset = NULL;
+	band_lo = NULL;
+	band_hi = NULL;
+	arena = NULL;
+	arena_scale = NULL;
+	arena_slot = 0;
+	arena_type = IMG_ARENA_F32;
 }
 
 TImgStack::TImgStack(size_t _N_images, TRect& _rect) {
@@ -1717,6 +4580,18 @@ TImgStack::TImgStack(size_t _N_images, TRect& _rect) {
 	img = new cv::Mat*[N_images];
 	for(size_t i=0; i<N_images; i++) { img[i] = NULL; }
 	rect = new TRect(_rect);
+	interleaved = NULL;
+	interleaved_stride = 0;
+	row_cumsum = NULL;
+	gmm = NULL;
+	band_data = NULL;
+	band_offset = NULL;
+	band_lo = NULL;
+	band_hi = NULL;
+	arena = NULL;
+	arena_scale = NULL;
+	arena_slot = 0;
+	arena_type = IMG_ARENA_F32;
 }
 
 TImgStack::~TImgStack() {
@@ -1729,6 +4604,12 @@ TImgStack::~TImgStack() {
 		delete[] img;
 	}
 	if(rect != NULL) { delete rect; }
+	free_interleaved();
+	free_row_cumsum();
+	free_pyramid();
+	free_gmm();
+	free_banded();
+	free_arena(false);
 }
 
 void TImgStack::resize(size_t _N_images) {
@@ -1741,6 +4622,12 @@ void TImgStack::resize(size_t _N_images) {
 		delete[] img;
 	}
 	if(rect != NULL) { delete rect; }
+	free_interleaved();
+	free_row_cumsum();
+	free_pyramid();
+	free_gmm();
+	free_banded();
+	free_arena(false);
 	
 	N_images = _N_images;
 	img = new cv::Mat*[N_images];
@@ -1771,7 +4658,79 @@ void TImgStack::cull(const std::vector<bool> &keep) {
 	
 	delete[] img;
 	img = img_tmp;
+	
+	if(gmm != NULL) {
+		k = 0;
+		for(i=0; i<N_images; i++) {
+			if(keep[i]) { gmm[k++] = gmm[i]; }
+		}
+	}
+	
+	// The banded copy may be the only copy of an image, so it is compacted, rather than rebuilt
+	if(band_data != NULL) {
+		const size_t N_x = rect->N_bins[1];
+		size_t idx_old, idx_new, N_stored = 0;
+		k = 0;
+		for(i=0; i<N_images; i++) {
+			if(!keep[i]) { continue; }
+			for(size_t x=0; x<N_x; x++) {
+				idx_old = i*N_x + x;
+				idx_new = k*N_x + x;
+				band_lo[idx_new] = band_lo[idx_old];
+				band_hi[idx_new] = band_hi[idx_old];
+				band_offset[idx_new] = band_offset[idx_old];
+				if(band_hi[idx_new] > band_lo[idx_new]) { N_stored += band_hi[idx_new] - band_lo[idx_new] + 2; }
+			}
+			k++;
+		}
+		
+		float *new_data = new float[N_stored];
+		size_t len;
+		N_stored = 0;
+		for(idx_new=0; idx_new<N_tmp*N_x; idx_new++) {
+			len = (band_hi[idx_new] > band_lo[idx_new]) ? band_hi[idx_new] - band_lo[idx_new] + 2 : 0;
+			std::copy(band_data + band_offset[idx_new], band_data + band_offset[idx_new] + len, new_data + N_stored);
+			band_offset[idx_new] = N_stored;
+			N_stored += len;
+		}
+		delete[] band_data;
+		band_data = new_data;
+	}
+	
+	// So is the arena, which may also hold the only copy of an image
+	if(arena != NULL) {
+		const size_t elem_size = (arena_type == IMG_ARENA_F32) ? sizeof(float) : sizeof(uint16_t);
+		const size_t slot_bytes = arena_slot * elem_size;
+		k = 0;
+		for(i=0; i<N_images; i++) {
+			if(!keep[i]) { continue; }
+			if(k != i) {
+				memmove((char*)arena + k*slot_bytes, (char*)arena + i*slot_bytes, slot_bytes);
+				arena_scale[k] = arena_scale[i];
+			}
+			if((arena_type == IMG_ARENA_F32) && (img[k] != NULL) && (img[k]->rows != 0)) {
+				*(img[k]) = cv::Mat(rect->N_bins[0], rect->N_bins[1], CV_32F, (float*)arena + k*arena_slot);
+			}
+			k++;
+		}
+	}
+	
 	N_images = N_tmp;
+	
+	// Rebuild the derived copies without the culled stars
+	if(interleaved != NULL) {
+		free_interleaved();
+		build_interleaved();
+	}
+	if(row_cumsum != NULL) {
+		free_row_cumsum();
+		build_row_cumsum();
+	}
+	if(pyramid.size() != 0) {
+		unsigned int N_levels = pyramid.size();
+		free_pyramid();
+		build_pyramid(N_levels);
+	}
 }
 
 void TImgStack::set_rect(TRect& _rect) {
@@ -1783,14 +4742,492 @@ void TImgStack::set_rect(TRect& _rect) {
 }
 
 void TImgStack::stack(cv::Mat& dest) {
-	if(N_images > 0) {
-		dest = *(img[0]);
-		for(size_t i=1; i<N_images; i++) {
-			dest += *(img[i]);
+	cv::Mat buf;
+	const cv::Mat *src;
+	bool empty = true;
+	for(size_t i=0; i<N_images; i++) {
+		src = get_dense(i, buf);
+		if(src == NULL) { continue; }
+		if(empty) {
+			src->copyTo(dest);
+			empty = false;
+		} else {
+			dest += *src;
 		}
-	} else {
-		dest.setTo(0);
 	}
+	if(empty) { dest.setTo(0); }
+}
+
+// Pixel (y, x) of image k. Images released by build_banded are read from the banded copy, and those
+// released by build_gmm are evaluated from their Gaussian mixtures.
+float TImgStack::pixel(size_t k, int y, int x) const {
+	if((img[k] != NULL) && (img[k]->rows != 0)) { return img[k]->at<float>(y, x); }
+	if(band_data != NULL) {
+		const size_t idx = k*rect->N_bins[1] + x;
+		if((y < band_lo[idx]) || (y >= band_hi[idx])) { return 0.; }
+		return band_data[band_offset[idx] + y + 1 - band_lo[idx]];
+	}
+	if(arena != NULL) { return arena_pixel(*this, k, (size_t)rect->N_bins[1]*y + x); }
+	if((gmm != NULL) && gmm[k].good) { return img_gmm_density(gmm[k], x, y); }
+	return 0.;
+}
+
+// Image k as a dense matrix. This is img[k] if the image is held, and otherwise buf, filled in from
+// pixel(). Returns NULL if there is no image.
+const cv::Mat* TImgStack::get_dense(size_t k, cv::Mat &buf) const {
+	if((img[k] != NULL) && (img[k]->rows != 0)) { return img[k]; }
+	if((band_data == NULL) && (arena == NULL) && ((gmm == NULL) || !gmm[k].good)) { return NULL; }
+	
+	const int N_y = rect->N_bins[0];
+	const int N_x = rect->N_bins[1];
+	buf.create(N_y, N_x, CV_32F);
+	float *row;
+	for(int y=0; y<N_y; y++) {
+		row = buf.ptr<float>(y);
+		for(int x=0; x<N_x; x++) { row[x] = pixel(k, y, x); }
+	}
+	
+	return &buf;
+}
+
+void TImgStack::build_interleaved() {
+	assert(rect != NULL);
+	
+	free_interleaved();
+	
+	const size_t N_y = rect->N_bins[0];
+	const size_t N_x = rect->N_bins[1];
+	
+	// Pad the number of stars, so that each (x, y) row of stars starts on a vector boundary
+	interleaved_stride = IMG_STACK_INTERLEAVE * ((N_images + IMG_STACK_INTERLEAVE - 1) / IMG_STACK_INTERLEAVE);
+	if(interleaved_stride == 0) { interleaved_stride = IMG_STACK_INTERLEAVE; }
+	
+	interleaved = new float[N_x * N_y * interleaved_stride];
+	std::fill(interleaved, interleaved + N_x * N_y * interleaved_stride, 0.f);
+	
+	cv::Mat buf;
+	const cv::Mat *src;
+	const float *row;
+	for(size_t k=0; k<N_images; k++) {
+		src = get_dense(k, buf);
+		if(src == NULL) { continue; }
+		assert((src->rows == N_y) && (src->cols == N_x));
+		
+		for(size_t y=0; y<N_y; y++) {
+			row = src->ptr<float>(y);
+			for(size_t x=0; x<N_x; x++) {
+				interleaved[(N_y*x + y)*interleaved_stride + k] = row[x];
+			}
+		}
+	}
+}
+
+void TImgStack::free_interleaved() {
+	if(interleaved != NULL) {
+		delete[] interleaved;
+		interleaved = NULL;
+	}
+	interleaved_stride = 0;
+}
+
+// Store the nonzero band of each DM column of each image, padded by one zero above and below, so that
+// the pixel pairs read by los_integral never need a bounds check beyond the comparison with the band.
+// The dense images are then released, and the banded copy is the only one kept. Returns the number of
+// values stored.
+size_t TImgStack::build_banded() {
+	assert(rect != NULL);
+	
+	const size_t N_y = rect->N_bins[0];
+	const size_t N_x = rect->N_bins[1];
+	assert(N_y < 65535);
+	
+	// Built alongside any existing banded copy, which may hold images that have already been released
+	uint16_t *new_lo = new uint16_t[N_images * N_x];
+	uint16_t *new_hi = new uint16_t[N_images * N_x];
+	size_t *new_offset = new size_t[N_images * N_x];
+	
+	// Find the bands, and the total storage needed
+	cv::Mat buf;
+	const cv::Mat *src;
+	size_t N_stored = 0;
+	size_t idx, y_lo, y_hi;
+	for(size_t k=0; k<N_images; k++) {
+		src = get_dense(k, buf);
+		
+		for(size_t x=0; x<N_x; x++) {
+			idx = k*N_x + x;
+			y_lo = N_y;
+			y_hi = 0;
+			
+			if(src != NULL) {
+				for(size_t y=0; y<N_y; y++) {
+					if(src->at<float>(y, x) != 0.) {
+						if(y < y_lo) { y_lo = y; }
+						y_hi = y + 1;
+					}
+				}
+			}
+			
+			if(y_hi == 0) { y_lo = 0; }	// Empty column
+			new_lo[idx] = y_lo;
+			new_hi[idx] = y_hi;
+			new_offset[idx] = N_stored;
+			if(y_hi > y_lo) { N_stored += y_hi - y_lo + 2; }
+		}
+	}
+	
+	// Pack the bands. Value y of column idx is at band_data[band_offset[idx] + y + 1 - band_lo[idx]].
+	float *new_data = new float[N_stored];
+	float *p;
+	for(size_t k=0; k<N_images; k++) {
+		src = get_dense(k, buf);
+		
+		for(size_t x=0; x<N_x; x++) {
+			idx = k*N_x + x;
+			if(new_hi[idx] <= new_lo[idx]) { continue; }
+			
+			p = new_data + new_offset[idx];
+			*(p++) = 0.;
+			for(size_t y=new_lo[idx]; y<new_hi[idx]; y++) { *(p++) = src->at<float>(y, x); }
+			*p = 0.;
+		}
+	}
+	
+	free_banded();
+	band_data = new_data;
+	band_offset = new_offset;
+	band_lo = new_lo;
+	band_hi = new_hi;
+	
+	for(size_t k=0; k<N_images; k++) {
+		if(img[k] != NULL) { img[k]->release(); }
+	}
+	
+	return N_stored;
+}
+
+void TImgStack::free_banded() {
+	if(band_data != NULL) { delete[] band_data; band_data = NULL; }
+	if(band_offset != NULL) { delete[] band_offset; band_offset = NULL; }
+	if(band_lo != NULL) { delete[] band_lo; band_lo = NULL; }
+	if(band_hi != NULL) { delete[] band_hi; band_hi = NULL; }
+}
+
+// Copy the images into one contiguous arena, with each star in a slot of arena_slot values, aligned to
+// IMG_ARENA_ALIGN bytes. Large arenas are aligned to, and advised onto, huge pages. Each image is stored
+// row by row, as in the cv::Mat, in the given storage type. For float32 storage, the images are then
+// re-pointed at the arena, and their own buffers released. For the 16-bit types, the arena is a
+// compact copy used only by the l.o.s. integrals.
+void TImgStack::build_arena(int type) {
+	assert(rect != NULL);
+	
+	const size_t N_y = rect->N_bins[0];
+	const size_t N_x = rect->N_bins[1];
+	const size_t elem_size = (type == IMG_ARENA_F32) ? sizeof(float) : sizeof(uint16_t);
+	
+	init_half_to_float_table();
+	
+	// Slots padded to the alignment
+	const size_t slot_elems = ((N_y * N_x * elem_size + IMG_ARENA_ALIGN - 1) / IMG_ARENA_ALIGN) * IMG_ARENA_ALIGN / elem_size;
+	size_t bytes = N_images * slot_elems * elem_size;
+	if(bytes == 0) { bytes = IMG_ARENA_ALIGN; }
+	
+	const size_t huge_page = 2 * 1024 * 1024;
+	void *new_arena = NULL;
+	if(bytes >= huge_page) {
+		bytes = ((bytes + huge_page - 1) / huge_page) * huge_page;
+		if(posix_memalign(&new_arena, huge_page, bytes) != 0) { new_arena = NULL; }
+		#ifdef MADV_HUGEPAGE
+		if(new_arena != NULL) { madvise(new_arena, bytes, MADV_HUGEPAGE); }
+		#endif
+	}
+	if(new_arena == NULL) {
+		if(posix_memalign(&new_arena, IMG_ARENA_ALIGN, bytes) != 0) {
+			std::cerr << "Could not allocate image arena of " << bytes << " bytes." << std::endl;
+			return;
+		}
+	}
+	
+	float *new_scale = new float[N_images > 0 ? N_images : 1];
+	
+	cv::Mat buf;
+	const cv::Mat *src;
+	const float *row;
+	for(size_t k=0; k<N_images; k++) {
+		new_scale[k] = 1.;
+		src = get_dense(k, buf);
+		if(src == NULL) {
+			memset((char*)new_arena + k*slot_elems*elem_size, 0, slot_elems*elem_size);
+			continue;
+		}
+		assert((src->rows == N_y) && (src->cols == N_x));
+		
+		if(type == IMG_ARENA_F32) {
+			float *dest = (float*)new_arena + k*slot_elems;
+			for(size_t y=0; y<N_y; y++) {
+				row = src->ptr<float>(y);
+				for(size_t x=0; x<N_x; x++) { dest[N_x*y + x] = row[x]; }
+			}
+		} else {
+			uint16_t *dest = (uint16_t*)new_arena + k*slot_elems;
+			
+			// For uint16, pixels are stored in units of the largest pixel / 65535
+			if(type == IMG_ARENA_U16) {
+				double img_max;
+				cv::minMaxLoc(*src, NULL, &img_max);
+				if(img_max > 0.) { new_scale[k] = img_max / 65535.; }
+			}
+			
+			for(size_t y=0; y<N_y; y++) {
+				row = src->ptr<float>(y);
+				for(size_t x=0; x<N_x; x++) {
+					if(type == IMG_ARENA_F16) {
+						dest[N_x*y + x] = float_to_half(row[x]);
+					} else if(type == IMG_ARENA_BF16) {
+						dest[N_x*y + x] = float_to_bfloat16(row[x]);
+					} else {
+						dest[N_x*y + x] = (row[x] > 0.) ? (uint16_t)(row[x] / new_scale[k] + 0.5) : 0;
+					}
+				}
+			}
+		}
+	}
+	
+	// Release the old arena only after copying, as the images may point into it. Images stored as
+	// float32 point into the new arena, and the others are released, to be read through pixel() and
+	// get_dense().
+	for(size_t k=0; k<N_images; k++) {
+		if((img[k] == NULL) || (img[k]->rows == 0)) { continue; }
+		if(type == IMG_ARENA_F32) {
+			*(img[k]) = cv::Mat(N_y, N_x, CV_32F, (float*)new_arena + k*slot_elems);
+		} else {
+			img[k]->release();
+		}
+	}
+	free_arena(false);
+	
+	arena = new_arena;
+	arena_scale = new_scale;
+	arena_slot = slot_elems;
+	arena_type = type;
+}
+
+// Free the arena. Unless detach_images is false, images that point into the arena are first given
+// their own copies, and images released by a 16-bit arena are decoded from it, unless the banded
+// copy or a good Gaussian-mixture fit stands in for them.
+void TImgStack::free_arena(bool detach_images) {
+	if(arena == NULL) { return; }
+	
+	if(detach_images && (img != NULL)) {
+		cv::Mat buf;
+		for(size_t k=0; k<N_images; k++) {
+			if(img[k] == NULL) { continue; }
+			if(img[k]->rows != 0) {
+				if(arena_type == IMG_ARENA_F32) { *(img[k]) = img[k]->clone(); }
+			} else if((band_data == NULL) && ((gmm == NULL) || !gmm[k].good)) {
+				get_dense(k, buf)->copyTo(*(img[k]));
+			}
+		}
+	}
+	
+	free(arena);
+	arena = NULL;
+	delete[] arena_scale;
+	arena_scale = NULL;
+	arena_slot = 0;
+}
+
+// Fit the surface of each star by a mixture of IMG_GMM_COMPONENTS Gaussians, in pixel units. The
+// fit is used in place of the image if the L1 norm of the residuals is less than max_residual times
+// the sum of the image, and the image is then released. Returns the number of stars that pass.
+unsigned int TImgStack::build_gmm(double max_residual) {
+	assert(rect != NULL);
+	
+	free_gmm();
+	gmm = new TImgGaussMix[N_images];
+	
+	const int N_y = rect->N_bins[0];
+	const int N_x = rect->N_bins[1];
+	unsigned int N_good = 0;
+	
+	#pragma omp parallel for schedule(dynamic) reduction(+:N_good)
+	for(size_t k=0; k<N_images; k++) {
+		TImgGaussMix &g = gmm[k];
+		g.good = false;
+		for(int c=0; c<IMG_GMM_COMPONENTS; c++) { g.w[c] = 0.; }
+		
+		cv::Mat buf;
+		const cv::Mat *src = get_dense(k, buf);
+		if(src == NULL) { continue; }
+		
+		double img_sum = 0.;
+		double img_max = 0.;
+		const float *row;
+		for(int y=0; y<N_y; y++) {
+			row = src->ptr<float>(y);
+			for(int x=0; x<N_x; x++) {
+				img_sum += row[x];
+				if(row[x] > img_max) { img_max = row[x]; }
+			}
+		}
+		if(!(img_sum > 0.)) { continue; }
+		
+		// Pixels holding all but a negligible part of the probability, as weighted points
+		std::vector<double> pts, w_pts;
+		for(int y=0; y<N_y; y++) {
+			row = src->ptr<float>(y);
+			for(int x=0; x<N_x; x++) {
+				if(row[x] > 1.e-4 * img_max) {
+					pts.push_back((double)x);
+					pts.push_back((double)y);
+					w_pts.push_back(row[x]);
+				}
+			}
+		}
+		if(w_pts.size() < 4*IMG_GMM_COMPONENTS) { continue; }
+		
+		TGaussianMixture mixture(2, IMG_GMM_COMPONENTS);
+		mixture.expectation_maximization(pts.data(), w_pts.data(), w_pts.size(), 25);
+		
+		// Store each component as a Gaussian in x times a Gaussian in y given x
+		double C_xx, C_xy, C_yy;
+		bool valid = true;
+		for(int c=0; c<IMG_GMM_COMPONENTS; c++) {
+			C_xx = gsl_matrix_get(mixture.get_cov(c), 0, 0);
+			C_xy = gsl_matrix_get(mixture.get_cov(c), 0, 1);
+			C_yy = gsl_matrix_get(mixture.get_cov(c), 1, 1);
+			if(!(C_xx > 0.) || !(C_yy - C_xy*C_xy/C_xx > 0.) || isnan(mixture.get_w(c))) {
+				valid = false;
+				break;
+			}
+			
+			g.w[c] = mixture.get_w(c) * img_sum;
+			g.mu_x[c] = mixture.get_mu(c)[0];
+			g.mu_y[c] = mixture.get_mu(c)[1];
+			g.sigma_x[c] = sqrt(C_xx);
+			g.slope[c] = C_xy / C_xx;
+			g.sigma_y[c] = sqrt(C_yy - C_xy*C_xy/C_xx);
+		}
+		if(!valid) { continue; }
+		
+		// Fit quality
+		double residual = 0.;
+		for(int y=0; y<N_y; y++) {
+			row = src->ptr<float>(y);
+			for(int x=0; x<N_x; x++) {
+				residual += fabs(img_gmm_density(g, x, y) - row[x]);
+			}
+		}
+		
+		// The mixture replaces the image, which is released
+		if(residual < max_residual * img_sum) {
+			g.good = true;
+			if(img[k] != NULL) { img[k]->release(); }
+			N_good++;
+		}
+	}
+	
+	return N_good;
+}
+
+void TImgStack::free_gmm() {
+	if(gmm != NULL) {
+		delete[] gmm;
+		gmm = NULL;
+	}
+}
+
+// Build the cumulative sums along DM. They are as large as the dense images, so are not built if the
+// surfaces are held in a more compact form, in which case los_integral_clouds reads the pixels instead.
+// The sums are accumulated in double precision, and stored in single precision.
+void TImgStack::build_row_cumsum() {
+	assert(rect != NULL);
+	
+	free_row_cumsum();
+	
+	if((band_data != NULL) || (gmm != NULL) || ((arena != NULL) && (arena_type != IMG_ARENA_F32))) { return; }
+	
+	const size_t N_y = rect->N_bins[0];
+	const size_t N_x = rect->N_bins[1];
+	
+	row_cumsum = new float[N_images * N_y * (N_x+1)];
+	
+	cv::Mat buf;
+	const cv::Mat *src;
+	float *sum;
+	const float *row;
+	double tmp_sum;
+	for(size_t k=0; k<N_images; k++) {
+		src = get_dense(k, buf);
+		
+		for(size_t y=0; y<N_y; y++) {
+			sum = row_cumsum + (N_y*k + y)*(N_x+1);
+			sum[0] = 0.;
+			
+			if(src == NULL) {
+				for(size_t x=0; x<N_x; x++) { sum[x+1] = 0.; }
+				continue;
+			}
+			
+			row = src->ptr<float>(y);
+			tmp_sum = 0.;
+			for(size_t x=0; x<N_x; x++) {
+				tmp_sum += row[x];
+				sum[x+1] = tmp_sum;
+			}
+		}
+	}
+}
+
+void TImgStack::free_row_cumsum() {
+	if(row_cumsum != NULL) {
+		delete[] row_cumsum;
+		row_cumsum = NULL;
+	}
+}
+
+// Build up to N_levels downsampled copies of the stack, each halving the resolution of the one
+// before. Pixels are averaged along E(B-V), and summed along DM, so that line integrals, which are
+// sums over DM pixels, keep the same normalization. Stops early at a level that does not divide
+// evenly.
+void TImgStack::build_pyramid(unsigned int N_levels) {
+	assert(rect != NULL);
+	
+	free_pyramid();
+	
+	TImgStack *prev = this;
+	uint32_t N_bins[2];
+	cv::Mat buf;
+	const cv::Mat *src;
+	
+	for(unsigned int l=1; l<=N_levels; l++) {
+		if((prev->rect->N_bins[0] % 2 != 0) || (prev->rect->N_bins[1] % 2 != 0)) { break; }
+		
+		N_bins[0] = prev->rect->N_bins[0] / 2;
+		N_bins[1] = prev->rect->N_bins[1] / 2;
+		TRect rect_coarse(rect->min, rect->max, N_bins);
+		
+		TImgStack *level = new TImgStack(N_images, rect_coarse);
+		for(size_t k=0; k<N_images; k++) {
+			level->img[k] = new cv::Mat;
+			src = prev->get_dense(k, buf);
+			if(src == NULL) { continue; }
+			cv::resize(*src, *(level->img[k]), cv::Size(N_bins[1], N_bins[0]), 0, 0, cv::INTER_AREA);
+			*(level->img[k]) *= 2.;
+		}
+		
+		if(interleaved != NULL) { level->build_interleaved(); }
+		
+		pyramid.push_back(level);
+		prev = level;
+	}
+}
+
+void TImgStack::free_pyramid() {
+	for(std::vector<TImgStack*>::iterator it = pyramid.begin(); it != pyramid.end(); ++it) {
+		delete *it;
+	}
+	pyramid.clear();
 }
 
 TLOSTransform::TLOSTransform(unsigned int ndim)
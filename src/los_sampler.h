@@ -33,8 +33,12 @@
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <algorithm>
+#include <limits>
 #include <math.h>
 #include <time.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 #include <stdint.h>
 
@@ -55,20 +59,82 @@ struct TMCMCOptions {
 	unsigned int samplers;
 	double p_replacement;
 	unsigned int N_runs;
+	bool HMC;	// Mix Hamiltonian Monte Carlo steps into the final burn-in and main run
+	unsigned int N_regions_coarse;	// If nonzero, burn in on profiles with this many regions first
+	double surrogate_frac;		// If nonzero, screen burn-in proposals on this fraction of the stars
+	bool slice;			// Mix coordinate-wise slice-sampling steps into the burn-in and main run
 	
 	TMCMCOptions(unsigned int _steps, unsigned int _samplers,
-	             double _p_replacement, unsigned int _N_runs)
+	             double _p_replacement, unsigned int _N_runs, bool _HMC=false)
 		: steps(_steps), samplers(_samplers),
-		  p_replacement(_p_replacement), N_runs(_N_runs)
+		  p_replacement(_p_replacement), N_runs(_N_runs), HMC(_HMC),
+		  N_regions_coarse(0), surrogate_frac(0.), slice(false)
 	{}
 };
 
+// Gaussian-mixture approximation of a stellar surface, in pixel units, with x along DM and y along E(B-V).
+// Each component is a Gaussian in x, times a Gaussian in y about a mean that depends linearly on x:
+//
+//     w N(x | mu_x, sigma_x) N(y | mu_y + slope*(x - mu_x), sigma_y) ,
+//
+// with the weights w summing to the sum of the pixels of the image.
+#define IMG_GMM_COMPONENTS 3
+
+struct TImgGaussMix {
+	float w[IMG_GMM_COMPONENTS];
+	float mu_x[IMG_GMM_COMPONENTS], sigma_x[IMG_GMM_COMPONENTS];
+	float mu_y[IMG_GMM_COMPONENTS], sigma_y[IMG_GMM_COMPONENTS];
+	float slope[IMG_GMM_COMPONENTS];
+	bool good;	// Whether the fit is good enough to replace the image
+};
+
 struct TImgStack {
 	cv::Mat **img;
 	TRect *rect;
 	
 	size_t N_images;
 	
+	// Optional copy of the images, interleaved so that the stars are innermost. Pixel (y, x)
+	// of image k is at interleaved[(rect->N_bins[0]*x + y)*interleaved_stride + k]. NULL
+	// unless build_interleaved() has been called.
+	float *interleaved;
+	size_t interleaved_stride;
+	
+	// Optional cumulative sums of each image along DM. Row y of image k is
+	// row_cumsum[(rect->N_bins[0]*k + y)*(rect->N_bins[1]+1) + x], the sum of
+	// pixels 0 <= x' < x. NULL unless build_row_cumsum() has been called, and
+	// not built for banded, Gaussian-mixture or 16-bit stacks, which it would outgrow.
+	float *row_cumsum;
+	
+	// Optional downsampled copies of the stack. Level l has 2^l times fewer pixels than
+	// the full stack along each axis, and pyramid[l-1] points to it. Empty unless
+	// build_pyramid() has been called.
+	std::vector<TImgStack*> pyramid;
+	
+	// Optional Gaussian-mixture fits to the images, one per star, used by los_integral for
+	// stars whose fits are good. The images of those stars are released, and are then read
+	// through pixel() and get_dense(). NULL unless build_gmm() has been called.
+	TImgGaussMix *gmm;
+	
+	// Optional banded copy of the images. Column x of image k holds nonzero pixels only in rows
+	// band_lo[idx] <= y < band_hi[idx], with idx = rect->N_bins[1]*k + x, and these are packed into
+	// band_data from band_offset[idx], with one zero before and after. The dense images are released
+	// once banded, and are then read through pixel() and get_dense(). NULL unless build_banded()
+	// has been called.
+	float *band_data;
+	size_t *band_offset;
+	uint16_t *band_lo, *band_hi;
+	
+	// Optional contiguous arena holding image k in slot k, at arena + k*arena_slot values of
+	// the storage type arena_type. Pixels stored as IMG_ARENA_U16 are in units of arena_scale[k],
+	// which is 1 for the other types. With IMG_ARENA_F32, the dense images point into the arena.
+	// With the 16-bit types, they are released, and are then read through pixel() and get_dense().
+	// NULL unless build_arena() has been called.
+	void *arena;
+	float *arena_scale;
+	size_t arena_slot;
+	int arena_type;
+	
 	TImgStack(size_t _N_images);
 	TImgStack(size_t _N_images, TRect &_rect);
 	~TImgStack();
@@ -77,24 +143,104 @@ struct TImgStack {
 	void resize(size_t _N_images);
 	void set_rect(TRect &_rect);
 	void stack(cv::Mat &dest);
+	
+	float pixel(size_t k, int y, int x) const;
+	const cv::Mat* get_dense(size_t k, cv::Mat &buf) const;
+	
+	void build_interleaved();
+	void free_interleaved();
+	
+	void build_row_cumsum();
+	void free_row_cumsum();
+	
+	void build_pyramid(unsigned int N_levels);
+	void free_pyramid();
+	
+	unsigned int build_gmm(double max_residual);
+	void free_gmm();
+	
+	size_t build_banded();
+	void free_banded();
+	
+	void build_arena(int type);
+	void free_arena(bool detach_images=true);
 };
 
+// Storage types of the image arena
+#define IMG_ARENA_F32 0
+#define IMG_ARENA_F16 1
+#define IMG_ARENA_BF16 2
+#define IMG_ARENA_U16 3
+
+// Alignment of the slots of the image arena, in bytes
+#define IMG_ARENA_ALIGN 64
+
+// Number of stars the interleaved image stack is padded to a multiple of
+#define IMG_STACK_INTERLEAVE 16
+
+// Number of stars integrated together by los_integral_batch
+#define LOS_INTEGRAL_STAR_BLOCK IMG_STACK_INTERLEAVE
+
+// Number of line integrals (stars times profiles) each thread must be left with for the line integrals
+// of one evaluation of ln(p) to be split across threads, so that the work outweighs starting the team
+#define LOS_PARALLEL_STARS_PER_THREAD 1000
+
+// Number of profiles used to find the sensitivities of the stars to the l.o.s. fit, and again to
+// check the error of the coreset, and their scatter in log(Delta E(B-V)) about the guess
+#define LOS_CORESET_PROBES 32
+#define LOS_CORESET_PROBE_SIGMA 0.5
+
+// Largest size, in bytes, of the cache of line integrals by distance region kept by lnp_los_extinction_local.
+// Larger caches are not allocated, and the custom steps are then scored by lnp_los_extinction.
+#define LOS_LOCAL_CACHE_MAX_BYTES ((size_t)1 << 29)
+
 struct TLOSMCMCParams {
 	TImgStack *img_stack;
+	TImgStack *img_stack_full;	// img_stack may point to a level of this stack's pyramid
 	std::vector<double> p0_over_Z, ln_p0_over_Z, inv_p0_over_Z;
 	double p0, lnp0;
 	
 	double *line_int;
 	float *Delta_EBV;
+	
+	// Working space for lnp_los_extinction_batch
+	unsigned int batch_size;
+	double *line_int_batch;
+	float *Delta_EBV_batch;
+	double *x_batch;
+	unsigned int *idx_batch;
+	
+	// Line integrals of each walker's current state by distance region, for lnp_los_extinction_local,
+	// in local_ensembles blocks of local_size walkers
+	unsigned int local_size, local_ensembles;
+	float *region_int;
+	double *region_key;
+	unsigned int *local_slot;
+	
 	unsigned int N_runs;
 	unsigned int N_threads;
 	unsigned int N_regions;
+	int N_star_threads;	// Threads each evaluation of ln(p) splits its stars across, or 0 to use those left idle
 	
 	double EBV_max;
 	double EBV_guess_max;
 	std::vector<double> EBV_prof_guess;
 	gsl_matrix *guess_cov, *guess_sqrt_cov;
 	
+	// Profiles to start the walkers from, N_regions+1 values each, and their cumulative weights.
+	// Empty unless filled by refine_los_extinction or load_los_warm_start.
+	std::vector<double> init_prof, init_cum_weight;
+	double init_scale, init_MH_bandwidth;	// Tuned step sizes to start from, if positive
+	
+	// Weight of each star in ln(p), if the stars are a coreset. Empty if every star counts once.
+	std::vector<double> star_weight;
+	unsigned int coreset_N_full;	// # of stars before selecting the coreset, or 0
+	double coreset_lnL_err;
+	
+	// Stars integrated by lnp_los_extinction_surrogate, and the factor that scales their ln(p) up to all stars
+	std::vector<size_t> surrogate_idx;
+	double surrogate_scale;
+	
 	std::vector<double> subpixel;
 	double subpixel_min, subpixel_max;
 	
@@ -112,6 +258,9 @@ struct TLOSMCMCParams {
 	void set_subpixel_mask(TStellarData& data);
 	void set_subpixel_mask(std::vector<double>& new_mask);
 	
+	void set_coreset(const std::vector<bool> &keep, const std::vector<double> &weight, double lnL_err);
+	void set_surrogate_stars(double frac);
+	
 	void calc_Delta_EBV_prior(TGalacticLOSModel& gal_los_model,
 	                          double EBV_tot, int verbosity=1);
 	
@@ -120,6 +269,37 @@ struct TLOSMCMCParams {
 	double* get_line_int(unsigned int thread_num);
 	float* get_Delta_EBV(unsigned int thread_num);
 	
+	void set_batch_size(unsigned int L);
+	double* get_line_int_batch(unsigned int thread_num);
+	float* get_Delta_EBV_batch(unsigned int thread_num);
+	double* get_x_batch(unsigned int thread_num);
+	unsigned int* get_idx_batch(unsigned int thread_num);
+	
+	void set_local_size(unsigned int L, unsigned int N_ensembles);
+	float* get_region_int(unsigned int ensemble, unsigned int slot);
+	double* get_region_key(unsigned int ensemble, unsigned int slot);
+	unsigned int* get_local_slot(unsigned int ensemble);
+	
+	unsigned int set_pyramid_level(unsigned int level);
+	
+	int get_N_star_threads(unsigned int K=1) const;
+	
+};
+
+// Final state of the samplers of a piecewise-linear fit, stored by sample_los_extinction, from which
+// its chains can be extended. Filled by load_los_ensemble.
+struct TLOSEnsembleState {
+	unsigned int N_runs, L, ndim;
+	uint64_t N_steps;			// # of steps already taken by each walker in the main run
+	std::vector<double> walker;		// {ln(p), x...} of walker j of run k, at (k*L + j)*(ndim+1)
+	std::vector<double> scale, MH_bandwidth, HMC_bandwidth, slice_width;	// Tuned step sizes of each run
+	size_t rng_size;
+	std::vector<unsigned char> rng_state;	// gsl_rng state of each run
+	std::vector<double> transf_stats;	// {N_items, sums of y_i, sums of y_i y_j} of each run, with y in the space of TLOSTransform
+	std::vector<double> sample;		// {ln(p), x...} of the best point, then of each stored sample
+	
+	void get_transf_stats(unsigned int k, TStats &stats) const;
+	double get_total_weight() const;	// Total weight of the chains so far
 };
 
 // Transform from log(DeltaEBV) to cumulative EBV for piecewise-linear l.o.s. fit
@@ -148,26 +328,83 @@ public:
 
 // Testing functions
 void test_extinction_profiles(TLOSMCMCParams &params);
+bool test_arena_round_trip(TImgStack &img_stack, unsigned int N_regions, unsigned int N_stars=100);
+bool test_los_local_lnp(TLOSMCMCParams &params, unsigned int N_proposals=200);
+bool test_los_batch_lnp(TLOSMCMCParams &params, unsigned int L=64);
+bool test_los_grad(TLOSMCMCParams &params, unsigned int N_profiles=20, double h=1.e-3);
+bool test_los_integral_batch(TImgStack &img_stack, unsigned int N_regions, unsigned int K=16, unsigned int N_stars=100);
+bool test_los_integral_gmm(TImgStack &img_stack, unsigned int N_regions, double max_residual, unsigned int N_stars=100);
+bool test_los_integral_banded(TImgStack &img_stack, unsigned int N_regions, unsigned int N_stars=100);
 
 // Sample piecewise-linear model
 
 void sample_los_extinction(const std::string& out_fname, const std::string& group_name,
                            TMCMCOptions &options, TLOSMCMCParams &params,
-                           int verbosity=1);
+                           int verbosity=1, const TLOSEnsembleState *resume=NULL);
 
 double lnp_los_extinction(const double *const Delta_EBV, unsigned int N_regions, TLOSMCMCParams &params);
 
+double lnp_los_extinction_grad(const double *const logEBV, unsigned int N, double *const grad, TLOSMCMCParams &params);
+
+void lnp_los_extinction_batch(const double *const logEBV, unsigned int N, unsigned int L, double *const lnp,
+                              TLOSMCMCParams &params);
+
+double lnp_los_extinction_prior(const double *const logEBV, unsigned int N, float *const Delta_EBV,
+                                TLOSMCMCParams &params);
+
+double lnp_los_line_int(const double *const line_int, TLOSMCMCParams &params);
+
+double lnp_los_extinction_local(const double *const X, const double *const Y, unsigned int N, unsigned int j,
+                                TLOSMCMCParams &params);
+
+void los_local_update(unsigned int j, bool accepted, TLOSMCMCParams &params);
+
+double lnp_los_extinction_surrogate(const double *const logEBV, unsigned int N, TLOSMCMCParams &params);
+
 void gen_rand_los_extinction_from_guess(double *const logEBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params);
 
+void gen_rand_los_extinction_from_prof(double *const logEBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params);
+
+void refine_los_extinction(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity=1);
+
+unsigned int select_los_coreset(TMCMCOptions &options, TLOSMCMCParams &params, unsigned int N_core,
+                                double max_lnL_err, int verbosity=1);
+
+bool load_los_warm_start(const std::string &fname, const std::string &group_name, TLOSMCMCParams &params);
+
+bool load_los_ensemble(const std::string &fname, const std::string &group_name, const TMCMCOptions &options,
+                       TLOSMCMCParams &params, TLOSEnsembleState &state);
+
 void gen_rand_los_extinction(double *const Delta_EBV, unsigned int N, gsl_rng *r, TLOSMCMCParams &params);
 
 void los_integral(TImgStack& img_stack, const double *const subpixel, double *const ret,
                   const float *const Delta_EBV, unsigned int N_regions);
 
+void los_integral_interleaved(TImgStack& img_stack, const double *const subpixel, double *const ret,
+                              const float *const Delta_EBV, unsigned int N_regions);
+
+void los_integral_arena(TImgStack& img_stack, const double *const subpixel, double *const ret,
+                        const float *const Delta_EBV, unsigned int N_regions);
+
+void los_integral_banded(TImgStack& img_stack, const double *const subpixel, double *const ret,
+                         const float *const Delta_EBV, unsigned int N_regions);
+
+void los_integral_gmm(TImgStack& img_stack, const double *const subpixel, double *const ret,
+                      const float *const Delta_EBV, unsigned int N_regions);
+
+void los_integral_batch(TImgStack& img_stack, const double *const subpixel, double *const ret,
+                        const float *const Delta_EBV, unsigned int N_regions, unsigned int K);
+
 double guess_EBV_max(TImgStack &img_stack);
 
 void guess_EBV_profile(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity=1);
 
+void guess_EBV_profile_MCMC(TMCMCOptions &options, TLOSMCMCParams &params, int verbosity=1);
+
+bool guess_EBV_profile_DP(TLOSMCMCParams &params, double *const logEBV);
+
+double polish_EBV_profile(TLOSMCMCParams &params, double *const logEBV, unsigned int max_iter);
+
 void monotonic_guess(TImgStack &img_stack, unsigned int N_regions, std::vector<double>& Delta_EBV, TMCMCOptions& options);
 
 double switch_log_Delta_EBVs(double *const _X, double *const _Y, unsigned int _N, gsl_rng* r, TLOSMCMCParams& _params);
@@ -57,6 +57,8 @@ struct TProgramOpts {
 	double mean_RV;
 	
 	unsigned int N_regions;
+	unsigned int N_regions_coarse;
+	double los_surrogate_frac;
 	unsigned int los_steps;
 	unsigned int los_samplers;
 	double los_p_replacement;
@@ -73,10 +75,24 @@ struct TProgramOpts {
 	
 	unsigned int N_runs;
 	unsigned int N_threads;
+	bool star_parallel;
+	bool star_grid;
+	bool marg_EBV;
+	bool interleave_stack;
+	bool banded_stack;
+	string stack_storage;
+	double gmm_max_residual;
+	unsigned int coreset_size;
+	double coreset_tol;
+	bool los_HMC;
+	bool los_slice;
+	bool warm_start;
+	bool extend;
 	
 	bool clobber;
 	
 	bool test_mode;
+	bool self_test;
 	
 	int verbosity;
 	
@@ -105,6 +121,8 @@ struct TProgramOpts {
 		mean_RV = 3.1;
 		
 		N_regions = 30;
+		N_regions_coarse = 0;
+		los_surrogate_frac = 0.;
 		los_steps = 4000;
 		los_samplers = 2;
 		los_p_replacement = 0.0;
@@ -121,10 +139,24 @@ struct TProgramOpts {
 		
 		N_runs = 4;
 		N_threads = 1;
+		star_parallel = false;
+		star_grid = false;
+		marg_EBV = false;
+		interleave_stack = false;
+		banded_stack = false;
+		stack_storage = "NONE";
+		gmm_max_residual = 0.;
+		coreset_size = 0;
+		coreset_tol = 1.;
+		los_HMC = false;
+		los_slice = false;
+		warm_start = false;
+		extend = false;
 		
 		clobber = false;
 		
 		test_mode = false;
+		self_test = false;
 		
 		verbosity = 0;
 		
@@ -156,15 +188,48 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 		("star-samplers", po::value<unsigned int>(&(opts.star_samplers)), ("# of samplers per dimension (stellar fit) (default: " + to_string(opts.star_samplers) + ")").c_str())
 		("star-p-replacement", po::value<double>(&(opts.star_p_replacement)), ("Probability of taking replacement step (stellar fit) (default: " + to_string(opts.star_p_replacement) + ")").c_str())
 		("no-stellar-priors", "Turn off priors for individual stars.")
+		("star-grid", "Evaluate each star's posterior on a grid in (E(B-V), DM, Mr, [Fe/H]),\n"
+		              "rather than sampling it (empirical library with fixed R_V only).")
+		("marginalize-EBV", "Marginalize analytically over E(B-V) when sampling individual\n"
+		                    "stars, and build their surfaces from conditional E(B-V) profiles\n"
+		                    "(empirical library only).")
 		("min-EBV", po::value<double>(&(opts.min_EBV)), ("Minimum stellar E(B-V) (default: " + to_string(opts.min_EBV) + ")").c_str())
 		
 		("mean-RV", po::value<double>(&(opts.mean_RV)), ("Mean R_V (per star) (default: " + to_string(opts.mean_RV) + ")").c_str())
 		("sigma-RV", po::value<double>(&(opts.sigma_RV)), ("Variation in R_V (per star) (default: " + to_string(opts.sigma_RV) + ", interpreted as no variance)").c_str())
 		
 		("regions", po::value<unsigned int>(&(opts.N_regions)), ("# of piecewise-linear regions in l.o.s. extinction profile (default: " + to_string(opts.N_regions) + ")").c_str())
+		("coarse-regions", po::value<unsigned int>(&(opts.N_regions_coarse)), ("Burn in on a profile with this many regions first, refining\n"
+		                                                                        "up to --regions (must divide it) (default: " + to_string(opts.N_regions_coarse) + ", off)").c_str())
+		("los-delayed-acceptance", po::value<double>(&(opts.los_surrogate_frac)), "During burn-in, screen proposals on this fraction of the stars, and\n"
+		                                                                          "score only those that pass on all stars (l.o.s. fit) (default: 0, off).")
 		("los-steps", po::value<unsigned int>(&(opts.los_steps)), ("# of MCMC steps in l.o.s. fit (per sampler) (default: " + to_string(opts.los_steps) + ")").c_str())
 		("los-samplers", po::value<unsigned int>(&(opts.los_samplers)), ("# of samplers per dimension (l.o.s. fit) (default: " + to_string(opts.los_samplers) + ")").c_str())
 		("los-p-replacement", po::value<double>(&(opts.los_p_replacement)), ("Probability of taking replacement step (l.o.s. fit) (default: " + to_string(opts.los_p_replacement) + ")").c_str())
+		("los-HMC", "Add Hamiltonian Monte Carlo steps, using the analytic gradient of the\n"
+		            "l.o.s. posterior, to the end of burn-in and to the main run (l.o.s. fit).")
+		("los-slice", "Add slice-sampling steps along single log(Delta E(B-V)) coordinates to\n"
+		              "the burn-in and to the main run (l.o.s. fit).")
+		("warm-start", "Process pixels in nested HEALPix order, and start the l.o.s. fit of each\n"
+		               "pixel from a neighbouring pixel already in the output file, if any.")
+		("extend", "Continue the l.o.s. chains of pixels already in the output file from\n"
+		           "their stored final state, instead of skipping them. The stellar surfaces\n"
+		           "must have been saved (--save-surfs) (piecewise-linear fit only).")
+		("stack-storage", po::value<string>(&(opts.stack_storage)), "Copy the stellar surfaces into one contiguous arena, stored as 'f32',\n"
+		                                                            "'f16', 'bf16' or 'u16' (uint16 with a scale per star). With 'f32', the\n"
+		                                                            "surfaces are moved into the arena, rather than copied.")
+		("banded-stack", "Store a copy of the stellar surfaces holding only the band of nonzero\n"
+		                 "E(B-V) pixels in each DM column, and skip columns in which the l.o.s.\n"
+		                 "profile passes outside the band.")
+		("coreset", po::value<unsigned int>(&(opts.coreset_size)), "Fit the l.o.s. to a weighted coreset of at least this many draws\n"
+		                                                           "from the stars, if there are more stars than this.")
+		("coreset-tol", po::value<double>(&(opts.coreset_tol)), "Largest error in ln(p) allowed of the coreset (default: 1).")
+		("gmm-surfaces", po::value<double>(&(opts.gmm_max_residual)), "Fit each stellar surface by a Gaussian mixture, and integrate the\n"
+		                                                              "l.o.s. fit through the mixture where the fractional L1 residual of\n"
+		                                                              "the fit is below the given value (default: 0, off).")
+		("interleave-stack", "Store a copy of the stellar surfaces interleaved by star, so that the\n"
+		                     "l.o.s. fit reads all the stars at once (doubles the memory used by\n"
+		                     "the surfaces).")
 		
 		("clouds", po::value<unsigned int>(&(opts.N_clouds)), ("# of clouds along the line of sight (default: " + to_string(opts.N_clouds) + ")\n"
 		                                                       "Setting this option causes the sampler to also fit a discrete "
@@ -230,6 +295,7 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 		("config", po::value<std::string>(&config_fname), "Configuration file containing additional options.")
 		
 		("test-los", "Allow user to test specific line-of-sight profiles manually.")
+		("self-test", "Check the optimized code paths against their reference versions on each pixel.")
 	;
 	
 	po::options_description dual_desc("Dual Options (both commandline and configuration file)");
@@ -239,6 +305,8 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 		            "only process pixels with incomplete output.")
 		("verbosity", po::value<int>(&(opts.verbosity)), ("Level of verbosity (0 = minimal, 2 = highest) (default: " + to_string(opts.verbosity) + ")").c_str())
 		("threads", po::value<unsigned int>(&(opts.N_threads)), ("# of threads to run on (default: " + to_string(opts.N_threads) + ")").c_str())
+		("star-parallel", "Fit many stars at once, one star per thread, rather than\n"
+		                  "splitting each star's runs across the threads.")
 	;
 	
 	po::positional_options_description pd;
@@ -296,7 +364,17 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 	if(vm.count("SFD-prior")) { opts.SFD_prior = true; }
 	if(vm.count("SFD-subpixel")) { opts.SFD_subpixel = true; }
 	if(vm.count("clobber")) { opts.clobber = true; }
+	if(vm.count("star-parallel")) { opts.star_parallel = true; }
+	if(vm.count("star-grid")) { opts.star_grid = true; }
+	if(vm.count("marginalize-EBV")) { opts.marg_EBV = true; }
+	if(vm.count("interleave-stack")) { opts.interleave_stack = true; }
+	if(vm.count("banded-stack")) { opts.banded_stack = true; }
+	if(vm.count("los-HMC")) { opts.los_HMC = true; }
+	if(vm.count("los-slice")) { opts.los_slice = true; }
+	if(vm.count("warm-start")) { opts.warm_start = true; }
+	if(vm.count("extend")) { opts.extend = true; }
 	if(vm.count("test-los")) { opts.test_mode = true; }
+	if(vm.count("self-test")) { opts.self_test = true; }
 	
 	
 	// Convert error floor to mags
@@ -313,11 +391,26 @@ int get_program_opts(int argc, char **argv, TProgramOpts &opts) {
 		return -1;
 	}
 	
+	if((opts.stack_storage != "NONE") && (opts.stack_storage != "f32") && (opts.stack_storage != "f16")
+	   && (opts.stack_storage != "bf16") && (opts.stack_storage != "u16")) {
+		cerr << "Stack storage must be one of 'f32', 'f16', 'bf16' or 'u16'." << endl;
+		return -1;
+	}
+	
+	if(opts.extend && (opts.clobber || (opts.N_regions == 0))) {
+		cerr << "Extending l.o.s. chains requires the piecewise-linear fit, and an output file that is not clobbered." << endl;
+		return -1;
+	}
+	
 	if(opts.N_regions != 0) {
 		if(120 % (opts.N_regions) != 0) {
 			cerr << "# of regions in extinction profile must divide 120 without remainder." << endl;
 			return -1;
 		}
+		if((opts.N_regions_coarse != 0) && (opts.N_regions % opts.N_regions_coarse != 0)) {
+			cerr << "# of coarse regions must divide # of regions in extinction profile without remainder." << endl;
+			return -1;
+		}
 	}
 	
 	return 1;
@@ -349,7 +442,10 @@ int main(int argc, char **argv) {
 	
 	TMCMCOptions star_options(opts.star_steps, opts.star_samplers, opts.star_p_replacement, opts.N_runs);
 	TMCMCOptions cloud_options(opts.cloud_steps, opts.cloud_samplers, opts.cloud_p_replacement, opts.N_runs);
-	TMCMCOptions los_options(opts.los_steps, opts.los_samplers, opts.los_p_replacement, opts.N_runs);
+	TMCMCOptions los_options(opts.los_steps, opts.los_samplers, opts.los_p_replacement, opts.N_runs, opts.los_HMC);
+	los_options.N_regions_coarse = opts.N_regions_coarse;
+	los_options.surrogate_frac = opts.los_surrogate_frac;
+	los_options.slice = opts.los_slice;
 	
 	
 	/*
@@ -364,6 +460,7 @@ int main(int argc, char **argv) {
 		emplib = new TStellarModel(opts.LF_fname, opts.template_fname);
 	}
 	TExtinctionModel ext_model(opts.ext_model_fname);
+	ext_model.set_fixed_RV(opts.mean_RV);
 	
 	
 	/*
@@ -371,10 +468,12 @@ int main(int argc, char **argv) {
 	 */
 	
 	omp_set_num_threads(opts.N_threads);
+	omp_set_max_active_levels(1);	// Nested regions get one thread each, e.g., the ensembles of stars fit as tasks
 	
 	// Get list of pixels in input file
 	vector<string> pix_name;
 	get_input_pixels(opts.input_fname, pix_name);
+	if(opts.warm_start) { sort_pixels_nested(pix_name); }	// Neighbours are then usually already done
 	cout << "# " << pix_name.size() << " pixels in input file." << endl << endl;
 	
 	// Remove the output file
@@ -405,6 +504,7 @@ int main(int argc, char **argv) {
 		
 		
 		// Check if this pixel has already been fully processed
+		bool extend_pixel = false;
 		if(!(opts.clobber)) {
 			bool process_pixel = false;
 			
@@ -451,6 +551,12 @@ int main(int argc, char **argv) {
 								}
 							}
 						}
+						
+						// A finished pixel can be extended if its surfaces and final l.o.s. state were stored
+						if(!process_pixel && opts.extend) {
+							extend_pixel = H5Utils::dataset_exists("stellar pdfs", pix_group)
+							               && H5Utils::group_exists("los_ensemble", pix_group);
+						}
 					}
 					
 					delete pix_group;
@@ -468,8 +574,12 @@ int main(int argc, char **argv) {
 				delete out_file;
 			}
 			
-			if(!process_pixel) {
-				cout << "# Pixel is already present in output. Skipping." << endl << endl;
+			if(!process_pixel && !extend_pixel) {
+				if(opts.extend) {
+					cout << "# Pixel has no stored l.o.s. state to extend. Skipping." << endl << endl;
+				} else {
+					cout << "# Pixel is already present in output. Skipping." << endl << endl;
+				}
 				
 				continue;	// All information is already present in output file
 			}
@@ -482,15 +592,22 @@ int main(int argc, char **argv) {
 		
 		bool gatherSurfs = (opts.N_regions || opts.N_clouds || opts.save_surfs);
 		
-		// Sample individual stars
-		if(opts.synthetic) {
+		// Sample individual stars, or read back their surfaces if the l.o.s. fit is being extended
+		if(extend_pixel) {
+			if(!load_indiv_surfs(opts.output_fname, *it, img_stack, conv, lnZ)) {
+				cout << "# Unable to read stellar surfaces. Skipping." << endl << endl;
+				continue;
+			}
+		} else if(opts.synthetic) {
 			sample_indiv_synth(opts.output_fname, star_options, los_model, *synthlib, ext_model,
 			                   stellar_data, img_stack, conv, lnZ, opts.sigma_RV,
-			                   opts.min_EBV, opts.save_surfs, gatherSurfs, opts.verbosity);
+			                   opts.min_EBV, opts.save_surfs, gatherSurfs, opts.verbosity, opts.star_parallel);
 		} else {
 			sample_indiv_emp(opts.output_fname, star_options, los_model, *emplib, ext_model,
 			                 stellar_data, img_stack, conv, lnZ, opts.mean_RV, opts.sigma_RV, opts.min_EBV,
-			                 opts.save_surfs, gatherSurfs, opts.star_priors, opts.verbosity);
+			                 opts.save_surfs, gatherSurfs, opts.star_priors, opts.verbosity, opts.star_parallel,
+			                 opts.star_grid, opts.marg_EBV);
+			if(opts.self_test) { test_emp_batch(los_model, *emplib, ext_model, stellar_data, opts.mean_RV); }
 		}
 		
 		clock_gettime(CLOCK_MONOTONIC, &t_mid);
@@ -531,12 +648,44 @@ int main(int argc, char **argv) {
 			}
 		}
 		if(gatherSurfs) { img_stack.cull(keep); }
+		if(gatherSurfs && opts.self_test) {
+			test_arena_round_trip(img_stack, opts.N_regions);
+			test_los_integral_batch(img_stack, opts.N_regions);
+			test_los_integral_banded(img_stack, opts.N_regions);
+			if(opts.gmm_max_residual > 0.) { test_los_integral_gmm(img_stack, opts.N_regions, opts.gmm_max_residual); }
+		}
+		if(gatherSurfs && (opts.stack_storage != "NONE")) {
+			if(opts.stack_storage == "f16") {
+				img_stack.build_arena(IMG_ARENA_F16);
+			} else if(opts.stack_storage == "bf16") {
+				img_stack.build_arena(IMG_ARENA_BF16);
+			} else if(opts.stack_storage == "u16") {
+				img_stack.build_arena(IMG_ARENA_U16);
+			} else {
+				img_stack.build_arena(IMG_ARENA_F32);
+			}
+		}
+		if(gatherSurfs && opts.interleave_stack) { img_stack.build_interleaved(); }
+		if(gatherSurfs && opts.banded_stack) {
+			size_t N_banded = img_stack.build_banded();
+			if(opts.verbosity >= 2) {
+				size_t N_dense = img_stack.N_images * img_stack.rect->N_bins[0] * img_stack.rect->N_bins[1];
+				cout << "# Banded surfaces hold " << N_banded << " of " << N_dense << " pixels." << endl;
+			}
+		}
+		if(gatherSurfs && (opts.gmm_max_residual > 0.)) {
+			unsigned int N_gmm = img_stack.build_gmm(opts.gmm_max_residual);
+			cout << "# " << N_gmm << " of " << img_stack.N_images << " surfaces replaced by Gaussian mixtures." << endl;
+		}
 		
 		// Fit line-of-sight extinction profile
 		if((nFiltered < conv.size()) && ((opts.N_clouds != 0) || (opts.N_regions != 0))) {
 			cout << "# of stars filtered: " << nFiltered << " of " << conv.size();
 			cout << " (" << 100. * (double)nFiltered / (double)(conv.size()) << " %)" << endl;
 			
+			// Concurrent l.o.s. fits, their ensembles, and the stars of each evaluation
+			omp_set_max_active_levels(3);
+			
 			double p0 = exp(-5. - opts.ev_cut);
 			double EBV_max = -1.;
 			if(opts.SFD_prior) {
@@ -548,12 +697,24 @@ int main(int argc, char **argv) {
 			}
 			TLOSMCMCParams params(&img_stack, lnZ_filtered, p0, opts.N_runs, opts.N_threads, opts.N_regions, EBV_max);
 			if(opts.SFD_subpixel) { params.set_subpixel_mask(subpixel); }
+			if((opts.coreset_size != 0) && (opts.N_regions != 0)) {
+				select_los_coreset(los_options, params, opts.coreset_size, opts.coreset_tol, opts.verbosity);
+			}
 			
 			if(opts.test_mode) {
 				test_extinction_profiles(params);
 			}
+			if(opts.self_test && (opts.N_regions != 0)) {
+				test_los_local_lnp(params);
+				test_los_batch_lnp(params);
+				test_los_grad(params);
+			}
 			
-			if(opts.N_clouds != 0) {
+			// With both l.o.s. models and more than one thread, the cloud fit runs alongside the piecewise-linear fit
+			// When extending, only the piecewise-linear fit is rerun.
+			bool concurrent_fits = !extend_pixel && (opts.N_clouds != 0) && (opts.N_regions != 0) && (opts.N_threads >= 2);
+			
+			if((opts.N_clouds != 0) && !concurrent_fits && !extend_pixel) {
 				sample_los_extinction_clouds(opts.output_fname, *it, cloud_options, params, opts.N_clouds, opts.verbosity);
 			}
 			if(opts.N_regions != 0) {
@@ -561,8 +722,71 @@ int main(int argc, char **argv) {
 				if(opts.disk_prior) {
 					params.calc_Delta_EBV_prior(los_model, stellar_data.EBV, opts.verbosity);
 				}
-				sample_los_extinction(opts.output_fname, *it, los_options, params, opts.verbosity);
+				if(opts.warm_start && stellar_data.nested && !extend_pixel) {
+					vector<uint64_t> neighbours;
+					healpix_nest_neighbours(stellar_data.nside, stellar_data.healpix_index, neighbours);
+					for(size_t i=0; i<neighbours.size(); i++) {
+						stringstream neighbour_name;
+						neighbour_name << "pixel " << stellar_data.nside << "-" << neighbours[i];
+						if(load_los_warm_start(opts.output_fname, neighbour_name.str(), params)) { break; }
+					}
+				}
+				
+				TLOSEnsembleState los_state;
+				bool extend_los = extend_pixel && load_los_ensemble(opts.output_fname, *it, los_options, params, los_state);
+				if(extend_pixel && !extend_los) {
+					cout << "# Stored l.o.s. state does not match the current settings. Not extending." << endl;
+				}
+				
+				if(concurrent_fits) {
+					// The cloud fit gets its own scratch space, and each fit half of the threads. The image
+					// stack is shared, so the copies the fits would otherwise build and free are built here.
+					int N_threads_clouds = opts.N_threads / 2;
+					int N_threads_los = opts.N_threads - N_threads_clouds;
+					
+					vector<double> lnZ_stars(params.ln_p0_over_Z.size());
+					for(size_t k=0; k<lnZ_stars.size(); k++) { lnZ_stars[k] = params.lnp0 - params.ln_p0_over_Z[k]; }
+					TLOSMCMCParams cloud_params(&img_stack, lnZ_stars, p0, opts.N_runs, opts.N_threads, opts.N_regions, EBV_max);
+					cloud_params.set_subpixel_mask(params.subpixel);
+					cloud_params.star_weight = params.star_weight;
+					
+					// Within its half, each fit runs one ensemble per thread, and the piecewise-linear fit
+					// splits the stars of each evaluation across the threads left over
+					int N_ensemble_threads = ((int)opts.N_runs < N_threads_los) ? (int)opts.N_runs : N_threads_los;
+					cloud_params.N_star_threads = 1;
+					params.N_star_threads = N_threads_los / N_ensemble_threads;
+					
+					bool own_pyramid = (img_stack.pyramid.size() == 0);
+					if(own_pyramid) { img_stack.build_pyramid(2); }
+					bool own_row_cumsum = (img_stack.row_cumsum == NULL);
+					if(own_row_cumsum) { img_stack.build_row_cumsum(); }
+					
+					#pragma omp parallel sections num_threads(2)
+					{
+						#pragma omp section
+						{
+							omp_set_num_threads(N_threads_clouds);
+							sample_los_extinction_clouds(opts.output_fname, *it, cloud_options, cloud_params, opts.N_clouds, opts.verbosity);
+						}
+						#pragma omp section
+						{
+							omp_set_num_threads(N_threads_los);
+							sample_los_extinction(opts.output_fname, *it, los_options, params, opts.verbosity);
+						}
+					}
+					
+					params.N_star_threads = 0;
+					
+					if(own_row_cumsum) { img_stack.free_row_cumsum(); }
+					if(own_pyramid) { img_stack.free_pyramid(); }
+				} else if(extend_los) {
+					sample_los_extinction(opts.output_fname, *it, los_options, params, opts.verbosity, &los_state);
+				} else if(!extend_pixel) {
+					sample_los_extinction(opts.output_fname, *it, los_options, params, opts.verbosity);
+				}
 			}
+			
+			omp_set_max_active_levels(1);
 		}
 		
 		clock_gettime(CLOCK_MONOTONIC, &t_end);
@@ -26,6 +26,7 @@
 #include "model.h"
 
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <math.h>
@@ -272,6 +273,7 @@ TGalacticLOSModel::~TGalacticLOSModel() {
 	delete log_dNdmu_arr;
 	delete f_halo_arr;
 	delete mu_FeH_disk_arr;
+	delete log_prior_emp_arr;
 }
 
 void TGalacticLOSModel::init(double _l, double _b) {
@@ -305,6 +307,21 @@ void TGalacticLOSModel::init(double _l, double _b) {
 	}
 	log_dNdmu_norm = log_dNdmu_0 + log(log_dNdmu_norm);
 	log_dNdmu_norm += log((log_dNdmu_arr->get_x(DM_samples-1) - log_dNdmu_arr->get_x(0)) / DM_samples);
+	
+	// Tabulate the prior for the empirical stellar model. The metallicity distributions have
+	// widths of 0.2 dex or more, so steps of 0.02 in [Fe/H] and DM are plenty.
+	FeH_min_table = -3.;
+	FeH_max_table = 1.;
+	unsigned int N_DM_table = 1251;
+	unsigned int N_FeH_table = 201;
+	log_prior_emp_arr = new TBilinearInterp<double>(DM_min, DM_max, N_DM_table, FeH_min_table, FeH_max_table, N_FeH_table);
+	double dDM_table = (DM_max - DM_min) / (double)(N_DM_table - 1);
+	double dFeH_table = (FeH_max_table - FeH_min_table) / (double)(N_FeH_table - 1);
+	for(unsigned int j=0; j<N_FeH_table; j++) {
+		for(unsigned int i=0; i<N_DM_table; i++) {
+			(*log_prior_emp_arr)[i + N_DM_table*j] = log_prior_emp_full(DM_min + (double)i * dDM_table, FeH_min_table + (double)j * dFeH_table);
+		}
+	}
 }
 
 void TGalacticLOSModel::DM_to_RZ(double DM, double& R, double& Z) const {
@@ -431,18 +448,26 @@ double TGalacticLOSModel::log_prior_synth(const double *x) const {
 	return log_dNdmu(x[_DM]) + log(p);
 }
 
-double TGalacticLOSModel::log_prior_emp(double DM, double Mr, double FeH) const {
+double TGalacticLOSModel::log_prior_emp_full(double DM, double FeH) const {
 	double f_H = f_halo(DM);
 	double p = (1. - f_H) * p_FeH_fast(DM, FeH, 0);
 	p += f_H * p_FeH_fast(DM, FeH, 1);
 	return log_dNdmu(DM) + log(p);// + lnp_Mr(Mr);
 }
 
+double TGalacticLOSModel::log_prior_emp(double DM, double Mr, double FeH) const {
+	if((DM > DM_min) && (DM < DM_max) && (FeH > FeH_min_table) && (FeH < FeH_max_table)) {
+		return (*log_prior_emp_arr)(DM, FeH);
+	}
+	return log_prior_emp_full(DM, FeH);
+}
+
 double TGalacticLOSModel::log_prior_emp(const double *x) const {
-	double f_H = f_halo(x[0]);
-	double p = (1. - f_H) * p_FeH_fast(x[0], x[2], 0);
-	p += f_H * p_FeH_fast(x[0], x[2], 1);
-	return log_dNdmu(x[0]) + log(p);// + lnp_Mr(x[1]);
+	return log_prior_emp(x[0], x[1], x[2]);
+}
+
+double TGalacticLOSModel::log_prior_emp(const double *x, const TStellarModel &stellar_model) const {
+	return log_prior_emp(x[0], x[1], x[2]) + stellar_model.get_log_lf(x[1]);
 }
 
 double TGalacticLOSModel::get_log_dNdmu_norm() const { return log_dNdmu_norm; }
@@ -548,7 +573,7 @@ TSED& TSED::operator+=(const TSED &rhs) {
  ****************************************************************************************************************************/
 
 TStellarModel::TStellarModel(std::string lf_fname, std::string seds_fname)
-	: sed_interp(NULL), log_lf_interp(NULL) 
+	: sed_table(NULL), log_lf_interp(NULL) 
 {
 	load_lf(lf_fname);
 	load_seds(seds_fname);
@@ -556,7 +581,7 @@ TStellarModel::TStellarModel(std::string lf_fname, std::string seds_fname)
 
 TStellarModel::~TStellarModel() {
 	if(log_lf_interp != NULL) { delete log_lf_interp; }
-	if(sed_interp != NULL) { delete sed_interp; }
+	if(sed_table != NULL) { delete[] sed_table; }
 }
 
 bool TStellarModel::load_lf(std::string lf_fname) {
@@ -640,10 +665,13 @@ bool TStellarModel::load_seds(std::string seds_fname) {
 	unsigned int N_Mr = (unsigned int)(round((Mr_max - Mr_min) / dMr)) + 1;
 	unsigned int N_FeH = (unsigned int)(round((FeH_max - FeH_min) / dFeH)) + 1;
 	
-	// Construct the SED interpolation grid
-	sed_interp = new TBilinearInterp<TSED>(Mr_min, Mr_max, N_Mr, FeH_min, FeH_max, N_FeH);
+	// Construct the table of template magnitudes
+	unsigned int N_nodes = N_Mr * N_FeH;
+	sed_table = new float[NBANDS*N_nodes];
+	for(unsigned int i=0; i<NBANDS*N_nodes; i++) { sed_table[i] = 0.f; }
 	unsigned int idx;
 	double colors[NBANDS-1];
+	double absmag[NBANDS];
 	unsigned int r_index = 1; // TODO: indicate r_index in the template file
 	
 	// Now do a second pass to load the SEDs
@@ -658,17 +686,17 @@ bool TStellarModel::load_seds(std::string seds_fname) {
 		std::istringstream ss(line);
 		ss >> Mr >> FeH;
 		
-		idx = sed_interp->get_index(Mr, FeH);
+		idx = (unsigned int)((Mr - Mr_min) / dMr + 0.5) + N_Mr * (unsigned int)((FeH - FeH_min) / dFeH + 0.5);
+		assert(idx < N_nodes);
 		
-		TSED &sed_tmp = (*sed_interp)[idx];
-		//sed_tmp.Mr = Mr;
-		//sed_tmp.FeH = FeH;
 		for(unsigned int i=0; i<NBANDS-1; i++) { ss >> colors[i]; }
 		
 		// Transform colors into absolute magnitudes
-		sed_tmp.absmag[r_index] = Mr;
-		for(int i=r_index-1; i>=0; i--) { sed_tmp.absmag[i] = sed_tmp.absmag[i+1] + colors[i]; }
-		for(int i=r_index+1; i<NBANDS; i++) { sed_tmp.absmag[i] = sed_tmp.absmag[i-1] - colors[i-1]; }
+		absmag[r_index] = Mr;
+		for(int i=r_index-1; i>=0; i--) { absmag[i] = absmag[i+1] + colors[i]; }
+		for(int i=r_index+1; i<NBANDS; i++) { absmag[i] = absmag[i-1] - colors[i-1]; }
+		
+		for(unsigned int i=0; i<NBANDS; i++) { sed_table[N_nodes*i + idx] = absmag[i]; }
 		
 		count++;
 	}
@@ -683,6 +711,12 @@ bool TStellarModel::load_seds(std::string seds_fname) {
 	Mr_max_seds = Mr_max;
 	FeH_min_seds = FeH_min;
 	FeH_max_seds = FeH_max;
+	N_Mr_seds = N_Mr;
+	N_FeH_seds = N_FeH;
+	dMr_seds = (Mr_max - Mr_min) / (double)(N_Mr - 1);
+	dFeH_seds = (FeH_max - FeH_min) / (double)(N_FeH - 1);
+	inv_dMr_seds = 1. / dMr_seds;
+	inv_dFeH_seds = 1. / dFeH_seds;
 	
 	std::cout << "# " << Mr_min_seds << " < Mr < " << Mr_max_seds << std::endl;
 	std::cout << "# " << FeH_min_seds << " < FeH < " << FeH_max_seds << std::endl;
@@ -691,25 +725,46 @@ bool TStellarModel::load_seds(std::string seds_fname) {
 }
 
 
+// Returns zero magnitudes outside of the library
 TSED TStellarModel::get_sed(double Mr, double FeH) {
-	return (*sed_interp)(Mr, FeH);
+	TSED sed;
+	get_sed(Mr, FeH, sed);
+	return sed;
 }
 
-// x = {M_r, Fe/H}
-bool TStellarModel::get_sed(const double* x, TSED& sed) const {
-	if((x[0] <= Mr_min_seds) || (x[0] >= Mr_max_seds) || (x[1] <= FeH_min_seds) || (x[1] >= FeH_max_seds)) {
-		return false;
-	}
-	sed = (*sed_interp)(x[0], x[1]);
-	return true;
-}
-
-bool TStellarModel::get_sed(double Mr, double FeH, TSED& sed) const {
-	if((Mr <= Mr_min_seds) || (Mr >= Mr_max_seds) || (FeH <= FeH_min_seds) || (FeH >= FeH_max_seds)) {
-		return false;
+void TStellarModel::get_sed_batch(const double *const Mr, const double *const FeH, unsigned int n,
+                                  double *const absmag, unsigned int stride, bool *const in_lib) const {
+	unsigned int N_nodes = N_Mr_seds * N_FeH_seds;
+	
+	// Points are clamped to the interior of the grid, so that the loop over bands has no branches
+	double x_max = (double)(N_Mr_seds - 1) - 1.e-6;
+	double y_max = (double)(N_FeH_seds - 1) - 1.e-6;
+	double x, y;
+	unsigned int k, j;
+	float a_x, a_y;
+	const float *f;
+	
+	for(unsigned int m=0; m<n; m++) {
+		in_lib[m] = (Mr[m] > Mr_min_seds) && (Mr[m] < Mr_max_seds) && (FeH[m] > FeH_min_seds) && (FeH[m] < FeH_max_seds);
+		
+		x = (Mr[m] - Mr_min_seds) * inv_dMr_seds;
+		y = (FeH[m] - FeH_min_seds) * inv_dFeH_seds;
+		x = (x < 0.) ? 0. : ((x > x_max) ? x_max : x);
+		y = (y < 0.) ? 0. : ((y > y_max) ? y_max : y);
+		if(x != x) { x = 0.; }	// NaN
+		if(y != y) { y = 0.; }
+		
+		k = (unsigned int)x;
+		j = (unsigned int)y;
+		a_x = x - (double)k;
+		a_y = y - (double)j;
+		
+		f = sed_table + N_Mr_seds*j + k;
+		for(unsigned int i=0; i<NBANDS; i++, f+=N_nodes) {
+			absmag[stride*i + m] = (1.f - a_x) * ((1.f - a_y)*f[0] + a_y*f[N_Mr_seds])
+			                       + a_x * ((1.f - a_y)*f[1] + a_y*f[N_Mr_seds+1]);
+		}
 	}
-	sed = (*sed_interp)(Mr, FeH);
-	return true;
 }
 
 bool TStellarModel::in_model(double Mr, double FeH) {
@@ -720,6 +775,15 @@ double TStellarModel::get_log_lf(double Mr) const {
 	return (*log_lf_interp)(Mr) - log_lf_norm;
 }
 
+void TStellarModel::get_sed_grid(double &Mr_min, double &dMr, unsigned int &N_Mr, double &FeH_min, double &dFeH, unsigned int &N_FeH) const {
+	Mr_min = Mr_min_seds;
+	dMr = dMr_seds;
+	N_Mr = N_Mr_seds;
+	FeH_min = FeH_min_seds;
+	dFeH = dFeH_seds;
+	N_FeH = N_FeH_seds;
+}
+
 
 
 /****************************************************************************************************************************
@@ -916,11 +980,10 @@ bool TSyntheticStellarModel::get_sed(const double* MtZ, TSED& sed) const {
 }
 
 bool TSyntheticStellarModel::get_sed(double logMass, double logtau, double FeH, TSED &sed) {
-	Theta[0] = logMass;
-	Theta[1] = logtau;
-	Theta[2] = FeH;
+	// Local copy of coordinates, so that concurrent callers do not share state
+	double MtZ[3] = {logMass, logtau, FeH};
 	
-	return (*sed_interp)(&Theta[0], sed);
+	return (*sed_interp)(&MtZ[0], sed);
 }
 
 
@@ -931,7 +994,9 @@ bool TSyntheticStellarModel::get_sed(double logMass, double logtau, double FeH,
  * 
  ****************************************************************************************************************************/
 
-TExtinctionModel::TExtinctionModel(std::string A_RV_fname) {
+TExtinctionModel::TExtinctionModel(std::string A_RV_fname, unsigned int _N_RV)
+	: N_RV(_N_RV), A_table(NULL)
+{
 	std::vector<double> Acoeff;
 	std::vector<double> RV;
 	double tmp;
@@ -959,39 +1024,85 @@ TExtinctionModel::TExtinctionModel(std::string A_RV_fname) {
 		}
 	}
 	
-	A_spl = new gsl_spline*[NBANDS];
-	acc = new gsl_interp_accel*[NBANDS];
+	// Tabulate the spline through the coefficients on a regular grid in R_V
+	assert(N_RV >= 2);
+	dRV = (RV_max - RV_min) / (double)(N_RV - 1);
+	inv_dRV = 1. / dRV;
+	A_table = new double[NBANDS*N_RV];
 	
 	unsigned int N = RV.size();
 	double Acoeff_i[N];
 	double RV_arr[N];
 	for(unsigned int k=0; k<N; k++) { RV_arr[k] = RV[k]; }
+	gsl_spline *A_spl = gsl_spline_alloc(gsl_interp_cspline, N);
+	gsl_interp_accel *acc = gsl_interp_accel_alloc();
 	for(unsigned int i=0; i<NBANDS; i++) {
 		for(unsigned int k=0; k<N; k++) { Acoeff_i[k] = Acoeff[NBANDS*k + i]; }
-		A_spl[i] = gsl_spline_alloc(gsl_interp_cspline, N);
-		acc[i] = gsl_interp_accel_alloc();
-		gsl_spline_init(A_spl[i], RV_arr, Acoeff_i, N);
+		gsl_spline_init(A_spl, RV_arr, Acoeff_i, N);
+		gsl_interp_accel_reset(acc);
+		for(unsigned int k=0; k<N_RV; k++) {
+			A_table[NBANDS*k + i] = gsl_spline_eval(A_spl, std::min(RV_min + (double)k * dRV, RV_max), acc);
+		}
 	}
+	gsl_spline_free(A_spl);
+	gsl_interp_accel_free(acc);
+	
+	set_fixed_RV(3.1);
 }
 
 TExtinctionModel::~TExtinctionModel() {
-	for(unsigned int i=0; i<NBANDS; i++) {
-		gsl_spline_free(A_spl[i]);
-		gsl_interp_accel_free(acc[i]);
-	}
-	delete[] A_spl;
-	delete[] acc;
+	if(A_table != NULL) { delete[] A_table; }
 }
 
-double TExtinctionModel::get_A(double RV, unsigned int i) {
+double TExtinctionModel::get_A(double RV, unsigned int i) const {
 	if(!in_model(RV)) { return std::numeric_limits<double>::quiet_NaN(); }
-	return gsl_spline_eval(A_spl[i], RV, acc[i]);
+	if(RV == RV_fixed) { return A_fixed[i]; }
+	
+	double x = (RV - RV_min) * inv_dRV;
+	unsigned int k = (unsigned int)x;
+	if(k >= N_RV - 1) { k = N_RV - 2; }
+	double a = x - (double)k;
+	
+	return (1. - a) * A_table[NBANDS*k + i] + a * A_table[NBANDS*(k+1) + i];
 }
 
-bool TExtinctionModel::in_model(double RV) {
+const double* TExtinctionModel::get_A(double RV, double *const A_buf) const {
+	if(RV == RV_fixed) { return &(A_fixed[0]); }
+	
+	if(!in_model(RV)) {
+		for(unsigned int i=0; i<NBANDS; i++) { A_buf[i] = std::numeric_limits<double>::quiet_NaN(); }
+		return A_buf;
+	}
+	
+	double x = (RV - RV_min) * inv_dRV;
+	unsigned int k = (unsigned int)x;
+	if(k >= N_RV - 1) { k = N_RV - 2; }
+	double a = x - (double)k;
+	
+	const double *const A_0 = A_table + NBANDS*k;
+	const double *const A_1 = A_0 + NBANDS;
+	for(unsigned int i=0; i<NBANDS; i++) { A_buf[i] = (1. - a) * A_0[i] + a * A_1[i]; }
+	
+	return A_buf;
+}
+
+bool TExtinctionModel::in_model(double RV) const {
 	return (RV >= RV_min) && (RV <= RV_max);
 }
 
+void TExtinctionModel::set_fixed_RV(double RV) {
+	// Bypass the cache while filling it
+	RV_fixed = std::numeric_limits<double>::quiet_NaN();
+	double A_tmp[NBANDS];
+	get_A(RV, &(A_tmp[0]));
+	for(unsigned int i=0; i<NBANDS; i++) { A_fixed[i] = A_tmp[i]; }
+	RV_fixed = RV;
+}
+
+double TExtinctionModel::get_fixed_RV() const { return RV_fixed; }
+
+const double* TExtinctionModel::get_fixed_A() const { return &(A_fixed[0]); }
+
 
 
 /****************************************************************************************************************************
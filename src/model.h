@@ -85,11 +85,23 @@ public:
 	bool in_model(double Mr, double FeH);
 	double get_log_lf(double Mr) const;
 	
+	// Absolute magnitudes of n points at once, in struct-of-arrays layout: absmag[stride*i + j] is
+	// band i of point j. Points outside the library have in_lib[j] = false, and finite (but meaningless) magnitudes.
+	void get_sed_batch(const double *const Mr, const double *const FeH, unsigned int n,
+	                   double *const absmag, unsigned int stride, bool *const in_lib) const;
+	
+	// Regular grid on which the templates are defined: N_Mr x N_FeH nodes, starting at (Mr_min, FeH_min)
+	void get_sed_grid(double &Mr_min, double &dMr, unsigned int &N_Mr, double &FeH_min, double &dFeH, unsigned int &N_FeH) const;
+	
 private:
 	// Template library data
 	double dMr_seds, dFeH_seds, Mr_min_seds, FeH_min_seds, Mr_max_seds, FeH_max_seds;	// Sample spacing for stellar SEDs
 	unsigned int N_FeH_seds, N_Mr_seds;
-	TBilinearInterp<TSED> *sed_interp;	// Bilinear interpolation of stellar SEDs in Mr and FeH
+	double inv_dMr_seds, inv_dFeH_seds;
+	
+	// Template magnitudes in single precision, one plane per band: sed_table[N_Mr*N_FeH*i + N_Mr*j + k]
+	// is band i at the kth Mr and jth [Fe/H] node
+	float *sed_table;
 	
 	// Luminosity function library data
 	TLinearInterp *log_lf_interp;
@@ -99,6 +111,43 @@ private:
 	bool load_seds(std::string seds_fname);
 };
 
+// Bilinear interpolation in the template table
+inline bool TStellarModel::get_sed(double Mr, double FeH, TSED& sed) const {
+	if((Mr <= Mr_min_seds) || (Mr >= Mr_max_seds) || (FeH <= FeH_min_seds) || (FeH >= FeH_max_seds)) {
+		return false;
+	}
+	
+	// Rounding can put a point just inside the upper edge on the last node, so clamp as in get_sed_batch
+	double x = (Mr - Mr_min_seds) * inv_dMr_seds;
+	double y = (FeH - FeH_min_seds) * inv_dFeH_seds;
+	double x_max = (double)(N_Mr_seds - 1) - 1.e-6;
+	double y_max = (double)(N_FeH_seds - 1) - 1.e-6;
+	if(x > x_max) { x = x_max; }
+	if(y > y_max) { y = y_max; }
+	unsigned int k = (unsigned int)x;
+	unsigned int j = (unsigned int)y;
+	float a_x = x - (double)k;
+	float a_y = y - (double)j;
+	
+	float w_00 = (1.f - a_x) * (1.f - a_y);
+	float w_10 = a_x * (1.f - a_y);
+	float w_01 = (1.f - a_x) * a_y;
+	float w_11 = a_x * a_y;
+	
+	unsigned int N_nodes = N_Mr_seds * N_FeH_seds;
+	const float *f = sed_table + N_Mr_seds*j + k;
+	for(unsigned int i=0; i<NBANDS; i++, f+=N_nodes) {
+		sed.absmag[i] = w_00*f[0] + w_10*f[1] + w_01*f[N_Mr_seds] + w_11*f[N_Mr_seds+1];
+	}
+	
+	return true;
+}
+
+// x = {M_r, Fe/H}
+inline bool TStellarModel::get_sed(const double* x, TSED& sed) const {
+	return get_sed(x[0], x[1], sed);
+}
+
 // Returns a normalized creation function C(logM, tau),
 // where logM is the log (base 10) of stellar mass, and
 // tau (positive) is the time in the past. The creation
@@ -167,18 +216,34 @@ private:
 };
 
 // Dust extinction model
+// Extinction coefficients as a function of R_V. The cubic spline through the input
+// file is tabulated once on a fine grid, after which all lookups are const, and
+// safe to call from any number of threads.
 class TExtinctionModel {
 public:
-	TExtinctionModel(std::string A_RV_fname);
+	TExtinctionModel(std::string A_RV_fname, unsigned int _N_RV=2001);
 	~TExtinctionModel();
 	
-	double get_A(double RV, unsigned int i);	// Get A_i(EBV=1), where i is a bandpass
-	bool in_model(double RV);
+	double get_A(double RV, unsigned int i) const;	// Get A_i(EBV=1), where i is a bandpass
+	
+	// Get A_i(EBV=1) in all bands. Returns the cached coefficients if RV is the fixed R_V,
+	// and otherwise fills (and returns) A_buf.
+	const double* get_A(double RV, double *const A_buf) const;
+	
+	bool in_model(double RV) const;
+	
+	// Cache the coefficients for an R_V that will be used repeatedly (default: 3.1)
+	void set_fixed_RV(double RV);
+	double get_fixed_RV() const;
+	const double* get_fixed_A() const;
 	
 private:
-	double RV_min, RV_max;
-	gsl_spline **A_spl;
-	gsl_interp_accel **acc;
+	double RV_min, RV_max, dRV, inv_dRV;
+	unsigned int N_RV;
+	double *A_table;	// A_table[NBANDS*k + i] is A_i at the kth R_V node
+	
+	double RV_fixed;
+	double A_fixed[NBANDS];
 };
 
 // Luminosity function
@@ -300,9 +365,14 @@ public:
 	double log_prior_synth(double DM, double logM, double logtau, double FeH) const;
 	double log_prior_synth(const double* x) const;
 	
-	// Full priors on (DM, Mr, [Fe/H]) for empirical stellar model
+	// Full priors on (DM, Mr, [Fe/H]) for empirical stellar model. These are looked up
+	// in a table over (DM, [Fe/H]), built in init(), and computed directly off the table.
 	double log_prior_emp(double DM, double Mr, double FeH) const;
 	double log_prior_emp(const double* x) const;
+	double log_prior_emp_full(double DM, double FeH) const;
+	
+	// Prior including the luminosity function of stellar_model, which is separable in Mr
+	double log_prior_emp(const double* x, const TStellarModel &stellar_model) const;
 	
 	// Expected dust reddening, up to normalizing constant
 	double dA_dmu(double DM) const;
@@ -325,6 +395,10 @@ private:
 	double DM_min, DM_max, DM_samples, log_dNdmu_norm;
 	TLinearInterp *log_dNdmu_arr, *f_halo_arr, *mu_FeH_disk_arr;
 	
+	// Table of log_prior_emp_full over DM_min < DM < DM_max, FeH_min_table < FeH < FeH_max_table
+	double FeH_min_table, FeH_max_table;
+	TBilinearInterp<double> *log_prior_emp_arr;
+	
 	void init(double _l, double _b);
 	
 	// Stellar density
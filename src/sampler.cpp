@@ -34,7 +34,7 @@
  ****************************************************************************************************************************/
 
 TMCMCParams::TMCMCParams(TGalacticLOSModel *_gal_model, TSyntheticStellarModel *_synth_stellar_model, TStellarModel *_emp_stellar_model,
-			  TExtinctionModel *_ext_model, TStellarData *_data, unsigned int _N_DM, double _DM_min, double _DM_max)
+			  const TExtinctionModel *_ext_model, TStellarData *_data, unsigned int _N_DM, double _DM_min, double _DM_max)
 	: gal_model(_gal_model), synth_stellar_model(_synth_stellar_model), emp_stellar_model(_emp_stellar_model),
           ext_model(_ext_model), data(_data), N_DM(_N_DM), DM_min(_DM_min), DM_max(_DM_max)
 {
@@ -52,6 +52,30 @@ TMCMCParams::TMCMCParams(TGalacticLOSModel *_gal_model, TSyntheticStellarModel *
 	RV_variance = 0.2*0.2;
 	
 	use_priors = true;
+	marg_EBV = false;
+}
+
+TMCMCParams::TMCMCParams(const TMCMCParams& p)
+	: gal_model(p.gal_model), synth_stellar_model(p.synth_stellar_model), emp_stellar_model(p.emp_stellar_model),
+	  ext_model(p.ext_model), data(p.data), N_DM(p.N_DM), DM_min(p.DM_min), DM_max(p.DM_max)
+{
+	N_stars = p.N_stars;
+	EBV_interp = new TLinearInterp(DM_min, DM_max, N_DM);
+	for(unsigned int i=0; i<N_DM; i++) { (*EBV_interp)[i] = (*(p.EBV_interp))[i]; }
+	EBV_min = p.EBV_min;
+	EBV_max = p.EBV_max;
+	
+	EBV_SFD = p.EBV_SFD;
+	EBV_floor = p.EBV_floor;
+	lnp0 = p.lnp0;
+	idx_star = p.idx_star;
+	
+	vary_RV = p.vary_RV;
+	RV_mean = p.RV_mean;
+	RV_variance = p.RV_variance;
+	
+	use_priors = p.use_priors;
+	marg_EBV = p.marg_EBV;
 }
 
 TMCMCParams::~TMCMCParams() {
@@ -88,27 +112,26 @@ double TMCMCParams::get_EBV(double DM) {
 //     x = {DM, Log_10(Mass_init), Log_10(Age), [Fe/H]}
 double logP_single_star_synth(const double *x, double EBV, double RV,
                               const TGalacticLOSModel &gal_model, const TSyntheticStellarModel &stellar_model,
-                              TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed) {
+                              const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed) {
 	double logP = 0.;
 	
 	/*
 	 *  Likelihood
 	 */
-	bool del_sed = false;
-	if(tmp_sed == NULL) {
-		del_sed = true;
-		tmp_sed = new TSED(true);
-	}
+	TSED local_sed(true);
+	if(tmp_sed == NULL) { tmp_sed = &local_sed; }
 	if(!stellar_model.get_sed(x+1, *tmp_sed)) {
-		if(del_sed) { delete tmp_sed; }
 		return neg_inf_replacement;
 	}
 	
+	double A_buf[NBANDS];
+	const double *A = ext_model.get_A(RV, &(A_buf[0]));
+	
 	double logL = 0.;
 	double tmp;
 	for(unsigned int i=0; i<NBANDS; i++) {
 		if(d.err[i] < 1.e9) {
-			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * ext_model.get_A(RV, i);	// Model apparent magnitude
+			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * A[i];	// Model apparent magnitude
 			logL -= log( 1. + exp((tmp - d.maglimit[i] - 0.16) / 0.20) );
 			//logL += log( 0.5 - 0.5 * erf((tmp - d.maglimit[i] + 0.1) / 0.25) );	// Completeness fraction
 			tmp = (d.m[i] - tmp) / d.err[i];
@@ -117,8 +140,6 @@ double logP_single_star_synth(const double *x, double EBV, double RV,
 	}
 	logP += logL - d.lnL_norm;
 	
-	if(del_sed) { delete tmp_sed; }
-	
 	/*
 	 *  Priors
 	 */
@@ -132,7 +153,7 @@ double logP_single_star_synth(const double *x, double EBV, double RV,
 //     x = {DM, M_r, [Fe/H]}
 double logP_single_star_emp(const double *x, double EBV, double RV,
                             const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
-                            TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed) {
+                            const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed) {
 	double logP = 0.;
 	
 	/*
@@ -152,21 +173,20 @@ double logP_single_star_emp(const double *x, double EBV, double RV,
 	/*
 	 *  Likelihood
 	 */
-	bool del_sed = false;
-	if(tmp_sed == NULL) {
-		del_sed = true;
-		tmp_sed = new TSED(true);
-	}
+	TSED local_sed(true);
+	if(tmp_sed == NULL) { tmp_sed = &local_sed; }
 	if(!stellar_model.get_sed(x+1, *tmp_sed)) {
-		if(del_sed) { delete tmp_sed; }
 		return neg_inf_replacement;
 	}
 	
+	double A_buf[NBANDS];
+	const double *A = ext_model.get_A(RV, &(A_buf[0]));
+	
 	double logL = 0.;
 	double tmp;
 	for(unsigned int i=0; i<NBANDS; i++) {
 		if(d.err[i] < 1.e9) {
-			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * ext_model.get_A(RV, i);	// Model apparent magnitude
+			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * A[i];	// Model apparent magnitude
 			logL -= log( 1. + exp((tmp - d.maglimit[i] - 0.16) / 0.20) );
 			//logL += log( 0.5 - 0.5 * erf((tmp - d.maglimit[i] + 0.1) / 0.25) );	// Completeness fraction
 			//std::cout << tmp << ", " << d.maglimit[i] << std::endl;
@@ -176,12 +196,10 @@ double logP_single_star_emp(const double *x, double EBV, double RV,
 	}
 	logP += logL - d.lnL_norm;
 	
-	if(del_sed) { delete tmp_sed; }
-	
 	/*
 	 *  Priors
 	 */
-	logP += gal_model.log_prior_emp(x) + stellar_model.get_log_lf(x[1]);
+	logP += gal_model.log_prior_emp(x, stellar_model);
 	
 	return logP;
 }
@@ -192,39 +210,294 @@ double logP_single_star_emp(const double *x, double EBV, double RV,
 //     x = {DM, M_r, [Fe/H]}
 double logP_single_star_emp_noprior(const double *x, double EBV, double RV,
                                     const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
-                                    TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed) {
+                                    const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed) {
 	double logP = 0.;
 	
 	/*
 	 *  Likelihood
 	 */
-	bool del_sed = false;
-	if(tmp_sed == NULL) {
-		del_sed = true;
-		tmp_sed = new TSED(true);
-	}
+	TSED local_sed(true);
+	if(tmp_sed == NULL) { tmp_sed = &local_sed; }
 	if(!stellar_model.get_sed(x+1, *tmp_sed)) {
-		if(del_sed) { delete tmp_sed; }
 		return neg_inf_replacement;
 	}
 	
+	double A_buf[NBANDS];
+	const double *A = ext_model.get_A(RV, &(A_buf[0]));
+	
 	double logL = 0.;
 	double tmp;
 	for(unsigned int i=0; i<NBANDS; i++) {
 		if(d.err[i] < 1.e9) {
-			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * ext_model.get_A(RV, i);	// Model apparent magnitude
+			tmp = tmp_sed->absmag[i] + x[_DM] + EBV * A[i];	// Model apparent magnitude
 			tmp = (d.m[i] - tmp) / d.err[i];
 			logL -= 0.5*tmp*tmp;
 		}
 	}
 	logP += logL - d.lnL_norm;
 	
-	if(del_sed) { delete tmp_sed; }
+	return logP;
+}
+
+
+// Natural logarithm of the upper tail probability of the standard normal, ln P(Z > z)
+double log_gaussian_tail(double z) {
+	if(z < 35.) { return log(0.5 * erfc(z / SQRT2)); }
+	return -0.5*z*z - log(z * SQRT2PI) + log(1. - 1./(z*z));	// Asymptotic expansion, where erfc underflows
+}
+
+// Natural logarithm of posterior probability density of x = {DM, M_r, [Fe/H]}, marginalized over E(B-V) >= EBV_min.
+//
+// The model magnitudes are linear in E(B-V), so for fixed x, chi^2 is quadratic in E(B-V), and the likelihood
+// is a Gaussian in E(B-V), with mean S_rA / S_AA and variance 1 / S_AA, where r_i is the residual at E(B-V) = 0,
+//     S_rA = sum_i A_i r_i / sigma_i^2 ,   S_AA = sum_i A_i^2 / sigma_i^2 .
+// This Gaussian is integrated in closed form. The completeness term does not fit this form, and is evaluated at the
+// mean E(B-V) of the truncated Gaussian. If not NULL, EBV_mu and EBV_sigma are set to the conditional mean and
+// standard deviation of E(B-V), before truncation.
+double logP_single_star_emp_marg_EBV(const double *x, double RV, double EBV_min,
+                                     const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
+                                     const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d,
+                                     bool use_priors, double *EBV_mu, double *EBV_sigma) {
+	if(isnan(x[0]) || isnan(x[1]) || isnan(x[2])) {
+		#pragma omp critical (cout)
+		{
+		std::cerr << "Encountered NaN parameter value!" << std::endl;
+		std::cerr << "  " << x[0] << std::endl;
+		std::cerr << "  " << x[1] << std::endl;
+		std::cerr << "  " << x[2] << std::endl;
+		}
+		return neg_inf_replacement;
+	}
+	
+	TSED sed(true);
+	if(!stellar_model.get_sed(x+1, sed)) {
+		return neg_inf_replacement;
+	}
+	
+	// Coefficients of chi^2 as a quadratic in E(B-V)
+	double A_buf[NBANDS];
+	const double *A = ext_model.get_A(RV, &(A_buf[0]));
+	double S_AA = 0.;
+	double S_rA = 0.;
+	double S_rr = 0.;
+	double r, w;
+	for(unsigned int i=0; i<NBANDS; i++) {
+		if(d.err[i] < 1.e9) {
+			r = d.m[i] - sed.absmag[i] - x[_DM];
+			w = 1. / (d.err[i]*d.err[i]);
+			S_AA += w * A[i] * A[i];
+			S_rA += w * r * A[i];
+			S_rr += w * r * r;
+		}
+	}
+	if(S_AA <= 0.) { return neg_inf_replacement; }	// E(B-V) is unconstrained
+	
+	double mu = S_rA / S_AA;
+	double sigma = 1. / sqrt(S_AA);
+	double alpha = (EBV_min - mu) / sigma;
+	double ln_tail = log_gaussian_tail(alpha);
+	
+	if(EBV_mu != NULL) { *EBV_mu = mu; }
+	if(EBV_sigma != NULL) { *EBV_sigma = sigma; }
+	
+	double logP = -0.5 * (S_rr - mu * S_rA) + log(SQRT2PI * sigma) + ln_tail - d.lnL_norm;
+	
+	if(use_priors) {
+		// Completeness, at the mean of the truncated Gaussian
+		double EBV_bar = mu + sigma * exp(-0.5*alpha*alpha - log(SQRT2PI) - ln_tail);
+		double m_mod;
+		for(unsigned int i=0; i<NBANDS; i++) {
+			if(d.err[i] < 1.e9) {
+				m_mod = sed.absmag[i] + x[_DM] + EBV_bar * A[i];
+				logP -= log( 1. + exp((m_mod - d.maglimit[i] - 0.16) / 0.20) );
+			}
+		}
+		
+		logP += gal_model.log_prior_emp(x, stellar_model);
+	}
 	
 	return logP;
 }
 
 
+// Natural logarithm of posterior probability density for L stellar states at once. The
+// states are stored in struct-of-arrays layout, with x[k*L + j] the kth coordinate of state j:
+//
+//     x = {DM, M_r, [Fe/H]}
+//
+// EBV (and RV, if not NULL) hold one value per state. If RV is NULL, all states share RV_fixed.
+// With use_priors set, this matches logP_single_star_emp, and otherwise logP_single_star_emp_noprior.
+void logP_single_star_emp_batch(const double *const x, const double *const EBV, const double *const RV, double RV_fixed,
+                                unsigned int L, const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
+                                const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d,
+                                double *const logP, bool use_priors) {
+	const double *const DM = x;
+	const double *const Mr = x + L;
+	const double *const FeH = x + 2*L;
+	
+	double A_buf[NBANDS];
+	const double *const A_fixed = ext_model.get_A(RV_fixed, &(A_buf[0]));
+	
+	// States are processed in blocks small enough to keep on the stack. Within a block,
+	// the loops over states have no branches, and can be vectorized by the compiler.
+	double absmag[NBANDS][LOGP_BATCH_BLOCK];
+	double A[NBANDS][LOGP_BATCH_BLOCK];
+	double logL[LOGP_BATCH_BLOCK];
+	bool in_lib[LOGP_BATCH_BLOCK];
+	
+	double x_star[3];
+	double m_mod, tmp, inv_err, m_lim;
+	unsigned int n;
+	
+	for(unsigned int j0=0; j0<L; j0+=LOGP_BATCH_BLOCK) {
+		n = (L - j0 < LOGP_BATCH_BLOCK) ? (L - j0) : LOGP_BATCH_BLOCK;
+		
+		// Gather SEDs and reddening vectors
+		stellar_model.get_sed_batch(Mr + j0, FeH + j0, n, &(absmag[0][0]), LOGP_BATCH_BLOCK, &(in_lib[0]));
+		
+		for(unsigned int j=0; j<n; j++) {
+			if(isnan(DM[j0+j]) || isnan(Mr[j0+j]) || isnan(FeH[j0+j])) {
+				#pragma omp critical (cout)
+				{
+				std::cerr << "Encountered NaN parameter value!" << std::endl;
+				std::cerr << "  " << DM[j0+j] << std::endl;
+				std::cerr << "  " << Mr[j0+j] << std::endl;
+				std::cerr << "  " << FeH[j0+j] << std::endl;
+				}
+				in_lib[j] = false;
+			}
+			
+			const double *const A_j = (RV == NULL) ? A_fixed : ext_model.get_A(RV[j0+j], &(A_buf[0]));
+			for(unsigned int i=0; i<NBANDS; i++) { A[i][j] = A_j[i]; }
+			
+			logL[j] = -d.lnL_norm;
+		}
+		
+		// Likelihood. Every state is compared against the same star, so the set
+		// of observed bands is common to the whole block.
+		for(unsigned int i=0; i<NBANDS; i++) {
+			if(d.err[i] >= 1.e9) { continue; }
+			
+			inv_err = 1. / d.err[i];
+			m_lim = d.maglimit[i] + 0.16;
+			
+			if(use_priors) {
+				for(unsigned int j=0; j<n; j++) {
+					m_mod = absmag[i][j] + DM[j0+j] + EBV[j0+j] * A[i][j];	// Model apparent magnitude
+					tmp = (d.m[i] - m_mod) * inv_err;
+					logL[j] -= log(1. + exp((m_mod - m_lim) * 5.)) + 0.5*tmp*tmp;	// Completeness and chi^2
+				}
+			} else {
+				for(unsigned int j=0; j<n; j++) {
+					m_mod = absmag[i][j] + DM[j0+j] + EBV[j0+j] * A[i][j];
+					tmp = (d.m[i] - m_mod) * inv_err;
+					logL[j] -= 0.5*tmp*tmp;
+				}
+			}
+		}
+		
+		// Priors
+		for(unsigned int j=0; j<n; j++) {
+			if(!in_lib[j]) {
+				logP[j0+j] = neg_inf_replacement;
+				continue;
+			}
+			
+			logP[j0+j] = logL[j];
+			
+			if(use_priors) {
+				x_star[0] = DM[j0+j];
+				x_star[1] = Mr[j0+j];
+				x_star[2] = FeH[j0+j];
+				logP[j0+j] += gal_model.log_prior_emp(&(x_star[0]), stellar_model);
+			}
+		}
+	}
+}
+
+// Score L random states of each of the first N_stars stars with logP_single_star_emp_batch, and check them
+// against logP_single_star_emp (or logP_single_star_emp_noprior). The states extend past the edges of the
+// stellar library, and alternate stars use a fixed R_V or one R_V per state. Returns true if all checks pass.
+bool test_emp_batch(const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model, const TExtinctionModel &ext_model,
+                    const TStellarData &stellar_data, double RV_mean, unsigned int N_stars, unsigned int L) {
+	if(stellar_data.star.size() < N_stars) { N_stars = stellar_data.star.size(); }
+	
+	double Mr_min, dMr, FeH_min, dFeH;
+	unsigned int N_Mr, N_FeH;
+	stellar_model.get_sed_grid(Mr_min, dMr, N_Mr, FeH_min, dFeH, N_FeH);
+	double Mr_max = Mr_min + (double)(N_Mr - 1) * dMr;
+	double FeH_max = FeH_min + (double)(N_FeH - 1) * dFeH;
+	
+	gsl_rng *r;
+	seed_gsl_rng(&r);
+	
+	double *x = new double[3*L];
+	double *EBV = new double[L];
+	double *RV = new double[L];
+	double *logP_batch = new double[L];
+	double x_star[3];
+	double logP, err;
+	double max_err = 0.;
+	unsigned int N_fail = 0;
+	
+	for(unsigned int n=0; n<N_stars; n++) {
+		const TStellarData::TMagnitudes &d = stellar_data.star[n];
+		bool vary_RV = (n % 2 == 1);
+		
+		for(unsigned int j=0; j<L; j++) {
+			x[j] = 4. + 15. * gsl_rng_uniform(r);
+			x[L+j] = Mr_min - 0.5 + (Mr_max - Mr_min + 1.) * gsl_rng_uniform(r);
+			x[2*L+j] = FeH_min - 0.2 + (FeH_max - FeH_min + 0.4) * gsl_rng_uniform(r);
+			EBV[j] = 3. * gsl_rng_uniform(r);
+			RV[j] = 2.5 + 1.5 * gsl_rng_uniform(r);
+			if(!ext_model.in_model(RV[j])) { RV[j] = RV_mean; }
+		}
+		
+		for(int use_priors=0; use_priors<2; use_priors++) {
+			logP_single_star_emp_batch(x, EBV, vary_RV ? RV : NULL, RV_mean, L, gal_model, stellar_model,
+			                           ext_model, d, logP_batch, (use_priors == 1));
+			
+			for(unsigned int j=0; j<L; j++) {
+				x_star[0] = x[j];
+				x_star[1] = x[L+j];
+				x_star[2] = x[2*L+j];
+				if(use_priors == 1) {
+					logP = logP_single_star_emp(&(x_star[0]), EBV[j], vary_RV ? RV[j] : RV_mean,
+					                            gal_model, stellar_model, ext_model, d);
+				} else {
+					logP = logP_single_star_emp_noprior(&(x_star[0]), EBV[j], vary_RV ? RV[j] : RV_mean,
+					                                    gal_model, stellar_model, ext_model, d);
+				}
+				
+				// The SEDs are interpolated in single precision, in a different order
+				if(is_neg_inf_replacement(logP) || is_neg_inf_replacement(logP_batch[j])) {
+					if(is_neg_inf_replacement(logP) != is_neg_inf_replacement(logP_batch[j])) { N_fail++; }
+				} else {
+					err = fabs(logP_batch[j] - logP);
+					if(err > max_err) { max_err = err; }
+					if(!(err <= 1.e-5 * (1. + fabs(logP)))) { N_fail++; }
+				}
+			}
+		}
+	}
+	
+	std::cout << "# Batched stellar ln(p): max. error = " << max_err << " over " << 2*L*N_stars << " states";
+	if(N_fail == 0) {
+		std::cout << " (passed)" << std::endl;
+	} else {
+		std::cout << " (FAILED: " << N_fail << " states)" << std::endl;
+	}
+	
+	delete[] x;
+	delete[] EBV;
+	delete[] RV;
+	delete[] logP_batch;
+	gsl_rng_free(r);
+	
+	return (N_fail == 0);
+}
+
+
 double logP_EBV(TMCMCParams &p) {
 	double logP = 0.;
 	
@@ -745,6 +1018,13 @@ void gen_rand_state_indiv_emp(double *const x, unsigned int N, gsl_rng *r, TMCMC
 	delete tmp_sed;
 }
 
+// Version of gen_rand_state_indiv_emp with E(B-V) marginalized out: x = {DM, M_r, [Fe/H], [R_V]}
+void gen_rand_state_indiv_emp_marg_EBV(double *const x, unsigned int N, gsl_rng *r, TMCMCParams &params) {
+	double y[5];
+	gen_rand_state_indiv_emp(&(y[0]), N+1, r, params);
+	for(unsigned int i=0; i<N; i++) { x[i] = y[i+1]; }
+}
+
 double logP_indiv_simple_synth(const double *x, unsigned int N, TMCMCParams &params) {
 	if(x[0] < params.EBV_floor) { return neg_inf_replacement; }
 	double RV;
@@ -783,10 +1063,317 @@ double logP_indiv_simple_emp(const double *x, unsigned int N, TMCMCParams &param
 	return logp;
 }
 
+// Version of logP_indiv_simple_emp with E(B-V) marginalized out: x = {DM, M_r, [Fe/H], [R_V]}
+double logP_indiv_simple_emp_marg_EBV(const double *x, unsigned int N, TMCMCParams &params) {
+	double RV;
+	double logp = 0;
+	if(params.vary_RV) {
+		RV = x[3];
+		if((RV <= 2.1) || (RV >= 5.)) {
+			return neg_inf_replacement;
+		}
+		logp = -0.5*(RV-params.RV_mean)*(RV-params.RV_mean)/params.RV_variance;
+	} else {
+		RV = params.RV_mean;
+	}
+	logp += logP_single_star_emp_marg_EBV(x, RV, params.EBV_floor, *params.gal_model, *params.emp_stellar_model,
+	                                      *params.ext_model, params.data->star[params.idx_star], params.use_priors);
+	return logp;
+}
+
+// Convert a chain in x = {DM, M_r, [Fe/H], [R_V]} into one in {E(B-V), DM, M_r, [Fe/H], [R_V]}, drawing E(B-V) for each
+// point from its (truncated Gaussian) conditional distribution. If img is not NULL, the (E(B-V), DM) surface is built
+// by adding the conditional E(B-V) profile of each point to its DM column, rather than by binning the draws.
+void expand_chain_marg_EBV(const TChain &chain_marg, TChain &chain, TMCMCParams &params, gsl_rng *r,
+                           const TRect &rect, cv::Mat *const img) {
+	unsigned int N = chain_marg.get_ndim();
+	assert(N+1 <= 5);
+	
+	const TStellarData::TMagnitudes &d = params.data->star[params.idx_star];
+	
+	if(img != NULL) { *img = cv::Mat::zeros(rect.N_bins[0], rect.N_bins[1], CV_64F); }
+	
+	chain.clear();
+	
+	double y[5];
+	const double *x;
+	double RV, mu, sigma, alpha_min, norm, z_lower, z_upper, p, E_lower, E_upper;
+	unsigned int i1, i2, k_begin, k_end;
+	
+	for(unsigned int n=0; n<chain_marg.get_length(); n++) {
+		x = chain_marg.get_element(n);
+		RV = params.vary_RV ? x[3] : params.RV_mean;
+		
+		if(is_neg_inf_replacement(logP_single_star_emp_marg_EBV(x, RV, params.EBV_floor, *params.gal_model,
+		                                                        *params.emp_stellar_model, *params.ext_model, d,
+		                                                        false, &mu, &sigma))) {
+			continue;
+		}
+		
+		y[0] = mu + gsl_ran_gaussian_tail(r, params.EBV_floor - mu, sigma);
+		for(unsigned int i=0; i<N; i++) { y[i+1] = x[i]; }
+		chain.add_point(&(y[0]), chain_marg.get_L(n), chain_marg.get_w(n));
+		
+		if(img == NULL) { continue; }
+		if(!rect.get_index(rect.min[0], x[_DM], i1, i2)) { continue; }
+		
+		// Probability in each E(B-V) pixel within 8 sigma of the (truncated) distribution
+		alpha_min = (params.EBV_floor - mu) / sigma;
+		norm = exp(log_gaussian_tail(alpha_min));
+		
+		if(norm < 1.e-300) {	// All the mass is piled up against the floor
+			if(rect.get_index(params.EBV_floor, x[_DM], i1, i2)) {
+				img->at<double>(i1, i2) += chain_marg.get_w(n);
+			}
+			continue;
+		}
+		
+		E_lower = std::max(mu - 8.*sigma, std::max(params.EBV_floor, rect.min[0]));
+		E_upper = std::max(mu, params.EBV_floor) + 8.*sigma;
+		if(E_lower >= rect.max[0]) { continue; }
+		k_begin = (unsigned int)((E_lower - rect.min[0]) / rect.dx[0]);
+		k_end = rect.N_bins[0];
+		if(E_upper < rect.max[0]) { k_end = (unsigned int)((E_upper - rect.min[0]) / rect.dx[0]) + 1; }
+		
+		for(unsigned int k=k_begin; k<k_end; k++) {
+			z_lower = (rect.min[0] + (double)k * rect.dx[0] - mu) / sigma;
+			z_upper = z_lower + rect.dx[0] / sigma;
+			if(z_upper <= alpha_min) { continue; }
+			if(z_lower < alpha_min) { z_lower = alpha_min; }
+			
+			// Difference of tails on the side of the mean where they do not cancel
+			if(z_lower >= 0.) {
+				p = 0.5 * (erfc(z_lower / SQRT2) - erfc(z_upper / SQRT2));
+			} else {
+				p = 0.5 * (erfc(-z_upper / SQRT2) - erfc(-z_lower / SQRT2));
+			}
+			
+			img->at<double>(k, i2) += chain_marg.get_w(n) * p / norm;
+		}
+	}
+	
+	if(img != NULL) {
+		*img /= chain_marg.get_total_weight();
+		
+		// E(B-V) is already smooth, so only DM is blurred
+		double s2 = 0.1 / rect.dx[1];
+		int w2 = 2 * ceil(30.*s2) + 1;
+		cv::GaussianBlur(*img, *img, cv::Size(w2,1), s2, s2, cv::BORDER_REPLICATE);
+		
+		img->convertTo(*img, CV_32F);
+	}
+}
+
+// Batched version of logP_indiv_simple_emp, for TAffineSampler::set_batch_pdf. The states are
+// in struct-of-arrays layout, x[k*L + j], with each state being x = {E(B-V), DM, M_r, [Fe/H], [R_V]}.
+void logP_indiv_simple_emp_batch(const double *const x, unsigned int N, unsigned int L, double *const logp, TMCMCParams &params) {
+	const double *const EBV = x;
+	const double *RV = NULL;
+	if(params.vary_RV) { RV = x + 4*L; }
+	
+	logP_single_star_emp_batch(x + L, EBV, RV, params.RV_mean, L, *params.gal_model, *params.emp_stellar_model,
+	                           *params.ext_model, params.data->star[params.idx_star], logp, params.use_priors);
+	
+	for(unsigned int j=0; j<L; j++) {
+		if(EBV[j] < params.EBV_floor) {
+			logp[j] = neg_inf_replacement;
+		} else if(params.vary_RV) {
+			if((RV[j] <= 2.1) || (RV[j] >= 5.)) {
+				logp[j] = neg_inf_replacement;
+			} else if(!is_neg_inf_replacement(logp[j])) {
+				logp[j] -= 0.5*(RV[j]-params.RV_mean)*(RV[j]-params.RV_mean)/params.RV_variance;
+			}
+		}
+	}
+}
+
+// Fit each star in params.data, handing the results to the write buffers (and to conv, lnZ) in star order.
+// With star_parallel set, the stars are fit concurrently as OpenMP tasks, each on its own copy of params.
+// The per-star samplers then run their ensembles serially (nested parallel regions get one thread each),
+// so that idle threads steal whole stars rather than sitting at the end of each star's parallel loop.
+// Returns the number of stars which failed to converge.
+unsigned int sample_indiv_stars(indiv_star_sampler_t f_sample_star, TMCMCOptions &options, TMCMCParams &params,
+                                unsigned int ndim, const TRect &rect, TImgStack &img_stack,
+                                TChainWriteBuffer &chainBuffer, TImgWriteBuffer *const imgBuffer,
+                                std::vector<bool> &conv, std::vector<double> &lnZ,
+                                const bool gatherSurfs, const bool star_parallel, int verbosity) {
+	unsigned int N_nonconv = 0;
+	
+	if(!star_parallel) {
+		TChain chain(ndim, 1);
+		double *GR = new double[ndim];
+		bool converged, has_GR;
+		double lnZ_tmp;
+		
+		for(size_t n=0; n<params.N_stars; n++) {
+			params.idx_star = n;
+			
+			has_GR = f_sample_star(options, params, ndim, rect, (gatherSurfs ? img_stack.img[n] : NULL),
+			                       chain, GR, converged, lnZ_tmp, verbosity);
+			
+			// Save thinned chain and binned p(DM, EBV) surface
+			chainBuffer.add(chain, converged, lnZ_tmp, has_GR ? GR : NULL);
+			if(imgBuffer != NULL) { imgBuffer->add(*(img_stack.img[n])); }
+			
+			lnZ.push_back(lnZ_tmp);
+			conv.push_back(converged);
+			if(!converged) { N_nonconv++; }
+		}
+		
+		delete[] GR;
+		
+		return N_nonconv;
+	}
+	
+	// Finished stars wait here until all stars before them have been written
+	std::vector<TChain*> chain_done(params.N_stars, NULL);
+	std::vector<double> lnZ_done(params.N_stars, 0.);
+	std::vector<char> conv_done(params.N_stars, 0);
+	std::vector<char> has_GR_done(params.N_stars, 0);
+	double *GR_done = new double[ndim*params.N_stars];
+	size_t N_written = 0;
+	
+	#pragma omp parallel
+	{
+		#pragma omp single
+		{
+			for(size_t n=0; n<params.N_stars; n++) {
+				#pragma omp task firstprivate(n)
+				{
+					TMCMCParams star_params(params);
+					star_params.idx_star = n;
+					
+					TChain *chain = new TChain(ndim, 1);
+					bool converged;
+					double lnZ_tmp;
+					
+					bool has_GR = f_sample_star(options, star_params, ndim, rect, (gatherSurfs ? img_stack.img[n] : NULL),
+					                            *chain, GR_done + ndim*n, converged, lnZ_tmp, verbosity);
+					
+					#pragma omp critical (indiv_write_buffer)
+					{
+						chain_done[n] = chain;
+						lnZ_done[n] = lnZ_tmp;
+						conv_done[n] = converged;
+						has_GR_done[n] = has_GR;
+						
+						// Flush every star that is now next in line
+						while((N_written < params.N_stars) && (chain_done[N_written] != NULL)) {
+							chainBuffer.add(*(chain_done[N_written]), conv_done[N_written], lnZ_done[N_written],
+							                has_GR_done[N_written] ? GR_done + ndim*N_written : NULL);
+							if(imgBuffer != NULL) { imgBuffer->add(*(img_stack.img[N_written])); }
+							
+							lnZ.push_back(lnZ_done[N_written]);
+							conv.push_back(conv_done[N_written]);
+							if(!conv_done[N_written]) { N_nonconv++; }
+							
+							delete chain_done[N_written];
+							chain_done[N_written] = NULL;
+							N_written++;
+						}
+					}
+				}
+			}
+		}
+	}
+	
+	assert(N_written == params.N_stars);
+	
+	delete[] GR_done;
+	
+	return N_nonconv;
+}
+
+bool sample_indiv_synth_star(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                             const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                             bool &converged, double &lnZ, int verbosity) {
+	unsigned int max_attempts = 3;
+	unsigned int N_steps = options.steps;
+	unsigned int N_samplers = options.samplers;
+	unsigned int N_runs = options.N_runs;
+	double GR_threshold = 1.1;
+	
+	TNullLogger logger;
+	TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_synth;
+	TAffineSampler<TMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_state_indiv_synth;
+	
+	timespec t_start, t_write, t_end;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	
+	//std::cerr << "# Setting up sampler" << std::endl;
+	TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
+	sampler.set_scale(1.2);
+	sampler.set_replacement_bandwidth(0.2);
+	sampler.set_sigma_min(0.02);
+	
+	//std::cerr << "# Burn-in" << std::endl;
+	sampler.step(N_steps, false, 0., 0.2);
+	sampler.clear();
+	
+	//std::cerr << "# Main run" << std::endl;
+	converged = false;
+	size_t attempt;
+	for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
+		sampler.step((1<<attempt)*N_steps, true, 0., 0.2);
+		
+		converged = true;
+		sampler.get_GR_diagnostic(GR);
+		for(size_t i=0; i<ndim; i++) {
+			if(GR[i] > GR_threshold) {
+				converged = false;
+				if(attempt != max_attempts-1) {
+					sampler.clear();
+					//logger.clear();
+				}
+				break;
+			}
+		}
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_write);
+	
+	// Compute evidence
+	chain = sampler.get_chain();
+	lnZ = chain.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
+	//if(isinf(lnZ)) { lnZ = neg_inf_replacement; }
+	
+	// Binned p(DM, EBV) surface
+	if(img != NULL) {
+		chain.get_image(*img, rect, 0, 1, true, 0.02, 0.1, 30.);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	
+	if(verbosity >= 2) {
+		#pragma omp critical (cout)
+		{
+		std::cout << "Star #" << params.idx_star+1 << " of " << params.N_stars << std::endl;
+		std::cout << "====================================" << std::endl;
+		
+		//std::cout << "Sampler stats:" << std::endl;
+		sampler.print_stats();
+		std::cout << std::endl;
+		
+		if(!converged) {
+			std::cout << "# Failed to converge." << std::endl;
+		}
+		
+		std::cout << "# Number of steps: " << (1<<(attempt-1))*N_steps << std::endl;
+		std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
+		std::cout << "# Sample time: " << std::setprecision(2) << (t_write.tv_sec - t_start.tv_sec) + 1.e-9*(t_write.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
+		std::cout << "# Write time: " << std::setprecision(2) << (t_end.tv_sec - t_write.tv_sec) + 1.e-9*(t_end.tv_nsec - t_write.tv_nsec) << " s" << std::endl << std::endl;
+		}
+	}
+	
+	return true;
+}
+
 void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                         TSyntheticStellarModel& stellar_model, TExtinctionModel& extinction_model, TStellarData& stellar_data,
                         TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
-                        double RV_sigma, double minEBV, const bool saveSurfs, const bool gatherSurfs, int verbosity) {
+                        double RV_sigma, double minEBV, const bool saveSurfs, const bool gatherSurfs, int verbosity,
+                        const bool star_parallel) {
 	// Parameters must be consistent - cannot save surfaces without gathering them
 	assert(!(saveSurfs & (!gatherSurfs)));
 	
@@ -814,136 +1401,233 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
 	TImgWriteBuffer *imgBuffer = NULL;
 	if(saveSurfs) { imgBuffer = new TImgWriteBuffer(rect, params.N_stars); }
 	
-	TNullLogger logger;
-	
-	unsigned int max_attempts = 3;
-	unsigned int N_steps = options.steps;
-	unsigned int N_samplers = options.samplers;
-	unsigned int N_runs = options.N_runs;
 	unsigned int ndim;
 	
 	if(params.vary_RV) { ndim = 6; } else { ndim = 5; }
 	
-	double *GR = new double[ndim];
-	double GR_threshold = 1.1;
-	
-	TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_synth;
-	TAffineSampler<TMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_state_indiv_synth;
-	
 	if(verbosity >= 1) {
 		std::cout << std::endl;
 	}
 	
-	unsigned int N_nonconv = 0;
-	
 	TChainWriteBuffer chainBuffer(ndim, 100, params.N_stars);
 	std::stringstream group_name;
 	group_name << "/" << stellar_data.pix_name;
 	
+	unsigned int N_nonconv = sample_indiv_stars(&sample_indiv_synth_star, options, params, ndim, rect, img_stack,
+	                                            chainBuffer, imgBuffer, conv, lnZ, gatherSurfs, star_parallel, verbosity);
+	
+	chainBuffer.write(out_fname, group_name.str(), "stellar chains");
+	if(saveSurfs) { imgBuffer->write(out_fname, group_name.str(), "stellar pdfs"); }
+	
+	if(verbosity >= 1) {
+		std::cout << "====================================" << std::endl;
+		std::cout << std::endl;
+		std::cout << "# Failed to converge " << N_nonconv << " of " << params.N_stars << " times (" << std::setprecision(2) << 100.*(double)N_nonconv/(double)(params.N_stars) << " %)." << std::endl;
+		std::cout << std::endl;
+		std::cout << "====================================" << std::endl;
+	}
+	
+	if(imgBuffer != NULL) { delete imgBuffer; }
+}
+
+bool sample_indiv_emp_star(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                           const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                           bool &converged, double &lnZ, int verbosity) {
+	unsigned int max_attempts = 3;
+	unsigned int N_steps = options.steps;
+	unsigned int N_samplers = options.samplers;
+	unsigned int N_runs = options.N_runs;
+	double GR_threshold = 1.1;
+	
+	TNullLogger logger;
+	TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_emp;
+	TAffineSampler<TMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_state_indiv_emp;
+	
+	// With E(B-V) marginalized out, the sampler runs in the remaining dimensions
+	unsigned int ndim_sampler = ndim;
+	double *GR_sampler = GR;
+	if(params.marg_EBV) {
+		ndim_sampler = ndim - 1;
+		GR_sampler = GR + 1;
+		GR[0] = std::numeric_limits<double>::quiet_NaN();
+		f_pdf = &logP_indiv_simple_emp_marg_EBV;
+		f_rand_state = &gen_rand_state_indiv_emp_marg_EBV;
+	}
+	
 	timespec t_start, t_write, t_end;
 	
-	for(size_t n=0; n<params.N_stars; n++) {
-		params.idx_star = n;
-		
-		clock_gettime(CLOCK_MONOTONIC, &t_start);
-		
-		if(verbosity >= 2) {
-			std::cout << "Star #" << n+1 << " of " << params.N_stars << std::endl;
-			std::cout << "====================================" << std::endl;
+	// Diagnostic output is collected here, and printed in one piece once the star is done
+	std::stringstream scale_log;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	
+	//std::cerr << "# Setting up sampler" << std::endl;
+	TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim_sampler, N_samplers*ndim_sampler, params, logger, N_runs);
+	sampler.set_scale(1.5);
+	sampler.set_replacement_bandwidth(0.30);
+	sampler.set_replacement_accept_bias(1.e-5);
+	sampler.set_sigma_min(0.02);
+	if(!params.marg_EBV) { sampler.set_batch_pdf(&logP_indiv_simple_emp_batch); }
+	
+	//std::cerr << "# Burn-in" << std::endl;
+	
+	// Burn-in
+	
+	// Round 1 (3/6)
+	sampler.step_MH(N_steps*(1./6.), false);
+	sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
+	
+	if(verbosity >= 2) {
+		scale_log << std::endl;
+		scale_log << "scale: (";
+		scale_log << std::setprecision(2);
+		for(int k=0; k<sampler.get_N_samplers(); k++) {
+			scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
 		}
+	}
+	
+	// Remove spurious modes
+	sampler.set_replacement_accept_bias(1.e-2);
+	int N_steps_biased = N_steps*(1./6.);
+	if(N_steps_biased > 20) { N_steps_biased = 20; }
+	sampler.step(N_steps_biased, false, 0., 1.);
+	
+	sampler.tune_stretch(6, 0.30);
+	sampler.tune_MH(6, 0.30);
+	
+	if(verbosity >= 2) {
+		scale_log << ") -> (";
+		for(int k=0; k<sampler.get_N_samplers(); k++) {
+			scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+		}
+		scale_log << ")" << std::endl;
+	}
+	
+	// Round 2 (3/6)
+	sampler.set_replacement_accept_bias(0.);
+	sampler.step_MH(N_steps*(1./6.), false);
+	sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
+	
+	if(verbosity >= 2) {
+		scale_log << "scale: (";
+		scale_log << std::setprecision(2);
+		for(int k=0; k<sampler.get_N_samplers(); k++) {
+			scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+		}
+	}
+	
+	sampler.tune_stretch(6, 0.30);
+	sampler.tune_MH(6, 0.30);
+	
+	if(verbosity >= 2) {
+		scale_log << ") -> (";
+		for(int k=0; k<sampler.get_N_samplers(); k++) {
+			scale_log << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+		}
+		scale_log << ")" << std::endl;
+		scale_log << std::endl;
+	}
+	
+	sampler.clear();
+	
+	//std::cerr << "# Main run" << std::endl;
+	
+	// Main run
+	converged = false;
+	size_t attempt;
+	for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
+		sampler.step((1<<attempt)*N_steps, true, 0., options.p_replacement);
+		//sampler.step_MH((1<<attempt)*N_steps*(1./3.), true);
 		
-		//std::cerr << "# Setting up sampler" << std::endl;
-		TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
-		sampler.set_scale(1.2);
-		sampler.set_replacement_bandwidth(0.2);
-		sampler.set_sigma_min(0.02);
-		
-		//std::cerr << "# Burn-in" << std::endl;
-		sampler.step(N_steps, false, 0., 0.2);
-		sampler.clear();
-		
-		//std::cerr << "# Main run" << std::endl;
-		bool converged = false;
-		size_t attempt;
-		for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
-			sampler.step((1<<attempt)*N_steps, true, 0., 0.2);
-			
-			converged = true;
-			sampler.get_GR_diagnostic(GR);
-			for(size_t i=0; i<ndim; i++) {
-				if(GR[i] > GR_threshold) {
-					converged = false;
-					if(attempt != max_attempts-1) {
-						sampler.clear();
-						//logger.clear();
-					}
-					break;
+		converged = true;
+		sampler.get_GR_diagnostic(GR_sampler);
+		for(size_t i=0; i<ndim_sampler; i++) {
+			if(GR_sampler[i] > GR_threshold) {
+				converged = false;
+				if(attempt != max_attempts-1) {
+					sampler.clear();
+					//logger.clear();
 				}
+				break;
 			}
 		}
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_write);
+	
+	if(params.marg_EBV) {
+		// Evidence of the marginalized chain, and E(B-V) restored from its conditional distribution
+		TChain chain_marg = sampler.get_chain();
+		lnZ = chain_marg.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
 		
-		clock_gettime(CLOCK_MONOTONIC, &t_write);
-		
+		gsl_rng *r;
+		seed_gsl_rng(&r);
+		expand_chain_marg_EBV(chain_marg, chain, params, r, rect, img);
+		gsl_rng_free(r);
+	} else {
 		// Compute evidence
-		TChain chain = sampler.get_chain();
-		double lnZ_tmp = chain.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
-		//if(isinf(lnZ_tmp)) { lnZ_tmp = neg_inf_replacement; }
-		
-		// Save thinned chain
-		chainBuffer.add(chain, converged, lnZ_tmp, GR);
+		chain = sampler.get_chain();
+		lnZ = chain.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
+		//if(isinf(lnZ)) { lnZ = neg_inf_replacement; }
 		
-		// Save binned p(DM, EBV) surface
-		if(gatherSurfs) {
-			chain.get_image(*(img_stack.img[n]), rect, 0, 1, true, 0.02, 0.1, 30.);
+		// Binned p(DM, EBV) surface
+		if(img != NULL) {
+			chain.get_image(*img, rect, 0, 1, true, 0.0125, 0.1, 30.);
 		}
-		if(saveSurfs) { imgBuffer->add(*(img_stack.img[n])); }
-		
-		lnZ.push_back(lnZ_tmp);
-		conv.push_back(converged);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	
+	if(verbosity >= 2) {
+		const TStellarData::TMagnitudes &d = params.data->star[params.idx_star];
 		
-		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		#pragma omp critical (cout)
+		{
+		std::cout << "Star #" << params.idx_star+1 << " of " << params.N_stars << std::endl;
+		std::cout << "====================================" << std::endl;
 		
-		//std::cout << "Sampler stats:" << std::endl;
-		if(verbosity >= 2) {
-			sampler.print_stats();
-			std::cout << std::endl;
+		std::cout << "mags = ";
+		for(unsigned int i=0; i<NBANDS; i++) {
+			std::cout << std::setprecision(4) << d.m[i] << " ";
 		}
+		std::cout << std::endl;
+		std::cout << "errs = ";
+		for(unsigned int i=0; i<NBANDS; i++) {
+			std::cout << std::setprecision(3) << d.err[i] << " ";
+		}
+		std::cout << std::endl;
+		std::cout << "maglimit = ";
+		for(unsigned int i=0; i<NBANDS; i++) {
+			std::cout << std::setprecision(3) << d.maglimit[i] << " ";
+		}
+		std::cout << std::endl << std::endl;
+		
+		std::cout << scale_log.str();
+		
+		sampler.print_stats();
+		std::cout << std::endl;
 		
 		if(!converged) {
-			N_nonconv++;
-			if(verbosity >= 2) {
-				std::cout << "# Failed to converge." << std::endl;
-			}
+			std::cout << "# Failed to converge." << std::endl;
 		}
 		
-		if(verbosity >= 2) {
-			std::cout << "# Number of steps: " << (1<<(attempt-1))*N_steps << std::endl;
-			std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
-			std::cout << "# Sample time: " << std::setprecision(2) << (t_write.tv_sec - t_start.tv_sec) + 1.e-9*(t_write.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
-			std::cout << "# Write time: " << std::setprecision(2) << (t_end.tv_sec - t_write.tv_sec) + 1.e-9*(t_end.tv_nsec - t_write.tv_nsec) << " s" << std::endl << std::endl;
+		std::cout << "# Number of steps: " << (1<<(attempt-1))*N_steps << std::endl;
+		std::cout << "# ln Z: " << lnZ << std::endl;
+		std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
+		std::cout << "# Sample time: " << std::setprecision(2) << (t_write.tv_sec - t_start.tv_sec) + 1.e-9*(t_write.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
+		std::cout << "# Write time: " << std::setprecision(2) << (t_end.tv_sec - t_write.tv_sec) + 1.e-9*(t_end.tv_nsec - t_write.tv_nsec) << " s" << std::endl << std::endl;
 		}
 	}
 	
-	chainBuffer.write(out_fname, group_name.str(), "stellar chains");
-	if(saveSurfs) { imgBuffer->write(out_fname, group_name.str(), "stellar pdfs"); }
-	
-	if(verbosity >= 1) {
-		std::cout << "====================================" << std::endl;
-		std::cout << std::endl;
-		std::cout << "# Failed to converge " << N_nonconv << " of " << params.N_stars << " times (" << std::setprecision(2) << 100.*(double)N_nonconv/(double)(params.N_stars) << " %)." << std::endl;
-		std::cout << std::endl;
-		std::cout << "====================================" << std::endl;
-	}
-	
-	if(imgBuffer != NULL) { delete imgBuffer; }
-	delete[] GR;
+	return true;
 }
 
 void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                       TStellarModel& stellar_model, TExtinctionModel& extinction_model, TStellarData& stellar_data,
                       TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
                       double RV_mean, double RV_sigma, double minEBV,
-                      const bool saveSurfs, const bool gatherSurfs, const bool use_priors, int verbosity) {
+                      const bool saveSurfs, const bool gatherSurfs, const bool use_priors, int verbosity,
+                      const bool star_parallel, const bool grid_eval, const bool marg_EBV) {
 	// Parameters must be consistent - cannot save surfaces without gathering them
 	assert(!(saveSurfs & (!gatherSurfs)));
 	
@@ -953,6 +1637,7 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 	TMCMCParams params(&galactic_model, NULL, &stellar_model, &extinction_model, &stellar_data, N_DM, DM_min, DM_max);
 	params.EBV_floor = minEBV;
 	params.use_priors = use_priors;
+	params.marg_EBV = marg_EBV;
 	
 	params.RV_mean = RV_mean;
 	if(RV_sigma > 0.) {
@@ -974,212 +1659,498 @@ void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLO
 	TImgWriteBuffer *imgBuffer = NULL;
 	if(saveSurfs) { imgBuffer = new TImgWriteBuffer(rect, params.N_stars); }
 	
-	unsigned int max_attempts = 3;
-	unsigned int N_steps = options.steps;
-	unsigned int N_samplers = options.samplers;
-	unsigned int N_runs = options.N_runs;
 	unsigned int ndim;
 	
 	if(params.vary_RV) { ndim = 5; } else { ndim = 4; }
 	
-	double *GR = new double[ndim];
-	double GR_threshold = 1.1;
-	
-	TNullLogger logger;
-	TAffineSampler<TMCMCParams, TNullLogger>::pdf_t f_pdf = &logP_indiv_simple_emp;
-	TAffineSampler<TMCMCParams, TNullLogger>::rand_state_t f_rand_state = &gen_rand_state_indiv_emp;
-	
-	timespec t_start, t_write, t_end;
-	
 	if(verbosity >= 1) {
 		std::cout << std::endl;
 	}
 	
-	unsigned int N_nonconv = 0;
-	
 	TChainWriteBuffer chainBuffer(ndim, 100, params.N_stars);
 	std::stringstream group_name;
 	group_name << "/" << stellar_data.pix_name;
 	
-	for(size_t n=0; n<params.N_stars; n++) {
-		params.idx_star = n;
-		
-		clock_gettime(CLOCK_MONOTONIC, &t_start);
-		
+	// The grid engine has no parallelism within a star, so stars are always spread across the threads
+	indiv_star_sampler_t f_sample_star = &sample_indiv_emp_star;
+	bool parallel = star_parallel;
+	if(grid_eval) {
+		if(params.vary_RV) {
+			std::cerr << "# Grid evaluation requires a fixed R_V. Sampling stars instead." << std::endl;
+		} else {
+			f_sample_star = &sample_indiv_emp_grid_star;
+			parallel = true;
+		}
+	}
+	
+	unsigned int N_nonconv = sample_indiv_stars(f_sample_star, options, params, ndim, rect, img_stack,
+	                                            chainBuffer, imgBuffer, conv, lnZ, gatherSurfs, parallel, verbosity);
+	
+	chainBuffer.write(out_fname, group_name.str(), "stellar chains");
+	if(saveSurfs) { imgBuffer->write(out_fname, group_name.str(), "stellar pdfs"); }
+	
+	if(verbosity >= 1) {
 		if(verbosity >= 2) {
-			std::cout << "Star #" << n+1 << " of " << params.N_stars << std::endl;
 			std::cout << "====================================" << std::endl;
-			
-			std::cout << "mags = ";
-			for(unsigned int i=0; i<NBANDS; i++) {
-				std::cout << std::setprecision(4) << params.data->star[n].m[i] << " ";
-			}
-			std::cout << std::endl;
-			std::cout << "errs = ";
-			for(unsigned int i=0; i<NBANDS; i++) {
-				std::cout << std::setprecision(3) << params.data->star[n].err[i] << " ";
-			}
 			std::cout << std::endl;
-			std::cout << "maglimit = ";
-			for(unsigned int i=0; i<NBANDS; i++) {
-				std::cout << std::setprecision(3) << params.data->star[n].maglimit[i] << " ";
-			}
-			std::cout << std::endl << std::endl;
 		}
-		
-		//std::cerr << "# Setting up sampler" << std::endl;
-		TParallelAffineSampler<TMCMCParams, TNullLogger> sampler(f_pdf, f_rand_state, ndim, N_samplers*ndim, params, logger, N_runs);
-		sampler.set_scale(1.5);
-		sampler.set_replacement_bandwidth(0.30);
-		sampler.set_replacement_accept_bias(1.e-5);
-		sampler.set_sigma_min(0.02);
-		
-		//std::cerr << "# Burn-in" << std::endl;
-		
-		// Burn-in
-		
-		// Round 1 (3/6)
-		sampler.step_MH(N_steps*(1./6.), false);
-		sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
-		
+		std::cout << "# Failed to converge " << N_nonconv << " of " << params.N_stars << " times (" << std::setprecision(2) << 100.*(double)N_nonconv/(double)(params.N_stars) << " %)." << std::endl;
 		if(verbosity >= 2) {
 			std::cout << std::endl;
-			std::cout << "scale: (";
-			std::cout << std::setprecision(2);
-			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
-			}
+			std::cout << "====================================" << std::endl << std::endl;
 		}
+	}
+	
+	if(imgBuffer != NULL) { delete imgBuffer; }
+}
+
+// Read back the stellar surfaces written to group_name of fname by sample_indiv_emp or sample_indiv_synth
+// (with saveSurfs set), along with the convergence flag and evidence of each star, so that the l.o.s. fits
+// can be rerun without sampling the stars again. Returns false if the surfaces were not saved.
+bool load_indiv_surfs(const std::string &fname, const std::string &group_name, TImgStack &img_stack,
+                      std::vector<bool> &conv, std::vector<double> &lnZ) {
+	H5::H5File *file = H5Utils::openFile(fname, H5Utils::READ);
+	if(file == NULL) { return false; }
+	
+	std::stringstream chain_name, img_name;
+	chain_name << "/" << group_name << "/stellar chains";
+	img_name << "/" << group_name << "/stellar pdfs";
+	
+	H5::DataSet *chain_dset = NULL;
+	H5::DataSet *img_dset = NULL;
+	try {
+		chain_dset = H5Utils::openDataSet(file, chain_name.str());
+		img_dset = H5Utils::openDataSet(file, img_name.str());
+	} catch(H5::Exception &err) { }
+	
+	bool usable = (chain_dset != NULL) && (img_dset != NULL);
+	
+	hsize_t dim[3];
+	if(usable) {
+		H5::DataSpace dspace = img_dset->getSpace();
+		usable = (dspace.getSimpleExtentNdims() == 3);
+		if(usable) { dspace.getSimpleExtentDims(&(dim[0])); }
+	}
+	
+	// Bounds of the surfaces, as written by TImgWriteBuffer
+	unsigned int N_bins[2];
+	double min[2], max[2];
+	if(usable) {
+		try {
+			H5::Attribute att = img_dset->openAttribute("nPix");
+			att.read(H5::PredType::NATIVE_UINT32, reinterpret_cast<void*>(&(N_bins[0])));
+			att = img_dset->openAttribute("min");
+			att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(&(min[0])));
+			att = img_dset->openAttribute("max");
+			att.read(H5::PredType::NATIVE_DOUBLE, reinterpret_cast<void*>(&(max[0])));
+		} catch(H5::AttributeIException &err) {
+			usable = false;
+		}
+	}
+	if(usable) { usable = (dim[1] == N_bins[0]) && (dim[2] == N_bins[1]); }
+	
+	// Convergence flags and evidences, as written by TChainWriteBuffer
+	char *converged = NULL;
+	float *lnZ_buf = NULL;
+	if(usable) {
+		converged = new char[dim[0]];
+		lnZ_buf = new float[dim[0]];
+		try {
+			H5::Attribute att = chain_dset->openAttribute("converged");
+			usable = (att.getSpace().getSimpleExtentNpoints() == dim[0]);
+			if(usable) { att.read(H5::PredType::NATIVE_CHAR, converged); }
+			att = chain_dset->openAttribute("ln(Z)");
+			usable = usable && (att.getSpace().getSimpleExtentNpoints() == dim[0]);
+			if(usable) { att.read(H5::PredType::NATIVE_FLOAT, lnZ_buf); }
+		} catch(H5::AttributeIException &err) {
+			usable = false;
+		}
+	}
+	
+	if(usable) {
+		float *buf = new float[dim[0] * dim[1] * dim[2]];
+		img_dset->read(buf, H5::PredType::NATIVE_FLOAT);
 		
-		// Remove spurious modes
-		sampler.set_replacement_accept_bias(1.e-2);
-		int N_steps_biased = N_steps*(1./6.);
-		if(N_steps_biased > 20) { N_steps_biased = 20; }
-		sampler.step(N_steps_biased, false, 0., 1.);
+		TRect rect(min, max, N_bins);
+		img_stack.resize(dim[0]);
+		img_stack.set_rect(rect);
+		for(size_t n=0; n<dim[0]; n++) {
+			cv::Mat(dim[1], dim[2], CV_32F, buf + n*dim[1]*dim[2]).copyTo(*(img_stack.img[n]));
+		}
 		
-		sampler.tune_stretch(6, 0.30);
-		sampler.tune_MH(6, 0.30);
+		conv.clear();
+		lnZ.clear();
+		for(size_t n=0; n<dim[0]; n++) {
+			conv.push_back(converged[n] != 0);
+			lnZ.push_back(lnZ_buf[n]);
+		}
 		
-		if(verbosity >= 2) {
-			std::cout << ") -> (";
-			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+		delete[] buf;
+	}
+	
+	if(converged != NULL) { delete[] converged; }
+	if(lnZ_buf != NULL) { delete[] lnZ_buf; }
+	if(chain_dset != NULL) { delete chain_dset; }
+	if(img_dset != NULL) { delete img_dset; }
+	delete file;
+	
+	return usable;
+}
+
+/*************************************************************************
+ * 
+ *   Grid evaluation of individual stellar posteriors
+ * 
+ *************************************************************************/
+
+TIndivGrid::TIndivGrid(TMCMCParams &params, const TRect &_rect, double _delta_logP)
+	: rect(_rect), delta_logP(_delta_logP), N_evaluated(0)
+{
+	const TStellarData::TMagnitudes &d = params.data->star[params.idx_star];
+	const TStellarModel &stellar_model = *params.emp_stellar_model;
+	use_priors = params.use_priors;
+	lnL_norm = d.lnL_norm;
+	
+	// Pixel centers
+	N_E = rect.N_bins[0];
+	N_DM = rect.N_bins[1];
+	E_c.resize(N_E);
+	DM_c.resize(N_DM);
+	for(unsigned int k=0; k<N_E; k++) { E_c[k] = rect.min[0] + ((double)k + 0.5) * rect.dx[0]; }
+	for(unsigned int l=0; l<N_DM; l++) { DM_c[l] = rect.min[1] + ((double)l + 0.5) * rect.dx[1]; }
+	
+	// Template-independent chi^2 coefficients
+	S = 0.;
+	S_A = 0.;
+	S_AA = 0.;
+	for(unsigned int i=0; i<NBANDS; i++) {
+		observed[i] = (d.err[i] < 1.e9);
+		A[i] = params.ext_model->get_A(params.RV_mean, i);
+		w[i] = observed[i] ? 1. / (d.err[i]*d.err[i]) : 0.;
+		m_lim[i] = d.maglimit[i] + 0.16;
+		S += w[i];
+		S_A += w[i] * A[i];
+		S_AA += w[i] * A[i] * A[i];
+	}
+	double det = S * S_AA - S_A * S_A;
+	bool degenerate = (det <= 1.e-10 * S * S_AA);	// E(B-V) and DM are degenerate (e.g., one band)
+	
+	// Library grid. The edges are excluded, as TStellarModel::get_sed rejects them.
+	double Mr_min, dMr, FeH_min, dFeH;
+	unsigned int N_Mr, N_FeH;
+	stellar_model.get_sed_grid(Mr_min, dMr, N_Mr, FeH_min, dFeH, N_FeH);
+	ln_dV = log(rect.dx[0] * rect.dx[1] * dMr * dFeH);
+	
+	// Galactic prior depends only on DM and [Fe/H]
+	log_prior.resize(N_DM * N_FeH, 0.);
+	log_prior_max.resize(N_FeH, 0.);
+	if(use_priors) {
+		double FeH;
+		for(unsigned int j=0; j<N_FeH; j++) {
+			FeH = FeH_min + (double)j * dFeH;
+			log_prior_max[j] = neg_inf_replacement;
+			for(unsigned int l=0; l<N_DM; l++) {
+				log_prior[N_DM*j + l] = params.gal_model->log_prior_emp(DM_c[l], 0., FeH);	// Mr is unused
+				if(log_prior[N_DM*j + l] > log_prior_max[j]) { log_prior_max[j] = log_prior[N_DM*j + l]; }
 			}
-			std::cout << ")" << std::endl;
 		}
-		
-		// Round 2 (3/6)
-		sampler.set_replacement_accept_bias(0.);
-		sampler.step_MH(N_steps*(1./6.), false);
-		sampler.step(N_steps*(2./6.), false, 0., options.p_replacement);
-		
-		if(verbosity >= 2) {
-			std::cout << "scale: (";
-			std::cout << std::setprecision(2);
-			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+	}
+	
+	// Templates
+	TSED sed(true);
+	TTemplate t;
+	double r, Q_min, E_0, DM_0;
+	if(N_Mr > 2 && N_FeH > 2) { tmpl.reserve((N_Mr - 2) * (N_FeH - 2)); }
+	for(unsigned int j=1; j+1<N_FeH; j++) {
+		for(unsigned int n=1; n+1<N_Mr; n++) {
+			t.Mr = Mr_min + (double)n * dMr;
+			t.FeH = FeH_min + (double)j * dFeH;
+			t.FeH_idx = j;
+			if(!stellar_model.get_sed(t.Mr, t.FeH, sed)) { continue; }
+			
+			t.S_r = 0.;
+			t.S_rA = 0.;
+			t.S_rr = 0.;
+			for(unsigned int i=0; i<NBANDS; i++) {
+				t.absmag[i] = sed.absmag[i];
+				if(!observed[i]) { continue; }
+				r = d.m[i] - sed.absmag[i];
+				t.S_r += w[i] * r;
+				t.S_rA += w[i] * r * A[i];
+				t.S_rr += w[i] * r * r;
+			}
+			
+			// Unconstrained minimum of chi^2
+			if(degenerate) {
+				Q_min = t.S_rr - t.S_r * t.S_r / S;
+			} else {
+				E_0 = (S * t.S_rA - S_A * t.S_r) / det;
+				DM_0 = (S_AA * t.S_r - S_A * t.S_rA) / det;
+				Q_min = t.S_rr - E_0 * t.S_rA - DM_0 * t.S_r;
 			}
+			if(Q_min < 0.) { Q_min = 0.; }
+			
+			t.log_lf = use_priors ? stellar_model.get_log_lf(t.Mr) : 0.;
+			t.logP_max = t.log_lf + log_prior_max[j] - lnL_norm - 0.5 * Q_min;
+			
+			tmpl.push_back(t);
 		}
-		
-		sampler.tune_stretch(6, 0.30);
-		sampler.tune_MH(6, 0.30);
-		
-		if(verbosity >= 2) {
-			std::cout << ") -> (";
-			for(int k=0; k<sampler.get_N_samplers(); k++) {
-				std::cout << sampler.get_sampler(k)->get_scale() << ((k == sampler.get_N_samplers() - 1) ? "" : ", ");
+	}
+	
+	std::sort(tmpl.begin(), tmpl.end());
+}
+
+TIndivGrid::~TIndivGrid() { }
+
+bool TIndivGrid::well_posed() const { return S > 0.; }
+
+unsigned int TIndivGrid::get_N_templates() const { return tmpl.size(); }
+
+unsigned int TIndivGrid::get_N_evaluated() const { return N_evaluated; }
+
+bool TIndivGrid::row_window(const TTemplate &t, unsigned int k, double logP_min, unsigned int &l_begin, unsigned int &l_end) const {
+	// Largest chi^2 that can still reach logP_min
+	double Q_cut = 2. * (t.log_lf + log_prior_max[t.FeH_idx] - lnL_norm - logP_min);
+	if(Q_cut < 0.) { return false; }
+	
+	// Along the row, chi^2 = S DM^2 + 2 b DM + c, with its minimum at DM_0
+	double E = E_c[k];
+	double b = E * S_A - t.S_r;
+	double c = t.S_rr - 2. * E * t.S_rA + E * E * S_AA;
+	double DM_0 = -b / S;
+	double Q_row = c - b * b / S;
+	if(Q_row > Q_cut) { return false; }
+	
+	double half_width = sqrt((Q_cut - Q_row) / S);
+	double l_min = ceil((DM_0 - half_width - rect.min[1]) / rect.dx[1] - 0.5);
+	double l_max = floor((DM_0 + half_width - rect.min[1]) / rect.dx[1] - 0.5);
+	if((l_max < 0.) || (l_min >= (double)N_DM)) { return false; }
+	
+	l_begin = (l_min < 0.) ? 0 : (unsigned int)l_min;
+	l_end = (l_max >= (double)N_DM) ? N_DM : (unsigned int)l_max + 1;
+	
+	return l_begin < l_end;
+}
+
+void TIndivGrid::row_logP(const TTemplate &t, unsigned int k, unsigned int l_begin, unsigned int l_end, double *const lp) const {
+	unsigned int n = l_end - l_begin;
+	const double *const DM = &(DM_c[l_begin]);
+	const double *const prior = &(log_prior[N_DM*t.FeH_idx + l_begin]);
+	
+	double E = E_c[k];
+	double b2 = 2. * (E * S_A - t.S_r);
+	double c = t.S_rr - 2. * E * t.S_rA + E * E * S_AA;
+	double base = t.log_lf - lnL_norm;
+	
+	// Likelihood and priors
+	for(unsigned int l=0; l<n; l++) {
+		lp[l] = base + prior[l] - 0.5 * ((S * DM[l] + b2) * DM[l] + c);
+	}
+	
+	// Completeness
+	if(use_priors) {
+		double offset;
+		for(unsigned int i=0; i<NBANDS; i++) {
+			if(!observed[i]) { continue; }
+			offset = t.absmag[i] + E * A[i] - m_lim[i];
+			for(unsigned int l=0; l<n; l++) {
+				lp[l] -= log(1. + exp((offset + DM[l]) * 5.));
 			}
-			std::cout << ")" << std::endl;
-			std::cout << std::endl;
 		}
+	}
+}
+
+double TIndivGrid::evaluate(cv::Mat *const img, TChain &chain, unsigned int N_samples) {
+	std::vector<double> p_img(N_E * N_DM, 0.);	// Posterior mass in each pixel, in units of exp(ref)
+	std::vector<double> lnZ_tmpl(tmpl.size(), neg_inf_replacement);
+	std::vector<double> lp(N_DM);
+	
+	double ref = neg_inf_replacement;
+	double logP_best = neg_inf_replacement;
+	double x_best[4];
+	double row_max, sum, scale;
+	unsigned int l_begin, l_end;
+	
+	N_evaluated = 0;
+	
+	for(unsigned int s=0; s<tmpl.size(); s++) {
+		const TTemplate &t = tmpl[s];
 		
-		sampler.clear();
-		
-		//std::cerr << "# Main run" << std::endl;
+		// No remaining template can contribute
+		if(t.logP_max < logP_best - delta_logP) { break; }
+		N_evaluated++;
 		
-		// Main run
-		bool converged = false;
-		size_t attempt;
-		for(attempt = 0; (attempt < max_attempts) && (!converged); attempt++) {
-			sampler.step((1<<attempt)*N_steps, true, 0., options.p_replacement);
-			//sampler.step_MH((1<<attempt)*N_steps*(1./3.), true);
+		sum = 0.;
+		for(unsigned int k=0; k<N_E; k++) {
+			if(!row_window(t, k, logP_best - delta_logP, l_begin, l_end)) { continue; }
+			row_logP(t, k, l_begin, l_end, &(lp[0]));
 			
-			converged = true;
-			sampler.get_GR_diagnostic(GR);
-			for(size_t i=0; i<ndim; i++) {
-				if(GR[i] > GR_threshold) {
-					converged = false;
-					if(attempt != max_attempts-1) {
-						sampler.clear();
-						//logger.clear();
+			row_max = neg_inf_replacement;
+			for(unsigned int l=0; l<l_end-l_begin; l++) {
+				if(lp[l] > row_max) { row_max = lp[l]; }
+			}
+			if(!(row_max > neg_inf_replacement)) { continue; }
+			
+			if(row_max > logP_best) {
+				logP_best = row_max;
+				for(unsigned int l=0; l<l_end-l_begin; l++) {
+					if(lp[l] == row_max) {
+						x_best[0] = E_c[k];
+						x_best[1] = DM_c[l_begin+l];
+						break;
 					}
-					break;
 				}
+				x_best[2] = t.Mr;
+				x_best[3] = t.FeH;
+			}
+			
+			// Keep the accumulated mass from overflowing
+			if(row_max > ref + 50.) {
+				if(ref > neg_inf_replacement) {
+					scale = exp(ref - row_max);
+					for(unsigned int m=0; m<p_img.size(); m++) { p_img[m] *= scale; }
+					sum *= scale;
+				}
+				ref = row_max;
+			}
+			
+			double *const p_row = &(p_img[N_DM*k + l_begin]);
+			for(unsigned int l=0; l<l_end-l_begin; l++) {
+				lp[l] = exp(lp[l] - ref);
+				p_row[l] += lp[l];
+				sum += lp[l];
 			}
 		}
 		
-		clock_gettime(CLOCK_MONOTONIC, &t_write);
-		
-		// Compute evidence
-		TChain chain = sampler.get_chain();
-		double lnZ_tmp = chain.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
-		//if(isinf(lnZ_tmp)) { lnZ_tmp = neg_inf_replacement; }
-		
-		// Save thinned chain
-		chainBuffer.add(chain, converged, lnZ_tmp, GR);
-		
-		// Save binned p(DM, EBV) surface
-		if(gatherSurfs) {
-			chain.get_image(*(img_stack.img[n]), rect, 0, 1, true, 0.0125, 0.1, 30.);
+		if(sum > 0.) { lnZ_tmpl[s] = ref + log(sum); }
+	}
+	
+	double Z_sum = 0.;
+	for(unsigned int m=0; m<p_img.size(); m++) { Z_sum += p_img[m]; }
+	
+	if(img != NULL) {
+		*img = cv::Mat::zeros(N_E, N_DM, CV_64F);
+		if(Z_sum > 0.) {
+			for(unsigned int k=0; k<N_E; k++) {
+				for(unsigned int l=0; l<N_DM; l++) {
+					img->at<double>(k, l) = p_img[N_DM*k + l] / Z_sum;
+				}
+			}
 		}
-		if(saveSurfs) { imgBuffer->add(*(img_stack.img[n])); }
-		
-		lnZ.push_back(lnZ_tmp);
-		conv.push_back(converged);
+	}
+	
+	chain.clear();
+	if(!(Z_sum > 0.)) { return neg_inf_replacement; }
+	
+	// Draw from the posterior by systematic resampling, first of templates, and then of pixels
+	// within each chosen template. Pixels are revisited with the final cut on logP, which
+	// only drops regions with negligible mass.
+	double Z_tmpl_sum = 0.;
+	for(unsigned int s=0; s<N_evaluated; s++) { Z_tmpl_sum += exp(lnZ_tmpl[s] - ref); }
+	
+	double x[4];
+	double Z_cumulative = 0.;
+	double Z_row, Z_target;
+	unsigned int N_before = 0;
+	unsigned int N_after, N_draws, draw;
+	
+	for(unsigned int s=0; s<N_evaluated; s++) {
+		Z_cumulative += exp(lnZ_tmpl[s] - ref);
+		N_after = (unsigned int)floor(Z_cumulative / Z_tmpl_sum * (double)N_samples + 0.5);
+		if(N_after > N_samples) { N_after = N_samples; }
+		N_draws = N_after - N_before;
+		N_before = N_after;
+		if(N_draws == 0) { continue; }
 		
-		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		const TTemplate &t = tmpl[s];
+		x[2] = t.Mr;
+		x[3] = t.FeH;
 		
-		if(verbosity >= 2) {
-			sampler.print_stats();
-			std::cout << std::endl;
+		// Total mass of this template within the final cut
+		sum = 0.;
+		for(unsigned int k=0; k<N_E; k++) {
+			if(!row_window(t, k, logP_best - delta_logP, l_begin, l_end)) { continue; }
+			row_logP(t, k, l_begin, l_end, &(lp[0]));
+			for(unsigned int l=0; l<l_end-l_begin; l++) { sum += exp(lp[l] - ref); }
 		}
+		if(!(sum > 0.)) { continue; }
 		
-		if(!converged) {
-			N_nonconv++;
-			if(verbosity >= 2) {
-				std::cout << "# Failed to converge." << std::endl;
+		// Place the draws evenly in cumulative mass
+		draw = 0;
+		Z_target = 0.5 / (double)N_draws * sum;
+		Z_row = 0.;
+		for(unsigned int k=0; (k<N_E) && (draw<N_draws); k++) {
+			if(!row_window(t, k, logP_best - delta_logP, l_begin, l_end)) { continue; }
+			row_logP(t, k, l_begin, l_end, &(lp[0]));
+			x[0] = E_c[k];
+			for(unsigned int l=0; (l<l_end-l_begin) && (draw<N_draws); l++) {
+				Z_row += exp(lp[l] - ref);
+				while((draw < N_draws) && (Z_row >= Z_target)) {
+					x[1] = DM_c[l_begin+l];
+					chain.add_point(&(x[0]), lp[l], 1.);
+					draw++;
+					Z_target = ((double)draw + 0.5) / (double)N_draws * sum;
+				}
 			}
 		}
-		
-		if(verbosity >= 2) {
-			std::cout << "# Number of steps: " << (1<<(attempt-1))*N_steps << std::endl;
-			std::cout << "# ln Z: " << lnZ.back() << std::endl;
-			std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
-			std::cout << "# Sample time: " << std::setprecision(2) << (t_write.tv_sec - t_start.tv_sec) + 1.e-9*(t_write.tv_nsec - t_start.tv_nsec) << " s" << std::endl;
-			std::cout << "# Write time: " << std::setprecision(2) << (t_end.tv_sec - t_write.tv_sec) + 1.e-9*(t_end.tv_nsec - t_write.tv_nsec) << " s" << std::endl << std::endl;
-		}
 	}
 	
-	chainBuffer.write(out_fname, group_name.str(), "stellar chains");
-	if(saveSurfs) { imgBuffer->write(out_fname, group_name.str(), "stellar pdfs"); }
+	// Include the best point, with negligible weight
+	chain.add_point(&(x_best[0]), logP_best, 1.e-5);
 	
-	if(verbosity >= 1) {
-		if(verbosity >= 2) {
-			std::cout << "====================================" << std::endl;
-			std::cout << std::endl;
-		}
-		std::cout << "# Failed to converge " << N_nonconv << " of " << params.N_stars << " times (" << std::setprecision(2) << 100.*(double)N_nonconv/(double)(params.N_stars) << " %)." << std::endl;
-		if(verbosity >= 2) {
-			std::cout << std::endl;
-			std::cout << "====================================" << std::endl << std::endl;
+	return ref + log(Z_sum) + ln_dV;
+}
+
+// Drop-in replacement for sample_indiv_emp_star, which evaluates the posterior on a grid instead of sampling it.
+// Stars with no observed bands are passed on to the sampler. The evidence is the same harmonic-mean estimate
+// as the sampler makes, from the draws of the grid, so that the evidence cut treats all the stars alike.
+// The evaluation is deterministic, so there is no convergence diagnostic.
+bool sample_indiv_emp_grid_star(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                                const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                                bool &converged, double &lnZ, int verbosity) {
+	assert(!params.vary_RV);
+	
+	timespec t_start, t_end;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	
+	TIndivGrid grid(params, rect);
+	if(!grid.well_posed()) {
+		return sample_indiv_emp_star(options, params, ndim, rect, img, chain, GR, converged, lnZ, verbosity);
+	}
+	
+	double lnZ_grid = grid.evaluate(img, chain);
+	lnZ = chain.get_ln_Z_harmonic(true, 10., 0.25, 0.05);
+	
+	// Smooth on the same scale as the binned MCMC surfaces
+	if(img != NULL) {
+		double s1 = 0.0125 / rect.dx[0];
+		double s2 = 0.1 / rect.dx[1];
+		int w1 = 2 * ceil(30.*s1) + 1;
+		int w2 = 2 * ceil(30.*s2) + 1;
+		cv::GaussianBlur(*img, *img, cv::Size(w2,w1), s2, s1, cv::BORDER_REPLICATE);
+		img->convertTo(*img, CV_32F);
+	}
+	
+	converged = true;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	
+	if(verbosity >= 2) {
+		#pragma omp critical (cout)
+		{
+		std::cout << "Star #" << params.idx_star+1 << " of " << params.N_stars << std::endl;
+		std::cout << "====================================" << std::endl;
+		std::cout << "# Templates evaluated: " << grid.get_N_evaluated() << " of " << grid.get_N_templates() << std::endl;
+		std::cout << "# ln Z: " << lnZ << " (grid: " << lnZ_grid << ")" << std::endl;
+		std::cout << "# Time elapsed: " << std::setprecision(2) << (t_end.tv_sec - t_start.tv_sec) + 1.e-9*(t_end.tv_nsec - t_start.tv_nsec) << " s" << std::endl << std::endl;
 		}
 	}
 	
-	if(imgBuffer != NULL) { delete imgBuffer; }
-	delete[] GR;
+	return false;
 }
 
 
+
 /*************************************************************************
  * 
  *   Auxiliary Functions
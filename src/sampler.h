@@ -32,6 +32,8 @@
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <algorithm>
+#include <limits>
 #include <math.h>
 #include <time.h>
 
@@ -61,15 +63,16 @@
 
 // Wrapper for parameters needed by the sampler
 struct TMCMCParams {
-	TMCMCParams(TGalacticLOSModel* _gal_model, TSyntheticStellarModel* _synth_stellar_model, TStellarModel* _emp_stellar_model, TExtinctionModel* _ext_model,
+	TMCMCParams(TGalacticLOSModel* _gal_model, TSyntheticStellarModel* _synth_stellar_model, TStellarModel* _emp_stellar_model, const TExtinctionModel* _ext_model,
                     TStellarData* _data, unsigned int _N_DM, double _DM_min, double _DM_max);
+	TMCMCParams(const TMCMCParams& p);	// Deep copy, so that each thread can fit a different star
 	~TMCMCParams();
 	
 	// Model
 	TSyntheticStellarModel *synth_stellar_model;
 	TStellarModel *emp_stellar_model;
 	TGalacticLOSModel *gal_model;
-	TExtinctionModel *ext_model;
+	const TExtinctionModel *ext_model;	// Shared by the star-parallel tasks, so only used through const lookups
 	double EBV_SFD, EBV_floor;
 	double DM_min, DM_max;
 	unsigned int N_DM, N_stars;
@@ -93,6 +96,66 @@ struct TMCMCParams {
 	double RV_mean, RV_variance;
 	
 	bool use_priors;
+	bool marg_EBV;		// Marginalize analytically over E(B-V) in the individual stellar fits (empirical library)
+};
+
+
+// Posterior of one star (params.idx_star) under the empirical library, evaluated directly on the
+// (E(B-V), DM) pixels of an image and the (Mr, [Fe/H]) nodes of the template library. R_V is fixed.
+//
+// For each template, chi^2 is a quadratic in (E(B-V), DM),
+//     chi^2 = S DM^2 + 2 S_A E DM + S_AA E^2 - 2 S_r DM - 2 S_rA E + S_rr ,
+// which gives both an upper bound on the posterior of the template, and the range of DM in each row
+// of the image that can contribute. Templates are visited in order of decreasing bound, and regions
+// more than delta_logP below the best point found so far are skipped.
+class TIndivGrid {
+public:
+	TIndivGrid(TMCMCParams &params, const TRect &_rect, double _delta_logP=15.);
+	~TIndivGrid();
+	
+	// Fill img (if not NULL) with the normalized surface, and chain with N_samples draws
+	// from the posterior (plus the best point). Returns ln Z.
+	double evaluate(cv::Mat *const img, TChain &chain, unsigned int N_samples=500);
+	
+	bool well_posed() const;		// False if no bands are observed
+	unsigned int get_N_templates() const;
+	unsigned int get_N_evaluated() const;	// # of templates visited by the last call to evaluate
+	
+private:
+	struct TTemplate {
+		double absmag[NBANDS];
+		double Mr, FeH, log_lf;
+		unsigned int FeH_idx;
+		double S_r, S_rA, S_rr;	// Template-dependent chi^2 coefficients
+		double logP_max;	// Upper bound on log posterior anywhere in (E(B-V), DM)
+		
+		// Sort in order of decreasing logP_max
+		bool operator<(const TTemplate &rhs) const { return logP_max > rhs.logP_max; }
+	};
+	
+	TRect rect;
+	unsigned int N_E, N_DM;
+	std::vector<double> E_c, DM_c;		// Pixel centers
+	
+	double A[NBANDS], w[NBANDS], m_lim[NBANDS];
+	bool observed[NBANDS];
+	double S, S_A, S_AA;			// Template-independent chi^2 coefficients
+	double lnL_norm;
+	bool use_priors;
+	
+	std::vector<double> log_prior;		// Galactic prior on (DM pixel, [Fe/H] node): log_prior[N_DM*FeH_idx + l]
+	std::vector<double> log_prior_max;	// Maximum over DM for each [Fe/H] node
+	std::vector<TTemplate> tmpl;
+	double ln_dV;				// Log volume of one grid cell
+	
+	double delta_logP;
+	unsigned int N_evaluated;
+	
+	// Range of DM pixels [l_begin, l_end) in row k where template t can exceed logP_min
+	bool row_window(const TTemplate &t, unsigned int k, double logP_min, unsigned int &l_begin, unsigned int &l_end) const;
+	
+	// Log posterior of template t at pixels [l_begin, l_end) of row k
+	void row_logP(const TTemplate &t, unsigned int k, unsigned int l_begin, unsigned int l_end, double *const lp) const;
 };
 
 
@@ -102,13 +165,31 @@ double logP_los_synth(const double* x, unsigned int N, TMCMCParams& p, double* l
 
 double logP_single_star_synth(const double *x, double EBV, double RV,
                               const TGalacticLOSModel &gal_model, const TSyntheticStellarModel &stellar_model,
-                              TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed=NULL);
+                              const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed=NULL);
 double logP_single_star_emp(const double *x, double EBV, double RV,
                             const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
-                            TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed=NULL);
+                            const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed=NULL);
 double logP_single_star_emp_noprior(const double *x, double EBV, double RV,
                                     const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
-                                    TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed=NULL);
+                                    const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d, TSED *tmp_sed=NULL);
+
+double logP_single_star_emp_marg_EBV(const double *x, double RV, double EBV_min,
+                                     const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
+                                     const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d,
+                                     bool use_priors=true, double *EBV_mu=NULL, double *EBV_sigma=NULL);
+
+// Batched (struct-of-arrays) versions, which score a block of states in one call
+#define LOGP_BATCH_BLOCK 32
+
+void logP_single_star_emp_batch(const double *const x, const double *const EBV, const double *const RV, double RV_fixed,
+                                unsigned int L, const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model,
+                                const TExtinctionModel &ext_model, const TStellarData::TMagnitudes &d,
+                                double *const logP, bool use_priors=true);
+void logP_indiv_simple_emp_batch(const double *const x, unsigned int N, unsigned int L, double *const logp, TMCMCParams &params);
+
+// Check of the batched versions against the scalar ones
+bool test_emp_batch(const TGalacticLOSModel &gal_model, const TStellarModel &stellar_model, const TExtinctionModel &ext_model,
+                    const TStellarData &stellar_data, double RV_mean, unsigned int N_stars=10, unsigned int L=200);
 
 // Sampling routines
 void sample_model_synth(TGalacticLOSModel& galactic_model, TSyntheticStellarModel& stellar_model, TExtinctionModel& extinction_model, TStellarData& stellar_data);
@@ -118,13 +199,41 @@ void sample_indiv_synth(std::string &out_fname, TMCMCOptions &options, TGalactic
                         TSyntheticStellarModel& stellar_model,TExtinctionModel& extinction_model, TStellarData& stellar_data,
                         TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
                         double RV_sigma=-1., double minEBV=0., const bool saveSurfs=false, const bool gatherSurfs=true,
-                        int verbosity=1);
+                        int verbosity=1, const bool star_parallel=false);
 
 void sample_indiv_emp(std::string &out_fname, TMCMCOptions &options, TGalacticLOSModel& galactic_model,
                       TStellarModel& stellar_model, TExtinctionModel& extinction_model, TStellarData& stellar_data,
                       TImgStack& img_stack, std::vector<bool> &conv, std::vector<double> &lnZ,
                       double RV_mean=3.1, double RV_sigma=-1., double minEBV=0., const bool saveSurfs=false, const bool gatherSurfs=true,
-                      const bool use_priors=true, int verbosity=1);
+                      const bool use_priors=true, int verbosity=1, const bool star_parallel=false,
+                      const bool grid_eval=false, const bool marg_EBV=false);
+
+bool load_indiv_surfs(const std::string &fname, const std::string &group_name, TImgStack &img_stack,
+                      std::vector<bool> &conv, std::vector<double> &lnZ);
+
+// Fits a single star, params.idx_star, storing the chain, evidence and (if img != NULL) the binned surface.
+// Returns false if the fit has no convergence diagnostic, in which case GR is left unset.
+typedef bool (*indiv_star_sampler_t)(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                                     const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                                     bool &converged, double &lnZ, int verbosity);
+
+unsigned int sample_indiv_stars(indiv_star_sampler_t f_sample_star, TMCMCOptions &options, TMCMCParams &params,
+                                unsigned int ndim, const TRect &rect, TImgStack &img_stack,
+                                TChainWriteBuffer &chainBuffer, TImgWriteBuffer *const imgBuffer,
+                                std::vector<bool> &conv, std::vector<double> &lnZ,
+                                const bool gatherSurfs, const bool star_parallel, int verbosity=1);
+
+bool sample_indiv_synth_star(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                             const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                             bool &converged, double &lnZ, int verbosity=1);
+
+bool sample_indiv_emp_star(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                           const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                           bool &converged, double &lnZ, int verbosity=1);
+
+bool sample_indiv_emp_grid_star(TMCMCOptions &options, TMCMCParams &params, unsigned int ndim,
+                                const TRect &rect, cv::Mat *const img, TChain &chain, double *const GR,
+                                bool &converged, double &lnZ, int verbosity=1);
 
 // Auxiliary functions
 void seed_gsl_rng(gsl_rng **r);
@@ -134,5 +243,7 @@ void rand_vector(double *const x, size_t N, gsl_rng* r, double A=1.);
 void rand_gaussian_vector(double *const x, double mu, double sigma, size_t N, gsl_rng* r);
 void rand_gaussian_vector(double *const x, double *mu, double *sigma, size_t N, gsl_rng *r);
 
+double log_gaussian_tail(double z);
+
 
 #endif // _SAMPLER_H__
@@ -67,6 +67,15 @@ void TStats::update(const TStats *const stats) {
 	N_items_tot += stats->N_items_tot;
 }
 
+// Replace the contents with the weighted sums of x_i and x_i x_j, and the total weight, of some chain
+void TStats::set_sums(const double *const sum_x, const double *const sum_xx, uint64_t N_items) {
+	for(unsigned int i=0; i<N; i++) {
+		E_k[i] = sum_x[i];
+		for(unsigned int j=0; j<N; j++) { E_ij[i+N*j] = sum_xx[i+N*j]; }
+	}
+	N_items_tot = N_items;
+}
+
 // Update the chain from the statistics in another TStats object
 void TStats::operator()(const TStats *const stats) { update(stats); }
 
@@ -146,6 +155,14 @@ uint64_t TStats::get_N_items() const { return N_items_tot; }
 
 unsigned int TStats::get_dim() const { return N; }
 
+// Copy out the weighted sums of x_i and x_i x_j, so that the statistics can be stored and restored with set_sums
+void TStats::get_sums(double *const sum_x, double *const sum_xx) const {
+	for(unsigned int i=0; i<N; i++) {
+		sum_x[i] = E_k[i];
+		for(unsigned int j=0; j<N; j++) { sum_xx[i+N*j] = E_ij[i+N*j]; }
+	}
+}
+
 // Calculates the covariance matrix Sigma, alongside Sigma^{-1} and det(Sigma)
 void TStats::get_cov_matrix(gsl_matrix* Sigma, gsl_matrix* invSigma, double* detSigma) const {
 	// Check that the matrices are the correct size
@@ -34,6 +34,7 @@ public:
 	void clear();							// Clear the contents of the statistics object
 	void update(const double *const x, unsigned int weight);	// Update the chain from a an array of doubles with a weight
 	void update(const TStats *const stats);
+	void set_sums(const double *const sum_x, const double *const sum_xx, uint64_t N_items);	// Replace the contents with the given weighted sums of x_i and x_i x_j
 	
 	void operator()(const double *const x, unsigned int weight);	// proxy for update()
 	void operator()(const TStats *const stats);			// proxy for update()
@@ -51,6 +52,7 @@ public:
 	void get_cov_matrix(gsl_matrix* Sigma, gsl_matrix* invSigma, double* detSigma) const;	// Calculates the covariance matrix Sigma, alongside Sigma^{-1} and det(Sigma)
 	uint64_t get_N_items() const;
 	unsigned int get_dim() const;
+	void get_sums(double *const sum_x, double *const sum_xx) const;	// Copy out the weighted sums of x_i (N) and x_i x_j (N*N)
 	
 	// I/O
 	void print() const;											// Print out statistics